@@ -0,0 +1,319 @@
+#include "../../config.h"
+#include "inotifytools/inotifytools.h"
+#include "inotifytools/inotify.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Benchmarks for libinotifytools.  Every result is printed as one line of
+// space separated key=value pairs, starting with bench=<name>.
+//
+// Usage: bench [dirs[,dirs...]] [renames] [events]
+//
+// The setup, memory and rename benchmarks run once for each tree size given
+// in dirs, the event throughput and formatting benchmarks once on a small tree
+// of their own.  All workloads are deterministic, so results of different
+// builds can be compared line by line.
+
+#define TOP_DIRS 10
+#define DEPTH 20
+// directories the churn generator spreads its files over
+#define CHURN_DIRS 16
+// events generated for each file: create, open, modify, close_write, delete
+#define CHURN_EVENTS_PER_FILE 5
+#define FORMAT_EVENTS 1000000
+#define SETUP_THREADS 4
+
+static char root[] = "/tmp/inotifytools_bench.XXXXXX";
+// tree the benchmarks currently run on, below root
+static char tree[4096];
+
+double now_us() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void fail( char const * what ) {
+	fprintf( stderr, "%s: %s\n", what, strerror(errno) );
+	exit( EXIT_FAILURE );
+}
+
+void make_dir( char const * path ) {
+	if ( 0 != mkdir( path, 0700 ) && errno != EEXIST ) fail( path );
+}
+
+/**
+ * Create TOP_DIRS deep subtrees below the tree with about @a dirs directories
+ * in total.  Each subtree is a chain of DEPTH directories, and every directory
+ * in the chain has @a width empty subdirectories.
+ *
+ * @return the number of directories created, not counting the root.
+ */
+int make_deep_tree( int dirs ) {
+	int width = dirs / (TOP_DIRS * DEPTH) - 1;
+	if ( width < 0 ) width = 0;
+	char path[4096];
+	int made = 0;
+	make_dir( tree );
+	for ( int t = 0; t < TOP_DIRS; ++t ) {
+		int len = snprintf( path, sizeof(path), "%s/%d", tree, t );
+		for ( int d = 0; d < DEPTH; ++d ) {
+			if ( d ) len += snprintf( &path[len], sizeof(path) - len, "/d%d", d );
+			make_dir( path );
+			++made;
+			for ( int w = 0; w < width; ++w ) {
+				snprintf( &path[len], sizeof(path) - len, "/w%d", w );
+				make_dir( path );
+				++made;
+			}
+			path[len] = 0;
+		}
+	}
+	return made;
+}
+
+/**
+ * Rename subtrees back and forth with inotifytools_replace_filename(), as
+ * inotifywait -m -r does when a watched directory is moved.  @a level is the
+ * depth in each chain of the directory renamed: 0 renames whole top level
+ * subtrees, DEPTH - 1 only the last directory of each chain and its
+ * subdirectories.
+ */
+void bench_rename( char const * name, int level, int renames ) {
+	int watches = inotifytools_get_num_watches();
+
+	char base[4096], from[4096], to[4096];
+	double start = now_us();
+	for ( int i = 0; i < renames; ++i ) {
+		int t = i % TOP_DIRS;
+		int there = (i / TOP_DIRS) % 2;
+		int len = snprintf( base, sizeof(base), "%s/%d", tree, t );
+		for ( int d = 1; d <= level; ++d ) {
+			len += snprintf( &base[len], sizeof(base) - len, "/d%d", d );
+		}
+		snprintf( from, sizeof(from), "%s%s/", base, there ? "m" : "" );
+		snprintf( to, sizeof(to), "%s%s/", base, there ? "" : "m" );
+		inotifytools_replace_filename( from, to );
+	}
+	double elapsed = now_us() - start;
+
+	printf( "bench=%s watches=%d renames=%d watches_per_rename=%d "
+	        "us_per_rename=%.2f\n", name, watches, renames,
+	        watches / TOP_DIRS * (DEPTH - level) / DEPTH, elapsed / renames );
+}
+
+/**
+ * Watch the tree, serially and with SETUP_THREADS threads, and measure the
+ * time per directory and the heap used per watch.
+ *
+ * @return 1 if the tree is watched afterwards, 0 if it couldn't be.
+ */
+int bench_setup( int dirs ) {
+	double start = now_us();
+	if ( !inotifytools_watch_recursively_parallel( tree, IN_ALL_EVENTS, NULL,
+	                                               SETUP_THREADS ) ) {
+		printf( "bench=setup_parallel dirs=%d error=%s\n", dirs,
+		        strerror( inotifytools_error() ) );
+		return 0;
+	}
+	double elapsed = now_us() - start;
+	int watches = inotifytools_get_num_watches();
+	printf( "bench=setup_parallel dirs=%d threads=%d watches=%d "
+	        "us_per_dir=%.2f\n", dirs, SETUP_THREADS, watches,
+	        elapsed / watches );
+	inotifytools_cleanup();
+	if ( !inotifytools_initialize() ) {
+		errno = inotifytools_error();
+		fail( "inotifytools_initialize" );
+	}
+
+	// serially last, so the heap measured holds nothing but the watches
+	size_t heap = mallinfo2().uordblks;
+	start = now_us();
+	if ( !inotifytools_watch_recursively( tree, IN_ALL_EVENTS ) ) {
+		printf( "bench=setup dirs=%d error=%s\n", dirs,
+		        strerror( inotifytools_error() ) );
+		return 0;
+	}
+	elapsed = now_us() - start;
+	watches = inotifytools_get_num_watches();
+	printf( "bench=setup dirs=%d watches=%d us_per_dir=%.2f\n", dirs,
+	        watches, elapsed / watches );
+	printf( "bench=watch_memory watches=%d heap_bytes_per_watch=%.1f\n",
+	        watches, (double)(mallinfo2().uordblks - heap) / watches );
+	return 1;
+}
+
+/**
+ * Create, write, close and delete files, spread over CHURN_DIRS directories
+ * below the tree, until about @a events events were generated.  Runs in a
+ * child process.
+ */
+void churn( int events ) {
+	char path[4096];
+	int files = events / CHURN_EVENTS_PER_FILE;
+	for ( int i = 0; i < files; ++i ) {
+		snprintf( path, sizeof(path), "%s/%d/f%d", tree, i % CHURN_DIRS, i );
+		int fd = open( path, O_WRONLY | O_CREAT, 0600 );
+		if ( fd < 0 || 1 != write( fd, "x", 1 ) || 0 != close( fd ) ||
+		     0 != unlink( path ) ) {
+			fail( path );
+		}
+	}
+}
+
+/**
+ * Read the events of the churn generator with inotifytools_next_events() as
+ * fast as they come, and measure the rate of events and how many each read
+ * from the kernel returned.
+ */
+void bench_throughput( int events ) {
+	char path[4096];
+	for ( int d = 0; d < CHURN_DIRS; ++d ) {
+		snprintf( path, sizeof(path), "%s/%d", tree, d );
+		make_dir( path );
+	}
+	if ( !inotifytools_watch_recursively( tree, IN_ALL_EVENTS ) ) {
+		errno = inotifytools_error();
+		fail( "inotifytools_watch_recursively" );
+	}
+	long long reads = inotifytools_get_num_reads();
+	long long read = inotifytools_get_num_events_read();
+
+	double start = now_us(), last = start;
+	pid_t pid = fork();
+	if ( pid < 0 ) fail( "fork" );
+	if ( pid == 0 ) {
+		churn( events );
+		_exit( EXIT_SUCCESS );
+	}
+
+	long long received = 0, overflows = 0;
+	int running = 1;
+	struct inotify_event * event;
+	// once the generator is done, a short wait without events ends the run
+	while ( (event = inotifytools_next_events_ms( running ? 1000 : 100, 1,
+	                                              -1 )) || running ) {
+		if ( !event ) {
+			int status;
+			if ( waitpid( pid, &status, 0 ) != pid ) fail( "waitpid" );
+			running = 0;
+			continue;
+		}
+		if ( event->mask & IN_Q_OVERFLOW ) ++overflows;
+		++received;
+		last = now_us();
+	}
+	if ( running ) waitpid( pid, NULL, 0 );
+	reads = inotifytools_get_num_reads() - reads;
+	read = inotifytools_get_num_events_read() - read;
+
+	printf( "bench=throughput events=%lld events_per_sec=%.0f reads=%lld "
+	        "events_per_read=%.1f overflows=%lld\n", received,
+	        received / ((last - start) / 1e6), reads,
+	        reads ? (double)read / reads : 0.0, overflows );
+}
+
+/**
+ * Format events as inotifywait does with its default --format and with
+ * --csv, and measure the time per event.
+ */
+void bench_format() {
+	char path[4096];
+	snprintf( path, sizeof(path), "%s/0/", tree );
+	int wd = inotifytools_wd_from_filename( path );
+	if ( wd < 0 ) fail( "inotifytools_wd_from_filename" );
+
+	union {
+		struct inotify_event event;
+		char buf[sizeof(struct inotify_event) + 32];
+	} u;
+	memset( &u, 0, sizeof(u) );
+	u.event.wd = wd;
+	u.event.mask = IN_CLOSE_WRITE;
+	u.event.len = 16;
+	strcpy( u.event.name, "file_name_0001" );
+
+	char out[4096];
+	size_t bytes = 0;
+	double start = now_us();
+	for ( int i = 0; i < FORMAT_EVENTS; ++i ) {
+		bytes += inotifytools_snprintf( out, sizeof(out) - 1, &u.event,
+		                                "%w %,e %f\n" );
+	}
+	double elapsed = now_us() - start;
+	printf( "bench=format_default events=%d ns_per_event=%.1f "
+	        "bytes_per_event=%.1f\n", FORMAT_EVENTS,
+	        elapsed * 1e3 / FORMAT_EVENTS, (double)bytes / FORMAT_EVENTS );
+
+	// what inotifywait --csv asks of the library for each event
+	bytes = 0;
+	start = now_us();
+	for ( int i = 0; i < FORMAT_EVENTS; ++i ) {
+		bytes += snprintf( out, sizeof(out), "%s,%s,%s\n",
+		                   inotifytools_filename_from_wd( u.event.wd ),
+		                   inotifytools_event_to_str_sep( u.event.mask, ',' ),
+		                   u.event.name );
+	}
+	elapsed = now_us() - start;
+	printf( "bench=format_csv events=%d ns_per_event=%.1f "
+	        "bytes_per_event=%.1f\n", FORMAT_EVENTS,
+	        elapsed * 1e3 / FORMAT_EVENTS, (double)bytes / FORMAT_EVENTS );
+}
+
+void remove_tree() {
+	char cmd[4096];
+	snprintf( cmd, sizeof(cmd), "rm -rf %s", tree );
+	if ( system( cmd ) != 0 ) fail( cmd );
+}
+
+int main( int argc, char ** argv ) {
+	char const * sizes = argc > 1 ? argv[1] : "10000";
+	int renames = argc > 2 ? atoi( argv[2] ) : 1000;
+	int events = argc > 3 ? atoi( argv[3] ) : 100000;
+
+	if ( !mkdtemp( root ) ) fail( "mkdtemp" );
+
+	for ( char const * size = sizes; *size; ) {
+		char * end;
+		int dirs = strtol( size, &end, 10 );
+		size = *end == ',' ? end + 1 : end;
+		if ( dirs <= 0 ) continue;
+
+		snprintf( tree, sizeof(tree), "%s/tree%d", root, dirs );
+		make_deep_tree( dirs );
+		if ( !inotifytools_initialize() ) {
+			errno = inotifytools_error();
+			fail( "inotifytools_initialize" );
+		}
+		if ( bench_setup( dirs ) ) {
+			bench_rename( "rename_subtree", 0, renames );
+			bench_rename( "rename_leaf", DEPTH - 1, renames );
+		}
+		inotifytools_cleanup();
+		remove_tree();
+	}
+
+	snprintf( tree, sizeof(tree), "%s/churn", root );
+	make_dir( tree );
+	if ( !inotifytools_initialize() ) {
+		errno = inotifytools_error();
+		fail( "inotifytools_initialize" );
+	}
+	bench_throughput( events );
+	bench_format();
+	inotifytools_cleanup();
+	remove_tree();
+
+	return rmdir( root ) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,976 @@
+// kate: replace-tabs off; space-indent off;
+
+/**
+ * @file fanotify.c
+ * @internal
+ * fanotify backend; see inotifytools_set_backend().
+ *
+ * Each watched path puts one FAN_MARK_FILESYSTEM mark on the file system it
+ * is on.  fanotify then reports every event of that file system with a file
+ * handle of the directory it happened in and the name of the entry
+ * (FAN_REPORT_DFID_NAME).  Directories are given watch descriptors the first
+ * time one of their handles is seen; the handle is resolved to a path with
+ * open_by_handle_at(), and the events of directories outside every watched
+ * path are dropped.  When a directory is moved or deleted, the paths of all
+ * directories are resolved again when their next event arrives.
+ */
+
+#include "../../config.h"
+#include "inotifytools_p.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "inotifytools/inotify.h"
+
+#if defined(HAVE_SYS_FANOTIFY_H)
+#include <sys/fanotify.h>
+#elif defined(HAVE_LINUX_FANOTIFY_H)
+#include <linux/fanotify.h>
+#endif
+
+#if defined(FAN_REPORT_DFID_NAME) && defined(FAN_MARK_FILESYSTEM)
+
+#ifndef HAVE_SYS_FANOTIFY_H
+static int fanotify_init( unsigned int flags, unsigned int event_f_flags ) {
+	return syscall( __NR_fanotify_init, flags, event_f_flags );
+}
+
+static int fanotify_mark( int fd, unsigned int flags, uint64_t mask,
+                          int dirfd, char const * pathname ) {
+	return syscall( __NR_fanotify_mark, fd, flags, mask, dirfd, pathname );
+}
+#endif
+
+/**
+ * @internal
+ * Events which fanotify reports with the same bits as inotify.
+ */
+#define FAN_INOTIFY_EVENTS ( IN_ACCESS | IN_MODIFY | IN_ATTRIB | \
+                             IN_CLOSE_WRITE | IN_CLOSE_NOWRITE | IN_OPEN | \
+                             IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | \
+                             IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF )
+
+/**
+ * @internal
+ * Directory handles are keyed by the file system id, followed by the handle
+ * type and the handle bytes.
+ */
+#define FSID_SIZE sizeof(__kernel_fsid_t)
+#define KEY_HEADER (FSID_SIZE + sizeof(int))
+#define KEY_SIZE (KEY_HEADER + MAX_HANDLE_SZ)
+
+#define MIN_DIR_BUCKETS 64
+
+/**
+ * @internal
+ * Upper bound of the size of an inotify event with a padded name.
+ */
+#define FAN_EVENT_MAX ( 2 * sizeof(struct inotify_event) + NAME_MAX )
+
+/**
+ * @internal
+ * A marked file system.  @a fd is open on some file of it, for
+ * open_by_handle_at(), and @a path is where it was first marked.
+ */
+struct fan_fs {
+	unsigned char fsid[FSID_SIZE];
+	int fd;
+	char *path;
+	int roots;
+	struct fan_fs *next;
+};
+
+/**
+ * @internal
+ * A path passed to add_watch() or add_tree().  @a path is the name the
+ * watch was added with and @a real its canonical path; both end in '/' for
+ * directories.  A file is in the list of files of its directory @a parent,
+ * under @a name, which points into @a real.
+ */
+struct fan_root {
+	int wd;
+	char *path;
+	char *real;
+	size_t real_len;
+	struct fan_dir *parent;
+	char const *name;
+	struct fan_root *next_file;
+	uint32_t events;
+	int is_dir;
+	int recursive;
+	inotifytools_exclude *exclude;
+	struct fan_fs *fs;
+	struct fan_root *next;
+};
+
+/**
+ * @internal
+ * A directory seen in an event.  @a real is its canonical path ending in
+ * '/', or NULL if it could not be resolved, and @a root the watch it is
+ * reported to, or NULL if it is outside of every watched path.  Both are
+ * valid while @a generation matches the backend's.  @a files are the
+ * watched files in it.
+ */
+struct fan_dir {
+	struct fan_dir *next;
+	struct fan_root *files;
+	unsigned hash;
+	int wd;
+	int ignored;
+	unsigned generation;
+	char *real;
+	struct fan_root *root;
+	size_t key_len;
+	unsigned char key[];
+};
+
+/**
+ * @internal
+ * State of the fanotify backend.  @a pending_len bytes of records read into
+ * @a raw, from @a pending on, did not fit into the last read's buffer, and
+ * @a lost is set if events of a record which could not fit into an empty
+ * buffer were dropped.
+ */
+struct fan_state {
+	struct fan_dir **buckets;
+	unsigned num_buckets;
+	unsigned num_dirs;
+	struct fan_dir **by_wd;
+	unsigned by_wd_size;
+	int next_wd;
+	unsigned generation;
+	struct fan_root *roots;
+	struct fan_fs *filesystems;
+	uint32_t cookie;
+	uint32_t move_cookie;
+	char *raw;
+	size_t raw_size;
+	size_t pending;
+	size_t pending_len;
+	int lost;
+	char *path;
+	size_t path_size;
+	unsigned char key[KEY_SIZE];
+	struct file_handle *handle;
+};
+
+/**
+ * @internal
+ * FNV-1a hash of a directory key.
+ */
+static unsigned hash_key( unsigned char const * key, size_t len ) {
+	unsigned hash = 2166136261u;
+	size_t i;
+	for ( i = 0; i < len; ++i ) {
+		hash = (hash ^ key[i]) * 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * @internal
+ * Build the key of the handle @a fh on the file system @a fsid in
+ * @a st->key.
+ *
+ * @return the length of the key, or 0 if the handle is too big.
+ */
+static size_t make_key( struct fan_state * st, void const * fsid,
+                        struct file_handle const * fh ) {
+	if ( fh->handle_bytes > MAX_HANDLE_SZ ) return 0;
+	memcpy( st->key, fsid, FSID_SIZE );
+	memcpy( st->key + FSID_SIZE, &fh->handle_type, sizeof(int) );
+	memcpy( st->key + KEY_HEADER, fh->f_handle, fh->handle_bytes );
+	return KEY_HEADER + fh->handle_bytes;
+}
+
+/**
+ * @internal
+ * Make room for at least @a size bytes in @a st->path.
+ *
+ * @return 1 on success, 0 if out of memory.
+ */
+static int path_reserve( struct fan_state * st, size_t size ) {
+	if ( size <= st->path_size ) return 1;
+	if ( size < 2 * st->path_size ) size = 2 * st->path_size;
+	if ( size < PATH_MAX ) size = PATH_MAX;
+	char *path = (char *)realloc( st->path, size );
+	if ( !path ) return 0;
+	st->path = path;
+	st->path_size = size;
+	return 1;
+}
+
+/**
+ * @internal
+ * Find the directory with the key in @a st->key, adding it if @a create is
+ * set.  New directories are not resolved yet.
+ *
+ * @return the directory, or NULL if not found or out of memory.
+ */
+static struct fan_dir * dir_get( struct fan_state * st, size_t key_len,
+                                 int create ) {
+	unsigned hash = hash_key( st->key, key_len );
+	struct fan_dir * dir;
+	if ( st->num_buckets ) {
+		dir = st->buckets[hash & (st->num_buckets - 1)];
+		for ( ; dir; dir = dir->next ) {
+			if ( dir->hash == hash && dir->key_len == key_len &&
+			     !memcmp( dir->key, st->key, key_len ) ) {
+				return dir;
+			}
+		}
+	}
+	if ( !create ) return NULL;
+
+	if ( st->num_dirs >= st->num_buckets ) {
+		unsigned size = st->num_buckets ? 2 * st->num_buckets
+		                                : MIN_DIR_BUCKETS;
+		struct fan_dir **buckets = (struct fan_dir **)calloc( size,
+		                                           sizeof(struct fan_dir *) );
+		if ( !buckets ) return NULL;
+		unsigned i;
+		for ( i = 0; i < st->num_buckets; ++i ) {
+			struct fan_dir * next;
+			for ( dir = st->buckets[i]; dir; dir = next ) {
+				next = dir->next;
+				dir->next = buckets[dir->hash & (size - 1)];
+				buckets[dir->hash & (size - 1)] = dir;
+			}
+		}
+		free( st->buckets );
+		st->buckets = buckets;
+		st->num_buckets = size;
+	}
+	if ( (unsigned)st->next_wd >= st->by_wd_size ) {
+		unsigned size = st->by_wd_size ? 2 * st->by_wd_size
+		                               : MIN_DIR_BUCKETS;
+		struct fan_dir **by_wd = (struct fan_dir **)realloc( st->by_wd,
+		                                   size * sizeof(struct fan_dir *) );
+		if ( !by_wd ) return NULL;
+		memset( &by_wd[st->by_wd_size], 0,
+		        (size - st->by_wd_size) * sizeof(struct fan_dir *) );
+		st->by_wd = by_wd;
+		st->by_wd_size = size;
+	}
+
+	dir = (struct fan_dir *)calloc( 1, sizeof(struct fan_dir) + key_len );
+	if ( !dir ) return NULL;
+	dir->hash = hash;
+	dir->wd = st->next_wd++;
+	dir->generation = st->generation - 1;
+	dir->key_len = key_len;
+	memcpy( dir->key, st->key, key_len );
+	dir->next = st->buckets[hash & (st->num_buckets - 1)];
+	st->buckets[hash & (st->num_buckets - 1)] = dir;
+	st->by_wd[dir->wd] = dir;
+	++st->num_dirs;
+	return dir;
+}
+
+/**
+ * @internal
+ * Find out where @a dir is now.
+ *
+ * @return its canonical path ending in '/', to be freed by the caller, or
+ *         NULL if it is gone.
+ */
+static char * dir_resolve( struct fan_state * st, struct fan_dir const * dir ) {
+	struct fan_fs * fs;
+	for ( fs = st->filesystems; fs; fs = fs->next ) {
+		if ( !memcmp( fs->fsid, dir->key, FSID_SIZE ) ) break;
+	}
+	if ( !fs ) return NULL;
+
+	st->handle->handle_bytes = dir->key_len - KEY_HEADER;
+	memcpy( &st->handle->handle_type, dir->key + FSID_SIZE, sizeof(int) );
+	memcpy( st->handle->f_handle, dir->key + KEY_HEADER,
+	        st->handle->handle_bytes );
+	int fd = open_by_handle_at( fs->fd, st->handle, O_PATH | O_CLOEXEC );
+	if ( fd < 0 ) return NULL;
+
+	char link[64];
+	char target[PATH_MAX + 1];
+	struct stat sb;
+	snprintf( link, sizeof(link), "/proc/self/fd/%d", fd );
+	ssize_t len = readlink( link, target, sizeof(target) - 2 );
+	int gone = fstat( fd, &sb ) || sb.st_nlink == 0;
+	close( fd );
+	if ( len <= 0 || gone || target[0] != '/' ) return NULL;
+
+	if ( target[len-1] != '/' ) target[len++] = '/';
+	target[len] = '\0';
+	return strdup( target );
+}
+
+/**
+ * @internal
+ * Check the directories from @a root down to @a path against the excludes
+ * of @a root.  @a path is modified, but restored before returning.
+ */
+static int root_excludes( struct fan_root const * root, char * path ) {
+	if ( !root->exclude ) return 0;
+	size_t i;
+	for ( i = strlen( root->path ); path[i]; ++i ) {
+		if ( path[i] != '/' ) continue;
+		char c = path[i+1];
+		path[i+1] = '\0';
+		int excluded = inotifytools_exclude_matches( root->exclude, path );
+		path[i+1] = c;
+		if ( excluded ) return 1;
+	}
+	return 0;
+}
+
+/**
+ * @internal
+ * Find the watch the events of the directory @a real are reported to.
+ *
+ * @return the root, with the path of the directory below it in @a st->path,
+ *         or NULL if the directory is not watched.
+ */
+static struct fan_root * root_match( struct fan_state * st,
+                                     char const * real ) {
+	struct fan_root * root;
+	for ( root = st->roots; root; root = root->next ) {
+		if ( !root->is_dir ) continue;
+		if ( root->recursive ? strncmp( real, root->real, root->real_len )
+		                     : strcmp( real, root->real ) ) {
+			continue;
+		}
+		size_t len = strlen( root->path );
+		char const * rest = real + root->real_len;
+		if ( !path_reserve( st, len + strlen( rest ) + 1 ) ) return NULL;
+		memcpy( st->path, root->path, len );
+		strcpy( st->path + len, rest );
+		if ( root->recursive && root_excludes( root, st->path ) ) continue;
+		return root;
+	}
+	return NULL;
+}
+
+/**
+ * @internal
+ * Bring the path and root of @a dir up to date, and rename its watch if its
+ * path changed.
+ */
+static void dir_evaluate( inotifytools_ctx * ctx, struct fan_state * st,
+                          struct fan_dir * dir ) {
+	dir->generation = st->generation;
+	// a directory which can't be resolved any more keeps its last path
+	char * real = dir_resolve( st, dir );
+	if ( real ) {
+		free( dir->real );
+		dir->real = real;
+	}
+	dir->root = dir->real ? root_match( st, dir->real ) : NULL;
+	if ( !dir->root || dir->ignored ) return;
+
+	char const * name = inotifytools_ctx_filename_from_wd( ctx, dir->wd );
+	if ( !name || strcmp( name, st->path ) ) {
+		inotifytools_backend_set_path( ctx, dir->wd, st->path );
+	}
+}
+
+/**
+ * @internal
+ * Append an event to @a buf, padding the name like the kernel does.
+ *
+ * @return 1 on success, 0 if it doesn't fit.
+ */
+static int emit( char * buf, size_t size, size_t * used, int wd,
+                 uint32_t mask, uint32_t cookie, char const * name ) {
+	size_t name_len = strlen( name );
+	size_t len = 0;
+	if ( name_len ) {
+		len = (name_len + sizeof(struct inotify_event)) &
+		      ~(sizeof(struct inotify_event) - 1);
+	}
+	if ( *used + sizeof(struct inotify_event) + len > size ) return 0;
+
+	struct inotify_event * event = (struct inotify_event *)(buf + *used);
+	event->wd = wd;
+	event->mask = mask;
+	event->cookie = cookie;
+	event->len = len;
+	memcpy( event->name, name, name_len );
+	memset( event->name + name_len, 0, len - name_len );
+	*used += sizeof(struct inotify_event) + len;
+	return 1;
+}
+
+/**
+ * @internal
+ * Find the directory a fanotify event happened in, bringing it up to date.
+ *
+ * @param meta an aligned copy of the metadata at the start of @a record.
+ * @param name set to the name of the file in the directory the event is
+ *             about, or "" for the directory itself.
+ *
+ * @return the directory, or NULL if the event has none or out of memory.
+ */
+static struct fan_dir * record_dir( inotifytools_ctx * ctx,
+                                    struct fan_state * st,
+                                    struct fanotify_event_metadata const * meta,
+                                    char const * record, char const ** name ) {
+	struct fanotify_event_info_fid const * fid = NULL;
+	*name = "";
+	char const * p = record + meta->metadata_len;
+	char const * end = record + meta->event_len;
+	while ( p + sizeof(struct fanotify_event_info_header) <= end ) {
+		struct fanotify_event_info_header const * hdr =
+		    (struct fanotify_event_info_header const *)p;
+		if ( hdr->len < sizeof(*hdr) || p + hdr->len > end ) break;
+		if ( hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ||
+		     hdr->info_type == FAN_EVENT_INFO_TYPE_DFID ) {
+			fid = (struct fanotify_event_info_fid const *)p;
+			struct file_handle const * fh =
+			    (struct file_handle const *)fid->handle;
+			if ( hdr->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME ) {
+				*name = (char const *)fh->f_handle + fh->handle_bytes;
+			}
+			break;
+		}
+		p += hdr->len;
+	}
+	if ( !fid ) return NULL;
+	// events on the directory itself
+	if ( !strcmp( *name, "." ) ) *name = "";
+
+	size_t key_len = make_key( st, &fid->fsid,
+	                           (struct file_handle const *)fid->handle );
+	struct fan_dir * dir = key_len ? dir_get( st, key_len, 1 ) : NULL;
+	if ( dir && dir->generation != st->generation ) dir_evaluate( ctx, st, dir );
+	return dir;
+}
+
+/**
+ * @internal
+ * @return upper bound of the number of bytes translate_event() adds for an
+ *         event on @a name in @a dir.
+ */
+static size_t record_need( struct fan_dir const * dir, char const * name ) {
+	size_t need = FAN_EVENT_MAX;
+	struct fan_root const * root;
+	if ( !*name ) return need;
+	for ( root = dir->files; root; root = root->next_file ) {
+		if ( !strcmp( root->name, name ) ) need += FAN_EVENT_MAX;
+	}
+	return need;
+}
+
+/**
+ * @internal
+ * Translate one fanotify event on @a name in @a dir, as found by
+ * record_dir(), into inotify events in @a buf.
+ */
+static void translate_event( struct fan_state * st,
+                             struct fanotify_event_metadata const * meta,
+                             struct fan_dir * dir, char const * name,
+                             char * buf, size_t size, size_t * used ) {
+	uint32_t mask = meta->mask & FAN_INOTIFY_EVENTS;
+	if ( meta->mask & FAN_ONDIR ) mask |= IN_ISDIR;
+
+	// fanotify has no cookies, but reports both halves of a rename in a row
+	uint32_t cookie = 0;
+	if ( mask & IN_MOVED_FROM ) {
+		if ( !++st->cookie ) ++st->cookie;
+		cookie = st->move_cookie = st->cookie;
+	}
+	else if ( mask & IN_MOVED_TO ) {
+		cookie = st->move_cookie;
+		st->move_cookie = 0;
+	}
+	else {
+		st->move_cookie = 0;
+	}
+
+	if ( *name ) {
+		struct fan_root * root;
+		for ( root = dir->files; root; root = root->next_file ) {
+			if ( (mask & root->events) == 0 || strcmp( root->name, name ) ) {
+				continue;
+			}
+			if ( !emit( buf, size, used, root->wd, mask & root->events,
+			            cookie, "" ) ) {
+				st->lost = 1;
+			}
+		}
+	}
+	if ( dir->root && !dir->ignored && (mask & dir->root->events) &&
+	     !emit( buf, size, used, dir->wd,
+	            (mask & dir->root->events) | (mask & IN_ISDIR), cookie,
+	            name ) ) {
+		st->lost = 1;
+	}
+
+	// the paths of the directories below a moved or deleted one change
+	if ( (mask & IN_ISDIR) &&
+	     (mask & (IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE)) ) {
+		++st->generation;
+	}
+}
+
+/**
+ * @internal
+ */
+static int fanotify_backend_open( void ** data ) {
+	struct fan_state * st = (struct fan_state *)calloc( 1, sizeof(*st) );
+	if ( !st ) return -1;
+	st->handle = (struct file_handle *)malloc( sizeof(struct file_handle) +
+	                                           MAX_HANDLE_SZ );
+	if ( !st->handle ) {
+		free( st );
+		return -1;
+	}
+	st->next_wd = 1;
+
+	int fd = fanotify_init( FAN_CLASS_NOTIF | FAN_REPORT_DFID_NAME |
+	                        FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_CLOEXEC );
+	if ( fd < 0 ) {
+		int error = errno;
+		free( st->handle );
+		free( st );
+		errno = error;
+		return -1;
+	}
+	*data = st;
+	return fd;
+}
+
+/**
+ * @internal
+ */
+static void root_free( struct fan_root * root ) {
+	inotifytools_exclude_free( root->exclude );
+	free( root->path );
+	free( root->real );
+	free( root );
+}
+
+/**
+ * @internal
+ */
+static void fanotify_backend_close( void * data, int fd ) {
+	struct fan_state * st = (struct fan_state *)data;
+	close( fd );
+	if ( !st ) return;
+
+	while ( st->roots ) {
+		struct fan_root * next = st->roots->next;
+		root_free( st->roots );
+		st->roots = next;
+	}
+	while ( st->filesystems ) {
+		struct fan_fs * next = st->filesystems->next;
+		close( st->filesystems->fd );
+		free( st->filesystems->path );
+		free( st->filesystems );
+		st->filesystems = next;
+	}
+	unsigned i;
+	for ( i = 0; i < st->by_wd_size; ++i ) {
+		if ( !st->by_wd[i] ) continue;
+		free( st->by_wd[i]->real );
+		free( st->by_wd[i] );
+	}
+	free( st->by_wd );
+	free( st->buckets );
+	free( st->raw );
+	free( st->path );
+	free( st->handle );
+	free( st );
+}
+
+/**
+ * @internal
+ * Find the marked file system @a path is on, or start tracking it.  Its
+ * root count is not changed.
+ *
+ * @return the file system, or NULL with @a errno set.
+ */
+static struct fan_fs * fs_get( struct fan_state * st, char const * path ) {
+	// Only opened for a new file system, since the open is reported once
+	// it is marked.
+	struct statfs sfs;
+	if ( statfs( path, &sfs ) ) return NULL;
+	struct fan_fs * fs;
+	for ( fs = st->filesystems; fs; fs = fs->next ) {
+		if ( !memcmp( fs->fsid, &sfs.f_fsid, FSID_SIZE ) ) return fs;
+	}
+
+	// open_by_handle_at() doesn't take O_PATH descriptors
+	int fd = open( path, O_RDONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC );
+	if ( fd < 0 ) return NULL;
+	fs = (struct fan_fs *)calloc( 1, sizeof(*fs) );
+	if ( fs ) fs->path = strdup( path );
+	if ( !fs || !fs->path ) {
+		free( fs );
+		close( fd );
+		errno = ENOMEM;
+		return NULL;
+	}
+	memcpy( fs->fsid, &sfs.f_fsid, FSID_SIZE );
+	fs->fd = fd;
+	fs->next = st->filesystems;
+	st->filesystems = fs;
+	return fs;
+}
+
+/**
+ * @internal
+ * Stop tracking @a fs if no root is on it any more, removing its mark.
+ */
+static void fs_put( struct fan_state * st, int fd, struct fan_fs * fs ) {
+	if ( fs->roots ) return;
+	// fails if the path was moved away, but then the events are dropped
+	fanotify_mark( fd, FAN_MARK_REMOVE | FAN_MARK_FILESYSTEM,
+	               FAN_INOTIFY_EVENTS | FAN_ONDIR, AT_FDCWD, fs->path );
+	struct fan_fs ** link = &st->filesystems;
+	while ( *link != fs ) link = &(*link)->next;
+	*link = fs->next;
+	close( fs->fd );
+	free( fs->path );
+	free( fs );
+}
+
+/**
+ * @internal
+ * Find the directory @a path on @a fs, adding it if needed.
+ *
+ * @return the directory, or NULL with @a errno set.
+ */
+static struct fan_dir * dir_find( struct fan_state * st,
+                                  struct fan_fs const * fs,
+                                  char const * path ) {
+	int mount_id;
+	st->handle->handle_bytes = MAX_HANDLE_SZ;
+	if ( name_to_handle_at( AT_FDCWD, path, st->handle, &mount_id, 0 ) ) {
+		return NULL;
+	}
+	size_t key_len = make_key( st, fs->fsid, st->handle );
+	struct fan_dir * dir = key_len ? dir_get( st, key_len, 1 ) : NULL;
+	if ( !dir ) errno = ENOMEM;
+	return dir;
+}
+
+/**
+ * @internal
+ * Find the directory @a path on @a fs, adding it if needed, and have it
+ * evaluated again on its next event.
+ *
+ * @return the directory, or NULL with @a errno set.
+ */
+static struct fan_dir * dir_of_path( struct fan_state * st,
+                                     struct fan_fs const * fs,
+                                     char const * path ) {
+	struct fan_dir * dir = dir_find( st, fs, path );
+	if ( !dir ) return NULL;
+	dir->ignored = 0;
+	dir->generation = st->generation - 1;
+	return dir;
+}
+
+/**
+ * @internal
+ * @return the recursive watch which already reports @a events for the
+ *         directory @a path, whose canonical path is @a real, or NULL.
+ */
+static struct fan_root * root_cover( struct fan_state * st, char const * path,
+                                     char const * real, uint32_t events ) {
+	struct fan_root * cover = root_match( st, real );
+	if ( !cover || !cover->recursive || (cover->events & events) != events ) {
+		return NULL;
+	}
+	// a file system mounted below the watch isn't marked
+	struct statfs sfs;
+	if ( statfs( path, &sfs ) ||
+	     memcmp( cover->fs->fsid, &sfs.f_fsid, FSID_SIZE ) ) {
+		return NULL;
+	}
+	return cover;
+}
+
+/**
+ * @internal
+ * Watch @a path, and everything below it if @a recursive is set.  A
+ * directory a recursive watch already covers is only given a watch
+ * descriptor, and the excludes of that watch apply below it.
+ */
+static int add_root( struct fan_state * st, int fd, char const * path,
+                     uint32_t events, int recursive,
+                     inotifytools_exclude const * exclude ) {
+	if ( !(events & FAN_INOTIFY_EVENTS) ) {
+		errno = EINVAL;
+		return -1;
+	}
+	struct stat sb;
+	if ( stat( path, &sb ) ) return -1;
+	int is_dir = S_ISDIR( sb.st_mode );
+
+	struct fan_root * root = (struct fan_root *)calloc( 1, sizeof(*root) );
+	char * real = realpath( path, NULL );
+	if ( !root || !real ) goto fail;
+	root->events = events;
+	root->is_dir = is_dir;
+	root->recursive = recursive && is_dir;
+	size_t len = strlen( path );
+	size_t real_len = strlen( real );
+	int slash = is_dir && path[len-1] != '/';
+	int real_slash = is_dir && real[real_len-1] != '/';
+	root->path = (char *)malloc( len + slash + 1 );
+	root->real = (char *)malloc( real_len + real_slash + 1 );
+	if ( !root->path || !root->real ) goto fail;
+	sprintf( root->path, "%s%s", path, slash ? "/" : "" );
+	sprintf( root->real, "%s%s", real, real_slash ? "/" : "" );
+	root->real_len = real_len + real_slash;
+	free( real );
+	real = NULL;
+
+	// directories created below a recursive watch, which inotifywait
+	// watches as they come, are already covered by it
+	struct fan_root * cover =
+	    is_dir ? root_cover( st, path, root->real, events ) : NULL;
+	if ( cover ) {
+		root_free( root );
+		struct fan_dir * dir = dir_of_path( st, cover->fs, path );
+		return dir ? dir->wd : -1;
+	}
+
+	root->fs = fs_get( st, path );
+	if ( !root->fs ) goto fail;
+	if ( fanotify_mark( fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+	                    (events & FAN_INOTIFY_EVENTS) | FAN_ONDIR,
+	                    AT_FDCWD, path ) ) {
+		goto fail_fs;
+	}
+
+	if ( is_dir ) {
+		struct fan_dir * dir = dir_of_path( st, root->fs, path );
+		if ( !dir ) goto fail_fs;
+		root->wd = dir->wd;
+	}
+	else {
+		// the events of a file come with the handle of its directory
+		root->name = strrchr( root->real, '/' ) + 1;
+		size_t dir_len = root->name - root->real;
+		if ( !path_reserve( st, dir_len + 1 ) ) {
+			errno = ENOMEM;
+			goto fail_fs;
+		}
+		memcpy( st->path, root->real, dir_len );
+		st->path[dir_len] = '\0';
+		root->parent = dir_find( st, root->fs, st->path );
+		if ( !root->parent ) goto fail_fs;
+		root->wd = st->next_wd++;
+		root->next_file = root->parent->files;
+		root->parent->files = root;
+	}
+	if ( root->recursive ) root->exclude = inotifytools_exclude_copy( exclude );
+
+	struct fan_root ** link = &st->roots;
+	while ( *link ) link = &(*link)->next;
+	*link = root;
+	++root->fs->roots;
+	++st->generation;
+	return root->wd;
+
+fail_fs:
+	{
+		int error = errno;
+		fs_put( st, fd, root->fs );
+		errno = error;
+	}
+fail:
+	{
+		int error = errno ? errno : ENOMEM;
+		free( real );
+		if ( root ) root_free( root );
+		errno = error;
+	}
+	return -1;
+}
+
+/**
+ * @internal
+ */
+static int fanotify_backend_add_watch( void * data, int fd, char const * path,
+                                       uint32_t events ) {
+	return add_root( (struct fan_state *)data, fd, path, events, 0, NULL );
+}
+
+/**
+ * @internal
+ */
+static int fanotify_backend_add_tree( void * data, int fd, char const * path,
+                                      uint32_t events,
+                                      inotifytools_exclude const * exclude ) {
+	return add_root( (struct fan_state *)data, fd, path, events, 1, exclude );
+}
+
+/**
+ * @internal
+ * Removing a directory which was not added itself only stops its events
+ * from being reported, until it is added again.
+ */
+static int fanotify_backend_rm_watch( void * data, int fd, int wd ) {
+	struct fan_state * st = (struct fan_state *)data;
+	int found = 0;
+	struct fan_root ** link = &st->roots;
+	while ( *link ) {
+		struct fan_root * root = *link;
+		if ( root->wd != wd ) {
+			link = &root->next;
+			continue;
+		}
+		*link = root->next;
+		if ( root->parent ) {
+			struct fan_root ** file = &root->parent->files;
+			while ( *file != root ) file = &(*file)->next_file;
+			*file = root->next_file;
+		}
+		--root->fs->roots;
+		fs_put( st, fd, root->fs );
+		root_free( root );
+		++st->generation;
+		found = 1;
+	}
+	if ( wd > 0 && (unsigned)wd < st->by_wd_size && st->by_wd[wd] ) {
+		st->by_wd[wd]->ignored = 1;
+		found = 1;
+	}
+	if ( !found ) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * @internal
+ * A record can turn into an event for each watch of the file it is about
+ * and one for its directory, which may not fit into @a size bytes although
+ * the record does.  Records which might not fit are kept for the next read.
+ */
+static ssize_t fanotify_backend_read( inotifytools_ctx * ctx, void * data,
+                                      int fd, char * buf, size_t size ) {
+	struct fan_state * st = (struct fan_state *)data;
+	size_t used = 0;
+	if ( st->lost ) {
+		st->move_cookie = 0;
+		st->lost = !emit( buf, size, &used, -1, IN_Q_OVERFLOW, 0, "" );
+	}
+
+	char const * record;
+	ssize_t len;
+	if ( st->pending_len ) {
+		record = st->raw + st->pending;
+		len = st->pending_len;
+		st->pending_len = 0;
+	}
+	else {
+		if ( st->raw_size < size ) {
+			char * raw = (char *)realloc( st->raw, size );
+			if ( !raw ) return -1;
+			st->raw = raw;
+			st->raw_size = size;
+		}
+		len = read( fd, st->raw, size );
+		if ( len < 0 && errno == EAGAIN && used ) len = 0;
+		else if ( len <= 0 ) return len;
+		record = st->raw;
+	}
+
+	// Records are only 4 byte aligned once they carry info records, but the
+	// metadata has a 64 bit mask, so it is copied out before use.
+	struct fanotify_event_metadata meta;
+	for ( ; len >= (ssize_t)FAN_EVENT_METADATA_LEN;
+	      record += meta.event_len, len -= meta.event_len ) {
+		memcpy( &meta, record, sizeof(meta) );
+		if ( meta.event_len < FAN_EVENT_METADATA_LEN ||
+		     meta.event_len > len ) break;
+		int translate = meta.vers == FANOTIFY_METADATA_VERSION &&
+		                !(meta.mask & FAN_Q_OVERFLOW);
+		char const * name = "";
+		struct fan_dir * dir =
+		    translate ? record_dir( ctx, st, &meta, record, &name ) : NULL;
+		size_t need = dir ? record_need( dir, name ) : FAN_EVENT_MAX;
+		if ( used && used + need > size ) {
+			st->pending = record - st->raw;
+			st->pending_len = len;
+			break;
+		}
+		if ( meta.fd >= 0 ) close( meta.fd );
+		if ( dir ) {
+			translate_event( st, &meta, dir, name, buf, size, &used );
+		}
+		else if ( meta.vers == FANOTIFY_METADATA_VERSION &&
+		          (meta.mask & FAN_Q_OVERFLOW) ) {
+			st->move_cookie = 0;
+			if ( !emit( buf, size, &used, -1, IN_Q_OVERFLOW, 0, "" ) ) {
+				st->lost = 1;
+			}
+		}
+	}
+	if ( !used ) {
+		errno = EAGAIN;
+		return -1;
+	}
+	return used;
+}
+
+/**
+ * @internal
+ * Count the records kept by the last read as queued, so they are read next.
+ */
+static int fanotify_backend_queued( void * data, int fd ) {
+	struct fan_state * st = (struct fan_state *)data;
+	int bytes;
+	if ( -1 == ioctl( fd, FIONREAD, &bytes ) ) return -1;
+	return bytes + st->pending_len +
+	       (st->lost ? sizeof(struct inotify_event) : 0);
+}
+
+struct inotifytools_backend const inotifytools_fanotify_backend = {
+	"fanotify",
+	fanotify_backend_open,
+	fanotify_backend_close,
+	fanotify_backend_add_watch,
+	fanotify_backend_add_tree,
+	fanotify_backend_rm_watch,
+	fanotify_backend_read,
+	fanotify_backend_queued,
+};
+
+#else // FAN_REPORT_DFID_NAME
+
+/**
+ * @internal
+ * Built without fanotify headers new enough for FAN_REPORT_DFID_NAME.
+ */
+static int fanotify_backend_open( void ** data __attribute__((unused)) ) {
+	errno = ENOSYS;
+	return -1;
+}
+
+struct inotifytools_backend const inotifytools_fanotify_backend = {
+	"fanotify",
+	fanotify_backend_open,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+};
+
+#endif // FAN_REPORT_DFID_NAME
@@ -0,0 +1,575 @@
+// kate: replace-tabs off; space-indent off;
+
+/**
+ * @file filter.c
+ * @internal
+ * Compiled include and exclude patterns; see inotifytools_add_filter().
+ *
+ * Patterns which only compare a literal with the whole path, its start or
+ * its end, such as the glob "*.swp" or the regex "\.swp$", go into hash
+ * tables, and no regular expression is run for them.  All other patterns of
+ * a side are combined into as few regular expressions as possible, one for
+ * each set of regcomp() flags.
+ *
+ * The path is matched as the directory of the watch and the name of the
+ * event, without joining them unless a regular expression has to run, and
+ * only suffixes which fit in the name don't even need the directory.
+ */
+
+#include "../../config.h"
+#include "inotifytools/inotifytools.h"
+#include "inotifytools_p.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/** @internal How a literal is compared with a path. */
+enum {
+	LITERAL_EXACT,
+	LITERAL_PREFIX,
+	LITERAL_SUFFIX,
+	LITERAL_KINDS
+};
+
+/**
+ * @internal
+ * Open addressing hash table of literals, with the distinct literal lengths
+ * it holds: a path is looked up once for each length.
+ */
+struct literal_table {
+	struct literal {
+		uint32_t hash;
+		size_t len;
+		char *str;
+	} *slots;
+	size_t mask;
+	size_t count;
+	size_t *lens;
+	int num_lens;
+};
+
+/**
+ * @internal
+ * The include or the exclude patterns of a filter.  @a literals are indexed
+ * by kind and by whether they ignore case.
+ */
+struct filter_side {
+	int count;
+	struct literal_table literals[LITERAL_KINDS][2];
+	regex_t *regexes;
+	int num_regexes;
+};
+
+struct inotifytools_filter {
+	struct filter_side exclude;
+	struct filter_side include;
+	// longest suffix literal, and whether anything else needs the directory
+	size_t max_suffix;
+	int needs_dir;
+};
+
+/**
+ * @internal
+ * A path in up to two pieces, the directory and the name.
+ */
+struct path_view {
+	char const *dir;
+	size_t dir_len;
+	char const *name;
+	size_t name_len;
+};
+
+/** @internal Byte @a i of the path, folded to lower case if @a icase. */
+static inline unsigned char view_at( struct path_view const *v, size_t i,
+                                     int icase ) {
+	unsigned char c = i < v->dir_len ? v->dir[i] : v->name[i - v->dir_len];
+	return icase ? tolower( c ) : c;
+}
+
+/** @internal FNV-1a of the @a len bytes at @a start of the path. */
+static uint32_t view_hash( struct path_view const *v, size_t start,
+                           size_t len, int icase ) {
+	uint32_t hash = 2166136261u;
+	for ( size_t i = start; i < start + len; ++i ) {
+		hash = (hash ^ view_at( v, i, icase )) * 16777619u;
+	}
+	return hash;
+}
+
+/** @internal FNV-1a of @a str, which is already folded if need be. */
+static uint32_t str_hash( char const *str, size_t len ) {
+	struct path_view v = { str, len, "", 0 };
+	return view_hash( &v, 0, len, 0 );
+}
+
+/**
+ * @internal
+ * Add the literal @a str of @a len bytes to @a t, which takes it over.
+ */
+static void literal_add( struct literal_table *t, char *str, size_t len ) {
+	if ( 2 * (t->count + 1) > t->mask + 1 || !t->slots ) {
+		size_t size = t->slots ? 2 * (t->mask + 1) : 16;
+		struct literal *slots =
+			(struct literal *)calloc( size, sizeof(struct literal) );
+		niceassert( slots, "out of memory" );
+		for ( size_t i = 0; t->slots && i <= t->mask; ++i ) {
+			if ( !t->slots[i].str ) continue;
+			size_t j = t->slots[i].hash & (size - 1);
+			while ( slots[j].str ) j = (j + 1) & (size - 1);
+			slots[j] = t->slots[i];
+		}
+		free( t->slots );
+		t->slots = slots;
+		t->mask = size - 1;
+	}
+
+	uint32_t hash = str_hash( str, len );
+	size_t j = hash & t->mask;
+	for ( ; t->slots[j].str; j = (j + 1) & t->mask ) {
+		if ( t->slots[j].len == len && !memcmp( t->slots[j].str, str, len ) ) {
+			free( str );
+			return;
+		}
+	}
+	t->slots[j].hash = hash;
+	t->slots[j].len = len;
+	t->slots[j].str = str;
+	++t->count;
+
+	for ( int i = 0; i < t->num_lens; ++i ) {
+		if ( t->lens[i] == len ) return;
+	}
+	t->lens = (size_t *)realloc( t->lens, (t->num_lens + 1) * sizeof(size_t) );
+	niceassert( t->lens, "out of memory" );
+	t->lens[t->num_lens++] = len;
+}
+
+/**
+ * @internal
+ * @return 1 if @a t holds the @a len bytes at @a start of the path.
+ */
+static int literal_find( struct literal_table const *t,
+                         struct path_view const *v, size_t start, size_t len,
+                         int icase ) {
+	uint32_t hash = view_hash( v, start, len, icase );
+	for ( size_t j = hash & t->mask; t->slots[j].str; j = (j + 1) & t->mask ) {
+		struct literal const *l = &t->slots[j];
+		if ( l->hash != hash || l->len != len ) continue;
+		size_t i = 0;
+		while ( i < len && view_at( v, start + i, icase ) ==
+		                   (unsigned char)l->str[i] ) {
+			++i;
+		}
+		if ( i == len ) return 1;
+	}
+	return 0;
+}
+
+static void literal_free( struct literal_table *t ) {
+	for ( size_t i = 0; t->slots && i <= t->mask; ++i ) free( t->slots[i].str );
+	free( t->slots );
+	free( t->lens );
+}
+
+/**
+ * @internal
+ * Find the literal a regex only compares with the whole path, its start or
+ * its end: "^lit$", "^lit" or "lit$", where lit has no special characters
+ * but those escaped with a backslash.
+ *
+ * @return the literal, with its kind in @a kind, or NULL if the regex does
+ *         more than that.
+ */
+static char * regex_literal( char const *pattern, int cflags, int *kind ) {
+	size_t len = strlen( pattern );
+	int start = pattern[0] == '^';
+	int end = len > (size_t)start && pattern[len - 1] == '$' &&
+	          (len < 2 || pattern[len - 2] != '\\');
+	if ( !start && !end ) return NULL;
+	*kind = start && end ? LITERAL_EXACT : start ? LITERAL_PREFIX :
+	        LITERAL_SUFFIX;
+
+	char const *special = cflags & REG_EXTENDED ? ".[]\\*^$+?(){}|" :
+	                                              ".[]\\*^$";
+	char *lit = (char *)malloc( len + 1 );
+	niceassert( lit, "out of memory" );
+	size_t n = 0;
+	for ( size_t i = start; i < len - end; ++i ) {
+		char c = pattern[i];
+		if ( c == '\\' ) {
+			c = pattern[++i];
+			if ( !c || !strchr( special, c ) ) break;
+		}
+		// unescaped +?(){}| are special in some flavours either way
+		else if ( strchr( ".[]\\*^$+?(){}|", c ) ) break;
+		lit[n++] = c;
+		if ( i + 1 == len - end ) {
+			lit[n] = 0;
+			return lit;
+		}
+	}
+	free( lit );
+	return NULL;
+}
+
+/**
+ * @internal
+ * Find the literal a glob compares with the whole path, its start or its
+ * end: "lit", "lit*" or "*lit".
+ *
+ * @return the literal, with its kind in @a kind, or NULL if the glob does
+ *         more than that.
+ */
+static char * glob_literal( char const *pattern, int *kind ) {
+	size_t len = strlen( pattern );
+	size_t first = pattern[0] == '*';
+	size_t last = len;
+	if ( len > first && pattern[len - 1] == '*' &&
+	     (len < 2 || pattern[len - 2] != '\\') ) {
+		--last;
+	}
+	if ( first && last < len ) return NULL;
+	*kind = first ? LITERAL_SUFFIX : last < len ? LITERAL_PREFIX :
+	        LITERAL_EXACT;
+
+	char *lit = (char *)malloc( len + 1 );
+	niceassert( lit, "out of memory" );
+	size_t n = 0;
+	for ( size_t i = first; i < last; ++i ) {
+		char c = pattern[i];
+		if ( c == '\\' && i + 1 < last ) c = pattern[++i];
+		else if ( c == '*' || c == '?' || c == '[' || c == '\\' ) {
+			free( lit );
+			return NULL;
+		}
+		lit[n++] = c;
+	}
+	lit[n] = 0;
+	if ( !n ) {
+		free( lit );
+		return NULL;
+	}
+	return lit;
+}
+
+/**
+ * @internal
+ * @return the index of the ']' closing the bracket expression which starts
+ *         at @a glob[@a i], or 0 if there is none.  A ']' right after the
+ *         '[' or its '!' is part of the expression.
+ */
+static size_t bracket_end( char const *glob, size_t i ) {
+	size_t j = i + 1;
+	if ( glob[j] == '!' || glob[j] == '^' ) ++j;
+	if ( glob[j] == ']' ) ++j;
+	while ( glob[j] && glob[j] != ']' ) ++j;
+	return glob[j] ? j : 0;
+}
+
+/**
+ * @internal
+ * Translate a glob into an extended regex matching the same whole paths.
+ * '*' and '?' match '/' too, as fnmatch() does without FNM_PATHNAME.
+ *
+ * @return the regex, to be freed by the caller.
+ */
+static char * glob_to_regex( char const *glob ) {
+	size_t len = strlen( glob );
+	// every character may become two, plus "^(" and ")$"
+	char *re = (char *)malloc( 2 * len + 5 );
+	niceassert( re, "out of memory" );
+	char *p = re;
+	size_t close;
+	*p++ = '^';
+	*p++ = '(';
+	for ( size_t i = 0; i < len; ++i ) {
+		char c = glob[i];
+		if ( c == '*' ) {
+			*p++ = '.';
+			*p++ = '*';
+		}
+		else if ( c == '?' ) *p++ = '.';
+		else if ( c == '[' && (close = bracket_end( glob, i )) ) {
+			// copy the bracket expression, with '!' for negation
+			*p++ = '[';
+			if ( glob[++i] == '!' ) {
+				*p++ = '^';
+				++i;
+			}
+			while ( i < close ) *p++ = glob[i++];
+			*p++ = ']';
+		}
+		else {
+			if ( c == '\\' && i + 1 < len ) c = glob[++i];
+			if ( strchr( ".[]\\()*+?{}|^$", c ) ) *p++ = '\\';
+			*p++ = c;
+		}
+	}
+	*p++ = ')';
+	*p++ = '$';
+	*p = 0;
+	return re;
+}
+
+/**
+ * @internal
+ * @return 1 if the extended regex @a pattern has a back reference, whose
+ *         number would change when combined with others.
+ */
+static int has_backref( char const *pattern ) {
+	for ( char const *p = pattern; *p; ++p ) {
+		if ( *p == '\\' && *++p >= '1' && *p <= '9' ) return 1;
+		if ( !*p ) break;
+	}
+	return 0;
+}
+
+/**
+ * @internal
+ * Compile @a pattern into the next regex of @a side.
+ *
+ * @return 0 on success, or EINVAL.
+ */
+static int side_add_regex( struct filter_side *side, char const *pattern,
+                           int cflags ) {
+	side->regexes = (regex_t *)realloc( side->regexes,
+	                   (side->num_regexes + 1) * sizeof(regex_t) );
+	niceassert( side->regexes, "out of memory" );
+	if ( 0 != regcomp( &side->regexes[side->num_regexes], pattern,
+	                   cflags | REG_NOSUB ) ) {
+		return EINVAL;
+	}
+	++side->num_regexes;
+	return 0;
+}
+
+/**
+ * @internal
+ * Compile the regexes of @a side: those with the same @a cflags are joined
+ * into one alternation, if they are extended and have no back references.
+ *
+ * @return 0 on success, or EINVAL if a pattern is not a valid regex.
+ */
+static int side_compile_regexes( struct filter_side *side,
+                                 char const **regexes, int const *cflags,
+                                 int count ) {
+	int *done = (int *)calloc( count ? count : 1, sizeof(int) );
+	niceassert( done, "out of memory" );
+	int error = 0;
+	for ( int i = 0; !error && i < count; ++i ) {
+		if ( done[i] ) continue;
+		done[i] = 1;
+		if ( !(cflags[i] & REG_EXTENDED) || has_backref( regexes[i] ) ) {
+			error = side_add_regex( side, regexes[i], cflags[i] );
+			continue;
+		}
+
+		size_t len = strlen( regexes[i] ) + 3;
+		for ( int j = i + 1; j < count; ++j ) {
+			if ( cflags[j] == cflags[i] && !has_backref( regexes[j] ) ) {
+				len += strlen( regexes[j] ) + 3;
+			}
+		}
+		char *joined = (char *)malloc( len );
+		niceassert( joined, "out of memory" );
+		char *p = joined;
+		p += sprintf( p, "(%s)", regexes[i] );
+		for ( int j = i + 1; j < count; ++j ) {
+			if ( cflags[j] != cflags[i] || has_backref( regexes[j] ) ) {
+				continue;
+			}
+			p += sprintf( p, "|(%s)", regexes[j] );
+			done[j] = 1;
+		}
+		error = side_add_regex( side, joined, cflags[i] );
+		free( joined );
+	}
+	free( done );
+	return error;
+}
+
+static void side_free( struct filter_side *side ) {
+	for ( int k = 0; k < LITERAL_KINDS; ++k ) {
+		literal_free( &side->literals[k][0] );
+		literal_free( &side->literals[k][1] );
+	}
+	for ( int i = 0; i < side->num_regexes; ++i ) regfree( &side->regexes[i] );
+	free( side->regexes );
+}
+
+/**
+ * @internal
+ * Compile @a count patterns into one filter.
+ *
+ * @return the filter, NULL if there are no patterns, or NULL with
+ *         @a error set to EINVAL if a regex doesn't compile.
+ */
+inotifytools_filter * inotifytools_filter_compile(
+                        struct inotifytools_filter_pattern const *patterns,
+                        int count, int *error ) {
+	*error = 0;
+	if ( !count ) return NULL;
+	inotifytools_filter *f =
+		(inotifytools_filter *)calloc( 1, sizeof(inotifytools_filter) );
+	niceassert( f, "out of memory" );
+
+	// the regexes left over for each side
+	char const **regexes[2];
+	char **owned = (char **)calloc( count, sizeof(char *) );
+	int *cflags[2], num_regexes[2] = { 0, 0 };
+	for ( int s = 0; s < 2; ++s ) {
+		regexes[s] = (char const **)calloc( count, sizeof(char *) );
+		cflags[s] = (int *)calloc( count, sizeof(int) );
+		niceassert( regexes[s] && cflags[s] && owned, "out of memory" );
+	}
+
+	for ( int i = 0; i < count; ++i ) {
+		struct inotifytools_filter_pattern const *p = &patterns[i];
+		int include = !!(p->flags & INOTIFYTOOLS_FILTER_INCLUDE);
+		struct filter_side *side = include ? &f->include : &f->exclude;
+		int icase = !!(p->cflags & REG_ICASE);
+		++side->count;
+
+		int kind;
+		char *lit = p->flags & INOTIFYTOOLS_FILTER_GLOB ?
+		            glob_literal( p->pattern, &kind ) :
+		            regex_literal( p->pattern, p->cflags, &kind );
+		if ( lit ) {
+			size_t len = strlen( lit );
+			for ( size_t j = 0; icase && j < len; ++j ) {
+				lit[j] = tolower( (unsigned char)lit[j] );
+			}
+			literal_add( &side->literals[kind][icase], lit, len );
+			if ( kind != LITERAL_SUFFIX ) f->needs_dir = 1;
+			else if ( len > f->max_suffix ) f->max_suffix = len;
+			continue;
+		}
+
+		f->needs_dir = 1;
+		int n = num_regexes[include]++;
+		if ( p->flags & INOTIFYTOOLS_FILTER_GLOB ) {
+			owned[i] = glob_to_regex( p->pattern );
+			regexes[include][n] = owned[i];
+			cflags[include][n] = REG_EXTENDED | (icase ? REG_ICASE : 0);
+		}
+		else {
+			regexes[include][n] = p->pattern;
+			cflags[include][n] = p->cflags;
+		}
+	}
+
+	if ( side_compile_regexes( &f->exclude, regexes[0], cflags[0],
+	                           num_regexes[0] ) ||
+	     side_compile_regexes( &f->include, regexes[1], cflags[1],
+	                           num_regexes[1] ) ) {
+		*error = EINVAL;
+		inotifytools_filter_free( f );
+		f = NULL;
+	}
+
+	for ( int i = 0; i < count; ++i ) free( owned[i] );
+	free( owned );
+	for ( int s = 0; s < 2; ++s ) {
+		free( regexes[s] );
+		free( cflags[s] );
+	}
+	return f;
+}
+
+void inotifytools_filter_free( inotifytools_filter *f ) {
+	if ( !f ) return;
+	side_free( &f->exclude );
+	side_free( &f->include );
+	free( f );
+}
+
+/**
+ * @internal
+ * @return 1 if a pattern of @a side matches the path of @a v.  @a joined is
+ *         the same path in one string, or NULL if it is still to be built in
+ *         @a buf, which holds @a size bytes, for the first regex.  Without
+ *         a directory, only suffixes which fit in the name are compared.
+ */
+static int side_matches( struct filter_side const *side,
+                         struct path_view const *v, char const *joined,
+                         char *buf, size_t size ) {
+	size_t len = v->dir_len + v->name_len;
+	for ( int icase = 0; icase < 2; ++icase ) {
+		struct literal_table const *t;
+		t = &side->literals[LITERAL_SUFFIX][icase];
+		for ( int i = 0; i < t->num_lens; ++i ) {
+			size_t n = t->lens[i];
+			if ( n > (v->dir ? len : v->name_len) ) continue;
+			if ( literal_find( t, v, len - n, n, icase ) ) return 1;
+		}
+		if ( !v->dir ) continue;
+		t = &side->literals[LITERAL_EXACT][icase];
+		if ( t->count && literal_find( t, v, 0, len, icase ) ) return 1;
+		t = &side->literals[LITERAL_PREFIX][icase];
+		for ( int i = 0; i < t->num_lens; ++i ) {
+			if ( t->lens[i] > len ) continue;
+			if ( literal_find( t, v, 0, t->lens[i], icase ) ) return 1;
+		}
+	}
+
+	for ( int i = 0; i < side->num_regexes; ++i ) {
+		if ( !joined ) {
+			snprintf( buf, size, "%.*s%s", (int)v->dir_len, v->dir, v->name );
+			joined = buf;
+		}
+		if ( 0 == regexec( &side->regexes[i], joined, 0, 0, 0 ) ) return 1;
+	}
+	return 0;
+}
+
+/**
+ * @internal
+ * @return 1 if the directory is needed to decide whether events on a file
+ *         named @a name_len bytes are ignored, 0 if the name is enough.
+ */
+int inotifytools_filter_needs_dir( inotifytools_filter const *f,
+                                   size_t name_len ) {
+	return f->needs_dir || f->max_suffix > name_len;
+}
+
+/**
+ * @internal
+ * @return 1 if events on the file @a name in the directory @a dir are
+ *         ignored: they match an exclude pattern, or there are include
+ *         patterns and they match none of them.  @a dir is the path of the
+ *         watch, or NULL if inotifytools_filter_needs_dir() says it isn't
+ *         needed.  @a buf holds @a size bytes, and is used for joining the
+ *         two if a regex has to run.
+ */
+int inotifytools_filter_ignores( inotifytools_filter const *f,
+                                 char const *dir, char const *name,
+                                 char *buf, size_t size ) {
+	struct path_view v;
+	v.dir = dir;
+	v.dir_len = dir ? strlen( dir ) : 0;
+	v.name = name;
+	v.name_len = strlen( name );
+	char const *joined = !v.name_len ? dir : !v.dir_len ? name : NULL;
+
+	if ( f->exclude.count && side_matches( &f->exclude, &v, joined, buf,
+	                                       size ) ) {
+		return 1;
+	}
+	return f->include.count &&
+	       !side_matches( &f->include, &v, joined, buf, size );
+}
+
+/**
+ * @internal
+ * @return 1 if the directory @a path, without a trailing '/', matches an
+ *         exclude pattern.  Safe to call from several threads at once.
+ */
+int inotifytools_filter_prunes( inotifytools_filter const *f,
+                                char const *path ) {
+	struct path_view v = { path, strlen( path ), "", 0 };
+	return f->exclude.count && side_matches( &f->exclude, &v, path, NULL, 0 );
+}
@@ -21,27 +21,157 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <errno.h>
-#include <sys/select.h>
+#include <limits.h>
+#include <sys/epoll.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <dirent.h>
 #include <time.h>
 #include <regex.h>
-#include <setjmp.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <fnmatch.h>
 
 #include "inotifytools/inotify.h"
 
-#include "uthash.h"
+/** Initial size of the buffer events are read into. */
+#define READ_BUFFER_INITIAL ( 64 * 1024 )
+/** Default limit for growing the read buffer; see inotifytools_set_read_buffer(). */
+#define READ_BUFFER_DEFAULT_LIMIT ( 1024 * 1024 )
+/** Smallest read buffer which can hold any event. */
+#define READ_BUFFER_MIN ( sizeof(struct inotify_event) + NAME_MAX + 1 )
+#define MAX_STRLEN 4096
+
+/** Number of watch records in each block of the watch arena. */
+#define WATCH_BLOCK 1024
+
+/**
+ * Events which are tallied by record_stats().  The counters of each event
+ * are indexed by its bit number; the totals live at STAT_TOTAL, which is the
+ * bit number of IN_Q_OVERFLOW and therefore unused by the counted events.
+ */
+#define STAT_EVENTS ( IN_ACCESS | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                      IN_CLOSE_NOWRITE | IN_OPEN | IN_MOVED_FROM | \
+                      IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_DELETE_SELF | \
+                      IN_MOVE_SELF | IN_UNMOUNT )
+#define STAT_TOTAL 14
+#define NUM_STATS 15
 
-struct my_struct {
-    char *dir_name;
-    char dir_used;                    /* key */
-    UT_hash_handle hh;         /* makes this structure hashable */
+/**
+ * @internal
+ * All state belonging to one inotify instance.  Nothing in here is shared
+ * between contexts, so distinct contexts may be used from distinct threads.
+ */
+struct inotifytools_ctx {
+	struct inotifytools_backend const *backend;
+	void *backend_data;
+	int inotify_fd;
+	int epoll_fd;
+	/* Set with inotifytools_set_wake_fd(), or -1. */
+	int wake_fd;
+	uint64_t *stats[NUM_STATS];
+	uint64_t stat_total[NUM_STATS];
+	unsigned stats_size;
+	int collect_stats;
+	/* Counters of the current and the last interval started by
+	 * inotifytools_next_interval(), which uses buffer @a epoch & 1.  The
+	 * counters of a slot in buffer b belong to interval interval_epoch[b]
+	 * of the slot, and are zeroed lazily by its first event of a later
+	 * interval, so starting an interval costs nothing.  @a epoch is 0 until
+	 * intervals are used. */
+	unsigned epoch;
+	uint32_t *interval[2][NUM_STATS];
+	unsigned *interval_epoch[2];
+	uint64_t interval_total[2][NUM_STATS];
+	int sort_event;
+	struct watch_arena watches;
+	struct watch_table table_wd;
+	watch *last_watch;
+	struct path_set path_names;
+	struct path_set path_nodes;
+	int error;
+	int init;
+	char *timefmt;
+	time_t time_cached;
+	int time_valid;
+	size_t time_len;
+	char time_str[MAX_STRLEN];
+	struct inotifytools_format *format;
+	/* Compiled from @a filter_patterns, see inotifytools_add_filter(). */
+	inotifytools_filter *filter;
+	struct inotifytools_filter_pattern *filter_patterns;
+	int num_filter_patterns;
+	int prune;
+
+	/* Set by inotifytools_set_reach_tracking().  Bit wd of @a reached is
+	 * set once watch wd has had an event, bit wd of @a reach_dirty once
+	 * that or the watch itself is news to the last file written by
+	 * inotifytools_write_reach_file(), @a reach_path.  Both bitmaps have
+	 * @a reach_words words. */
+	int reach;
+	uint64_t *reached;
+	uint64_t *reach_dirty;
+	unsigned reach_words;
+	char *reach_path;
+
+	/* Set by inotifytools_set_rescan_on_overflow().  @a snapshots is indexed
+	 * by watch slot like the statistics, @a roots lists the recursive
+	 * watches inotifytools_rescan() brings up to date. */
+	int rescan;
+	struct dir_snapshot *snapshots;
+	unsigned snapshots_size;
+	struct rescan_root *roots;
+
+	/* Set by inotifytools_set_coalesce_ms(); @a coalesce holds the events
+	 * held back and is allocated when the first one is. */
+	long coalesce_ms;
+	struct coalesce *coalesce;
+
+	/* IN_MOVED_FROM events waiting for their IN_MOVED_TO, see
+	 * inotifytools_track_move(). */
+	struct move_tracker *moves;
+
+	/* Buffer holding events read from inotify.  @a first_byte is the index
+	 * of the next event which has not been handed out yet, @a bytes is the
+	 * amount of data in the buffer.  The buffer grows up to @a
+	 * event_buf_limit bytes while reads fill it; @a read_full is set if the
+	 * last one did. */
+	char *event_buf;
+	size_t event_buf_size;
+	size_t event_buf_limit;
+	int read_full;
+	int first_byte;
+	ssize_t bytes;
+	long long num_reads;
+	long long num_events_read;
+
+	/* Set while inotifytools_enable_metrics() is on; everything timed for
+	 * it checks this first, so the cost when off is one branch. */
+	struct inotifytools_metrics *metrics;
+
+	/* Set while a reader thread fills a ring buffer with events, see
+	 * inotifytools_start_reader(). */
+	struct event_ring *ring;
+
+	/* Set once inotifytools_watch_recursively_async() has started its
+	 * worker thread. */
+	struct async *async;
+
+	/* Scratch buffers for functions which return strings owned by the
+	 * library; they are overwritten by the next call on the same context. */
+	char match_name[MAX_STRLEN];
+	char out[MAX_STRLEN+1];
+	char *path;
+	size_t path_size;
 };
 
-struct my_struct *hashtable = NULL;
 
 
 /**
@@ -130,60 +260,112 @@ struct my_struct *hashtable = NULL;
  *       event for each filename.
  */
 
-#define MAX_EVENTS 4096
-#define MAX_STRLEN 4096
 #define INOTIFY_PROCDIR "/proc/sys/fs/inotify/"
 #define WATCHES_SIZE_PATH INOTIFY_PROCDIR "max_user_watches"
-#define QUEUE_SIZE_PATH   INOTIFY_PROCDIR "max_queued_watches"
+#define QUEUE_SIZE_PATH   INOTIFY_PROCDIR "max_queued_events"
 #define INSTANCES_PATH    INOTIFY_PROCDIR "max_user_instances"
 
-static int inotify_fd;
-static unsigned  num_access;
-static unsigned  num_modify;
-static unsigned  num_attrib;
-static unsigned  num_close_nowrite;
-static unsigned  num_close_write;
-static unsigned  num_open;
-static unsigned  num_move_self;
-static unsigned  num_moved_to;
-static unsigned  num_moved_from;
-static unsigned  num_create;
-static unsigned  num_delete;
-static unsigned  num_delete_self;
-static unsigned  num_unmount;
-static unsigned  num_total;
-static int collect_stats = 0;
-
-struct rbtree *tree_wd = 0;
-struct rbtree *tree_filename = 0;
-static int error = 0;
-static int init = 0;
-static char* timefmt = 0;
-static regex_t* regex = 0;
+/**
+ * @internal
+ */
+static int inotify_backend_open( void **data ) {
+	*data = NULL;
+	return inotify_init();
+}
 
-int isdir( char const * path );
-void record_stats( struct inotify_event const * event );
-int onestr_to_event(char const * event);
+/**
+ * @internal
+ */
+static void inotify_backend_close( void *data __attribute__((unused)),
+                                   int fd ) {
+	close( fd );
+}
 
 /**
  * @internal
- * Assert that a condition evaluates to true, and optionally output a message
- * if the assertion fails.
- *
- * @param  cond  Integer; if 0, assertion fails, otherwise assertion succeeds.
- *
- * @param  mesg  A human-readable error message shown if assertion fails.
- *
- * @section example Example
- * @code
- * int upper = 100, lower = 50;
- * int input = get_user_input();
- * niceassert( input <= upper && input >= lower,
- *             "input not in required range!");
- * @endcode
  */
-#define niceassert(cond,mesg) _niceassert((long)cond, __LINE__, __FILE__, \
-                                          #cond, mesg)
+static int inotify_backend_add_watch( void *data __attribute__((unused)),
+                                      int fd, char const *path,
+                                      uint32_t events ) {
+	return inotify_add_watch( fd, path, events );
+}
+
+/**
+ * @internal
+ */
+static int inotify_backend_rm_watch( void *data __attribute__((unused)),
+                                     int fd, int wd ) {
+	return inotify_rm_watch( fd, wd );
+}
+
+/**
+ * @internal
+ */
+static ssize_t inotify_backend_read(
+		inotifytools_ctx *ctx __attribute__((unused)),
+		void *data __attribute__((unused)), int fd, char *buf, size_t size ) {
+	return read( fd, buf, size );
+}
+
+/**
+ * @internal
+ * The default backend.  Recursive watches are set up one directory at a
+ * time, so it has no @a add_tree.
+ */
+static struct inotifytools_backend const inotify_backend = {
+	"inotify",
+	inotify_backend_open,
+	inotify_backend_close,
+	inotify_backend_add_watch,
+	NULL,
+	inotify_backend_rm_watch,
+	inotify_backend_read,
+	NULL,
+};
+
+/**
+ * @internal
+ * Backends which can be selected with inotifytools_set_backend().
+ */
+static struct inotifytools_backend const * const backends[] = {
+	&inotify_backend,
+	&inotifytools_fanotify_backend,
+	&inotifytools_shard_backend,
+	NULL
+};
+
+/**
+ * @internal
+ * Context used by all functions which don't take an explicit context.
+ */
+static inotifytools_ctx default_ctx = { .inotify_fd = -1, .epoll_fd = -1,
+                                        .wake_fd = -1 };
+
+int isdir( char const * path );
+void record_stats( inotifytools_ctx *ctx, struct inotify_event const * event );
+int onestr_to_event(char const * event);
+static void rescan_free( inotifytools_ctx *ctx );
+static void coalesce_free( inotifytools_ctx *ctx );
+static void moves_free( inotifytools_ctx *ctx );
+static void filters_clear( inotifytools_ctx *ctx );
+static long long now_ms();
+static int format_event( inotifytools_ctx *ctx,
+                         inotifytools_format const * format,
+                         char * out, int size,
+                         struct inotify_event * event );
+static void ring_stop( inotifytools_ctx *ctx );
+static void async_free( inotifytools_ctx *ctx );
+static void async_wait_idle( inotifytools_ctx *ctx );
+static void async_collect( inotifytools_ctx *ctx );
+static int async_read( inotifytools_ctx *ctx );
+static int async_wake_fd( inotifytools_ctx *ctx );
+static int async_is_duplicate( inotifytools_ctx *ctx,
+                               struct inotify_event const * event );
+static int async_is_self( inotifytools_ctx *ctx,
+                          struct inotify_event const * event );
+static void reach_mark( inotifytools_ctx *ctx, int wd );
+static void reach_new( inotifytools_ctx *ctx, int wd );
+static void reach_free( inotifytools_ctx *ctx );
 
 #define nasprintf(...) niceassert( -1 != asprintf(__VA_ARGS__), "out of memory")
 
@@ -217,33 +399,18 @@ void _niceassert( long cond, int line, char const * file, char const * condstr,
 	}
 }
 
-/**
- * @internal
- * Construct a string from a character.
- *
- * @param ch A character.
- *
- * @return A string of length 1 consisting of the character @a ch.  The string
- *         will be overwritten in subsequent calls.
- */
-char * chrtostr(char ch) {
-	static char str[2] = { '\0', '\0' };
-	str[0] = ch;
-	return str;
-}
-
 /**
  * @internal
  */
-int read_num_from_file( char * filename, int * num ) {
+int read_num_from_file( inotifytools_ctx *ctx, char * filename, int * num ) {
 	FILE * file = fopen( filename, "r" );
 	if ( !file ) {
-		error = errno;
+		ctx->error = errno;
 		return 0;
 	}
 
 	if ( EOF == fscanf( file, "%d", num ) ) {
-		error = errno;
+		ctx->error = errno;
 		return 0;
 	}
 
@@ -252,1390 +419,7067 @@ int read_num_from_file( char * filename, int * num ) {
 	return 1;
 }
 
-int wd_compare(const void *d1, const void *d2, const void *config) {
-	if (!d1 || !d2) return d1 - d2;
-	return ((watch*)d1)->wd - ((watch*)d2)->wd;
+#define WATCH_TABLE_MIN_SIZE 64
+
+/**
+ * @internal
+ * @return the slot of @a t holding the watch for @a wd, or the empty slot
+ *         where it would be inserted.
+ */
+static watch ** watch_table_slot( struct watch_table *t, int wd ) {
+	unsigned mask = t->size - 1;
+	unsigned i = (unsigned)wd & mask;
+	while ( t->slots[i] && t->slots[i]->wd != wd ) {
+		i = (i + 1) & mask;
+	}
+	return &t->slots[i];
 }
 
-int filename_compare(const void *d1, const void *d2, const void *config) {
-	if (!d1 || !d2) return d1 - d2;
-	return strcmp(((watch*)d1)->filename, ((watch*)d2)->filename);
+/**
+ * @internal
+ * Resize @a t to @a size slots, which must be a power of two large enough to
+ * hold all watches currently in the table.
+ */
+static void watch_table_resize( struct watch_table *t, unsigned size ) {
+	watch **old = t->slots;
+	unsigned old_size = t->size;
+	unsigned i;
+
+	t->slots = (watch**)calloc( size, sizeof(watch*) );
+	niceassert( t->slots, "out of memory" );
+	t->size = size;
+	for ( i = 0; i < old_size; ++i ) {
+		if ( old[i] ) *watch_table_slot( t, old[i]->wd ) = old[i];
+	}
+	free( old );
 }
 
 /**
  * @internal
+ * @return the watch for @a wd in @a t, or NULL if there is none.
  */
-watch *watch_from_wd( int wd ) {
-	watch w;
-	w.wd = wd;
-	return (watch*)rbfind(&w, tree_wd);
+static watch * watch_table_find( struct watch_table *t, int wd ) {
+	if ( !t->count ) return NULL;
+	return *watch_table_slot( t, wd );
 }
 
 /**
  * @internal
+ * Add @a w to @a t.  There must not already be a watch with the same wd.
  */
-watch *watch_from_filename( char const *filename ) {
-	watch w;
-	w.filename = (char*)filename;
-	return (watch*)rbfind(&w, tree_filename);
+static void watch_table_insert( struct watch_table *t, watch *w ) {
+	if ( 2 * (t->count + 1) > t->size ) {
+		watch_table_resize( t, t->size ? 2 * t->size : WATCH_TABLE_MIN_SIZE );
+	}
+	*watch_table_slot( t, w->wd ) = w;
+	++t->count;
 }
 
 /**
- * Initialise inotify.
- *
- * You must call this function before using any function which adds or removes
- * watches or attempts to access any information about watches.
+ * @internal
+ * Remove the watch for @a wd from @a t, if any.
  *
- * @return 1 on success, 0 on failure.  On failure, the error can be
- *         obtained from inotifytools_error().
+ * Entries following the removed one in its probe sequence are shifted back,
+ * so lookups never need to skip over deleted slots.
  */
-int inotifytools_initialize() {
-	if (init) return 1;
-
-	error = 0;
-	// Try to initialise inotify
-	inotify_fd = inotify_init();
-	if (inotify_fd < 0)	{
-		error = inotify_fd;
-		return 0;
+static void watch_table_remove( struct watch_table *t, int wd ) {
+	if ( !t->count ) return;
+	watch **slot = watch_table_slot( t, wd );
+	if ( !*slot ) return;
+
+	unsigned mask = t->size - 1;
+	unsigned i = slot - t->slots;
+	unsigned j = i;
+	t->slots[i] = NULL;
+	--t->count;
+	for (;;) {
+		j = (j + 1) & mask;
+		if ( !t->slots[j] ) break;
+		unsigned home = (unsigned)t->slots[j]->wd & mask;
+		// move slots[j] into the hole unless its home lies cyclically in
+		// (i, j], in which case it is still reachable from its home.
+		if ( i <= j ? (i < home && home <= j) : (i < home || home <= j) ) {
+			continue;
+		}
+		t->slots[i] = t->slots[j];
+		t->slots[j] = NULL;
+		i = j;
 	}
-
-	collect_stats = 0;
-	init = 1;
-	tree_wd = rbinit(wd_compare, 0);
-	tree_filename = rbinit(filename_compare, 0);
-	timefmt = 0;
-
-	return 1;
 }
 
 /**
  * @internal
+ * Free all slots of @a t.  The watches themselves are not freed.
  */
-void destroy_watch(watch *w) {
-	if (w->filename) free(w->filename);
-	free(w);
+static void watch_table_destroy( struct watch_table *t ) {
+	free( t->slots );
+	t->slots = NULL;
+	t->size = 0;
+	t->count = 0;
 }
 
 /**
  * @internal
+ * FNV-1a hash of the first @a len characters of @a str.
  */
-void cleanup_tree(const void *nodep,
-                 const VISIT which,
-                 const int depth, void* arg) {
-	if (which != endorder && which != leaf) return;
-	watch *w = (watch*)nodep;
-	destroy_watch(w);
+static unsigned hash_path( char const * str, size_t len ) {
+	unsigned h = 2166136261u;
+	size_t i;
+	for ( i = 0; i < len; ++i ) {
+		h ^= (unsigned char)str[i];
+		h *= 16777619u;
+	}
+	return h;
 }
 
 /**
- * Close inotify and free the memory used by inotifytools.
- *
- * If you call this function, you must call inotifytools_initialize()
- * again before any other functions can be used.
+ * @internal
+ * Path store.
+ *
+ * Instead of keeping a full copy of its path, each watch refers to a path
+ * node.  A node is one component of a path, such as "/", "home/" or "file",
+ * together with the node of the path leading up to it, so watches on a deep
+ * tree share the nodes of their common directories.  Component strings are
+ * interned, so that names occurring in many directories are stored once.
+ * A path is split after every '/', which means that joining the components
+ * of a node and its ancestors gives back exactly the string it was created
+ * from.
+ *
+ * Nodes and names live in open-addressed hash sets keyed by (parent, name)
+ * and by string respectively.  Both start with their hash, which the sets
+ * use for probing.
  */
-void inotifytools_cleanup() {
-	if (!init) return;
+struct path_entry {
+	unsigned hash;
+};
+
+/**
+ * @internal
+ * An interned path component, referenced by @a refs path nodes.
+ */
+struct path_name {
+	struct path_entry e;
+	unsigned refs;
+	unsigned len;
+	char str[];
+};
 
-	init = 0;
-	close(inotify_fd);
-	collect_stats = 0;
-	error = 0;
-	timefmt = 0;
+/**
+ * @internal
+ * A path component below @a parent, which is NULL for the first component.
+ * @a refs counts the child nodes and the watches using this node; @a w is the
+ * watch found when looking up the path of this node.
+ */
+struct path_node {
+	struct path_entry e;
+	unsigned refs;
+	struct path_node * parent;
+	struct path_name * name;
+	watch * w;
+};
+
+#define PATH_SET_MIN_SIZE 64
+
+/**
+ * @internal
+ * Put @a e into the first free slot of its probe sequence in @a set.
+ */
+static void path_set_place( struct path_set * set, struct path_entry * e ) {
+	unsigned mask = set->size - 1;
+	unsigned i = e->hash & mask;
+	while ( set->slots[i] ) i = (i + 1) & mask;
+	set->slots[i] = e;
+}
 
-	if (regex) {
-		regfree(regex);
-		free(regex);
-		regex = 0;
+/**
+ * @internal
+ * Add @a e to @a set, growing it to keep at most half of the slots used.
+ */
+static void path_set_insert( struct path_set * set, struct path_entry * e ) {
+	if ( 2 * (set->count + 1) > set->size ) {
+		struct path_entry ** old = set->slots;
+		unsigned old_size = set->size;
+		unsigned i;
+
+		set->size = old_size ? 2 * old_size : PATH_SET_MIN_SIZE;
+		set->slots = (struct path_entry **)calloc( set->size,
+		                                           sizeof(*set->slots) );
+		niceassert( set->slots, "out of memory" );
+		for ( i = 0; i < old_size; ++i ) {
+			if ( old[i] ) path_set_place( set, old[i] );
+		}
+		free( old );
 	}
+	path_set_place( set, e );
+	++set->count;
+}
 
-	rbwalk(tree_wd, cleanup_tree, 0);
-	rbdestroy(tree_wd); tree_wd = 0;
-	rbdestroy(tree_filename); tree_filename = 0;
+/**
+ * @internal
+ * Remove @a e from @a set, shifting back later entries of its probe sequence
+ * like watch_table_remove() does.
+ */
+static void path_set_remove( struct path_set * set, struct path_entry * e ) {
+	unsigned mask = set->size - 1;
+	unsigned i = e->hash & mask;
+	while ( set->slots[i] != e ) i = (i + 1) & mask;
+
+	unsigned j = i;
+	set->slots[i] = NULL;
+	--set->count;
+	for (;;) {
+		j = (j + 1) & mask;
+		if ( !set->slots[j] ) break;
+		unsigned home = set->slots[j]->hash & mask;
+		if ( i <= j ? (i < home && home <= j) : (i < home || home <= j) ) {
+			continue;
+		}
+		set->slots[i] = set->slots[j];
+		set->slots[j] = NULL;
+		i = j;
+	}
 }
 
 /**
  * @internal
+ * Free @a set and every entry in it.
  */
-void empty_stats(const void *nodep,
-                 const VISIT which,
-                 const int depth, void *arg) {
-    if (which != endorder && which != leaf) return;
-	watch *w = (watch*)nodep;
-	w->hit_access = 0;
-	w->hit_modify = 0;
-	w->hit_attrib = 0;
-	w->hit_close_nowrite = 0;
-	w->hit_close_write = 0;
-	w->hit_open = 0;
-	w->hit_move_self = 0;
-	w->hit_moved_from = 0;
-	w->hit_moved_to = 0;
-	w->hit_create = 0;
-	w->hit_delete = 0;
-	w->hit_delete_self = 0;
-	w->hit_unmount = 0;
-	w->hit_total = 0;
+static void path_set_destroy( struct path_set * set ) {
+	unsigned i;
+	for ( i = 0; i < set->size; ++i ) free( set->slots[i] );
+	free( set->slots );
+	set->slots = NULL;
+	set->size = 0;
+	set->count = 0;
 }
 
 /**
  * @internal
+ * @return the interned name for the first @a len characters of @a str, or
+ *         NULL if there is none and @a create is 0.  A created name has no
+ *         references yet.
  */
-void replace_filename(const void *nodep,
-                      const VISIT which,
-                      const int depth, void *arg) {
-    if (which != endorder && which != leaf) return;
-	watch *w = (watch*)nodep;
-	char *old_name = ((char**)arg)[0];
-	char *new_name = ((char**)arg)[1];
-	int old_len = *((int*)&((char**)arg)[2]);
-	char *name;
-	if ( 0 == strncmp( old_name, w->filename, old_len ) ) {
-		nasprintf( &name, "%s%s", new_name, &(w->filename[old_len]) );
-		if (!strcmp( w->filename, new_name )) {
-			free(name);
-		} else {
-			rbdelete(w, tree_filename);
-			free( w->filename );
-			w->filename = name;
-			rbsearch(w, tree_filename);
+static struct path_name * path_name_get( inotifytools_ctx *ctx,
+                                         char const * str, size_t len,
+                                         int create ) {
+	unsigned hash = hash_path( str, len );
+	struct path_set * set = &ctx->path_names;
+	if ( set->count ) {
+		unsigned mask = set->size - 1;
+		unsigned i;
+		for ( i = hash & mask; set->slots[i]; i = (i + 1) & mask ) {
+			struct path_name * n = (struct path_name *)set->slots[i];
+			if ( n->e.hash == hash && n->len == len &&
+			     0 == memcmp( n->str, str, len ) ) {
+				return n;
+			}
 		}
 	}
+	if ( !create ) return NULL;
+
+	struct path_name * n = (struct path_name *)malloc( sizeof(*n) + len + 1 );
+	niceassert( n, "out of memory" );
+	n->e.hash = hash;
+	n->refs = 0;
+	n->len = len;
+	memcpy( n->str, str, len );
+	n->str[len] = 0;
+	path_set_insert( set, &n->e );
+	return n;
 }
 
 /**
  * @internal
+ * Drop a reference to @a name, freeing it if it is no longer used.
  */
-void get_num(const void *nodep,
-             const VISIT which,
-             const int depth, void *arg) {
-    if (which != endorder && which != leaf) return;
-	++(*((int*)arg));
+static void path_name_release( inotifytools_ctx *ctx,
+                               struct path_name * name ) {
+	if ( 0 == --name->refs ) {
+		path_set_remove( &ctx->path_names, &name->e );
+		free( name );
+	}
 }
 
+/**
+ * @internal
+ */
+static unsigned path_node_hash( struct path_node const * parent,
+                                struct path_name const * name ) {
+	return name->e.hash ^
+	       (unsigned)(((uintptr_t)parent >> 4) * 2654435761u);
+}
 
 /**
- * Initialize or reset statistics.
- *
- * inotifytools_initialize() must be called before this function can
- * be used.
- *
- * When this function is called, all subsequent events will be tallied.
- * Statistics can then be obtained via the @a inotifytools_get_stat_* functions.
- *
- * After the first call, subsequent calls to this function will reset the
- * event tallies to 0.
+ * @internal
+ * @return the node for @a name below @a parent, or NULL if there is none.
  */
-void inotifytools_initialize_stats() {
-	niceassert( init, "inotifytools_initialize not called yet" );
+static struct path_node * path_node_find( inotifytools_ctx *ctx,
+                                          struct path_node const * parent,
+                                          struct path_name const * name ) {
+	struct path_set * set = &ctx->path_nodes;
+	if ( !set->count ) return NULL;
+	unsigned hash = path_node_hash( parent, name );
+	unsigned mask = set->size - 1;
+	unsigned i;
+	for ( i = hash & mask; set->slots[i]; i = (i + 1) & mask ) {
+		struct path_node * node = (struct path_node *)set->slots[i];
+		if ( node->parent == parent && node->name == name ) return node;
+	}
+	return NULL;
+}
 
-	// if already collecting stats, reset stats
-	if (collect_stats) {
-		rbwalk(tree_wd, empty_stats, 0);
+/**
+ * @internal
+ * Drop a reference to @a node, freeing it and possibly its ancestors when
+ * nothing refers to them any more.
+ */
+static void path_node_release( inotifytools_ctx *ctx,
+                               struct path_node * node ) {
+	while ( node && 0 == --node->refs ) {
+		struct path_node * parent = node->parent;
+		path_set_remove( &ctx->path_nodes, &node->e );
+		path_name_release( ctx, node->name );
+		free( node );
+		node = parent;
 	}
+}
 
-	num_access = 0;
-	num_modify = 0;
-	num_attrib = 0;
-	num_close_nowrite = 0;
-	num_close_write = 0;
-	num_open = 0;
-	num_move_self = 0;
-	num_moved_from = 0;
-	num_moved_to = 0;
-	num_create = 0;
-	num_delete = 0;
-	num_delete_self = 0;
-	num_unmount = 0;
-	num_total = 0;
+/**
+ * @internal
+ * Set the position of @a node in the path store.  @a node must not be in
+ * the set of nodes.
+ */
+static void path_node_place( inotifytools_ctx *ctx, struct path_node * node,
+                             struct path_node * parent,
+                             struct path_name * name ) {
+	node->parent = parent;
+	node->name = name;
+	if ( parent ) ++parent->refs;
+	++name->refs;
+	node->e.hash = path_node_hash( parent, name );
+	path_set_insert( &ctx->path_nodes, &node->e );
+}
 
-	collect_stats = 1;
+/**
+ * @internal
+ * @return the length of the first component of @a path, up to and including
+ *         the first '/'.
+ */
+static size_t path_component_len( char const * path ) {
+	char const * slash = strchr( path, '/' );
+	return slash ? (size_t)(slash - path) + 1 : strlen( path );
 }
 
 /**
- * Convert character separated events from string form to integer form
- * (as in inotify.h).
- *
- * @param    event    a sequence of events in string form as defined in
- *                    inotify.h without leading IN_ prefix (e.g., MODIFY,
- *                    ATTRIB), separated by the @a sep character.  Case
- *                    insensitive.  Can be a single event.
- *                    Can be empty or NULL.  See section \ref events.
- *
- * @param    sep      Character used to separate events.  @a sep must not be
- *                    a character in a-z, A-Z, or _.
+ * @internal
+ * Find the node for the first @a len characters of @a path.
  *
- * @return            integer representing the mask specified by @a event, or 0
- *                    if any string in @a event is empty or NULL, or -1 if
- *                    any string in @a event does not match any event or
- *                    @a sep is invalid.
+ * @param create if nonzero, missing nodes are created.  A created node has no
+ *               references, so the caller must take one.
  *
- * @section example Example
- * @code
- * char * eventstr = "MODIFY:CLOSE:CREATE";
- * int eventnum = inotifytools_str_to_event_sep( eventstr, ':' );
- * if ( eventnum == IN_MODIFY | IN_CLOSE | IN_CREATE ) {
- *    printf( "This code always gets executed!\n" );
- * }
- * @endcode
+ * @return the node, or NULL if @a len is 0 or the path is not in the store and
+ *         @a create is 0.
  */
-int inotifytools_str_to_event_sep(char const * event, char sep) {
-	if ( strchr( "_" "abcdefghijklmnopqrstuvwxyz"
-	                 "ABCDEFGHIJKLMNOPQRSTUVWXYZ", sep ) ) {
-		return -1;
+static struct path_node * path_lookup( inotifytools_ctx *ctx,
+                                       char const * path, size_t len,
+                                       int create ) {
+	struct path_node * node = NULL;
+	size_t i = 0;
+	while ( i < len ) {
+		size_t comp = path_component_len( &path[i] );
+		if ( comp > len - i ) comp = len - i;
+		struct path_name * name = path_name_get( ctx, &path[i], comp, create );
+		if ( !name ) return NULL;
+		struct path_node * child = path_node_find( ctx, node, name );
+		if ( !child ) {
+			if ( !create ) return NULL;
+			child = (struct path_node *)calloc( 1, sizeof(*child) );
+			niceassert( child, "out of memory" );
+			path_node_place( ctx, child, node, name );
+		}
+		node = child;
+		i += comp;
 	}
+	return node;
+}
 
-	int ret, ret1, len;
-	char * event1, * event2;
-	char eventstr[4096];
-	ret = 0;
-
-	if ( !event || !event[0] ) return 0;
+/**
+ * @internal
+ * Build the full path of @a node in the scratch buffer of @a ctx.
+ *
+ * @return the path, which is overwritten by the next call.
+ */
+static char * path_str( inotifytools_ctx *ctx, struct path_node const * node ) {
+	size_t len = 0;
+	struct path_node const * n;
+	for ( n = node; n; n = n->parent ) len += n->name->len;
+
+	if ( len + 1 > ctx->path_size ) {
+		size_t size = ctx->path_size ? ctx->path_size : MAX_STRLEN;
+		while ( size < len + 1 ) size *= 2;
+		ctx->path = (char *)realloc( ctx->path, size );
+		niceassert( ctx->path, "out of memory" );
+		ctx->path_size = size;
+	}
 
-	event1 = (char *)event;
-	event2 = strchr( event1, sep );
-	while ( event1 && event1[0] ) {
-		if ( event2 ) {
-			len = event2 - event1;
-			niceassert( len < 4096, "malformed event string (very long)" );
-		}
-		else {
-			len = strlen(event1);
-		}
-		if ( len > 4095 ) len = 4095;
-		strncpy( eventstr, event1, len );
-		eventstr[len] = 0;
+	char * p = &ctx->path[len];
+	*p = 0;
+	for ( n = node; n; n = n->parent ) {
+		p -= n->name->len;
+		memcpy( p, n->name->str, n->name->len );
+	}
+	return ctx->path;
+}
 
-		ret1 = onestr_to_event( eventstr );
-		if ( 0 == ret1 || -1 == ret1 ) {
-			ret = ret1;
-			break;
-		}
-		ret |= ret1;
+/**
+ * @internal
+ * What a directory looked like when it was last read, so that
+ * inotifytools_rescan() can tell whether it has to be read again.  An @a ino
+ * of 0 means it has to.
+ */
+struct dir_snapshot {
+	ino_t ino;
+	struct timespec mtime;
+};
 
-		event1 = event2;
-		if ( event1 && event1[0] ) {
-			// jump over 'sep' character
-			++event1;
-			// if last character was 'sep'...
-			if ( !event1[0] ) return 0;
-			event2 = strchr( event1, sep );
+/**
+ * @internal
+ * Free the statistics table of @a ctx.
+ */
+static void stats_free( inotifytools_ctx *ctx ) {
+	int i, b;
+	for ( i = 0; i < NUM_STATS; ++i ) {
+		free( ctx->stats[i] );
+		ctx->stats[i] = NULL;
+		for ( b = 0; b < 2; ++b ) {
+			free( ctx->interval[b][i] );
+			ctx->interval[b][i] = NULL;
 		}
 	}
-
-	return ret;
+	for ( b = 0; b < 2; ++b ) {
+		free( ctx->interval_epoch[b] );
+		ctx->interval_epoch[b] = NULL;
+	}
+	ctx->stats_size = 0;
+	ctx->epoch = 0;
 }
 
 /**
- * Convert comma-separated events from string form to integer form
- * (as in inotify.h).
- *
- * @param    event    a sequence of events in string form as defined in
- *                    inotify.h without leading IN_ prefix (e.g., MODIFY,
- *                    ATTRIB), comma-separated.  Case
- *                    insensitive.  Can be a single event.
- *                    Can be empty or NULL.  See section \ref events.
- *
- * @return            integer representing the mask specified by @a event, or 0
- *                    if any string in @a event is empty or NULL, or -1 if
- *                    any string in @a event does not match any event.
+ * @internal
+ * Grow the interval counters of @a ctx from @a old to @a size slots.
  *
- * @section example Example
- * @code
- * char * eventstr = "MODIFY,CLOSE,CREATE";
- * int eventnum = inotifytools_str_to_event( eventstr );
- * if ( eventnum == IN_MODIFY | IN_CLOSE | IN_CREATE ) {
- *    printf( "This code always gets executed!\n" );
- * }
- * @endcode
+ * @return 1 on success, 0 if out of memory.
  */
-int inotifytools_str_to_event(char const * event) {
-	return inotifytools_str_to_event_sep( event, ',' );
+static int interval_reserve( inotifytools_ctx *ctx, unsigned old,
+                             unsigned size ) {
+	if ( size <= old ) return 1;
+	int i, b;
+	for ( b = 0; b < 2; ++b ) {
+		for ( i = 0; i < NUM_STATS; ++i ) {
+			if ( !ctx->stats[i] ) continue;
+			uint32_t *counts = (uint32_t *)realloc( ctx->interval[b][i],
+			                                        size * sizeof(uint32_t) );
+			if ( !counts ) return 0;
+			ctx->interval[b][i] = counts;
+		}
+		unsigned *epochs = (unsigned *)realloc( ctx->interval_epoch[b],
+		                                        size * sizeof(unsigned) );
+		if ( !epochs ) return 0;
+		// no interval is numbered 0
+		memset( &epochs[old], 0, (size - old) * sizeof(unsigned) );
+		ctx->interval_epoch[b] = epochs;
+	}
+	return 1;
 }
 
 /**
  * @internal
- * Convert a single event from string form to integer form (as in inotify.h).
+ * Make room for at least @a slots watch slots in the statistics table of
+ * @a ctx, zeroing the new counters.  Only the counters of STAT_EVENTS and the
+ * totals are allocated.
  *
- * @param    event    event in string form as defined in inotify.h without
- *                    leading IN_ prefix (e.g., MODIFY, ATTRIB).  Case
- *                    insensitive.  Can be empty or NULL.
- * @return            integer representing the mask specified by 'event', or 0
- *                    if @a event is empty or NULL, or -1 if string does not
- *                    match any event.
+ * @return 1 on success, 0 if out of memory.
  */
-int onestr_to_event(char const * event)
-{
-	static int ret;
-	ret = -1;
-
-	if ( !event || !event[0] )
-		ret = 0;
-	else if ( 0 == strcasecmp(event, "ACCESS") )
-		ret = IN_ACCESS;
-	else if ( 0 == strcasecmp(event, "MODIFY") )
-		ret = IN_MODIFY;
-	else if ( 0 == strcasecmp(event, "ATTRIB") )
-		ret = IN_ATTRIB;
-	else if ( 0 == strcasecmp(event, "CLOSE_WRITE") )
-		ret = IN_CLOSE_WRITE;
-	else if ( 0 == strcasecmp(event, "CLOSE_NOWRITE") )
-		ret = IN_CLOSE_NOWRITE;
-	else if ( 0 == strcasecmp(event, "OPEN") )
-		ret = IN_OPEN;
-	else if ( 0 == strcasecmp(event, "MOVED_FROM") )
-		ret = IN_MOVED_FROM;
-	else if ( 0 == strcasecmp(event, "MOVED_TO") )
-		ret = IN_MOVED_TO;
-	else if ( 0 == strcasecmp(event, "CREATE") )
-		ret = IN_CREATE;
-	else if ( 0 == strcasecmp(event, "DELETE") )
-		ret = IN_DELETE;
-	else if ( 0 == strcasecmp(event, "DELETE_SELF") )
-		ret = IN_DELETE_SELF;
-	else if ( 0 == strcasecmp(event, "UNMOUNT") )
-		ret = IN_UNMOUNT;
-	else if ( 0 == strcasecmp(event, "Q_OVERFLOW") )
-		ret = IN_Q_OVERFLOW;
-	else if ( 0 == strcasecmp(event, "IGNORED") )
-		ret = IN_IGNORED;
-	else if ( 0 == strcasecmp(event, "CLOSE") )
-		ret = IN_CLOSE;
-	else if ( 0 == strcasecmp(event, "MOVE_SELF") )
-		ret = IN_MOVE_SELF;
-	else if ( 0 == strcasecmp(event, "MOVE") )
-		ret = IN_MOVE;
-	else if ( 0 == strcasecmp(event, "ISDIR") )
-		ret = IN_ISDIR;
-	else if ( 0 == strcasecmp(event, "ONESHOT") )
-		ret = IN_ONESHOT;
-	else if ( 0 == strcasecmp(event, "ALL_EVENTS") )
-		ret = IN_ALL_EVENTS;
-
-	return ret;
+static int stats_reserve( inotifytools_ctx *ctx, unsigned slots ) {
+	if ( slots <= ctx->stats_size ) return 1;
+	unsigned size = ctx->stats_size * 2;
+	if ( size < slots ) size = slots;
+	int i;
+	for ( i = 0; i < NUM_STATS; ++i ) {
+		if ( i != STAT_TOTAL && !(STAT_EVENTS & (1 << i)) ) continue;
+		uint64_t *stats = (uint64_t *)realloc( ctx->stats[i],
+		                                       size * sizeof(uint64_t) );
+		if ( !stats ) return 0;
+		memset( &stats[ctx->stats_size], 0,
+		        (size - ctx->stats_size) * sizeof(uint64_t) );
+		ctx->stats[i] = stats;
+	}
+	if ( ctx->epoch && !interval_reserve( ctx, ctx->stats_size, size ) ) {
+		return 0;
+	}
+	ctx->stats_size = size;
+	return 1;
 }
 
 /**
- * Convert event from integer form to string form (as in inotify.h).
+ * @internal
+ * Allocate a watch record from the arena of @a ctx.  Slots of released
+ * watches are reused first; their counters are reset.
  *
- * The returned string is from static storage; subsequent calls to this function
- * or inotifytools_event_to_str_sep() will overwrite it.  Don't free() it and
- * make a copy if you want to keep it.
- *
- * @param    events   OR'd event(s) in integer form as defined in inotify.h.
- *                    See section \ref events.
- *
- * @return            comma-separated string representing the event(s), in no
- *                    particular order
- *
- * @section example Example
- * @code
- * int eventnum == IN_MODIFY | IN_CLOSE | IN_CREATE;
- * char * eventstr = inotifytools_event_to_str( eventnum );
- * printf( "%s\n", eventstr );
- * // outputs something like MODIFY,CLOSE,CREATE but order not guaranteed.
- * @endcode
- */
-char * inotifytools_event_to_str(int events) {
-	return inotifytools_event_to_str_sep(events, ',');
-}
-
-/**
- * Convert event from integer form to string form (as in inotify.h).
- *
- * The returned string is from static storage; subsequent calls to this function
- * or inotifytools_event_to_str() will overwrite it.  Don't free() it and
- * make a copy if you want to keep it.
- *
- * @param    events   OR'd event(s) in integer form as defined in inotify.h
- *
- * @param    sep      character used to separate events
- *
- * @return            @a sep separated string representing the event(s), in no
- *                    particular order.  If the integer is not made of OR'ed
- *                    inotify events, the string returned will be a hexadecimal
- *                    representation of the integer.
- *
- * @section example Example
- * @code
- * int eventnum == IN_MODIFY | IN_CLOSE | IN_CREATE;
- * char * eventstr = inotifytools_event_to_str_sep( eventnum, '-' );
- * printf( "%s\n", eventstr );
- * // outputs something like MODIFY-CLOSE-CREATE but order not guaranteed.
- * @endcode
+ * @return a watch with a valid @a slot, or NULL if out of memory.
  */
-char * inotifytools_event_to_str_sep(int events, char sep)
-{
-	static char ret[1024];
-	ret[0] = '\0';
-	ret[1] = '\0';
-
-	if ( IN_ACCESS & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "ACCESS" );
-	}
-	if ( IN_MODIFY & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "MODIFY" );
-	}
-	if ( IN_ATTRIB & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "ATTRIB" );
-	}
-	if ( IN_CLOSE_WRITE & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "CLOSE_WRITE" );
-	}
-	if ( IN_CLOSE_NOWRITE & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "CLOSE_NOWRITE" );
+static watch *watch_alloc( inotifytools_ctx *ctx ) {
+	struct watch_arena *arena = &ctx->watches;
+	unsigned slot;
+	if ( arena->num_free ) {
+		slot = arena->free_slots[--arena->num_free];
 	}
-	if ( IN_OPEN & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "OPEN" );
-	}
-	if ( IN_MOVED_FROM & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "MOVED_FROM" );
-	}
-	if ( IN_MOVED_TO & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "MOVED_TO" );
-	}
-	if ( IN_CREATE & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "CREATE" );
-	}
-	if ( IN_DELETE & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "DELETE" );
-	}
-	if ( IN_DELETE_SELF & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "DELETE_SELF" );
-	}
-	if ( IN_UNMOUNT & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "UNMOUNT" );
-	}
-	if ( IN_Q_OVERFLOW & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "Q_OVERFLOW" );
-	}
-	if ( IN_IGNORED & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "IGNORED" );
-	}
-	if ( IN_CLOSE & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "CLOSE" );
-	}
-	if ( IN_MOVE_SELF & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "MOVE_SELF" );
-	}
-	if ( IN_ISDIR & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "ISDIR" );
-	}
-	if ( IN_ONESHOT & events ) {
-		strcat( ret, chrtostr(sep) );
-		strcat( ret, "ONESHOT" );
+	else {
+		if ( arena->used == arena->num_blocks * WATCH_BLOCK ) {
+			unsigned capacity = arena->used + WATCH_BLOCK;
+			if ( ctx->collect_stats && !stats_reserve( ctx, capacity ) ) {
+				return NULL;
+			}
+			if ( capacity > arena->free_size ) {
+				unsigned size = arena->free_size * 2;
+				if ( size < capacity ) size = capacity;
+				unsigned *free_slots = (unsigned *)realloc( arena->free_slots,
+				                       size * sizeof(unsigned) );
+				if ( !free_slots ) return NULL;
+				arena->free_slots = free_slots;
+				arena->free_size = size;
+			}
+			watch **blocks = (watch **)realloc( arena->blocks,
+			                 (arena->num_blocks + 1) * sizeof(watch *) );
+			if ( !blocks ) return NULL;
+			arena->blocks = blocks;
+			watch *block = (watch *)malloc( WATCH_BLOCK * sizeof(watch) );
+			if ( !block ) return NULL;
+			arena->blocks[arena->num_blocks++] = block;
+		}
+		slot = arena->used++;
 	}
 
-	// Maybe we didn't match any... ?
-	if (ret[0] == '\0') {
-		niceassert( -1 != sprintf( ret, "%c0x%08x", sep, events ), 0 );
+	watch *w = &arena->blocks[slot / WATCH_BLOCK][slot % WATCH_BLOCK];
+	w->node = NULL;
+	w->wd = 0;
+	w->slot = slot;
+	if ( slot < ctx->snapshots_size ) ctx->snapshots[slot].ino = 0;
+	if ( ctx->collect_stats ) {
+		int i;
+		for ( i = 0; i < NUM_STATS; ++i ) {
+			if ( ctx->stats[i] ) ctx->stats[i][slot] = 0;
+		}
+		if ( ctx->epoch ) {
+			ctx->interval_epoch[0][slot] = 0;
+			ctx->interval_epoch[1][slot] = 0;
+		}
 	}
+	return w;
+}
 
-	return &ret[1];
+/**
+ * @internal
+ * Return @a w to the arena of @a ctx.
+ */
+static void watch_release( inotifytools_ctx *ctx, watch *w ) {
+	ctx->watches.free_slots[ctx->watches.num_free++] = w->slot;
 }
 
 /**
- * Get the filename used to establish a watch.
- *
- * inotifytools_initialize() must be called before this function can
- * be used.
- *
- * @param wd watch descriptor.
- *
- * @return filename associated with watch descriptor @a wd, or NULL if @a wd
- *         is not associated with any filename.
+ * @internal
+ * Directories modified less than this many seconds before they were read
+ * may be modified again without their mtime changing, since file systems
+ * keep timestamps with a granularity of up to two seconds.
+ */
+#define SNAPSHOT_RACY_SEC 2
+
+/**
+ * @internal
+ * Take a snapshot of the directory open on @a fd.
  *
- * @note This always returns the filename which was used to establish a watch.
- *       This means the filename may be a relative path.  If this isn't desired,
- *       then always use absolute paths when watching files.
- *       Also, this is not necessarily the filename which might have been used
- *       to cause an event on the file, since inotify is inode based and there
- *       can be many filenames mapping to a single inode.
- *       Finally, if a file is moved or renamed while being watched, the
- *       filename returned will still be the original name.
+ * @return 1 on success, 0 if @a fd can't be stat()ed.
  */
-char * inotifytools_filename_from_wd( int wd ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	watch *w = watch_from_wd(wd);
-	if (!w)
-        return NULL;
+static int snapshot_take( int fd, struct dir_snapshot * snap ) {
+	struct stat64 st;
+	if ( -1 == fstat64( fd, &st ) ) return 0;
+	snap->ino = st.st_ino;
+	snap->mtime = st.st_mtim;
+	struct timespec now;
+	clock_gettime( CLOCK_REALTIME, &now );
+	if ( snap->mtime.tv_sec + SNAPSHOT_RACY_SEC > now.tv_sec ) snap->ino = 0;
+	return 1;
+}
 
-	return w->filename;
+/**
+ * @internal
+ * Remember @a snap as the snapshot of the directory watched by @a w.  If
+ * there is no memory for it, the directory is just read again by the next
+ * rescan.
+ */
+static void snapshot_set( inotifytools_ctx *ctx, watch *w,
+                          struct dir_snapshot const * snap ) {
+	if ( w->slot >= ctx->snapshots_size ) {
+		unsigned size = ctx->snapshots_size * 2;
+		if ( size <= w->slot ) size = ctx->watches.num_blocks * WATCH_BLOCK;
+		struct dir_snapshot *snapshots = (struct dir_snapshot *)realloc(
+		    ctx->snapshots, size * sizeof(struct dir_snapshot) );
+		if ( !snapshots ) return;
+		memset( &snapshots[ctx->snapshots_size], 0,
+		        (size - ctx->snapshots_size) * sizeof(struct dir_snapshot) );
+		ctx->snapshots = snapshots;
+		ctx->snapshots_size = size;
+	}
+	ctx->snapshots[w->slot] = *snap;
 }
 
 /**
- * Get the watch descriptor for a particular filename.
- *
- * inotifytools_initialize() must be called before this function can
- * be used.
- *
- * @param filename file name to find watch descriptor for.
- *
- * @return watch descriptor associated with filename, or -1 if @a filename is
- *         not associated with any watch descriptor.
- *
- * @note The filename specified must always be the original name used to
- *       establish the watch.
+ * @internal
+ * @return 1 if the directory watched by @a w still matches its snapshot,
+ *         judging by @a st.
  */
-int inotifytools_wd_from_filename( char const * filename ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	watch *w = watch_from_filename(filename);
-	if (!w) return -1;
-	return w->wd;
+static int snapshot_matches( inotifytools_ctx *ctx, watch const *w,
+                             struct stat64 const * st ) {
+	if ( w->slot >= ctx->snapshots_size ) return 0;
+	struct dir_snapshot const * snap = &ctx->snapshots[w->slot];
+	return snap->ino && snap->ino == st->st_ino &&
+	       snap->mtime.tv_sec == st->st_mtim.tv_sec &&
+	       snap->mtime.tv_nsec == st->st_mtim.tv_nsec;
 }
 
 /**
- * Set the filename for a particular watch descriptor.
- *
- * This function should be used to update a filename when a file is known to
- * have been moved or renamed.  At the moment, libinotifytools does not
- * automatically handle this situation.
- *
- * inotifytools_initialize() must be called before this function can
- * be used.
- *
- * @param wd Watch descriptor.
- *
- * @param filename New filename.
+ * @internal
+ * Make @a path the filename of @a w.
  */
-void inotifytools_set_filename_by_wd( int wd, char const * filename ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	watch *w = watch_from_wd(wd);
-	if (!w) return;
-	if (w->filename) free(w->filename);
-	w->filename = strdup(filename);
+static void watch_set_path( inotifytools_ctx *ctx, watch *w,
+                            char const * path ) {
+	struct path_node * old = w->node;
+	struct path_node * node = path_lookup( ctx, path, strlen(path), 1 );
+	niceassert( node, "empty filename" );
+	++node->refs;
+	if ( !node->w ) node->w = w;
+	w->node = node;
+	if ( old ) {
+		if ( old->w == w ) old->w = NULL;
+		path_node_release( ctx, old );
+	}
 }
 
 /**
- * Set the filename for one or more watches with a particular existing filename.
- *
- * This function should be used to update a filename when a file is known to
- * have been moved or renamed.  At the moment, libinotifytools does not
- * automatically handle this situation.
- *
- * inotifytools_initialize() must be called before this function can
- * be used.
- *
- * @param oldname Current filename.
+ * @internal
+ * Find the watch for a watch descriptor.
  *
- * @param newname New filename.
+ * The last watch found is remembered, so that the several lookups made for
+ * a single event (statistics, formatting, filtering) only hash once.
  */
-void inotifytools_set_filename_by_filename( char const * oldname,
-                                            char const * newname ) {
-	watch *w = watch_from_filename(oldname);
-	if (!w) return;
-	if (w->filename) free(w->filename);
-	w->filename = strdup(newname);
+watch *watch_from_wd( inotifytools_ctx *ctx, int wd ) {
+	if ( ctx->last_watch && ctx->last_watch->wd == wd ) {
+		return ctx->last_watch;
+	}
+	watch *w = watch_table_find( &ctx->table_wd, wd );
+	if ( w ) ctx->last_watch = w;
+	return w;
 }
 
 /**
- * Replace a certain filename prefix on all watches.
- *
- * This function should be used to update filenames for an entire directory tree
- * when a directory is known to have been moved or renamed.  At the moment,
- * libinotifytools does not automatically handle this situation.
- *
- * inotifytools_initialize() must be called before this function can
- * be used.
- *
- * @param oldname Current filename prefix.
- *
- * @param newname New filename prefix.
- *
- * @section example Example
- * @code
- * // if /home/user1/original_dir is moved to /home/user2/new_dir, then to
- * // update all watches:
- * inotifytools_replace_filename( "/home/user1/original_dir",
- *                                "/home/user2/new_dir" );
- * @endcode
+ * @internal
+ * Remove @a w from all lookup structures of @a ctx and free it.
  */
-void inotifytools_replace_filename( char const * oldname,
-                                    char const * newname ) {
-	if ( !oldname || !newname ) return;
-	char *names[2+sizeof(int)/sizeof(char*)];
-	names[0] = (char*)oldname;
-	names[1] = (char*)newname;
-	*((int*)&names[2]) = strlen(oldname);
-	rbwalk(tree_filename, replace_filename, (void*)names);
+static void forget_watch( inotifytools_ctx *ctx, watch *w ) {
+	if ( ctx->last_watch == w ) ctx->last_watch = NULL;
+	watch_table_remove( &ctx->table_wd, w->wd );
+	if ( w->node->w == w ) w->node->w = NULL;
+	path_node_release( ctx, w->node );
+	watch_release( ctx, w );
 }
 
 /**
  * @internal
  */
-int remove_inotify_watch(watch *w) {
-	error = 0;
-	int status = inotify_rm_watch( inotify_fd, w->wd );
-	if ( status < 0 ) {
-		fprintf(stderr, "Failed to remove watch on %s: %s\n", w->filename,
-		        strerror(status) );
-		error = status;
+watch *watch_from_filename( inotifytools_ctx *ctx, char const *filename ) {
+	struct path_node * node = path_lookup( ctx, filename, strlen(filename),
+	                                       0 );
+	return node ? node->w : NULL;
+}
+
+/**
+ * Like inotifytools_initialize(), but operates on @a ctx.  This is only
+ * needed to reinitialise a context after inotifytools_ctx_cleanup();
+ * inotifytools_ctx_create() returns an initialised context.
+ */
+int inotifytools_ctx_initialize( inotifytools_ctx *ctx ) {
+	if (ctx->init) return 1;
+
+	ctx->error = 0;
+	ctx->event_buf = (char *)malloc( READ_BUFFER_INITIAL );
+	if ( !ctx->event_buf ) {
+		ctx->error = ENOMEM;
+		return 0;
+	}
+	ctx->event_buf_size = READ_BUFFER_INITIAL;
+	ctx->event_buf_limit = READ_BUFFER_DEFAULT_LIMIT;
+	ctx->read_full = 0;
+	ctx->num_reads = 0;
+	ctx->num_events_read = 0;
+	if ( !ctx->backend ) ctx->backend = &inotify_backend;
+	// Try to initialise inotify
+	ctx->inotify_fd = ctx->backend->open( &ctx->backend_data );
+	if (ctx->inotify_fd < 0)	{
+		ctx->error = errno;
+		free( ctx->event_buf );
+		ctx->event_buf = NULL;
+		return 0;
+	}
+
+	// inotify is watched edge-triggered, so that waiting for more events to
+	// arrive never spins on events which are already queued.
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = ctx->inotify_fd;
+	ctx->epoll_fd = epoll_create( 1 );
+	if ( ctx->epoll_fd < 0 || -1 == epoll_ctl( ctx->epoll_fd, EPOLL_CTL_ADD,
+	                                           ctx->inotify_fd, &ev ) ) {
+		ctx->error = errno;
+		if ( ctx->epoll_fd >= 0 ) close( ctx->epoll_fd );
+		ctx->epoll_fd = -1;
+		ctx->backend->close( ctx->backend_data, ctx->inotify_fd );
+		ctx->backend_data = NULL;
+		ctx->inotify_fd = -1;
+		free( ctx->event_buf );
+		ctx->event_buf = NULL;
 		return 0;
 	}
+
+	ctx->collect_stats = 0;
+	ctx->init = 1;
+	ctx->timefmt = 0;
+	ctx->first_byte = 0;
+	ctx->bytes = 0;
+
 	return 1;
 }
 
 /**
  * @internal
+ * Make @a backend, just opened as @a fd with state @a data, the backend of
+ * @a ctx in place of the current one, which is closed.  If @a fd is -1, the
+ * open failed and its error is taken from @a errno.
+ *
+ * @return 1 on success, 0 on failure, with the current backend kept.
  */
-watch *create_watch(int wd, char *filename) {
-	if ( wd <= 0 || !filename) return 0;
-
-	watch *w = (watch*)calloc(1, sizeof(watch));
-	w->wd = wd;
-	w->filename = strdup(filename);
-	rbsearch(w, tree_wd);
-	rbsearch(w, tree_filename);
+static int switch_backend( inotifytools_ctx *ctx,
+                           struct inotifytools_backend const *backend,
+                           int fd, void *data ) {
+	if ( fd < 0 ) {
+		ctx->error = errno;
+		return 0;
+	}
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = fd;
+	if ( -1 == epoll_ctl( ctx->epoll_fd, EPOLL_CTL_ADD, fd, &ev ) ) {
+		ctx->error = errno;
+		backend->close( data, fd );
+		return 0;
+	}
+	epoll_ctl( ctx->epoll_fd, EPOLL_CTL_DEL, ctx->inotify_fd, NULL );
+	ctx->backend->close( ctx->backend_data, ctx->inotify_fd );
+	ctx->backend = backend;
+	ctx->backend_data = data;
+	ctx->inotify_fd = fd;
+	ctx->first_byte = 0;
+	ctx->bytes = 0;
+	return 1;
 }
 
 /**
- * Remove a watch on a file specified by watch descriptor.
- *
- * inotifytools_initialize() must be called before this function can
- * be used.
+ * Select the kernel interface events are read from.
+ *
+ * \li \c inotify, the default, sets up one inotify watch per watched
+ *     directory.  Recursive watches are limited by
+ *     inotifytools_get_max_user_watches() and take a while to set up on big
+ *     trees.
+ * \li \c fanotify marks the whole file system containing each watched path
+ *     once, with FAN_MARK_FILESYSTEM, and finds the directory of each event
+ *     from the file handle fanotify reports (FAN_REPORT_DFID_NAME).  Setting
+ *     up a recursive watch costs the same for any size of tree, and there is
+ *     no limit on the number of directories.  Events outside the watched
+ *     paths are dropped.  This needs Linux 5.9 or later and the
+ *     CAP_SYS_ADMIN capability.
+ * \li \c sharded spreads the watches over four inotify instances by a hash
+ *     of their path; see inotifytools_set_shards().
+ *
+ * With fanotify, the watches below a recursive watch are created when the
+ * first event in their directory arrives, so inotifytools_get_num_watches()
+ * only counts directories which have had events.  Excludes are applied at
+ * that point too.  Events are not split up by watch: an event on a
+ * subdirectory is only reported to its parent, fanotify may merge several
+ * events on the same file into one with several bits set, and @a cookie is
+ * made up by pairing each IN_MOVED_FROM with the IN_MOVED_TO which directly
+ * follows it.
+ *
+ * inotifytools_initialize() must be called before this function can be used,
+ * and no watches may have been added yet.  The backend stays selected until
+ * inotifytools_cleanup().
+ *
+ * @param name name of the backend, \c inotify, \c fanotify or \c sharded.
  *
- * @param wd Watch descriptor of watch to be removed.
- *
- * @return 1 on success, 0 on failure.  If the given watch doesn't exist,
- *         returns 1.  On failure, the error can be
- *         obtained from inotifytools_error().
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error(): EINVAL for an unknown @a name,
+ *         EBUSY if there are already watches, or the error from opening the
+ *         backend, such as EPERM or ENOSYS.  The previous backend is kept on
+ *         failure.
  */
-int inotifytools_remove_watch_by_wd( int wd ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	watch *w = watch_from_wd(wd);
-	if (!w) return 1;
+int inotifytools_set_backend( char const * name ) {
+	return inotifytools_ctx_set_backend( &default_ctx, name );
+}
 
-	if (!remove_inotify_watch(w)) return 0;
-	rbdelete(w, tree_wd);
-	rbdelete(w, tree_filename);
-	destroy_watch(w);
-	return 1;
+/**
+ * Like inotifytools_set_backend(), but operates on @a ctx.
+ */
+int inotifytools_ctx_set_backend( inotifytools_ctx *ctx, char const * name ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+
+	struct inotifytools_backend const * const * backend;
+	for ( backend = backends; *backend; ++backend ) {
+		if ( !strcmp( (*backend)->name, name ) ) break;
+	}
+	if ( !*backend ) {
+		ctx->error = EINVAL;
+		return 0;
+	}
+	if ( *backend == ctx->backend ) return 1;
+	if ( ctx->table_wd.count || ctx->ring || ctx->async ) {
+		ctx->error = EBUSY;
+		return 0;
+	}
+
+	void *data;
+	int fd = (*backend)->open( &data );
+	return switch_backend( ctx, *backend, fd, data );
 }
 
 /**
- * Remove a watch on a file specified by filename.
- *
- * @param filename Name of file on which watch should be removed.
+ * Spread the watches of the context over @a num_shards inotify instances.
+ *
+ * Each inotify instance has a queue of its own in the kernel, limited by
+ * inotifytools_get_max_queued_events(), and is drained into a common stream
+ * by a thread of its own, so that a busy tree is less likely to overflow
+ * the queue while events are being handled.  Events are reported in the
+ * order the threads read them, which is the order they happened in within
+ * each instance only.  A directory moved between watches of different
+ * instances may report IN_MOVED_TO before IN_MOVED_FROM.
+ *
+ * By default, each directory goes to the instance given by a hash of its
+ * path.  A directory keeps its instance when it is moved, so its own events,
+ * such as IN_MOVE_SELF, may be read before the IN_MOVED_TO its new path is
+ * learnt from, and then still name the old path.  With @a by_subtree, each
+ * directory directly below the first path watched goes to an instance along
+ * with everything below it, so that moves within such a subtree keep their
+ * order.  Recursive watches should use @a by_subtree, as inotifywait -r
+ * does.
+ *
+ * Watch descriptors stay unique across instances, but are not small
+ * consecutive numbers anymore; adding a watch fails with EOVERFLOW if its
+ * watch descriptor would not fit into an int.  The threads block all signals.  If one of
+ * them gives up, e.g. because its inotify instance failed, reading events
+ * fails with its error once the events sent before are read.
+ * inotifytools_start_reader() can't be used on a sharded context.
+ *
+ * inotifytools_initialize() must be called before this function can be
+ * used, and no watches may have been added yet.
+ *
+ * @param num_shards number of inotify instances; 1 selects the inotify
+ *                   backend again.
+ * @param by_subtree if nonzero, assign instances by top level subtree
+ *                   instead of by directory.
  *
  * @return 1 on success, 0 on failure.  On failure, the error can be
- *         obtained from inotifytools_error().
- *
- * @note The filename specified must always be the original name used to
- *       establish the watch.
+ *         obtained from inotifytools_error(): EINVAL if @a num_shards is
+ *         less than 1, EBUSY if there are already watches, EMFILE if the
+ *         instances would exceed /proc/sys/fs/inotify/max_user_instances.
+ *         The previous backend is kept on failure.
  */
-int inotifytools_remove_watch_by_filename( char const * filename ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	watch *w = watch_from_filename(filename);
-	if (!w) return 1;
+int inotifytools_set_shards( int num_shards, int by_subtree ) {
+	return inotifytools_ctx_set_shards( &default_ctx, num_shards,
+	                                    by_subtree );
+}
 
-	if (!remove_inotify_watch(w)) return 0;
-	rbdelete(w, tree_wd);
-	rbdelete(w, tree_filename);
-	destroy_watch(w);
-	return 1;
+/**
+ * Like inotifytools_set_shards(), but operates on @a ctx.
+ */
+int inotifytools_ctx_set_shards( inotifytools_ctx *ctx, int num_shards,
+                                 int by_subtree ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	if ( num_shards < 1 ) {
+		ctx->error = EINVAL;
+		return 0;
+	}
+	if ( num_shards == 1 && ctx->backend == &inotify_backend ) return 1;
+	if ( ctx->table_wd.count || ctx->ring || ctx->async ) {
+		ctx->error = EBUSY;
+		return 0;
+	}
+
+	void *data;
+	if ( num_shards == 1 ) {
+		int fd = inotify_backend.open( &data );
+		return switch_backend( ctx, &inotify_backend, fd, data );
+	}
+	int fd = inotifytools_shard_open( &data, num_shards, by_subtree );
+	return switch_backend( ctx, &inotifytools_shard_backend, fd, data );
 }
 
 /**
- * Set up a watch on a file.
+ * Initialise inotify.
  *
- * @param filename Absolute or relative path of file to watch.
+ * You must call this function before using any function which adds or removes
+ * watches or attempts to access any information about watches.
  *
- * @param events bitwise ORed inotify events to watch for.  See section
- *               \ref events.
+ * This initialises the default context, which is used by every function that
+ * does not take an explicit context.  See inotifytools_ctx_create() for
+ * running several independent instances.
  *
  * @return 1 on success, 0 on failure.  On failure, the error can be
  *         obtained from inotifytools_error().
  */
-int inotifytools_watch_file( char const * filename, int events ) {
-	static char const * filenames[2];
-	filenames[0] = filename;
-	filenames[1] = NULL;
-	return inotifytools_watch_files( filenames, events );
+int inotifytools_initialize() {
+	return inotifytools_ctx_initialize( &default_ctx );
 }
 
 /**
- * Set up a watch on a list of files.
+ * Create a new, initialised inotifytools context.
  *
- * inotifytools_initialize() must be called before this function can
- * be used.
+ * A context holds an inotify instance together with all the state that
+ * belongs to it: watches, statistics, the event buffer and settings such as
+ * the regex passed to inotifytools_ctx_ignore_events_by_regex().  Each
+ * @a inotifytools_ctx_* function behaves exactly like the function of the same
+ * name without @a _ctx, but operates on the given context instead of the
+ * default one.
  *
- * @param filenames null-terminated array of absolute or relative paths of
- *                  files to watch.
+ * Different contexts are completely independent, so they can be used
+ * concurrently from different threads.  A single context must not be used by
+ * more than one thread at a time.
  *
- * @param events bitwise OR'ed inotify events to watch for.  See section
- *               \ref events.
+ * @return a new context, which must be freed with inotifytools_ctx_destroy(),
+ *         or NULL on failure, in which case @a errno is set.
+ *
+ * @section example Example
+ * @code
+ * inotifytools_ctx * ctx = inotifytools_ctx_create();
+ * inotifytools_ctx_watch_recursively( ctx, "/srv/data", IN_ALL_EVENTS );
+ * struct inotify_event * event = inotifytools_ctx_next_event( ctx, -1 );
+ * inotifytools_ctx_printf( ctx, event, "%w%f %e\n" );
+ * inotifytools_ctx_destroy( ctx );
+ * @endcode
+ */
+inotifytools_ctx * inotifytools_ctx_create() {
+	inotifytools_ctx * ctx = (inotifytools_ctx *)calloc( 1, sizeof(*ctx) );
+	if ( !ctx ) return NULL;
+
+	ctx->inotify_fd = -1;
+	ctx->epoll_fd = -1;
+	ctx->wake_fd = -1;
+	if ( !inotifytools_ctx_initialize( ctx ) ) {
+		errno = ctx->error;
+		free( ctx );
+		return NULL;
+	}
+	return ctx;
+}
+
+/**
+ * Close inotify and free the memory used by inotifytools.
+ *
+ * If you call this function, you must call inotifytools_initialize()
+ * again before any other functions can be used.
+ */
+void inotifytools_cleanup() {
+	inotifytools_ctx_cleanup( &default_ctx );
+}
+
+/**
+ * Like inotifytools_cleanup(), but operates on @a ctx.  The context itself
+ * is not freed and may be initialised again with inotifytools_ctx_initialize().
+ */
+void inotifytools_ctx_cleanup( inotifytools_ctx *ctx ) {
+	if (!ctx->init) return;
+
+	ring_stop( ctx );
+	async_free( ctx );
+	ctx->init = 0;
+	close(ctx->epoll_fd);
+	ctx->epoll_fd = -1;
+	ctx->wake_fd = -1;
+	ctx->backend->close( ctx->backend_data, ctx->inotify_fd );
+	ctx->backend = NULL;
+	ctx->backend_data = NULL;
+	ctx->inotify_fd = -1;
+	ctx->collect_stats = 0;
+	ctx->error = 0;
+	ctx->timefmt = 0;
+	ctx->time_valid = 0;
+	ctx->prune = 0;
+	rescan_free( ctx );
+	ctx->rescan = 0;
+	coalesce_free( ctx );
+	ctx->coalesce_ms = 0;
+	moves_free( ctx );
+	reach_free( ctx );
+	inotifytools_format_free( ctx->format );
+	ctx->format = 0;
+	ctx->first_byte = 0;
+	ctx->bytes = 0;
+	free( ctx->event_buf );
+	ctx->event_buf = NULL;
+	ctx->event_buf_size = 0;
+
+	filters_clear( ctx );
+
+	watch_table_destroy( &ctx->table_wd );
+	stats_free( ctx );
+	free( ctx->metrics );
+	ctx->metrics = NULL;
+	unsigned i;
+	for ( i = 0; i < ctx->watches.num_blocks; ++i ) {
+		free( ctx->watches.blocks[i] );
+	}
+	free( ctx->watches.blocks );
+	free( ctx->watches.free_slots );
+	memset( &ctx->watches, 0, sizeof(ctx->watches) );
+	ctx->last_watch = NULL;
+	path_set_destroy( &ctx->path_nodes );
+	path_set_destroy( &ctx->path_names );
+	free( ctx->path );
+	ctx->path = NULL;
+	ctx->path_size = 0;
+}
+
+/**
+ * Free a context created with inotifytools_ctx_create(), closing inotify and
+ * removing all of its watches.
+ *
+ * @param ctx context to free; may be NULL.
+ */
+void inotifytools_ctx_destroy( inotifytools_ctx *ctx ) {
+	if ( !ctx ) return;
+	inotifytools_ctx_cleanup( ctx );
+	free( ctx );
+}
+
+/**
+ * Initialize or reset statistics.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * When this function is called, all subsequent events will be tallied.
+ * Statistics can then be obtained via the @a inotifytools_get_stat_* functions.
+ *
+ * After the first call, subsequent calls to this function will reset the
+ * event tallies to 0.
+ */
+void inotifytools_initialize_stats() {
+	inotifytools_ctx_initialize_stats( &default_ctx );
+}
+
+/**
+ * Like inotifytools_initialize_stats(), but operates on @a ctx.
+ */
+void inotifytools_ctx_initialize_stats( inotifytools_ctx *ctx ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+
+	// if already collecting stats, reset stats
+	if (ctx->collect_stats) {
+		int i;
+		for ( i = 0; i < NUM_STATS; ++i ) {
+			if ( ctx->stats[i] ) {
+				memset( ctx->stats[i], 0, ctx->stats_size * sizeof(uint64_t) );
+			}
+		}
+	}
+	else if ( !stats_reserve( ctx, ctx->watches.num_blocks * WATCH_BLOCK ) ) {
+		stats_free( ctx );
+		ctx->error = ENOMEM;
+		return;
+	}
+
+	memset( ctx->stat_total, 0, sizeof(ctx->stat_total) );
+	// neither the current nor the last interval has any events now
+	if ( ctx->epoch ) {
+		ctx->epoch += 2;
+		memset( ctx->interval_total, 0, sizeof(ctx->interval_total) );
+	}
+
+	ctx->collect_stats = 1;
+}
+
+/**
+ * Start a new statistics interval.
+ *
+ * From the first call on, events are also counted per interval, and the
+ * counts of the interval ended by the latest call can be obtained with
+ * inotifytools_get_interval_stat_by_wd(),
+ * inotifytools_get_interval_stat_total() and
+ * inotifytools_interval_wds_sorted_by_event(), while the next interval is
+ * being counted.  The counters for the new interval are reset as events
+ * come in, so this takes the same short time however many watches there
+ * are.  Interval counts are 32 bits wide.
+ *
+ * inotifytools_initialize_stats() must be called before this function can
+ * be used.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_next_interval() {
+	return inotifytools_ctx_next_interval( &default_ctx );
+}
+
+/**
+ * Like inotifytools_next_interval(), but operates on @a ctx.
+ */
+int inotifytools_ctx_next_interval( inotifytools_ctx *ctx ) {
+	if ( !ctx->collect_stats ) {
+		ctx->error = EINVAL;
+		return 0;
+	}
+	if ( !ctx->epoch ) {
+		if ( !interval_reserve( ctx, 0, ctx->stats_size ) ) {
+			ctx->error = ENOMEM;
+			return 0;
+		}
+		// the interval before the first one is empty
+		ctx->epoch = 2;
+		memset( ctx->interval_total, 0, sizeof(ctx->interval_total) );
+		return 1;
+	}
+	++ctx->epoch;
+	memset( ctx->interval_total[ctx->epoch & 1], 0,
+	        sizeof(ctx->interval_total[0]) );
+	return 1;
+}
+
+/**
+ * @internal
+ * An event name, with its length so that strings can be built with memcpy()
+ * and names compared without strlen().
+ */
+struct event_name {
+	int mask;
+	char const * name;
+	size_t len;
+};
+#define EVENT_NAME(name) { IN_##name, #name, sizeof(#name) - 1 }
+
+/** @internal Size of event_hash_names[], a power of 2. */
+#define EVENT_HASH_SIZE 32
+
+/**
+ * @internal
+ * Hash of the event name @a name, @a len bytes long, which is different for
+ * every name in event_hash_names[] whatever its case.
+ */
+static unsigned event_hash( char const * name, size_t len ) {
+	// setting 0x20 makes letters lower case and leaves '_' distinct
+	unsigned first = (unsigned char)name[0] | 0x20;
+	unsigned middle = (unsigned char)name[len / 2] | 0x20;
+	unsigned last = (unsigned char)name[len - 1] | 0x20;
+	return (len + first + middle + 12 * last) & (EVENT_HASH_SIZE - 1);
+}
+
+/**
+ * @internal
+ * The names accepted by inotifytools_str_to_event(), at the index of their
+ * event_hash().  The test suite checks that every name is found.
+ */
+static struct event_name const event_hash_names[EVENT_HASH_SIZE] = {
+	[0] = EVENT_NAME(OPEN),
+	[1] = EVENT_NAME(Q_OVERFLOW),
+	[3] = EVENT_NAME(MOVE),
+	[5] = EVENT_NAME(ALL_EVENTS),
+	[6] = EVENT_NAME(CREATE),
+	[8] = EVENT_NAME(MODIFY),
+	[9] = EVENT_NAME(CLOSE_WRITE),
+	[10] = EVENT_NAME(ISDIR),
+	[11] = EVENT_NAME(DELETE),
+	[13] = EVENT_NAME(MOVED_TO),
+	[15] = EVENT_NAME(IGNORED),
+	[16] = EVENT_NAME(ACCESS),
+	[17] = EVENT_NAME(ATTRIB),
+	[18] = EVENT_NAME(MOVED_FROM),
+	[19] = EVENT_NAME(CLOSE),
+	[25] = EVENT_NAME(ONESHOT),
+	[26] = EVENT_NAME(CLOSE_NOWRITE),
+	[27] = EVENT_NAME(UNMOUNT),
+	[28] = EVENT_NAME(DELETE_SELF),
+	[29] = EVENT_NAME(MOVE_SELF),
+};
+
+/**
+ * @internal
+ * Convert the event name @a name, @a len bytes long and not necessarily null
+ * terminated, to integer form.  Case insensitive.
+ *
+ * @return the mask of the event, 0 if @a len is 0, or -1 if @a name is not
+ *         the name of an event.
+ */
+static int event_from_name( char const * name, size_t len ) {
+	if ( !len ) return 0;
+	struct event_name const * e = &event_hash_names[event_hash( name, len )];
+	if ( e->len != len || 0 != strncasecmp( name, e->name, len ) ) return -1;
+	return e->mask;
+}
+
+/**
+ * Convert character separated events from string form to integer form
+ * (as in inotify.h).
+ *
+ * @param    event    a sequence of events in string form as defined in
+ *                    inotify.h without leading IN_ prefix (e.g., MODIFY,
+ *                    ATTRIB), separated by the @a sep character.  Case
+ *                    insensitive.  Can be a single event.
+ *                    Can be empty or NULL.  See section \ref events.
+ *
+ * @param    sep      Character used to separate events.  @a sep must not be
+ *                    a character in a-z, A-Z, or _.
+ *
+ * @return            integer representing the mask specified by @a event, or 0
+ *                    if any string in @a event is empty or NULL, or -1 if
+ *                    any string in @a event does not match any event or
+ *                    @a sep is invalid.
+ *
+ * @section example Example
+ * @code
+ * char * eventstr = "MODIFY:CLOSE:CREATE";
+ * int eventnum = inotifytools_str_to_event_sep( eventstr, ':' );
+ * if ( eventnum == IN_MODIFY | IN_CLOSE | IN_CREATE ) {
+ *    printf( "This code always gets executed!\n" );
+ * }
+ * @endcode
+ */
+int inotifytools_str_to_event_sep(char const * event, char sep) {
+	if ( strchr( "_" "abcdefghijklmnopqrstuvwxyz"
+	                 "ABCDEFGHIJKLMNOPQRSTUVWXYZ", sep ) ) {
+		return -1;
+	}
+
+	if ( !event || !event[0] ) return 0;
+
+	// each name is looked up where it is, without copying it
+	int ret = 0;
+	for (;;) {
+		char const * next = strchr( event, sep );
+		int mask = event_from_name( event, next ? (size_t)(next - event) :
+		                                          strlen( event ) );
+		if ( 0 == mask || -1 == mask ) return mask;
+		ret |= mask;
+		if ( !next ) return ret;
+		// jump over 'sep' character
+		event = next + 1;
+		// if last character was 'sep'...
+		if ( !event[0] ) return 0;
+	}
+}
+
+/**
+ * Convert comma-separated events from string form to integer form
+ * (as in inotify.h).
+ *
+ * @param    event    a sequence of events in string form as defined in
+ *                    inotify.h without leading IN_ prefix (e.g., MODIFY,
+ *                    ATTRIB), comma-separated.  Case
+ *                    insensitive.  Can be a single event.
+ *                    Can be empty or NULL.  See section \ref events.
+ *
+ * @return            integer representing the mask specified by @a event, or 0
+ *                    if any string in @a event is empty or NULL, or -1 if
+ *                    any string in @a event does not match any event.
+ *
+ * @section example Example
+ * @code
+ * char * eventstr = "MODIFY,CLOSE,CREATE";
+ * int eventnum = inotifytools_str_to_event( eventstr );
+ * if ( eventnum == IN_MODIFY | IN_CLOSE | IN_CREATE ) {
+ *    printf( "This code always gets executed!\n" );
+ * }
+ * @endcode
+ */
+int inotifytools_str_to_event(char const * event) {
+	return inotifytools_str_to_event_sep( event, ',' );
+}
+
+/**
+ * @internal
+ * Convert a single event from string form to integer form (as in inotify.h).
+ *
+ * @param    event    event in string form as defined in inotify.h without
+ *                    leading IN_ prefix (e.g., MODIFY, ATTRIB).  Case
+ *                    insensitive.  Can be empty or NULL.
+ * @return            integer representing the mask specified by 'event', or 0
+ *                    if @a event is empty or NULL, or -1 if string does not
+ *                    match any event.
+ */
+int onestr_to_event(char const * event)
+{
+	if ( !event ) return 0;
+	return event_from_name( event, strlen( event ) );
+}
+
+/**
+ * Convert event from integer form to string form (as in inotify.h).
+ *
+ * The returned string is from static storage; subsequent calls to this function
+ * or inotifytools_event_to_str_sep() will overwrite it.  Don't free() it and
+ * make a copy if you want to keep it.  inotifytools_event_to_str_r()
+ * writes it to a buffer of your own instead.
+ *
+ * @param    events   OR'd event(s) in integer form as defined in inotify.h.
+ *                    See section \ref events.
+ *
+ * @return            comma-separated string representing the event(s), in no
+ *                    particular order
+ *
+ * @section example Example
+ * @code
+ * int eventnum == IN_MODIFY | IN_CLOSE | IN_CREATE;
+ * char * eventstr = inotifytools_event_to_str( eventnum );
+ * printf( "%s\n", eventstr );
+ * // outputs something like MODIFY,CLOSE,CREATE but order not guaranteed.
+ * @endcode
+ */
+char * inotifytools_event_to_str(int events) {
+	return inotifytools_event_to_str_sep(events, ',');
+}
+
+/**
+ * Convert event from integer form to string form (as in inotify.h).
+ *
+ * The returned string is from static storage; subsequent calls to this function
+ * or inotifytools_event_to_str() will overwrite it.  Don't free() it and
+ * make a copy if you want to keep it.  inotifytools_event_to_str_r()
+ * writes it to a buffer of your own instead.
+ *
+ * @param    events   OR'd event(s) in integer form as defined in inotify.h
+ *
+ * @param    sep      character used to separate events
+ *
+ * @return            @a sep separated string representing the event(s), in no
+ *                    particular order.  If the integer is not made of OR'ed
+ *                    inotify events, the string returned will be a hexadecimal
+ *                    representation of the integer.
+ *
+ * @section example Example
+ * @code
+ * int eventnum == IN_MODIFY | IN_CLOSE | IN_CREATE;
+ * char * eventstr = inotifytools_event_to_str_sep( eventnum, '-' );
+ * printf( "%s\n", eventstr );
+ * // outputs something like MODIFY-CLOSE-CREATE but order not guaranteed.
+ * @endcode
+ */
+char * inotifytools_event_to_str_sep(int events, char sep)
+{
+	static char ret[INOTIFYTOOLS_EVENT_STR_SIZE];
+	inotifytools_event_to_str_r( events, sep, ret, sizeof(ret) );
+	return ret;
+}
+
+/**
+ * @internal
+ * Names of the events, in the order they are listed by
+ * inotifytools_event_to_str().
+ */
+static struct event_name const event_names[] = {
+	EVENT_NAME(ACCESS),
+	EVENT_NAME(MODIFY),
+	EVENT_NAME(ATTRIB),
+	EVENT_NAME(CLOSE_WRITE),
+	EVENT_NAME(CLOSE_NOWRITE),
+	EVENT_NAME(OPEN),
+	EVENT_NAME(MOVED_FROM),
+	EVENT_NAME(MOVED_TO),
+	EVENT_NAME(CREATE),
+	EVENT_NAME(DELETE),
+	EVENT_NAME(DELETE_SELF),
+	EVENT_NAME(UNMOUNT),
+	EVENT_NAME(Q_OVERFLOW),
+	EVENT_NAME(IGNORED),
+	EVENT_NAME(CLOSE),
+	EVENT_NAME(MOVE_SELF),
+	EVENT_NAME(ISDIR),
+	EVENT_NAME(ONESHOT),
+};
+#undef EVENT_NAME
+
+/** @internal The event bits which have a name of their own. */
+#define NAMED_EVENTS ( IN_ALL_EVENTS | IN_UNMOUNT | IN_Q_OVERFLOW | \
+                       IN_IGNORED | IN_ISDIR | IN_ONESHOT )
+/** @internal Index of IN_CLOSE, which has two bits, in event_names[]. */
+#define CLOSE_NAME 14
+
+/**
+ * @internal
+ * Index in event_names[] of each bit of NAMED_EVENTS, by bit number.
+ */
+static unsigned char const event_name_index[32] = {
+	[0] = 0,	// ACCESS
+	[1] = 1,	// MODIFY
+	[2] = 2,	// ATTRIB
+	[3] = 3,	// CLOSE_WRITE
+	[4] = 4,	// CLOSE_NOWRITE
+	[5] = 5,	// OPEN
+	[6] = 6,	// MOVED_FROM
+	[7] = 7,	// MOVED_TO
+	[8] = 8,	// CREATE
+	[9] = 9,	// DELETE
+	[10] = 10,	// DELETE_SELF
+	[11] = 15,	// MOVE_SELF
+	[13] = 11,	// UNMOUNT
+	[14] = 12,	// Q_OVERFLOW
+	[15] = 13,	// IGNORED
+	[30] = 16,	// ISDIR
+	[31] = 17,	// ONESHOT
+};
+
+/**
+ * @internal
+ * Copy at most @a end - @a p bytes of @a str to @a p.
+ *
+ * @return the position after the last byte copied.
+ */
+static char * put_str( char * p, char * end, char const * str, size_t len ) {
+	if ( len > (size_t)(end - p) ) len = end - p;
+	memcpy( p, str, len );
+	return p + len;
+}
+
+/**
+ * @internal
+ * Write the @a sep separated string form of @a events to @a p, without a
+ * terminating null byte and without going past @a end.
+ *
+ * @return the position after the last byte written.
+ */
+static char * put_events( char * p, char * end, int events, char sep ) {
+	char * start = p;
+
+	// Map each bit set to the index of its name, so that names keep their
+	// order while only the bits which are set are looked at.
+	uint32_t names = 0;
+	uint32_t bits = (uint32_t)events & NAMED_EVENTS;
+	for ( ; bits; bits &= bits - 1 ) {
+		names |= 1u << event_name_index[__builtin_ctz( bits )];
+	}
+	if ( events & IN_CLOSE ) names |= 1u << CLOSE_NAME;
+
+	for ( ; names; names &= names - 1 ) {
+		struct event_name const * e = &event_names[__builtin_ctz( names )];
+		if ( p != start && p < end ) *p++ = sep;
+		p = put_str( p, end, e->name, e->len );
+	}
+
+	// Maybe we didn't match any... ?
+	if ( p == start ) {
+		char hex[11];
+		niceassert( -1 != sprintf( hex, "0x%08x", events ), 0 );
+		p = put_str( p, end, hex, 10 );
+	}
+	return p;
+}
+
+/**
+ * Convert event from integer form to string form in a buffer of the
+ * caller's.
+ *
+ * This is inotifytools_event_to_str_sep() without its static storage, so it
+ * can be used from several threads at once.  It allocates nothing and takes
+ * time proportional to the number of bits set in @a events.
+ *
+ * @param    events   OR'd event(s) in integer form as defined in inotify.h
+ *
+ * @param    sep      character used to separate events
+ *
+ * @param    buf      buffer to write the null terminated string to.
+ *
+ * @param    size     size of @a buf.  The string is cut short if it doesn't
+ *                    fit; INOTIFYTOOLS_EVENT_STR_SIZE bytes are enough for
+ *                    any @a events.
+ *
+ * @return the length of the string written, or -1 if @a size is not
+ *         positive.
+ */
+int inotifytools_event_to_str_r( int events, char sep, char * buf,
+                                 int size ) {
+	if ( size <= 0 ) return -1;
+	char * end = put_events( buf, buf + size - 1, events, sep );
+	*end = '\0';
+	return end - buf;
+}
+
+/**
+ * Get the filename used to establish a watch.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param wd watch descriptor.
+ *
+ * @return filename associated with watch descriptor @a wd, or NULL if @a wd
+ *         is not associated with any filename.  The filename is built in a
+ *         buffer owned by the library, which is overwritten by the next call
+ *         to this function; make a copy if you want to keep it.
+ *
+ * @note This always returns the filename which was used to establish a watch.
+ *       This means the filename may be a relative path.  If this isn't desired,
+ *       then always use absolute paths when watching files.
+ *       Also, this is not necessarily the filename which might have been used
+ *       to cause an event on the file, since inotify is inode based and there
+ *       can be many filenames mapping to a single inode.
+ *       Finally, if a file is moved or renamed while being watched, the
+ *       filename returned will still be the original name.
+ */
+char * inotifytools_filename_from_wd( int wd ) {
+	return inotifytools_ctx_filename_from_wd( &default_ctx, wd );
+}
+
+/**
+ * Like inotifytools_filename_from_wd(), but operates on @a ctx.
+ */
+char * inotifytools_ctx_filename_from_wd( inotifytools_ctx *ctx, int wd ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	watch *w = watch_from_wd(ctx, wd);
+	if (!w)
+        return NULL;
+
+	return path_str( ctx, w->node );
+}
+
+/**
+ * Get the watch descriptor for a particular filename.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param filename file name to find watch descriptor for.
+ *
+ * @return watch descriptor associated with filename, or -1 if @a filename is
+ *         not associated with any watch descriptor.
+ *
+ * @note The filename specified must always be the original name used to
+ *       establish the watch.
+ */
+int inotifytools_wd_from_filename( char const * filename ) {
+	return inotifytools_ctx_wd_from_filename( &default_ctx, filename );
+}
+
+/**
+ * Like inotifytools_wd_from_filename(), but operates on @a ctx.
+ */
+int inotifytools_ctx_wd_from_filename( inotifytools_ctx *ctx,
+                                       char const * filename ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	watch *w = watch_from_filename(ctx, filename);
+	if (!w) return -1;
+	return w->wd;
+}
+
+/**
+ * Set the filename for a particular watch descriptor.
+ *
+ * This function should be used to update a filename when a file is known to
+ * have been moved or renamed.  At the moment, libinotifytools does not
+ * automatically handle this situation.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param wd Watch descriptor.
+ *
+ * @param filename New filename.
+ */
+void inotifytools_set_filename_by_wd( int wd, char const * filename ) {
+	inotifytools_ctx_set_filename_by_wd( &default_ctx, wd, filename );
+}
+
+/**
+ * Like inotifytools_set_filename_by_wd(), but operates on @a ctx.
+ */
+void inotifytools_ctx_set_filename_by_wd( inotifytools_ctx *ctx, int wd,
+                                          char const * filename ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	watch *w = watch_from_wd(ctx, wd);
+	if (!w) return;
+	watch_set_path( ctx, w, filename );
+}
+
+/**
+ * Set the filename for one or more watches with a particular existing filename.
+ *
+ * This function should be used to update a filename when a file is known to
+ * have been moved or renamed.  At the moment, libinotifytools does not
+ * automatically handle this situation.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param oldname Current filename.
+ *
+ * @param newname New filename.
+ */
+void inotifytools_set_filename_by_filename( char const * oldname,
+                                            char const * newname ) {
+	inotifytools_ctx_set_filename_by_filename( &default_ctx, oldname, newname );
+}
+
+/**
+ * Like inotifytools_set_filename_by_filename(), but operates on @a ctx.
+ */
+void inotifytools_ctx_set_filename_by_filename( inotifytools_ctx *ctx,
+                                                char const * oldname,
+                                                char const * newname ) {
+	watch *w = watch_from_filename(ctx, oldname);
+	if (!w) return;
+	watch_set_path( ctx, w, newname );
+}
+
+/**
+ * Replace a certain filename prefix on all watches.
+ *
+ * This function should be used to update filenames for an entire directory tree
+ * when a directory is known to have been moved or renamed.  At the moment,
+ * libinotifytools does not automatically handle this situation.
+ *
+ * The time taken is proportional to the number of watches renamed, not to the
+ * total number of watches.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param oldname Current filename prefix.
+ *
+ * @param newname New filename prefix.
+ *
+ * @section example Example
+ * @code
+ * // if /home/user1/original_dir is moved to /home/user2/new_dir, then to
+ * // update all watches:
+ * inotifytools_replace_filename( "/home/user1/original_dir",
+ *                                "/home/user2/new_dir" );
+ * @endcode
+ */
+void inotifytools_replace_filename( char const * oldname,
+                                    char const * newname ) {
+	inotifytools_ctx_replace_filename( &default_ctx, oldname, newname );
+}
+
+/**
+ * Like inotifytools_replace_filename(), but operates on @a ctx.
+ */
+void inotifytools_ctx_replace_filename( inotifytools_ctx *ctx,
+                                        char const * oldname,
+                                        char const * newname ) {
+	if ( !oldname || !newname ) return;
+	size_t old_len = strlen(oldname);
+	size_t new_len = strlen(newname);
+
+	// When both names are directories, every watch below oldname hangs off
+	// its node, so moving that node renames all of them at once.
+	if ( old_len && new_len && oldname[old_len-1] == '/' &&
+	     newname[new_len-1] == '/' &&
+	     0 != strncmp( oldname, newname, old_len ) ) {
+		struct path_node * node = path_lookup( ctx, oldname, old_len, 0 );
+		if ( !node ) return;
+		if ( !path_lookup( ctx, newname, new_len, 0 ) ) {
+			size_t parent_len = new_len - 1;
+			while ( parent_len && newname[parent_len-1] != '/' ) --parent_len;
+			struct path_node * parent = path_lookup( ctx, newname,
+			                                         parent_len, 1 );
+			struct path_name * name = path_name_get( ctx,
+			                                         &newname[parent_len],
+			                                         new_len - parent_len, 1 );
+			struct path_node * old_parent = node->parent;
+			struct path_name * old_name = node->name;
+
+			path_set_remove( &ctx->path_nodes, &node->e );
+			path_node_place( ctx, node, parent, name );
+			path_name_release( ctx, old_name );
+			path_node_release( ctx, old_parent );
+			return;
+		}
+	}
+
+	// Otherwise, such as when the new name is already in use, rename the
+	// watches one by one.
+	unsigned i;
+	for ( i = 0; i < ctx->table_wd.size; ++i ) {
+		watch *w = ctx->table_wd.slots[i];
+		if ( !w ) continue;
+		char const * filename = path_str( ctx, w->node );
+		if ( 0 != strncmp( oldname, filename, old_len ) ||
+		     !strcmp( filename, newname ) ) {
+			continue;
+		}
+		char *name;
+		nasprintf( &name, "%s%s", newname, &filename[old_len] );
+		watch_set_path( ctx, w, name );
+		free( name );
+	}
+}
+
+/** Initial number of buckets of the table of pending moves. */
+#define MOVE_BUCKETS 64
+
+/**
+ * @internal
+ * An IN_MOVED_FROM event waiting for the IN_MOVED_TO event with the same
+ * cookie.  Pending moves are kept in the order they occurred, and chained
+ * into the buckets of struct move_tracker by cookie.
+ */
+struct pending_move {
+	struct pending_move *prev;
+	struct pending_move *next;
+	struct pending_move *chain;
+	long long time;
+	uint32_t cookie;
+	int isdir;
+	char *from;
+};
+
+/**
+ * @internal
+ * Move tracking state of one context.  @a from and @a to are the paths of
+ * the move handed out last, which the caller may still be looking at.
+ */
+struct move_tracker {
+	struct pending_move *head;
+	struct pending_move *tail;
+	struct pending_move **buckets;
+	unsigned num_buckets;
+	unsigned num_pending;
+	char *from;
+	char *to;
+};
+
+/**
+ * @internal
+ * Double the number of buckets of the table of pending moves.
+ */
+static void moves_grow( struct move_tracker *m ) {
+	unsigned num = m->num_buckets ? m->num_buckets * 2 : MOVE_BUCKETS;
+	struct pending_move **buckets =
+		(struct pending_move **)calloc( num, sizeof(*buckets) );
+	niceassert( buckets, "out of memory" );
+	struct pending_move *p;
+	for ( p = m->head; p; p = p->next ) {
+		p->chain = buckets[p->cookie & (num - 1)];
+		buckets[p->cookie & (num - 1)] = p;
+	}
+	free( m->buckets );
+	m->buckets = buckets;
+	m->num_buckets = num;
+}
+
+/**
+ * @internal
+ * Remove @a p from the pending moves and hand it out as @a move.  The
+ * pending move is freed; its path is kept until the next move is handed
+ * out.
+ */
+static void moves_take( struct move_tracker *m, struct pending_move *p,
+                        struct inotifytools_move * move ) {
+	struct pending_move **link = &m->buckets[p->cookie & (m->num_buckets - 1)];
+	while ( *link != p ) link = &(*link)->chain;
+	*link = p->chain;
+	if ( p->prev ) p->prev->next = p->next;
+	else m->head = p->next;
+	if ( p->next ) p->next->prev = p->prev;
+	else m->tail = p->prev;
+	--m->num_pending;
+
+	free( m->from );
+	m->from = p->from;
+	move->from = p->from;
+	move->cookie = p->cookie;
+	move->isdir = p->isdir;
+	free( p );
+}
+
+/**
+ * @internal
+ * Free the move tracking state of @a ctx.
+ */
+static void moves_free( inotifytools_ctx *ctx ) {
+	struct move_tracker *m = ctx->moves;
+	if ( !m ) return;
+	struct pending_move *p, *next;
+	for ( p = m->head; p; p = next ) {
+		next = p->next;
+		free( p->from );
+		free( p );
+	}
+	free( m->buckets );
+	free( m->from );
+	free( m->to );
+	free( m );
+	ctx->moves = NULL;
+}
+
+/**
+ * Pair up the two events of a move.
+ *
+ * inotify reports a move within the watched directories as an IN_MOVED_FROM
+ * event and an IN_MOVED_TO event with the same cookie.  Other events may be
+ * queued between the two when several moves happen at once, so they can't
+ * be paired by assuming one immediately follows the other.  Pass every
+ * event obtained to this function: IN_MOVED_FROM events are remembered by
+ * their cookie, and each IN_MOVED_TO event completes the move it belongs to.
+ * An IN_MOVED_FROM event no IN_MOVED_TO event follows belongs to a file
+ * moved out of the watched directories; see inotifytools_expire_move().
+ *
+ * The paths are found with inotifytools_filename_from_wd() when the events
+ * are passed in, so a move is reported with the paths of the watches at the
+ * time; call inotifytools_replace_filename() to update the watches below a
+ * moved directory before passing in further events.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param event event just obtained.
+ *
+ * @param move filled in if @a event completes a move.  @a move->from is the
+ *             path the file was moved from or NULL if it was moved in from
+ *             outside the watched directories, @a move->to is the path it
+ *             was moved to.  Paths don't end in a slash, even for
+ *             directories.  They stay valid until the next call to this
+ *             function or inotifytools_expire_move().
+ *
+ * @return 1 if @a event is an IN_MOVED_TO event and @a move was filled in, 0
+ *         otherwise.
+ *
+ * @section example Example
+ * @code
+ * struct inotifytools_move move;
+ * while ( (event = inotifytools_next_event( -1 )) ) {
+ *    if ( inotifytools_track_move( event, &move ) && move.from ) {
+ *       printf( "%s was renamed to %s\n", move.from, move.to );
+ *    }
+ *    while ( inotifytools_expire_move( 1000, &move ) ) {
+ *       printf( "%s was moved away\n", move.from );
+ *    }
+ * }
+ * @endcode
+ */
+int inotifytools_track_move( struct inotify_event * event,
+                             struct inotifytools_move * move ) {
+	return inotifytools_ctx_track_move( &default_ctx, event, move );
+}
+
+/**
+ * Like inotifytools_track_move(), but operates on @a ctx.
+ */
+int inotifytools_ctx_track_move( inotifytools_ctx *ctx,
+                                 struct inotify_event * event,
+                                 struct inotifytools_move * move ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	if ( !(event->mask & (IN_MOVED_FROM | IN_MOVED_TO)) ) return 0;
+	char const * dir = inotifytools_ctx_filename_from_wd( ctx, event->wd );
+	if ( !dir ) return 0;
+
+	if ( !ctx->moves ) {
+		ctx->moves = (struct move_tracker *)calloc( 1,
+		                                           sizeof(struct move_tracker) );
+		niceassert( ctx->moves, "out of memory" );
+	}
+	struct move_tracker *m = ctx->moves;
+
+	if ( event->mask & IN_MOVED_FROM ) {
+		struct pending_move *p =
+			(struct pending_move *)malloc( sizeof(struct pending_move) );
+		niceassert( p, "out of memory" );
+		nasprintf( &p->from, "%s%s", dir, event->len ? event->name : "" );
+		p->time = now_ms();
+		p->cookie = event->cookie;
+		p->isdir = !!(event->mask & IN_ISDIR);
+		if ( m->num_pending >= m->num_buckets ) moves_grow( m );
+		p->chain = m->buckets[p->cookie & (m->num_buckets - 1)];
+		m->buckets[p->cookie & (m->num_buckets - 1)] = p;
+		p->prev = m->tail;
+		p->next = NULL;
+		if ( m->tail ) m->tail->next = p;
+		else m->head = p;
+		m->tail = p;
+		++m->num_pending;
+		return 0;
+	}
+
+	struct pending_move *p = NULL;
+	if ( m->num_buckets ) {
+		for ( p = m->buckets[event->cookie & (m->num_buckets - 1)];
+		      p && p->cookie != event->cookie; p = p->chain );
+	}
+	if ( p ) {
+		moves_take( m, p, move );
+	}
+	else {
+		free( m->from );
+		m->from = NULL;
+		move->from = NULL;
+		move->cookie = event->cookie;
+		move->isdir = !!(event->mask & IN_ISDIR);
+	}
+	free( m->to );
+	nasprintf( &m->to, "%s%s", dir, event->len ? event->name : "" );
+	move->to = m->to;
+	return 1;
+}
+
+/**
+ * Get a file moved out of the watched directories.
+ *
+ * An IN_MOVED_FROM event passed to inotifytools_track_move() which no
+ * IN_MOVED_TO event has followed within @a max_age_ms milliseconds is taken
+ * to belong to a file moved out of the watched directories, and handed out
+ * by this function.  The two events of a move are queued at once, so a
+ * short time such as a second is plenty, as long as this function is called
+ * after the events read meanwhile have been passed in.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param max_age_ms time in milliseconds to wait for the IN_MOVED_TO event.
+ *
+ * @param move filled in with the oldest such move, if there is one.
+ *             @a move->to is NULL; see inotifytools_track_move() for the
+ *             other fields.
+ *
+ * @return 1 if @a move was filled in, 0 otherwise.
+ */
+int inotifytools_expire_move( long max_age_ms,
+                              struct inotifytools_move * move ) {
+	return inotifytools_ctx_expire_move( &default_ctx, max_age_ms, move );
+}
+
+/**
+ * Like inotifytools_expire_move(), but operates on @a ctx.
+ */
+int inotifytools_ctx_expire_move( inotifytools_ctx *ctx, long max_age_ms,
+                                  struct inotifytools_move * move ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	struct move_tracker *m = ctx->moves;
+	if ( !m || !m->head || m->head->time + max_age_ms > now_ms() ) return 0;
+	moves_take( m, m->head, move );
+	move->to = NULL;
+	return 1;
+}
+
+/**
+ * Get the number of IN_MOVED_FROM events passed to inotifytools_track_move()
+ * which are still waiting for their IN_MOVED_TO event.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @return number of pending moves.
+ */
+int inotifytools_get_num_pending_moves() {
+	return inotifytools_ctx_get_num_pending_moves( &default_ctx );
+}
+
+/**
+ * Like inotifytools_get_num_pending_moves(), but operates on @a ctx.
+ */
+int inotifytools_ctx_get_num_pending_moves( inotifytools_ctx *ctx ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	return ctx->moves ? (int)ctx->moves->num_pending : 0;
+}
+
+/**
+ * @internal
+ */
+int remove_inotify_watch(inotifytools_ctx *ctx, watch *w) {
+	ctx->error = 0;
+	int status = ctx->backend->rm_watch( ctx->backend_data, ctx->inotify_fd,
+	                                     w->wd );
+	if ( status < 0 ) {
+		fprintf(stderr, "Failed to remove watch on %s: %s\n",
+		        path_str( ctx, w->node ), strerror(status) );
+		ctx->error = status;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ */
+watch *create_watch(inotifytools_ctx *ctx, int wd, char *filename) {
+	if ( wd <= 0 || !filename) return 0;
+
+	// inotify hands out the same wd when an inode is watched again
+	watch *w = watch_from_wd(ctx, wd);
+	if (w) return w;
+
+	w = watch_alloc( ctx );
+	if ( !w ) return 0;
+	w->wd = wd;
+	watch_set_path( ctx, w, filename );
+	watch_table_insert(&ctx->table_wd, w);
+	if ( ctx->reach ) reach_new( ctx, wd );
+	return w;
+}
+
+/**
+ * @internal
+ * Name the watch @a wd, creating it if there is none yet.  Used by backends
+ * which create watch descriptors on their own.
+ */
+void inotifytools_backend_set_path( inotifytools_ctx *ctx, int wd,
+                                    char const *path ) {
+	watch *w = watch_from_wd( ctx, wd );
+	if ( w ) watch_set_path( ctx, w, path );
+	else create_watch( ctx, wd, (char *)path );
+}
+
+/**
+ * Remove a watch on a file specified by watch descriptor.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param wd Watch descriptor of watch to be removed.
+ *
+ * @return 1 on success, 0 on failure.  If the given watch doesn't exist,
+ *         returns 1.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_remove_watch_by_wd( int wd ) {
+	return inotifytools_ctx_remove_watch_by_wd( &default_ctx, wd );
+}
+
+/**
+ * Like inotifytools_remove_watch_by_wd(), but operates on @a ctx.
+ */
+int inotifytools_ctx_remove_watch_by_wd( inotifytools_ctx *ctx, int wd ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	watch *w = watch_from_wd(ctx, wd);
+	if (!w) return 1;
+
+	if (!remove_inotify_watch(ctx, w)) return 0;
+	forget_watch(ctx, w);
+	return 1;
+}
+
+/**
+ * Remove a watch on a file specified by filename.
+ *
+ * @param filename Name of file on which watch should be removed.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ *
+ * @note The filename specified must always be the original name used to
+ *       establish the watch.
+ */
+int inotifytools_remove_watch_by_filename( char const * filename ) {
+	return inotifytools_ctx_remove_watch_by_filename( &default_ctx, filename );
+}
+
+/**
+ * Like inotifytools_remove_watch_by_filename(), but operates on @a ctx.
+ */
+int inotifytools_ctx_remove_watch_by_filename( inotifytools_ctx *ctx,
+                                               char const * filename ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	watch *w = watch_from_filename(ctx, filename);
+	if (!w) return 1;
+
+	if (!remove_inotify_watch(ctx, w)) return 0;
+	forget_watch(ctx, w);
+	return 1;
+}
+
+/**
+ * Set up a watch on a file.
+ *
+ * @param filename Absolute or relative path of file to watch.
+ *
+ * @param events bitwise ORed inotify events to watch for.  See section
+ *               \ref events.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_watch_file( char const * filename, int events ) {
+	return inotifytools_ctx_watch_file( &default_ctx, filename, events );
+}
+
+/**
+ * Like inotifytools_watch_file(), but operates on @a ctx.
+ */
+int inotifytools_ctx_watch_file( inotifytools_ctx *ctx, char const * filename,
+                                 int events ) {
+	char const * filenames[2];
+	filenames[0] = filename;
+	filenames[1] = NULL;
+	return inotifytools_ctx_watch_files( ctx, filenames, events );
+}
+
+/**
+ * Set up a watch on a list of files.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param filenames null-terminated array of absolute or relative paths of
+ *                  files to watch.
+ *
+ * @param events bitwise OR'ed inotify events to watch for.  See section
+ *               \ref events.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_watch_files( char const * filenames[], int events ) {
+	return inotifytools_ctx_watch_files( &default_ctx, filenames, events );
+}
+
+/**
+ * Like inotifytools_watch_files(), but operates on @a ctx.
+ */
+int inotifytools_ctx_watch_files( inotifytools_ctx *ctx,
+                                  char const * filenames[], int events ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	ctx->error = 0;
+
+	int i;
+	for ( i = 0; filenames[i]; ++i ) {
+		int wd;
+		wd = ctx->backend->add_watch( ctx->backend_data, ctx->inotify_fd,
+		                              filenames[i], events );
+		if ( wd < 0 ) {
+			if ( wd == -1 ) {
+				ctx->error = errno;
+				return 0;
+			} // if ( wd == -1 )
+			else {
+				fprintf( stderr, "Failed to watch %s: returned wd was %d "
+				         "(expected -1 or >0 )", filenames[i], wd );
+				// no appropriate value for error
+				return 0;
+			} // else
+		} // if ( wd < 0 )
+
+		char *filename;
+		// Always end filename with / if it is a directory
+		if ( filenames[i][strlen(filenames[i])-1] == '/'
+		     || !isdir(filenames[i]) ) {
+			filename = strdup(filenames[i]);
+		}
+		else {
+			nasprintf( &filename, "%s/", filenames[i] );
+		}
+		create_watch(ctx, wd, filename);
+		free(filename);
+	} // for
+
+	return 1;
+}
+
+/**
+ * @internal
+ * @return 1 if at least one complete event read from inotify has not been
+ *         handed out yet, 0 otherwise.
+ */
+static int buffered_event_available( inotifytools_ctx *ctx ) {
+	return ctx->first_byte + (ssize_t)sizeof(struct inotify_event) <= ctx->bytes;
+}
+
+/**
+ * @internal
+ * Hand out the next event from the event buffer.
+ *
+ * @return pointer to the next event, or NULL if the buffer is exhausted.
+ */
+static struct inotify_event * next_buffered_event( inotifytools_ctx *ctx ) {
+	struct inotify_event * ret;
+
+	if ( !buffered_event_available( ctx ) ) {
+		ctx->first_byte = 0;
+		ctx->bytes = 0;
+		return NULL;
+	}
+
+	ret = (struct inotify_event *)(ctx->event_buf + ctx->first_byte);
+	ctx->first_byte += sizeof(struct inotify_event) + ret->len;
+	niceassert( ctx->first_byte <= ctx->bytes, "ridiculously long filename, "
+	            "things will almost certainly screw up." );
+
+	// if the pointer to the next event exactly hits end of bytes read,
+	// that's good.  next time we're called, we'll read.
+	if ( ctx->first_byte >= ctx->bytes ) {
+		ctx->first_byte = 0;
+		ctx->bytes = 0;
+	}
+	return ret;
+}
+
+/**
+ * @internal
+ * @return the current time of the monotonic clock, in milliseconds.
+ */
+static long long now_ms() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * @internal
+ * @return the current time of the monotonic clock, in nanoseconds.
+ */
+static long long now_ns() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @internal
+ * Add @a value to histogram @a h.
+ */
+static void histogram_add( struct inotifytools_histogram *h,
+                           unsigned long long value ) {
+	++h->count;
+	h->sum += value;
+	if ( value > h->max ) h->max = value;
+	int i = value ? 64 - __builtin_clzll( value ) : 0;
+	if ( i >= INOTIFYTOOLS_HISTOGRAM_BUCKETS ) {
+		i = INOTIFYTOOLS_HISTOGRAM_BUCKETS - 1;
+	}
+	++h->buckets[i];
+}
+
+/**
+ * @internal
+ * Add the time since @a start, as returned by now_ns(), to histogram @a h.
+ */
+static void histogram_add_since( struct inotifytools_histogram *h,
+                                 long long start ) {
+	histogram_add( h, now_ns() - start );
+}
+
+/**
+ * @internal
+ * @return milliseconds left until @a deadline (as returned by now_ms()), or 0
+ *         if it has passed.
+ */
+static long remaining_ms( long long deadline ) {
+	long long left = deadline - now_ms();
+	return left > 0 ? (long)left : 0;
+}
+
+/**
+ * @internal
+ * Wait on the epoll instance for inotify to become readable.
+ *
+ * The inotify fd is registered edge-triggered, so this only returns when new
+ * events are queued (or the timeout expires), never just because events
+ * which were already queued are still there.  The worker thread of
+ * inotifytools_watch_recursively_async() wakes it up too.
+ *
+ * @param timeout_ms maximum time to wait in milliseconds; negative blocks.
+ *
+ * @return 1 if woken up, 0 on timeout or if the fd given to
+ *         inotifytools_set_wake_fd() is readable, -1 on error (@a error is
+ *         set, e.g. to EINTR if a signal arrived).
+ */
+static int wait_for_inotify( inotifytools_ctx *ctx, long timeout_ms ) {
+	struct epoll_event ev;
+	int rc;
+
+	long long start = ctx->metrics ? now_ns() : 0;
+	rc = epoll_wait( ctx->epoll_fd, &ev, 1,
+	                 timeout_ms < 0 ? -1 :
+	                 timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms );
+	if ( ctx->metrics ) histogram_add_since( &ctx->metrics->wait_ns, start );
+	if ( rc < 0 ) {
+		ctx->error = errno;
+		return -1;
+	}
+	if ( rc && ev.data.fd == ctx->wake_fd ) return 0;
+	return rc;
+}
+
+/**
+ * @internal
+ * @return 1 if the fd given to inotifytools_set_wake_fd() is readable, 0
+ *         otherwise.
+ */
+static int wake_pending( inotifytools_ctx *ctx ) {
+	if ( ctx->wake_fd < 0 ) return 0;
+	struct pollfd fd;
+	fd.fd = ctx->wake_fd;
+	fd.events = POLLIN;
+	return poll( &fd, 1, 0 ) > 0;
+}
+
+/**
+ * @internal
+ * @return number of bytes queued on the inotify fd, or -1 on error.
+ */
+static int queued_bytes( inotifytools_ctx *ctx ) {
+	unsigned int bytes_to_read;
+
+	if ( ctx->backend->queued ) {
+		int bytes = ctx->backend->queued( ctx->backend_data, ctx->inotify_fd );
+		if ( bytes < 0 ) ctx->error = errno;
+		return bytes;
+	}
+	if ( -1 == ioctl( ctx->inotify_fd, FIONREAD, &bytes_to_read ) ) {
+		ctx->error = errno;
+		return -1;
+	}
+	return (int)bytes_to_read;
+}
+
+/**
+ * @internal
+ * Resize the event buffer of @a ctx, which must be empty, so that it holds
+ * @a want bytes: its size is doubled until it does, but kept within the
+ * limit set with inotifytools_set_read_buffer().  If there is not enough
+ * memory, the buffer is left as it is.
+ */
+static void read_buf_fit( inotifytools_ctx *ctx, size_t want ) {
+	size_t size = ctx->event_buf_size;
+	while ( size < want && size < ctx->event_buf_limit ) size *= 2;
+	if ( size > ctx->event_buf_limit ) size = ctx->event_buf_limit;
+	if ( size == ctx->event_buf_size ) return;
+	char *buf = (char *)realloc( ctx->event_buf, size );
+	if ( !buf ) return;
+	ctx->event_buf = buf;
+	ctx->event_buf_size = size;
+}
+
+/**
+ * @internal
+ * A ring buffer of events filled by a reader thread; see
+ * inotifytools_start_reader().  There is one producer, the reader thread,
+ * and one consumer, the thread reading events from the context, so no locks
+ * are needed: @a head is only written by the reader thread and @a tail only
+ * by the consumer, and each publishes the records before or after it with
+ * release stores.
+ *
+ * Records are struct inotify_event with their names, as read from inotify,
+ * which pads every record to a multiple of sizeof(struct inotify_event).
+ * The reader thread reads straight into the free space of the ring; where
+ * that wraps around, the space left at the end is filled with a record
+ * whose @a mask is 0, which the consumer skips.
+ *
+ * When the ring has no room, the reader thread stops reading from inotify,
+ * so that events wait in the kernel's queue, sets @a waiting and waits on
+ * @a space_fd, which the consumer writes once it has taken events.
+ * @a waiting is set before the reader thread looks at @a tail again, and
+ * the consumer looks at it after storing @a tail, so one of them always
+ * sees the other.
+ */
+struct event_ring {
+	char *buf;
+	size_t size;
+	size_t head;
+	size_t tail;
+	/* Number of events written and taken, for the depth of the ring.
+	 * @a high_water is only written by the reader thread. */
+	long long pushed;
+	long long popped;
+	long long high_water;
+	/* Set by the reader thread while it waits for room in the ring. */
+	int waiting;
+	/* errno of the read which ended the reader thread. */
+	int error;
+	int fd;
+	/* Written by the reader thread whenever it adds events. */
+	int data_fd;
+	/* Written by the consumer when it takes events while @a waiting. */
+	int space_fd;
+	/* Written to make the reader thread exit. */
+	int stop_fd;
+	pthread_t thread;
+};
+
+/**
+ * @internal
+ * @return number of bytes from @a pos to the end of the record there.
+ */
+static size_t ring_record_size( struct event_ring *r, size_t pos ) {
+	struct inotify_event *event =
+		(struct inotify_event *)(r->buf + (pos & (r->size - 1)));
+	return sizeof(struct inotify_event) + event->len;
+}
+
+/**
+ * @internal
+ * @return number of contiguous bytes free at the head of the ring, once
+ *         wrapped around if needed, for a ring whose tail is at @a tail.
+ */
+static size_t ring_room( struct event_ring *r, size_t tail ) {
+	size_t room = r->size - (r->head - tail);
+	size_t contig = r->size - (r->head & (r->size - 1));
+	if ( contig < READ_BUFFER_MIN ) {
+		contig = room >= contig ? room - contig : 0;
+	}
+	return contig > room ? room : contig;
+}
+
+/**
+ * @internal
+ * Read a batch of events into the ring, unless there is no room.
+ *
+ * @return 0 on success, -1 if the ring has no room for a read, or an errno
+ *         value if reading failed.
+ */
+static int ring_fill( struct event_ring *r ) {
+	size_t tail = __atomic_load_n( &r->tail, __ATOMIC_ACQUIRE );
+	if ( ring_room( r, tail ) < READ_BUFFER_MIN ) {
+		__atomic_store_n( &r->waiting, 1, __ATOMIC_SEQ_CST );
+		tail = __atomic_load_n( &r->tail, __ATOMIC_SEQ_CST );
+		if ( ring_room( r, tail ) < READ_BUFFER_MIN ) return -1;
+	}
+
+	size_t head = r->head;
+	size_t room = r->size - (head - tail);
+	size_t contig = r->size - (head & (r->size - 1));
+	struct inotify_event *event;
+	int events = 0;
+
+	// wrap around if the space left at the end is too small
+	if ( contig < READ_BUFFER_MIN ) {
+		event = (struct inotify_event *)(r->buf + (head & (r->size - 1)));
+		memset( event, 0, sizeof(struct inotify_event) );
+		event->len = contig - sizeof(struct inotify_event);
+		head += contig;
+		room -= contig;
+		contig = r->size;
+	}
+	if ( contig > room ) contig = room;
+
+	ssize_t bytes = read( r->fd, r->buf + (head & (r->size - 1)), contig );
+	if ( bytes < 0 && errno != EAGAIN && errno != EINTR ) return errno;
+	if ( bytes > 0 ) {
+		size_t end = head + bytes;
+		while ( head < end ) {
+			head += ring_record_size( r, head );
+			++events;
+		}
+	}
+	if ( !events ) return 0;
+
+	__atomic_store_n( &r->head, head, __ATOMIC_RELEASE );
+	long long pushed = r->pushed + events;
+	__atomic_store_n( &r->pushed, pushed, __ATOMIC_RELAXED );
+	long long depth = pushed - __atomic_load_n( &r->popped, __ATOMIC_RELAXED );
+	if ( depth > r->high_water ) {
+		__atomic_store_n( &r->high_water, depth, __ATOMIC_RELAXED );
+	}
+	eventfd_write( r->data_fd, 1 );
+	return 0;
+}
+
+/**
+ * @internal
+ * Body of the reader thread: move events from inotify into the ring until
+ * told to stop or reading fails, waiting for the consumer whenever the ring
+ * is full.
+ */
+static void * ring_reader( void *arg ) {
+	struct event_ring *r = (struct event_ring *)arg;
+	struct pollfd fds[2];
+	int full = 0;
+	fds[0].events = POLLIN;
+	fds[1].fd = r->stop_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		int error = 0;
+		fds[0].fd = full ? r->space_fd : r->fd;
+		if ( poll( fds, 2, -1 ) < 0 ) {
+			if ( errno != EINTR ) error = errno;
+		}
+		else if ( fds[1].revents ) {
+			return NULL;
+		}
+		else if ( fds[0].revents && full ) {
+			eventfd_t count;
+			eventfd_read( r->space_fd, &count );
+			full = 0;
+		}
+		else if ( fds[0].revents ) {
+			error = ring_fill( r );
+			full = error < 0;
+			if ( full ) error = 0;
+		}
+		if ( error ) {
+			__atomic_store_n( &r->error, error, __ATOMIC_RELEASE );
+			eventfd_write( r->data_fd, 1 );
+			return NULL;
+		}
+	}
+}
+
+/**
+ * @internal
+ * Wait for the reader thread to add events to the ring, or for the worker
+ * thread of inotifytools_watch_recursively_async() to find something.
+ *
+ * @param timeout_ms maximum time to wait in milliseconds; negative blocks.
+ *
+ * @return 1 if woken up by either thread, 0 on timeout or if the fd given
+ *         to inotifytools_set_wake_fd() is readable, -1 on error (@a error
+ *         is set).
+ */
+static int ring_wait( inotifytools_ctx *ctx, long timeout_ms ) {
+	struct pollfd fd[3];
+	fd[0].fd = ctx->ring->data_fd;
+	fd[0].events = POLLIN;
+	fd[1].fd = ctx->async ? async_wake_fd( ctx ) : -1;
+	fd[1].events = POLLIN;
+	fd[2].fd = ctx->wake_fd;
+	fd[2].events = POLLIN;
+	long long start = ctx->metrics ? now_ns() : 0;
+	int rc = poll( fd, 3, timeout_ms < 0 ? -1 :
+	               timeout_ms > INT_MAX ? INT_MAX : (int)timeout_ms );
+	if ( ctx->metrics ) histogram_add_since( &ctx->metrics->wait_ns, start );
+	if ( rc < 0 ) {
+		ctx->error = errno;
+		return -1;
+	}
+	if ( rc && fd[2].revents ) return 0;
+	if ( rc ) {
+		eventfd_t count;
+		eventfd_read( ctx->ring->data_fd, &count );
+		if ( ctx->async ) eventfd_read( async_wake_fd( ctx ), &count );
+	}
+	return rc;
+}
+
+/**
+ * @internal
+ * @return number of bytes of records in the ring.
+ */
+static size_t ring_used( struct event_ring *r ) {
+	return __atomic_load_n( &r->head, __ATOMIC_ACQUIRE ) - r->tail;
+}
+
+/**
+ * @internal
+ * Like read_inotify_events(), but take the events from the ring filled by
+ * the reader thread.
+ */
+static int ring_read( inotifytools_ctx *ctx, long timeout_ms,
+                      int num_events, long max_latency_ms ) {
+	struct event_ring *r = ctx->ring;
+	long long timeout_deadline = 0, deadline = 0;
+	size_t used;
+	int rc;
+
+	if ( timeout_ms >= 0 ) timeout_deadline = now_ms() + timeout_ms;
+	for (;;) {
+		// wait for the first event
+		while ( 0 == (used = ring_used( r )) ) {
+			int error = __atomic_load_n( &r->error, __ATOMIC_ACQUIRE );
+			if ( error ) {
+				ctx->error = error;
+				return 0;
+			}
+			rc = ring_wait( ctx, timeout_ms < 0 ? -1 :
+			                remaining_ms( timeout_deadline ) );
+			if ( rc > 0 && ctx->async && async_read( ctx ) ) return 1;
+			if ( rc <= 0 ) return 0;
+		}
+
+		// wait for more, as read_inotify_events() does, but no more than
+		// the reader thread can add before it waits for room
+		size_t wanted = sizeof(struct inotify_event)*num_events;
+		if ( wanted > ctx->event_buf_limit ) wanted = ctx->event_buf_limit;
+		if ( wanted > r->size - 2 * READ_BUFFER_MIN ) {
+			wanted = r->size - 2 * READ_BUFFER_MIN;
+		}
+		if ( max_latency_ms >= 0 ) deadline = now_ms() + max_latency_ms;
+		while ( max_latency_ms != 0 && used && used < wanted ) {
+			rc = ring_wait( ctx, max_latency_ms < 0 ? -1 :
+			                remaining_ms( deadline ) );
+			if ( rc < 0 ) return 0;
+			if ( rc == 0 ) break;
+			used = ring_used( r );
+		}
+
+		read_buf_fit( ctx, used );
+		size_t pos = r->tail, end = pos + used;
+		ssize_t bytes = 0;
+		long long events = 0;
+		while ( pos < end ) {
+			struct inotify_event *event =
+				(struct inotify_event *)(r->buf + (pos & (r->size - 1)));
+			size_t size = sizeof(struct inotify_event) + event->len;
+			if ( event->mask ) {
+				if ( (size_t)bytes + size > ctx->event_buf_size ) break;
+				memcpy( ctx->event_buf + bytes, event, size );
+				bytes += size;
+				++events;
+			}
+			pos += size;
+		}
+		__atomic_store_n( &r->tail, pos, __ATOMIC_SEQ_CST );
+		__atomic_store_n( &r->popped, r->popped + events, __ATOMIC_RELAXED );
+		if ( __atomic_exchange_n( &r->waiting, 0, __ATOMIC_SEQ_CST ) ) {
+			eventfd_write( r->space_fd, 1 );
+		}
+		if ( !bytes ) continue;
+
+		ctx->bytes = bytes;
+		ctx->read_full = (size_t)bytes + READ_BUFFER_MIN > ctx->event_buf_size;
+		++ctx->num_reads;
+		ctx->num_events_read += events;
+		if ( ctx->metrics ) {
+			histogram_add( &ctx->metrics->read_events, events );
+			histogram_add( &ctx->metrics->read_bytes, bytes );
+		}
+		if ( ctx->async ) async_collect( ctx );
+		return 1;
+	}
+}
+
+/**
+ * @internal
+ * Stop the reader thread of @a ctx and free its ring, with any events still
+ * in it.
+ */
+static void ring_stop( inotifytools_ctx *ctx ) {
+	struct event_ring *r = ctx->ring;
+	if ( !r ) return;
+	eventfd_write( r->stop_fd, 1 );
+	pthread_join( r->thread, NULL );
+	close( r->data_fd );
+	close( r->space_fd );
+	close( r->stop_fd );
+	free( r->buf );
+	free( r );
+	ctx->ring = NULL;
+}
+
+/**
+ * @internal
+ * Wait for events and read as many as fit into the (empty) event buffer.
+ *
+ * @param timeout_ms maximum time in milliseconds to wait for the first event.
+ *                   0 means don't wait at all, negative blocks until an event
+ *                   occurs.
+ *
+ * @param num_events number of events to wait for once the first event is
+ *                   available; see inotifytools_next_events_ms().
+ *
+ * @param max_latency_ms maximum time in milliseconds to wait for
+ *                       @a num_events events once the first event is
+ *                       available.  Negative waits as long as it takes.
+ *
+ * @return 1 if events were read, 0 on timeout or error.  On error, @a error
+ *         is set.
+ */
+static int read_inotify_events( inotifytools_ctx *ctx, long timeout_ms,
+                                int num_events, long max_latency_ms ) {
+	ssize_t this_bytes;
+	int queued, rc;
+	long long timeout_deadline, deadline;
+	unsigned int wanted;
+
+	ctx->first_byte = 0;
+	ctx->bytes = 0;
+
+	if ( ctx->async && async_read( ctx ) ) return 1;
+	if ( ctx->ring ) {
+		return ring_read( ctx, timeout_ms, num_events, max_latency_ms );
+	}
+
+	if ( timeout_ms >= 0 ) timeout_deadline = now_ms() + timeout_ms;
+	do {
+		// wait for the first event
+		while ( 0 == (queued = queued_bytes( ctx )) ) {
+			rc = wait_for_inotify( ctx, timeout_ms < 0 ? -1 :
+			                       remaining_ms( timeout_deadline ) );
+			if ( rc < 0 ) return 0;
+			if ( ctx->async && async_read( ctx ) ) return 1;
+			// timeout
+			if ( rc == 0 ) return 0;
+		}
+		if ( queued < 0 ) return 0;
+
+		// wait until we have enough bytes to read, or until the latency
+		// budget is used up.  Each wakeup means at least one new event was
+		// queued.
+		wanted = sizeof(struct inotify_event)*num_events;
+		if ( wanted > ctx->event_buf_limit ) wanted = ctx->event_buf_limit;
+		if ( max_latency_ms >= 0 ) deadline = now_ms() + max_latency_ms;
+		while ( max_latency_ms != 0 && (unsigned int)queued < wanted ) {
+			rc = wait_for_inotify( ctx, max_latency_ms < 0 ? -1 :
+			                       remaining_ms( deadline ) );
+			if ( rc < 0 ) return 0;
+			if ( rc == 0 ) break;
+			queued = queued_bytes( ctx );
+			if ( queued < 0 ) return 0;
+		}
+
+		// make room for everything queued, or more than last time if the
+		// previous read filled the buffer
+		read_buf_fit( ctx, ctx->read_full && ctx->event_buf_size > (size_t)queued ?
+		                   2 * ctx->event_buf_size : (size_t)queued );
+		this_bytes = ctx->backend->read( ctx, ctx->backend_data,
+		                                 ctx->inotify_fd, ctx->event_buf,
+		                                 ctx->event_buf_size );
+		// the backend filtered out everything it read
+	} while ( this_bytes < 0 && errno == EAGAIN );
+
+	if ( this_bytes < 0 ) {
+		ctx->error = errno;
+		return 0;
+	}
+	if ( this_bytes == 0 ) {
+		fprintf(stderr, "Inotify reported end-of-file.  Possibly too many "
+		                "events occurred at once.\n");
+		return 0;
+	}
+	ctx->bytes = this_bytes;
+	ctx->read_full = (size_t)this_bytes + READ_BUFFER_MIN > ctx->event_buf_size;
+	++ctx->num_reads;
+	ssize_t i;
+	long long events = 0;
+	for ( i = 0; i + (ssize_t)sizeof(struct inotify_event) <= this_bytes;
+	      i += sizeof(struct inotify_event) +
+	           ((struct inotify_event *)(ctx->event_buf + i))->len ) {
+		++events;
+	}
+	ctx->num_events_read += events;
+	if ( ctx->metrics ) {
+		histogram_add( &ctx->metrics->read_events, events );
+		histogram_add( &ctx->metrics->read_bytes, this_bytes );
+	}
+	// register the watches these events may be for
+	if ( ctx->async ) async_collect( ctx );
+	return 1;
+}
+
+/**
+ * @internal
+ * @return 1 if the path of @a event is ignored by the patterns given to
+ *         inotifytools_add_filter() or inotifytools_ignore_events_by_regex(),
+ *         or if the event duplicates one synthesized by
+ *         inotifytools_watch_recursively_async(), 0 otherwise.  Queue
+ *         overflows are never ignored.
+ */
+static int event_is_ignored( inotifytools_ctx *ctx,
+                             struct inotify_event * event ) {
+	if ( ctx->async && (async_is_self( ctx, event ) ||
+	                    async_is_duplicate( ctx, event )) ) {
+		return 1;
+	}
+	if ( !ctx->filter || (event->mask & IN_Q_OVERFLOW) ) return 0;
+	long long start = ctx->metrics ? now_ns() : 0;
+	char const * name = event->len ? event->name : "";
+	// the path of the watch is only built if the name isn't enough
+	char const * dir = NULL;
+	if ( inotifytools_filter_needs_dir( ctx->filter, strlen( name ) ) ) {
+		watch * w = watch_from_wd( ctx, event->wd );
+		dir = w ? path_str( ctx, w->node ) : "";
+	}
+	int match = inotifytools_filter_ignores( ctx->filter, dir, name,
+	                                         ctx->match_name, MAX_STRLEN );
+	if ( ctx->metrics ) histogram_add_since( &ctx->metrics->regex_ns, start );
+	return match;
+}
+
+/**
+ * Events which inotifytools_set_coalesce_ms() merges into an earlier event
+ * on the same file.  Any other event ends the run of events being merged.
+ */
+#define COALESCE_EVENTS ( IN_ACCESS | IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                          IN_CLOSE_NOWRITE | IN_OPEN | IN_ISDIR )
+/** Initial number of buckets of the table of open held events. */
+#define COALESCE_BUCKETS 64
+
+/**
+ * @internal
+ * An event held back by the coalescing stage.  The event and its name are
+ * stored right after this header.  While @a open, events on the same watch
+ * and name are merged into it; open events are also chained into the
+ * buckets of struct coalesce by @a hash.
+ */
+struct held_event {
+	struct held_event *next;
+	struct held_event *chain;
+	struct inotify_event *event;
+	long long due;
+	unsigned hash;
+	int open;
+};
+
+/**
+ * @internal
+ * The coalescing stage of one context.  Held events are kept in arrival
+ * order from @a head to @a tail; since they are all held for the same time,
+ * this is also the order they become due in.  @a handed lists those handed
+ * out by the last call, which the caller may still be looking at.
+ */
+struct coalesce {
+	struct held_event *head;
+	struct held_event *tail;
+	struct held_event *handed;
+	struct held_event **buckets;
+	unsigned num_buckets;
+	unsigned num_open;
+};
+
+/**
+ * @internal
+ * @return hash of the watch descriptor and name events are merged by.
+ */
+static unsigned coalesce_hash( int wd, char const * name ) {
+	unsigned hash = 2166136261u ^ (unsigned)wd;
+	hash *= 16777619u;
+	for ( ; *name; ++name ) {
+		hash ^= (unsigned char)*name;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * @internal
+ * Remove @a held from the table of open events, so nothing is merged into
+ * it any more.
+ */
+static void coalesce_close( struct coalesce *c, struct held_event *held ) {
+	struct held_event **link = &c->buckets[held->hash & (c->num_buckets - 1)];
+	while ( *link != held ) link = &(*link)->chain;
+	*link = held->chain;
+	held->open = 0;
+	--c->num_open;
+}
+
+/**
+ * @internal
+ * Double the number of buckets of the table of open events.
+ */
+static void coalesce_grow( struct coalesce *c ) {
+	unsigned num = c->num_buckets * 2;
+	struct held_event **buckets =
+		(struct held_event **)calloc( num, sizeof(*buckets) );
+	niceassert( buckets, "out of memory" );
+	unsigned i;
+	for ( i = 0; i < c->num_buckets; ++i ) {
+		struct held_event *held, *chain;
+		for ( held = c->buckets[i]; held; held = chain ) {
+			chain = held->chain;
+			held->chain = buckets[held->hash & (num - 1)];
+			buckets[held->hash & (num - 1)] = held;
+		}
+	}
+	free( c->buckets );
+	c->buckets = buckets;
+	c->num_buckets = num;
+}
+
+/**
+ * @internal
+ * Pass @a event through the coalescing stage: merge it into the open held
+ * event for the same watch and name, or hold back a copy of it.
+ *
+ * Only events in COALESCE_EVENTS are merged.  Any other event is held on
+ * its own and ends merging into earlier events on the same file, so that
+ * nothing is reordered across it; in particular each IN_MOVED_FROM stays
+ * right in front of its IN_MOVED_TO.  Events following IN_CREATE or
+ * IN_MOVED_TO on the new file are merged into it, and events on a watch are
+ * no longer merged once it is removed, since its descriptor may be reused.
+ */
+static void coalesce_add( inotifytools_ctx *ctx,
+                          struct inotify_event * event ) {
+	if ( !ctx->coalesce ) {
+		ctx->coalesce = (struct coalesce *)calloc( 1, sizeof(struct coalesce) );
+		niceassert( ctx->coalesce, "out of memory" );
+	}
+	struct coalesce *c = ctx->coalesce;
+	if ( !c->buckets ) {
+		c->buckets = (struct held_event **)calloc( COALESCE_BUCKETS,
+		                                           sizeof(*c->buckets) );
+		niceassert( c->buckets, "out of memory" );
+		c->num_buckets = COALESCE_BUCKETS;
+	}
+
+	unsigned hash = coalesce_hash( event->wd, event->len ? event->name : "" );
+	struct held_event *held;
+	for ( held = c->buckets[hash & (c->num_buckets - 1)]; held;
+	      held = held->chain ) {
+		if ( held->hash == hash && held->event->wd == event->wd &&
+		     0 == strcmp( held->event->len ? held->event->name : "",
+		                  event->len ? event->name : "" ) ) {
+			break;
+		}
+	}
+	if ( held && !(event->mask & ~COALESCE_EVENTS) ) {
+		held->event->mask |= event->mask;
+		return;
+	}
+	if ( held ) coalesce_close( c, held );
+	if ( event->mask & (IN_IGNORED | IN_Q_OVERFLOW) ) {
+		for ( held = c->head; held; held = held->next ) {
+			if ( held->open && ((event->mask & IN_Q_OVERFLOW) ||
+			                    held->event->wd == event->wd) ) {
+				coalesce_close( c, held );
+			}
+		}
+	}
+
+	held = (struct held_event *)malloc( sizeof(struct held_event) +
+	                                    sizeof(struct inotify_event) +
+	                                    event->len );
+	niceassert( held, "out of memory" );
+	held->event = (struct inotify_event *)(held + 1);
+	memcpy( held->event, event, sizeof(struct inotify_event) + event->len );
+	held->due = now_ms() + ctx->coalesce_ms;
+	held->hash = hash;
+	held->next = NULL;
+	held->open = !(event->mask & ~(COALESCE_EVENTS | IN_CREATE | IN_MOVED_TO));
+	if ( held->open ) {
+		if ( c->num_open >= c->num_buckets ) coalesce_grow( c );
+		held->chain = c->buckets[hash & (c->num_buckets - 1)];
+		c->buckets[hash & (c->num_buckets - 1)] = held;
+		++c->num_open;
+	}
+	if ( c->tail ) c->tail->next = held;
+	else c->head = held;
+	c->tail = held;
+}
+
+/**
+ * @internal
+ * @return 1 if the oldest held event is due to be handed out, 0 otherwise.
+ *         Once coalescing is disabled, every held event is due.
+ */
+static int coalesce_due( inotifytools_ctx *ctx ) {
+	struct coalesce *c = ctx->coalesce;
+	return c && c->head && (!ctx->coalesce_ms || c->head->due <= now_ms());
+}
+
+/**
+ * @internal
+ * Hand out the oldest held event.  It stays valid until the next call
+ * returning events.
+ */
+static struct inotify_event * coalesce_pop( inotifytools_ctx *ctx ) {
+	struct coalesce *c = ctx->coalesce;
+	struct held_event *held = c->head;
+	c->head = held->next;
+	if ( !c->head ) c->tail = NULL;
+	if ( held->open ) coalesce_close( c, held );
+	held->next = c->handed;
+	c->handed = held;
+	return held->event;
+}
+
+/**
+ * @internal
+ * Free the events handed out by the last call returning events.
+ */
+static void coalesce_release( inotifytools_ctx *ctx ) {
+	struct held_event *held, *next;
+	for ( held = ctx->coalesce->handed; held; held = next ) {
+		next = held->next;
+		free( held );
+	}
+	ctx->coalesce->handed = NULL;
+}
+
+/**
+ * @internal
+ * Free the coalescing stage of @a ctx, including events still held back.
+ */
+static void coalesce_free( inotifytools_ctx *ctx ) {
+	if ( !ctx->coalesce ) return;
+	coalesce_release( ctx );
+	struct held_event *held, *next;
+	for ( held = ctx->coalesce->head; held; held = next ) {
+		next = held->next;
+		free( held );
+	}
+	free( ctx->coalesce->buckets );
+	free( ctx->coalesce );
+	ctx->coalesce = NULL;
+}
+
+/**
+ * @internal
+ * Get the next event which is not ignored, tallying statistics and
+ * rescanning on overflow.  This is inotifytools_next_events_ms() without the
+ * coalescing stage.
+ */
+static struct inotify_event * next_event_ms( inotifytools_ctx *ctx,
+                                             long timeout_ms, int num_events,
+                                             long max_latency_ms ) {
+	struct inotify_event * ret;
+
+	do {
+		if ( !buffered_event_available( ctx ) &&
+		     !read_inotify_events( ctx, timeout_ms, num_events, max_latency_ms ) ) {
+			return NULL;
+		}
+		ret = next_buffered_event( ctx );
+	} while ( !ret || event_is_ignored( ctx, ret ) );
+
+	if ( ctx->collect_stats ) {
+		record_stats( ctx, ret );
+	}
+	if ( ctx->reach ) reach_mark( ctx, ret->wd );
+	if ( ctx->rescan && (ret->mask & IN_Q_OVERFLOW) ) {
+		inotifytools_ctx_rescan( ctx );
+	}
+	return ret;
+}
+
+/**
+ * @internal
+ * Feed events into the coalescing stage until the oldest held event is due.
+ *
+ * @param timeout_ms maximum time in milliseconds to wait; negative blocks.
+ *
+ * @param num_events, max_latency_ms see inotifytools_next_events_ms().
+ *
+ * @return 1 if a held event is due, 0 on timeout or error.  On error,
+ *         @a error is set.
+ */
+static int coalesce_wait( inotifytools_ctx *ctx, long timeout_ms,
+                          int num_events, long max_latency_ms ) {
+	long long deadline = 0;
+	struct inotify_event * event;
+
+	if ( timeout_ms >= 0 ) deadline = now_ms() + timeout_ms;
+	for (;;) {
+		// take in everything which can be had without waiting
+		ctx->error = 0;
+		while ( !coalesce_due( ctx ) &&
+		        (event = next_event_ms( ctx, 0, 1, 0 )) ) {
+			coalesce_add( ctx, event );
+		}
+		if ( ctx->error ) return 0;
+		if ( coalesce_due( ctx ) ) return 1;
+
+		long wait = -1;
+		if ( ctx->coalesce && ctx->coalesce->head ) {
+			wait = remaining_ms( ctx->coalesce->head->due );
+		}
+		if ( timeout_ms >= 0 ) {
+			long left = remaining_ms( deadline );
+			if ( !left ) return 0;
+			if ( wait < 0 || left < wait ) wait = left;
+		}
+		ctx->error = 0;
+		event = next_event_ms( ctx, wait, num_events, max_latency_ms );
+		if ( event ) coalesce_add( ctx, event );
+		else if ( ctx->error || wake_pending( ctx ) ) return 0;
+	}
+}
+
+/**
+ * Get the next inotify event to occur.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param timeout maximum amount of time, in seconds, to wait for an event.
+ *                If @a timeout is 0, the function is non-blocking.  If
+ *                @a timeout is negative, the function will block until an
+ *                event occurs.
+ *
+ * @return pointer to an inotify event, or NULL if function timed out before
+ *         an event occurred.  The event is located in static storage and it
+ *         may be overwritten in subsequent calls; do not call free() on it,
+ *         and make a copy if you want to keep it.
+ *
+ * @note Your program should call this function or
+ *       inotifytools_next_events() frequently; between calls to this function,
+ *       inotify events will be queued in the kernel, and eventually the queue
+ *       will overflow and you will miss some events.
+ *
+ * @note If the function inotifytools_ignore_events_by_regex() has been called
+ *       with a non-NULL parameter, this function will not return on events
+ *       which match the regular expression passed to that function.  However,
+ *       the @a timeout period begins again each time a matching event occurs.
+ */
+struct inotify_event * inotifytools_next_event( int timeout ) {
+	return inotifytools_ctx_next_event( &default_ctx, timeout );
+}
+
+/**
+ * Like inotifytools_next_event(), but operates on @a ctx.
+ */
+struct inotify_event * inotifytools_ctx_next_event( inotifytools_ctx *ctx,
+                                                    int timeout ) {
+	return inotifytools_ctx_next_events( ctx, timeout, 1 );
+}
+
+
+/**
+ * Get the next inotify events to occur.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param timeout maximum amount of time, in seconds, to wait for an event.
+ *                If @a timeout is 0, the function is non-blocking.  If
+ *                @a timeout is negative, the function will block until an
+ *                event occurs.
+ *
+ * @param num_events approximate number of inotify events to wait for until
+ *                   this function returns.  Use this for buffering reads to
+ *                   inotify if you expect to receive large amounts of events.
+ *                   You are NOT guaranteed that this number of events will
+ *                   actually be read; instead, you are guaranteed that the
+ *                   number of bytes read from inotify is
+ *                   @a num_events * sizeof(struct inotify_event).  Obviously
+ *                   the larger this number is, the greater the latency between
+ *                   when an event occurs and when you'll know about it.
+ *                   No more is waited for than fits into the limit set with
+ *                   inotifytools_set_read_buffer().
+ *
+ * @return pointer to an inotify event, or NULL if function timed out before
+ *         an event occurred or @a num_events < 1.  The event is located in
+ *         static storage and it may be overwritten in subsequent calls; do not
+ *         call free() on it, and make a copy if you want to keep it.
+ *         When @a num_events is greater than 1, this will return a pointer to
+ *         the first event only, and you MUST call this function again to
+ *         get pointers to subsequent events; don't try to add to the pointer
+ *         to find the next events or you will run into trouble.
+ *
+ * @note You may actually get different events with different values of
+ *       @a num_events.  This is because inotify does some in-kernel filtering
+ *       of duplicate events, meaning some duplicate events will not be
+ *       reported if @a num_events > 1.  For some purposes this is fine, but
+ *       for others (such as gathering accurate statistics on numbers of event
+ *       occurrences) you must call this function with @a num_events = 1, or
+ *       simply use inotifytools_next_event().
+ *
+ * @note Your program should call this function or
+ *       inotifytools_next_events() frequently; between calls to this function,
+ *       inotify events will be queued in the kernel, and eventually the queue
+ *       will overflow and you will miss some events.
+ *
+ * @note If the function inotifytools_ignore_events_by_regex() has been called
+ *       with a non-NULL parameter, this function will not return on events
+ *       which match the regular expression passed to that function.  However,
+ *       the @a timeout period begins again each time a matching event occurs.
+ */
+struct inotify_event * inotifytools_next_events( int timeout, int num_events ) {
+	return inotifytools_ctx_next_events( &default_ctx, timeout, num_events );
+}
+
+/**
+ * Like inotifytools_next_events(), but operates on @a ctx.
+ */
+struct inotify_event * inotifytools_ctx_next_events( inotifytools_ctx *ctx,
+                                                     int timeout,
+                                                     int num_events ) {
+	return inotifytools_ctx_next_events_ms( ctx,
+	                                        timeout <= 0 ? -1 : timeout * 1000L,
+	                                        num_events, -1 );
+}
+
+/**
+ * Get the next inotify events to occur, with millisecond timeouts.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * This works like inotifytools_next_events(), but waiting is done in
+ * milliseconds and the wait for @a num_events events can be bounded, which
+ * allows trading latency for batch size: the function returns as soon as
+ * @a num_events events are queued or @a max_latency_ms milliseconds have
+ * passed since the first event became available, whichever comes first.
+ *
+ * @param timeout_ms maximum amount of time, in milliseconds, to wait for an
+ *                   event.  If @a timeout_ms is 0, the function is
+ *                   non-blocking.  If @a timeout_ms is negative, the function
+ *                   will block until an event occurs.
+ *
+ * @param num_events approximate number of inotify events to wait for until
+ *                   this function returns; see inotifytools_next_events().
+ *
+ * @param max_latency_ms maximum amount of time, in milliseconds, to wait for
+ *                       @a num_events events once the first event is
+ *                       available.  If negative, wait until @a num_events
+ *                       events are available, as inotifytools_next_events()
+ *                       does.
+ *
+ * @return pointer to an inotify event, or NULL if function timed out before
+ *         an event occurred or @a num_events < 1.  See
+ *         inotifytools_next_events() for details.
+ */
+struct inotify_event * inotifytools_next_events_ms( long timeout_ms,
+                                                    int num_events,
+                                                    long max_latency_ms ) {
+	return inotifytools_ctx_next_events_ms( &default_ctx, timeout_ms,
+	                                        num_events, max_latency_ms );
+}
+
+/**
+ * Like inotifytools_next_events_ms(), but operates on @a ctx.
+ */
+struct inotify_event * inotifytools_ctx_next_events_ms( inotifytools_ctx *ctx,
+                                                        long timeout_ms,
+                                                        int num_events,
+                                                        long max_latency_ms ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+
+	if ( num_events < 1 ) return NULL;
+
+	ctx->error = 0;
+
+	if ( ctx->coalesce ) coalesce_release( ctx );
+	if ( !ctx->coalesce_ms && !coalesce_due( ctx ) ) {
+		return next_event_ms( ctx, timeout_ms, num_events, max_latency_ms );
+	}
+	if ( !coalesce_wait( ctx, timeout_ms, num_events, max_latency_ms ) ) {
+		return NULL;
+	}
+	return coalesce_pop( ctx );
+}
+
+/**
+ * Get all inotify events obtained by one read from inotify.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * This is a faster replacement for calling inotifytools_next_event() in a
+ * loop: a single call hands out every event which is already buffered, or
+ * which is obtained by a single read from inotify, so the per-call overhead is
+ * paid once per batch rather than once per event.
+ *
+ * @param timeout maximum amount of time, in seconds, to wait for an event.
+ *                If @a timeout is 0, the function is non-blocking.  If
+ *                @a timeout is negative, the function will block until an
+ *                event occurs.
+ *
+ * @param events caller-supplied array which will be filled with pointers to
+ *               up to @a max events.
+ *
+ * @param max size of the @a events array.  If more than @a max events are
+ *            buffered, the remaining events are returned by the next call to
+ *            this function or inotifytools_next_event().
+ *
+ * @return number of events stored in @a events, or 0 if function timed out
+ *         before an event occurred, an error occurred or @a max < 1.  On
+ *         error, the error can be obtained from inotifytools_error().  The
+ *         events are located in static storage and they are overwritten by
+ *         the next call to this function, inotifytools_next_event() or
+ *         inotifytools_next_events() which has to read from inotify; do not
+ *         call free() on them, and make a copy of any you want to keep.
+ *
+ * @note Events ignored with inotifytools_ignore_events_by_regex() are not
+ *       stored in @a events, and statistics are tallied for each stored event
+ *       exactly as with inotifytools_next_event().
+ *
+ * @section example Example
+ * @code
+ * struct inotify_event * events[64];
+ * int i, num;
+ * while ( (num = inotifytools_next_event_batch( -1, events, 64 )) > 0 ) {
+ *    for ( i = 0; i < num; ++i ) {
+ *       inotifytools_printf( events[i], "%w%f %e\n" );
+ *    }
+ * }
+ * @endcode
+ */
+int inotifytools_next_event_batch( int timeout, struct inotify_event ** events,
+                                   int max ) {
+	return inotifytools_ctx_next_event_batch( &default_ctx, timeout, events, max );
+}
+
+/**
+ * Like inotifytools_next_event_batch(), but operates on @a ctx.
+ */
+int inotifytools_ctx_next_event_batch( inotifytools_ctx *ctx, int timeout,
+                                       struct inotify_event ** events, int max ) {
+	return inotifytools_ctx_next_event_batch_ms( ctx,
+	                                         timeout <= 0 ? -1 : timeout * 1000L,
+	                                         events, max, 0 );
+}
+
+/**
+ * Get all inotify events obtained by one read from inotify, with millisecond
+ * timeouts and optional coalescing.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * This works like inotifytools_next_event_batch(), but waiting is done in
+ * milliseconds, and once the first event is available the function may keep
+ * waiting for up to @a max_latency_ms milliseconds for @a max events to
+ * accumulate, so that bursts are read with fewer, larger reads.
+ *
+ * @param timeout_ms maximum amount of time, in milliseconds, to wait for an
+ *                   event.  If @a timeout_ms is 0, the function is
+ *                   non-blocking.  If @a timeout_ms is negative, the function
+ *                   will block until an event occurs.
+ *
+ * @param events caller-supplied array which will be filled with pointers to
+ *               up to @a max events.
+ *
+ * @param max size of the @a events array.
+ *
+ * @param max_latency_ms maximum amount of time, in milliseconds, to wait for
+ *                       @a max events once the first event is available.  If
+ *                       0, events already queued are returned immediately.
+ *                       If negative, wait until @a max events are available.
+ *
+ * @return number of events stored in @a events, or 0 if function timed out
+ *         before an event occurred, an error occurred or @a max < 1.  See
+ *         inotifytools_next_event_batch() for details.
+ */
+int inotifytools_next_event_batch_ms( long timeout_ms,
+                                      struct inotify_event ** events,
+                                      int max, long max_latency_ms ) {
+	return inotifytools_ctx_next_event_batch_ms( &default_ctx, timeout_ms,
+	                                             events, max, max_latency_ms );
+}
+
+/**
+ * Like inotifytools_next_event_batch_ms(), but operates on @a ctx.
+ */
+int inotifytools_ctx_next_event_batch_ms( inotifytools_ctx *ctx,
+                                          long timeout_ms,
+                                          struct inotify_event ** events,
+                                          int max, long max_latency_ms ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+
+	if ( !events || max < 1 ) return 0;
+
+	struct inotify_event * ret;
+	int num;
+
+	ctx->error = 0;
+	num = 0;
+
+	if ( ctx->coalesce ) coalesce_release( ctx );
+	if ( ctx->coalesce_ms || coalesce_due( ctx ) ) {
+		if ( !coalesce_wait( ctx, timeout_ms, max_latency_ms ? max : 1,
+		                     max_latency_ms ) ) {
+			return 0;
+		}
+		do {
+			events[num++] = coalesce_pop( ctx );
+		} while ( num < max && coalesce_due( ctx ) );
+		return num;
+	}
+
+	do {
+		if ( !buffered_event_available( ctx ) &&
+		     !read_inotify_events( ctx, timeout_ms,
+		                           max_latency_ms ? max : 1,
+		                           max_latency_ms ) ) {
+			return 0;
+		}
+		while ( num < max && (ret = next_buffered_event( ctx )) ) {
+			if ( event_is_ignored( ctx, ret ) ) continue;
+			if ( ctx->collect_stats ) {
+				record_stats( ctx, ret );
+			}
+			if ( ctx->reach ) reach_mark( ctx, ret->wd );
+			if ( ctx->rescan && (ret->mask & IN_Q_OVERFLOW) ) {
+				inotifytools_ctx_rescan( ctx );
+			}
+			events[num++] = ret;
+		}
+	} while ( num == 0 );
+
+	return num;
+}
+
+/**
+ * Set up recursive watches on an entire directory tree.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param path path of directory or file to watch.  If the path is a directory,
+ *             every subdirectory will also be watched for the same events up
+ *             to the maximum readable depth.  If the path is a file, the file
+ *             is watched exactly as if inotifytools_watch_file() were used.
+ *
+ * @param events Inotify events to watch for.  See section \ref events.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().  Note that some errors on
+ *         subdirectories will be ignored; for example, if you watch a directory
+ *         tree which contains some directories which you do not have access to,
+ *         those directories will not be watched, but this function will still
+ *         return 1 if no other errors occur.
+ *
+ * @note This function does not attempt to work atomically.  If you use this
+ *       function to watch a directory tree and files or directories are being
+ *       created or removed within that directory tree, there are no guarantees
+ *       as to whether or not those files will be watched.
+ */
+int inotifytools_watch_recursively( char const * path, int events ) {
+	return inotifytools_ctx_watch_recursively( &default_ctx, path, events );
+}
+
+/**
+ * Like inotifytools_watch_recursively(), but operates on @a ctx.
+ */
+int inotifytools_ctx_watch_recursively( inotifytools_ctx *ctx,
+                                        char const * path, int events ) {
+	return inotifytools_ctx_watch_recursively_with_exclude( ctx, path, events, 0 );
+}
+
+
+/**
+ * @internal
+ * Node of the trie holding prefix excludes.  Edges are kept sorted by
+ * character in @a chars, with the matching children in @a children.
+ */
+struct exclude_trie {
+	unsigned char *chars;
+	struct exclude_trie **children;
+	unsigned num_children;
+	int terminal;
+};
+
+/**
+ * @internal
+ * Compiled exclude list; see inotifytools_exclude_compile().
+ *
+ * Exact excludes live in an open-addressed hash set of paths without their
+ * trailing '/', prefix excludes in a character trie and globs in a plain list.
+ */
+struct inotifytools_exclude {
+	char **exact;
+	unsigned exact_size;
+	unsigned exact_count;
+	struct exclude_trie *prefixes;
+	char **globs;
+	unsigned num_globs;
+};
+
+/**
+ * @internal
+ * @return the slot of the exact exclude set holding the first @a len
+ *         characters of @a path, or the empty slot where they would go.
+ */
+static char ** exclude_exact_slot( struct inotifytools_exclude const * ex,
+                                   char const * path, size_t len ) {
+	unsigned mask = ex->exact_size - 1;
+	unsigned i = hash_path( path, len ) & mask;
+	while ( ex->exact[i] && (strlen( ex->exact[i] ) != len ||
+	                         strncmp( ex->exact[i], path, len )) ) {
+		i = (i + 1) & mask;
+	}
+	return &ex->exact[i];
+}
+
+/**
+ * @internal
+ * Add the first @a len characters of @a path to the exact exclude set.
+ */
+static void exclude_add_exact( struct inotifytools_exclude * ex,
+                               char const * path, size_t len ) {
+	if ( 2 * (ex->exact_count + 1) > ex->exact_size ) {
+		char **old = ex->exact;
+		unsigned old_size = ex->exact_size;
+		unsigned i;
+		ex->exact_size = old_size ? 2 * old_size : 64;
+		ex->exact = (char **)calloc( ex->exact_size, sizeof(char *) );
+		niceassert( ex->exact, "out of memory" );
+		for ( i = 0; i < old_size; ++i ) {
+			if ( old[i] ) {
+				*exclude_exact_slot( ex, old[i], strlen(old[i]) ) = old[i];
+			}
+		}
+		free( old );
+	}
+
+	char **slot = exclude_exact_slot( ex, path, len );
+	if ( *slot ) return;
+	*slot = strndup( path, len );
+	niceassert( *slot, "out of memory" );
+	++ex->exact_count;
+}
+
+/**
+ * @internal
+ * Add the first @a len characters of @a prefix to the prefix trie.
+ */
+static void exclude_add_prefix( struct inotifytools_exclude * ex,
+                                char const * prefix, size_t len ) {
+	if ( !ex->prefixes ) {
+		ex->prefixes = (struct exclude_trie *)calloc( 1,
+		                                     sizeof(struct exclude_trie) );
+		niceassert( ex->prefixes, "out of memory" );
+	}
+
+	struct exclude_trie *node = ex->prefixes;
+	size_t i;
+	for ( i = 0; i < len && !node->terminal; ++i ) {
+		unsigned char ch = prefix[i];
+		unsigned pos = 0;
+		while ( pos < node->num_children && node->chars[pos] < ch ) ++pos;
+		if ( pos == node->num_children || node->chars[pos] != ch ) {
+			node->chars = (unsigned char *)realloc( node->chars,
+			                                        node->num_children + 1 );
+			node->children = (struct exclude_trie **)realloc( node->children,
+			    (node->num_children + 1) * sizeof(struct exclude_trie *) );
+			niceassert( node->chars && node->children, "out of memory" );
+			memmove( &node->chars[pos+1], &node->chars[pos],
+			         node->num_children - pos );
+			memmove( &node->children[pos+1], &node->children[pos],
+			         (node->num_children - pos) *
+			         sizeof(struct exclude_trie *) );
+			node->chars[pos] = ch;
+			node->children[pos] = (struct exclude_trie *)calloc( 1,
+			                                     sizeof(struct exclude_trie) );
+			niceassert( node->children[pos], "out of memory" );
+			++node->num_children;
+		}
+		node = node->children[pos];
+	}
+	// A shorter prefix already covers everything below this node.
+	node->terminal = 1;
+}
+
+/**
+ * @internal
+ * @return 1 if some prefix in @a node is a prefix of the first @a len
+ *         characters of @a path, 0 otherwise.
+ */
+static int exclude_trie_match( struct exclude_trie const * node,
+                               char const * path, size_t len ) {
+	size_t i;
+	for ( i = 0; node && !node->terminal; ++i ) {
+		if ( i == len ) return 0;
+		unsigned char ch = path[i];
+		unsigned lo = 0, hi = node->num_children;
+		while ( lo < hi ) {
+			unsigned mid = (lo + hi) / 2;
+			if ( node->chars[mid] < ch ) lo = mid + 1;
+			else hi = mid;
+		}
+		if ( lo == node->num_children || node->chars[lo] != ch ) return 0;
+		node = node->children[lo];
+	}
+	return node != NULL;
+}
+
+/**
+ * @internal
+ */
+static void exclude_trie_free( struct exclude_trie * node ) {
+	if ( !node ) return;
+	unsigned i;
+	for ( i = 0; i < node->num_children; ++i ) {
+		exclude_trie_free( node->children[i] );
+	}
+	free( node->chars );
+	free( node->children );
+	free( node );
+}
+
+/**
+ * @internal
+ */
+static struct exclude_trie * exclude_trie_copy(
+                                      struct exclude_trie const * node ) {
+	if ( !node ) return NULL;
+	struct exclude_trie * copy = (struct exclude_trie *)calloc( 1,
+	                                         sizeof(struct exclude_trie) );
+	niceassert( copy, "out of memory" );
+	copy->terminal = node->terminal;
+	copy->num_children = node->num_children;
+	if ( node->num_children ) {
+		copy->chars = (unsigned char *)malloc( node->num_children );
+		copy->children = (struct exclude_trie **)malloc(
+		                 node->num_children * sizeof(struct exclude_trie *) );
+		niceassert( copy->chars && copy->children, "out of memory" );
+		memcpy( copy->chars, node->chars, node->num_children );
+		unsigned i;
+		for ( i = 0; i < node->num_children; ++i ) {
+			copy->children[i] = exclude_trie_copy( node->children[i] );
+		}
+	}
+	return copy;
+}
+
+/**
+ * Compile a list of directories to exclude from recursive watches.
+ *
+ * Checking a directory against a compiled list only depends on the length of
+ * its path, not on the number of excludes, so large exclude lists don't slow
+ * down setting up watches.  A compiled list can be used for any number of
+ * calls to inotifytools_watch_recursively_excluding(), for example both for
+ * the initial watches and for directories created later.
+ *
+ * Each entry of @a exclude_list may be:
+ * \li a path, which excludes exactly that directory (and, since it is not
+ *     descended into, everything below it).  A trailing '/' is optional.
+ * \li a path ending in '*' with no other wildcards, which excludes every
+ *     directory whose path starts with the part before the '*'.  For example,
+ *     \c /var/cache* excludes \c /var/cache/ and \c /var/cache-old/.
+ * \li any other pattern containing '*', '?' or '[', which is matched against
+ *     the directory path (without trailing '/') with fnmatch(3) using
+ *     FNM_PATHNAME, so wildcards don't match '/'.  For example,
+ *     \c /home/?/tmp excludes \c /home/a/tmp but not \c /home/a/b/tmp.
+ *
+ * @param exclude_list NULL terminated list of excludes, or NULL.
+ *
+ * @return the compiled list, which must be freed with
+ *         inotifytools_exclude_free(), or NULL if @a exclude_list is empty.
+ *         NULL is a valid compiled list which excludes nothing.
+ */
+inotifytools_exclude * inotifytools_exclude_compile(
+                                         char const ** exclude_list ) {
+	if ( !exclude_list || !exclude_list[0] ) return NULL;
+
+	inotifytools_exclude * ex = (inotifytools_exclude *)calloc( 1,
+	                                         sizeof(inotifytools_exclude) );
+	niceassert( ex, "out of memory" );
+
+	char const ** entry;
+	for ( entry = exclude_list; *entry; ++entry ) {
+		size_t len = strlen( *entry );
+		// a trailing '/' is optional, except for "/" itself
+		while ( len > 1 && (*entry)[len-1] == '/' ) --len;
+		if ( !len ) continue;
+
+		size_t wild = strcspn( *entry, "*?[" );
+		if ( wild >= len ) {
+			exclude_add_exact( ex, *entry, len );
+		}
+		else if ( wild == len - 1 && (*entry)[wild] == '*' ) {
+			exclude_add_prefix( ex, *entry, wild );
+		}
+		else {
+			ex->globs = (char **)realloc( ex->globs,
+			                     (ex->num_globs + 1) * sizeof(char *) );
+			niceassert( ex->globs, "out of memory" );
+			ex->globs[ex->num_globs] = strndup( *entry, len );
+			niceassert( ex->globs[ex->num_globs], "out of memory" );
+			++ex->num_globs;
+		}
+	}
+	return ex;
+}
+
+/**
+ * @internal
+ * Copy a compiled exclude list, for backends which apply it after the call
+ * that passed it in has returned.
+ *
+ * @return the copy, which must be freed with inotifytools_exclude_free(), or
+ *         NULL if @a exclude is NULL.
+ */
+inotifytools_exclude * inotifytools_exclude_copy(
+                                      inotifytools_exclude const * exclude ) {
+	if ( !exclude ) return NULL;
+	inotifytools_exclude * ex = (inotifytools_exclude *)calloc( 1,
+	                                         sizeof(inotifytools_exclude) );
+	niceassert( ex, "out of memory" );
+	unsigned i;
+	if ( exclude->exact_size ) {
+		ex->exact = (char **)calloc( exclude->exact_size, sizeof(char *) );
+		niceassert( ex->exact, "out of memory" );
+		ex->exact_size = exclude->exact_size;
+		ex->exact_count = exclude->exact_count;
+		for ( i = 0; i < exclude->exact_size; ++i ) {
+			if ( !exclude->exact[i] ) continue;
+			ex->exact[i] = strdup( exclude->exact[i] );
+			niceassert( ex->exact[i], "out of memory" );
+		}
+	}
+	ex->prefixes = exclude_trie_copy( exclude->prefixes );
+	if ( exclude->num_globs ) {
+		ex->globs = (char **)malloc( exclude->num_globs * sizeof(char *) );
+		niceassert( ex->globs, "out of memory" );
+		ex->num_globs = exclude->num_globs;
+		for ( i = 0; i < exclude->num_globs; ++i ) {
+			ex->globs[i] = strdup( exclude->globs[i] );
+			niceassert( ex->globs[i], "out of memory" );
+		}
+	}
+	return ex;
+}
+
+/**
+ * Free an exclude list compiled with inotifytools_exclude_compile().
+ *
+ * @param exclude compiled list; may be NULL.
+ */
+void inotifytools_exclude_free( inotifytools_exclude * exclude ) {
+	if ( !exclude ) return;
+	unsigned i;
+	for ( i = 0; i < exclude->exact_size; ++i ) free( exclude->exact[i] );
+	free( exclude->exact );
+	exclude_trie_free( exclude->prefixes );
+	for ( i = 0; i < exclude->num_globs; ++i ) free( exclude->globs[i] );
+	free( exclude->globs );
+	free( exclude );
+}
+
+/**
+ * Check whether a directory is excluded by a compiled exclude list.
+ *
+ * @param exclude compiled list; may be NULL, which excludes nothing.
+ * @param path directory path, with or without trailing '/'.
+ *
+ * @return 1 if @a path is excluded, 0 otherwise.
+ */
+int inotifytools_exclude_matches( inotifytools_exclude const * exclude,
+                                  char const * path ) {
+	if ( !exclude ) return 0;
+
+	size_t len = strlen( path );
+	while ( len > 1 && path[len-1] == '/' ) --len;
+
+	if ( exclude->exact_count &&
+	     *exclude_exact_slot( exclude, path, len ) ) {
+		return 1;
+	}
+	if ( exclude_trie_match( exclude->prefixes, path, len ) ) return 1;
+	if ( exclude->num_globs ) {
+		char *trimmed = strndup( path, len );
+		niceassert( trimmed, "out of memory" );
+		unsigned i;
+		int match = 0;
+		for ( i = 0; i < exclude->num_globs && !match; ++i ) {
+			match = !fnmatch( exclude->globs[i], trimmed, FNM_PATHNAME );
+		}
+		free( trimmed );
+		return match;
+	}
+	return 0;
+}
+
+/**
+ * @internal
+ * @param filter patterns of the context, or NULL.
+ * @param dir directory path ending in '/'.  It is modified temporarily, but
+ *            restored before returning.
+ *
+ * @return 1 if @a dir must not be watched because events on it would be
+ *         ignored, 0 otherwise.  The trailing '/' is left out of the match, so
+ *         the patterns see the same name as for events on @a dir reported by
+ *         its parent.
+ */
+static int prune_dir( inotifytools_filter const * filter, char * dir ) {
+	if ( !filter ) return 0;
+	size_t len = strlen( dir );
+	dir[len-1] = '\0';
+	int match = inotifytools_filter_prunes( filter, dir );
+	dir[len-1] = '/';
+	return match;
+}
+
+/**
+ * @internal
+ * Growable buffer holding the path of the directory currently being walked.
+ */
+struct path_buf {
+	char *str;
+	size_t len;
+	size_t size;
+};
+
+/**
+ * @internal
+ * Append @a name followed by @a suffix to @a buf.
+ */
+static void path_buf_append( struct path_buf *buf, char const * name,
+                             char const * suffix ) {
+	size_t name_len = strlen( name );
+	size_t suffix_len = strlen( suffix );
+	size_t need = buf->len + name_len + suffix_len + 1;
+	if ( need > buf->size ) {
+		buf->size = need > 2 * buf->size ? need : 2 * buf->size;
+		if ( buf->size < PATH_MAX ) buf->size = PATH_MAX;
+		buf->str = (char *)realloc( buf->str, buf->size );
+		niceassert( buf->str, "out of memory" );
+	}
+	memcpy( buf->str + buf->len, name, name_len );
+	memcpy( buf->str + buf->len + name_len, suffix, suffix_len + 1 );
+	buf->len += name_len + suffix_len;
+}
+
+/**
+ * @internal
+ * Truncate @a buf to @a len characters.
+ */
+static void path_buf_truncate( struct path_buf *buf, size_t len ) {
+	buf->len = len;
+	buf->str[len] = '\0';
+}
+
+/**
+ * @internal
+ * Find out whether directory entry @a ent is a directory, without following
+ * symbolic links.  The type reported by readdir() is used when the file
+ * system provides one, so a stat is only needed for DT_UNKNOWN.
+ *
+ * @param dir_fd file descriptor of the directory containing @a ent.
+ *
+ * @return 1 if @a ent is a directory, 0 if it is not, -1 on error with
+ *         @a errno set.
+ */
+static int dirent_is_dir( int dir_fd, struct dirent const * ent ) {
+	if ( ent->d_type == DT_DIR ) return 1;
+	if ( ent->d_type != DT_UNKNOWN ) return 0;
+
+	struct stat64 my_stat;
+	if ( -1 == fstatat64( dir_fd, ent->d_name, &my_stat,
+	                      AT_SYMLINK_NOFOLLOW ) ) {
+		return -1;
+	}
+	return S_ISDIR( my_stat.st_mode ) ? 1 : 0;
+}
+
+/**
+ * @internal
+ * Add a watch on directory @a path, which must end in '/'.
+ *
+ * @param snap snapshot of the directory taken before it was read, or NULL.
+ *
+ * @return 1 on success, 0 on failure with @a ctx->error set.
+ */
+static int watch_dir( inotifytools_ctx *ctx, char const * path, int events,
+                      struct dir_snapshot const * snap ) {
+	int wd = ctx->backend->add_watch( ctx->backend_data, ctx->inotify_fd,
+	                                  path, events );
+	if ( wd < 0 ) {
+		ctx->error = errno;
+		return 0;
+	}
+	watch *w = create_watch( ctx, wd, (char *)path );
+	if ( w && snap ) snapshot_set( ctx, w, snap );
+	return 1;
+}
+
+/**
+ * @internal
+ * Watch the directory open on @a fd and everything below it.
+ *
+ * Subdirectories are opened relative to their parent, and @a buf, which holds
+ * the path of the directory ending in '/', is extended in place, so walking a
+ * directory costs no allocations and no system calls for entries which are
+ * not directories.  @a fd is closed before returning.
+ *
+ * @return 1 on success, 0 on failure with @a ctx->error set.
+ */
+static int watch_dir_recursively( inotifytools_ctx *ctx, int fd,
+                                  struct path_buf *buf, int events,
+                                  inotifytools_exclude const * exclude ) {
+	// time spent below this directory isn't counted for it
+	long long start = ctx->metrics ? now_ns() : 0, below = 0;
+
+	// The snapshot is taken before reading, so that a rescan reads the
+	// directory again if anything is added while it is being read.
+	struct dir_snapshot snap;
+	int have_snap = ctx->rescan && snapshot_take( fd, &snap );
+
+	DIR * dir = fdopendir( fd );
+	if ( !dir ) {
+		ctx->error = errno;
+		close( fd );
+		return 0;
+	}
+
+	size_t len = buf->len;
+	struct dirent * ent;
+	// Watch each directory within this directory
+	while ( (ent = readdir( dir )) ) {
+		if ( (0 == strcmp( ent->d_name, "." )) ||
+		     (0 == strcmp( ent->d_name, ".." )) ) {
+			continue;
+		}
+
+		int is_dir = dirent_is_dir( dirfd( dir ), ent );
+		if ( is_dir < 0 ) {
+			if ( errno != EACCES ) {
+				ctx->error = errno;
+				closedir( dir );
+				return 0;
+			}
+			ctx->error = 0;
+			continue;
+		}
+		if ( !is_dir ) continue;
+
+		path_buf_append( buf, ent->d_name, "/" );
+		if ( prune_dir( ctx->prune ? ctx->filter : NULL, buf->str ) ) {
+			path_buf_truncate( buf, len );
+			continue;
+		}
+		if ( !inotifytools_exclude_matches( exclude, buf->str ) ) {
+			int status = 0;
+			int child_fd = openat( dirfd( dir ), ent->d_name,
+			                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			                       O_CLOEXEC );
+			if ( child_fd < 0 ) {
+				ctx->error = errno;
+			}
+			else {
+				long long child = ctx->metrics ? now_ns() : 0;
+				status = watch_dir_recursively( ctx, child_fd, buf, events,
+				                                exclude );
+				if ( ctx->metrics ) below += now_ns() - child;
+			}
+			// For some errors, we will continue.
+			if ( !status && (EACCES != ctx->error) &&
+			     (ENOENT != ctx->error) && (ELOOP != ctx->error) ) {
+				path_buf_truncate( buf, len );
+				closedir( dir );
+				return 0;
+			}
+		}
+		path_buf_truncate( buf, len );
+		ctx->error = 0;
+	}
+
+	closedir( dir );
+	int ret = watch_dir( ctx, buf->str, events, have_snap ? &snap : NULL );
+	if ( ctx->metrics ) {
+		histogram_add( &ctx->metrics->dir_ns, now_ns() - start - below );
+	}
+	return ret;
+}
+
+/**
+ * Set up recursive watches on an entire directory tree, optionally excluding
+ * some directories.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @author UH
+ *
+ * @param path path of directory or file to watch.  If the path is a directory,
+ *             every subdirectory will also be watched for the same events up
+ *             to the maximum readable depth.  If the path is a file, the file
+ *             is watched exactly as if inotifytools_watch_file() were used.
+ *
+ * @param exclude_list NULL terminated path list of directories not to watch.
+ *                     Can be NULL if no paths are to be excluded.
+ *                     Directories may or may not include a trailing '/'.
+ *
+ * @param events Inotify events to watch for.  See section \ref events.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().  Note that some errors on
+ *         subdirectories will be ignored; for example, if you watch a directory
+ *         tree which contains some directories which you do not have access to,
+ *         those directories will not be watched, but this function will still
+ *         return 1 if no other errors occur.
+ *
+ * @note This function does not attempt to work atomically.  If you use this
+ *       function to watch a directory tree and files or directories are being
+ *       created or removed within that directory tree, there are no guarantees
+ *       as to whether or not those files will be watched.
+ */
+int inotifytools_watch_recursively_with_exclude( char const * path, int events,
+                                                 char const ** exclude_list ) {
+	return inotifytools_ctx_watch_recursively_with_exclude( &default_ctx, path,
+	                                                        events,
+	                                                        exclude_list );
+}
+
+/**
+ * Like inotifytools_watch_recursively_with_exclude(), but operates on @a ctx.
+ */
+int inotifytools_ctx_watch_recursively_with_exclude( inotifytools_ctx *ctx,
+                                                     char const * path,
+                                                     int events,
+                                                     char const ** exclude_list ) {
+	inotifytools_exclude * exclude = inotifytools_exclude_compile( exclude_list );
+	int ret = inotifytools_ctx_watch_recursively_excluding( ctx, path, events,
+	                                                        exclude, 1 );
+	inotifytools_exclude_free( exclude );
+	return ret;
+}
+
+/**
+ * @internal
+ * A directory found by the parallel crawler.  @a path always ends in '/'.
+ */
+struct crawl_dir {
+	char *path;
+	struct dir_snapshot snap;
+	struct crawl_dir *prev;
+	struct crawl_dir *next;
+};
+
+/**
+ * @internal
+ * Work queue owned by one crawler thread.  The owner pushes and pops at
+ * @a head, so each thread goes depth first through its part of the tree;
+ * idle threads steal from @a tail, which holds the oldest and usually
+ * largest subtrees.
+ */
+struct crawl_deque {
+	pthread_mutex_t lock;
+	struct crawl_dir *head;
+	struct crawl_dir *tail;
+};
+
+/**
+ * @internal
+ * State shared between the scanning threads and the thread adding watches.
+ */
+struct crawler {
+	struct crawl_deque *deques;
+	int num_threads;
+	inotifytools_exclude const *exclude;
+	inotifytools_filter const *prune;
+	int snapshot;
+
+	// everything below is protected by @a lock
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t found_cond;
+	// directories queued or being scanned
+	unsigned pending;
+	// bumped whenever work is queued, so idle threads don't miss it
+	unsigned long generation;
+	// scanned directories waiting to be watched
+	struct crawl_dir *found;
+	int abort;
+	int error;
+};
+
+/**
+ * @internal
+ * Argument of crawl_thread().
+ */
+struct crawl_thread_arg {
+	struct crawler *crawler;
+	int id;
+};
+
+/**
+ * @internal
+ * Children of a directory are pushed once this many have been found, so other
+ * threads can start on huge directories before they are fully read.
+ */
+#define CRAWL_PUBLISH_BATCH 64
+
+/**
+ * @internal
+ * Stop the crawl because of @a error.  Must be called with @a c->lock held.
+ */
+static void crawl_fail( struct crawler *c, int error ) {
+	if ( !c->abort ) c->error = error;
+	c->abort = 1;
+	pthread_cond_broadcast( &c->work_cond );
+	pthread_cond_broadcast( &c->found_cond );
+}
+
+/**
+ * @internal
+ * Make the @a num directories from @a first to @a last (linked by @a next)
+ * available to the crawler threads by pushing them onto deque @a id.
+ */
+static void crawl_publish( struct crawler *c, int id, struct crawl_dir *first,
+                           struct crawl_dir *last, unsigned num ) {
+	if ( !num ) return;
+
+	// Account for the new work before anyone can steal it, so pending never
+	// drops to 0 while directories are still queued.
+	pthread_mutex_lock( &c->lock );
+	c->pending += num;
+	++c->generation;
+	pthread_cond_broadcast( &c->work_cond );
+	pthread_mutex_unlock( &c->lock );
+
+	struct crawl_deque *q = &c->deques[id];
+	pthread_mutex_lock( &q->lock );
+	last->next = q->head;
+	if ( q->head ) q->head->prev = last;
+	else q->tail = last;
+	first->prev = NULL;
+	q->head = first;
+	pthread_mutex_unlock( &q->lock );
+}
+
+/**
+ * @internal
+ * @return the next directory for thread @a id to scan, taken from its own
+ *         deque if possible and stolen from another thread otherwise, or NULL
+ *         if all deques are empty.
+ */
+static struct crawl_dir * crawl_take( struct crawler *c, int id ) {
+	struct crawl_dir *d = NULL;
+	struct crawl_deque *q = &c->deques[id];
+
+	pthread_mutex_lock( &q->lock );
+	if ( q->head ) {
+		d = q->head;
+		q->head = d->next;
+		if ( q->head ) q->head->prev = NULL;
+		else q->tail = NULL;
+	}
+	pthread_mutex_unlock( &q->lock );
+	if ( d ) return d;
+
+	int i;
+	for ( i = 1; i < c->num_threads && !d; ++i ) {
+		q = &c->deques[(id + i) % c->num_threads];
+		pthread_mutex_lock( &q->lock );
+		if ( q->tail ) {
+			d = q->tail;
+			q->tail = d->prev;
+			if ( q->tail ) q->tail->next = NULL;
+			else q->head = NULL;
+		}
+		pthread_mutex_unlock( &q->lock );
+	}
+	return d;
+}
+
+/**
+ * @internal
+ * Read directory @a d, queue its subdirectories for scanning on deque @a id
+ * and then hand @a d to the thread adding watches.
+ */
+static void crawl_scan( struct crawler *c, int id, struct crawl_dir *d ) {
+	int error = 0;
+	DIR * dir = opendir( d->path );
+	if ( !dir ) {
+		error = errno;
+	}
+	else {
+		if ( c->snapshot ) snapshot_take( dirfd( dir ), &d->snap );
+		struct crawl_dir *first = NULL, *last = NULL;
+		unsigned num = 0;
+		struct dirent * ent;
+
+		while ( (ent = readdir( dir )) ) {
+			if ( !strcmp( ent->d_name, "." ) || !strcmp( ent->d_name, ".." ) ) {
+				continue;
+			}
+			int is_dir = dirent_is_dir( dirfd( dir ), ent );
+			if ( is_dir < 0 ) {
+				if ( errno != EACCES ) {
+					error = errno;
+					break;
+				}
+				continue;
+			}
+			if ( !is_dir ) continue;
+
+			struct crawl_dir *child =
+			    (struct crawl_dir *)calloc( 1, sizeof(struct crawl_dir) );
+			niceassert( child, "out of memory" );
+			nasprintf( &child->path, "%s%s/", d->path, ent->d_name );
+			if ( inotifytools_exclude_matches( c->exclude, child->path ) ||
+			     prune_dir( c->prune, child->path ) ) {
+				free( child->path );
+				free( child );
+				continue;
+			}
+			child->next = first;
+			if ( first ) first->prev = child;
+			else last = child;
+			first = child;
+			if ( ++num == CRAWL_PUBLISH_BATCH ) {
+				crawl_publish( c, id, first, last, num );
+				first = last = NULL;
+				num = 0;
+			}
+		}
+		closedir( dir );
+		crawl_publish( c, id, first, last, num );
+	}
+
+	pthread_mutex_lock( &c->lock );
+	if ( !dir && (EACCES == error || ENOENT == error || ELOOP == error ||
+	              ENOTDIR == error) ) {
+		// Silently skip directories which vanished or can't be read, just
+		// like inotifytools_watch_recursively_with_exclude() does.
+		free( d->path );
+		free( d );
+	}
+	else if ( error ) {
+		crawl_fail( c, error );
+		free( d->path );
+		free( d );
+	}
+	else {
+		d->next = c->found;
+		c->found = d;
+		pthread_cond_signal( &c->found_cond );
+	}
+	if ( 0 == --c->pending ) {
+		pthread_cond_broadcast( &c->work_cond );
+		pthread_cond_broadcast( &c->found_cond );
+	}
+	pthread_mutex_unlock( &c->lock );
+}
+
+/**
+ * @internal
+ * Main loop of a crawler thread: scan directories until there are none left.
+ */
+static void * crawl_thread( void *arg ) {
+	struct crawler *c = ((struct crawl_thread_arg *)arg)->crawler;
+	int id = ((struct crawl_thread_arg *)arg)->id;
+
+	for (;;) {
+		pthread_mutex_lock( &c->lock );
+		unsigned long generation = c->generation;
+		int stop = c->abort || !c->pending;
+		pthread_mutex_unlock( &c->lock );
+		if ( stop ) break;
+
+		struct crawl_dir *d = crawl_take( c, id );
+		if ( d ) {
+			crawl_scan( c, id, d );
+			continue;
+		}
+
+		// Nothing to steal; wait until more work is queued or all is done.
+		pthread_mutex_lock( &c->lock );
+		while ( c->generation == generation && c->pending && !c->abort ) {
+			pthread_cond_wait( &c->work_cond, &c->lock );
+		}
+		pthread_mutex_unlock( &c->lock );
+	}
+	return NULL;
+}
+
+/**
+ * @internal
+ * Free a list of directories linked by @a next.
+ */
+static void crawl_free_list( struct crawl_dir *d ) {
+	while ( d ) {
+		struct crawl_dir *next = d->next;
+		free( d->path );
+		free( d );
+		d = next;
+	}
+}
+
+/**
+ * Set up recursive watches on an entire directory tree, scanning it with
+ * several threads.
+ *
+ * This behaves like inotifytools_watch_recursively_with_exclude(), but the
+ * directory tree is read by @a num_threads threads which steal work from
+ * each other, while the calling thread adds the watches as directories are
+ * found.  On large trees, and especially on network file systems, this can
+ * reduce the time spent setting up watches considerably.
+ *
+ * Directories are watched in no particular order.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param path path of directory or file to watch.
+ *
+ * @param events Inotify events to watch for.  See section \ref events.
+ *
+ * @param exclude_list NULL terminated path list of directories not to watch.
+ *                     Can be NULL if no paths are to be excluded.
+ *
+ * @param num_threads number of threads scanning directories.  If this is 1
+ *                    or less, this is the same as
+ *                    inotifytools_watch_recursively_with_exclude().
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().  Errors on subdirectories are
+ *         handled as in inotifytools_watch_recursively_with_exclude().
+ */
+int inotifytools_watch_recursively_parallel( char const * path, int events,
+                                             char const ** exclude_list,
+                                             int num_threads ) {
+	return inotifytools_ctx_watch_recursively_parallel( &default_ctx, path,
+	                                                    events, exclude_list,
+	                                                    num_threads );
+}
+
+/**
+ * Like inotifytools_watch_recursively_parallel(), but operates on @a ctx.
+ */
+int inotifytools_ctx_watch_recursively_parallel( inotifytools_ctx *ctx,
+                                                 char const * path,
+                                                 int events,
+                                                 char const ** exclude_list,
+                                                 int num_threads ) {
+	inotifytools_exclude * exclude = inotifytools_exclude_compile( exclude_list );
+	int ret = inotifytools_ctx_watch_recursively_excluding( ctx, path, events,
+	                                                        exclude,
+	                                                        num_threads );
+	inotifytools_exclude_free( exclude );
+	return ret;
+}
+
+/**
+ * @internal
+ * Watch the directory tree below @a path, which must be a directory, by
+ * scanning it with @a num_threads threads.
+ *
+ * @return 1 on success, 0 on failure with @a ctx->error set.
+ */
+static int crawl_tree( inotifytools_ctx *ctx, char const * path, int events,
+                       inotifytools_exclude const * exclude,
+                       int num_threads ) {
+	struct crawler c;
+	memset( &c, 0, sizeof(c) );
+	c.num_threads = num_threads;
+	c.exclude = exclude;
+	c.prune = ctx->prune ? ctx->filter : NULL;
+	c.snapshot = ctx->rescan;
+	pthread_mutex_init( &c.lock, NULL );
+	pthread_cond_init( &c.work_cond, NULL );
+	pthread_cond_init( &c.found_cond, NULL );
+	c.deques = (struct crawl_deque *)calloc( num_threads,
+	                                         sizeof(struct crawl_deque) );
+	niceassert( c.deques, "out of memory" );
+	int i;
+	for ( i = 0; i < num_threads; ++i ) {
+		pthread_mutex_init( &c.deques[i].lock, NULL );
+	}
+
+	struct crawl_dir *root =
+	    (struct crawl_dir *)calloc( 1, sizeof(struct crawl_dir) );
+	niceassert( root, "out of memory" );
+	if ( path[strlen(path)-1] != '/' ) {
+		nasprintf( &root->path, "%s/", path );
+	}
+	else {
+		root->path = strdup( path );
+	}
+	crawl_publish( &c, 0, root, root, 1 );
+
+	pthread_t *threads = (pthread_t *)calloc( num_threads, sizeof(pthread_t) );
+	struct crawl_thread_arg *args = (struct crawl_thread_arg *)calloc(
+	    num_threads, sizeof(struct crawl_thread_arg) );
+	niceassert( threads && args, "out of memory" );
+	int started = 0;
+	for ( i = 0; i < num_threads; ++i ) {
+		args[i].crawler = &c;
+		args[i].id = i;
+		int rc = pthread_create( &threads[i], NULL, crawl_thread, &args[i] );
+		if ( rc ) {
+			pthread_mutex_lock( &c.lock );
+			if ( !started ) crawl_fail( &c, rc );
+			pthread_mutex_unlock( &c.lock );
+			break;
+		}
+		++started;
+	}
+
+	// Add watches for scanned directories as they come in.  Only this thread
+	// touches @a ctx.
+	for (;;) {
+		pthread_mutex_lock( &c.lock );
+		while ( !c.found && c.pending && !c.abort ) {
+			pthread_cond_wait( &c.found_cond, &c.lock );
+		}
+		struct crawl_dir *found = c.found;
+		c.found = NULL;
+		int stop = c.abort || (!found && !c.pending);
+		pthread_mutex_unlock( &c.lock );
+		if ( stop ) {
+			crawl_free_list( found );
+			break;
+		}
+
+		while ( found ) {
+			struct crawl_dir *next = found->next;
+			// the crawler threads read the directory, so only setting up
+			// the watch is counted for it
+			long long start = ctx->metrics ? now_ns() : 0;
+			int wd = ctx->backend->add_watch( ctx->backend_data,
+			                                  ctx->inotify_fd, found->path,
+			                                  events );
+			if ( wd >= 0 ) {
+				watch *w = create_watch( ctx, wd, found->path );
+				if ( w && c.snapshot ) snapshot_set( ctx, w, &found->snap );
+				if ( ctx->metrics ) {
+					histogram_add_since( &ctx->metrics->dir_ns, start );
+				}
+			}
+			else if ( errno != EACCES && errno != ENOENT && errno != ELOOP ) {
+				pthread_mutex_lock( &c.lock );
+				crawl_fail( &c, errno );
+				pthread_mutex_unlock( &c.lock );
+				crawl_free_list( found );
+				break;
+			}
+			free( found->path );
+			free( found );
+			found = next;
+		}
+	}
+
+	for ( i = 0; i < started; ++i ) {
+		pthread_join( threads[i], NULL );
+	}
+	for ( i = 0; i < num_threads; ++i ) {
+		crawl_free_list( c.deques[i].head );
+		pthread_mutex_destroy( &c.deques[i].lock );
+	}
+	crawl_free_list( c.found );
+	free( c.deques );
+	free( threads );
+	free( args );
+	pthread_cond_destroy( &c.found_cond );
+	pthread_cond_destroy( &c.work_cond );
+	pthread_mutex_destroy( &c.lock );
+
+	if ( c.abort ) {
+		ctx->error = c.error;
+		return 0;
+	}
+	return 1;
+}
+
+/**
+ * @internal
+ * A directory watched recursively while rescanning was on.
+ */
+struct rescan_root {
+	char *path;
+	int events;
+	inotifytools_exclude *exclude;
+	struct rescan_root *next;
+};
+
+/**
+ * @internal
+ * @return the innermost recursive watch @a path is in, or NULL.
+ */
+static struct rescan_root * rescan_root_find( inotifytools_ctx *ctx,
+                                              char const * path ) {
+	struct rescan_root *root, *best = NULL;
+	size_t best_len = 0;
+	for ( root = ctx->roots; root; root = root->next ) {
+		size_t len = strlen( root->path );
+		if ( len > best_len && 0 == strncmp( root->path, path, len ) ) {
+			best = root;
+			best_len = len;
+		}
+	}
+	return best;
+}
+
+/**
+ * @internal
+ * Remember that @a path, ending in '/', is watched recursively.  New
+ * directories watched on their own as they appear in a recursive watch, as
+ * inotifywait does, don't add a root of their own.
+ */
+static void rescan_root_add( inotifytools_ctx *ctx, char const * path,
+                             int events,
+                             inotifytools_exclude const * exclude ) {
+	struct rescan_root *root = rescan_root_find( ctx, path );
+	if ( root && root->events == events ) return;
+
+	root = (struct rescan_root *)calloc( 1, sizeof(struct rescan_root) );
+	niceassert( root, "out of memory" );
+	root->path = strdup( path );
+	niceassert( root->path, "out of memory" );
+	root->events = events;
+	root->exclude = inotifytools_exclude_copy( exclude );
+	root->next = ctx->roots;
+	ctx->roots = root;
+}
+
+/**
+ * @internal
+ * Forget all recursive watches and snapshots of @a ctx.
+ */
+static void rescan_free( inotifytools_ctx *ctx ) {
+	while ( ctx->roots ) {
+		struct rescan_root *next = ctx->roots->next;
+		free( ctx->roots->path );
+		inotifytools_exclude_free( ctx->roots->exclude );
+		free( ctx->roots );
+		ctx->roots = next;
+	}
+	free( ctx->snapshots );
+	ctx->snapshots = NULL;
+	ctx->snapshots_size = 0;
+}
+
+/**
+ * @internal
+ * Drop @a w without telling the kernel if it already forgot the watch.
+ */
+static void rescan_drop( inotifytools_ctx *ctx, watch *w ) {
+	ctx->backend->rm_watch( ctx->backend_data, ctx->inotify_fd, w->wd );
+	forget_watch( ctx, w );
+}
+
+/**
+ * @internal
+ * Make sure the directory @a buf->str is watched by @a wd under that name.
+ *
+ * If the kernel already watched it under another name, it was moved there
+ * while events were lost, and that watch and the ones below it are renamed.
+ *
+ * @return the watch, or NULL if there was none yet.
+ */
+static watch * rescan_claim( inotifytools_ctx *ctx, int wd,
+                             struct path_buf *buf ) {
+	watch *w = watch_from_wd( ctx, wd );
+	if ( !w ) return NULL;
+	char * old = strdup( path_str( ctx, w->node ) );
+	niceassert( old, "out of memory" );
+	if ( strcmp( old, buf->str ) ) {
+		inotifytools_ctx_replace_filename( ctx, old, buf->str );
+	}
+	free( old );
+	return w;
+}
+
+/**
+ * @internal
+ * Read the directory watched by @a w again after its snapshot stopped
+ * matching, and watch any subdirectories which are not watched yet for
+ * @a events, skipping those matched by @a exclude.
+ *
+ * @return 1 on success, 0 on failure with @a ctx->error set.
+ */
+static int rescan_dir_for( inotifytools_ctx *ctx, watch *w, int events,
+                           inotifytools_exclude const * exclude ) {
+	struct path_buf buf = { 0, 0, 0 };
+	path_buf_append( &buf, path_str( ctx, w->node ), "" );
+
+	int fd = open( buf.str, O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+	if ( fd < 0 ) {
+		int error = errno;
+		free( buf.str );
+		if ( error == ENOENT || error == ENOTDIR || error == ELOOP ) {
+			rescan_drop( ctx, w );
+			return 1;
+		}
+		if ( error == EACCES ) return 1;
+		ctx->error = error;
+		return 0;
+	}
+	struct dir_snapshot snap;
+	int have_snap = snapshot_take( fd, &snap );
+
+	// A different directory may have taken the place of the watched one.
+	int wd = ctx->backend->add_watch( ctx->backend_data, ctx->inotify_fd,
+	                                  buf.str, events );
+	if ( wd < 0 ) {
+		ctx->error = errno;
+		close( fd );
+		free( buf.str );
+		return 0;
+	}
+	if ( wd != w->wd ) {
+		rescan_drop( ctx, w );
+		w = rescan_claim( ctx, wd, &buf );
+		if ( !w ) w = create_watch( ctx, wd, buf.str );
+	}
+
+	DIR * dir = fdopendir( fd );
+	if ( !dir ) {
+		ctx->error = errno;
+		close( fd );
+		free( buf.str );
+		return 0;
+	}
+	size_t len = buf.len;
+	struct dirent * ent;
+	int ret = 1;
+	while ( ret && (ent = readdir( dir )) ) {
+		if ( !strcmp( ent->d_name, "." ) || !strcmp( ent->d_name, ".." ) ) {
+			continue;
+		}
+		if ( 1 != dirent_is_dir( dirfd( dir ), ent ) ) continue;
+
+		path_buf_append( &buf, ent->d_name, "/" );
+		if ( !watch_from_filename( ctx, buf.str ) &&
+		     !prune_dir( ctx->prune ? ctx->filter : NULL, buf.str ) &&
+		     !inotifytools_exclude_matches( exclude, buf.str ) ) {
+			int child_fd = openat( dirfd( dir ), ent->d_name,
+			                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			                       O_CLOEXEC );
+			int child_wd = child_fd < 0 ? -1 :
+			    ctx->backend->add_watch( ctx->backend_data, ctx->inotify_fd,
+			                             buf.str, events );
+			if ( child_wd >= 0 && rescan_claim( ctx, child_wd, &buf ) ) {
+				close( child_fd );
+			}
+			else if ( child_wd >= 0 ) {
+				ret = watch_dir_recursively( ctx, child_fd, &buf,
+				                             events, exclude );
+			}
+			else {
+				ctx->error = errno;
+				if ( child_fd >= 0 ) close( child_fd );
+				ret = 0;
+			}
+			if ( !ret && (EACCES == ctx->error || ENOENT == ctx->error ||
+			              ELOOP == ctx->error) ) {
+				ret = 1;
+			}
+		}
+		path_buf_truncate( &buf, len );
+	}
+	closedir( dir );
+	if ( ret ) {
+		ctx->error = 0;
+		if ( w && have_snap ) snapshot_set( ctx, w, &snap );
+	}
+	free( buf.str );
+	return ret;
+}
+
+/**
+ * @internal
+ * Like rescan_dir_for(), with the events and exclude list of the recursive
+ * watch @a w is in.  Directories outside of recursive watches are ignored.
+ */
+static int rescan_dir( inotifytools_ctx *ctx, watch *w ) {
+	struct rescan_root const * root =
+	    rescan_root_find( ctx, path_str( ctx, w->node ) );
+	if ( !root ) return 1;
+	return rescan_dir_for( ctx, w, root->events, root->exclude );
+}
+
+/**
+ * Set up recursive watches on an entire directory tree, excluding
+ * directories matched by a compiled exclude list.
+ *
+ * This is the most general form of inotifytools_watch_recursively(), and
+ * the cheapest one to call repeatedly with a large exclude list, since the
+ * list is compiled only once.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param path path of directory or file to watch.  @a path itself is always
+ *             watched, even if @a exclude matches it.
+ *
+ * @param events Inotify events to watch for.  See section \ref events.
+ *
+ * @param exclude list of directories not to watch, as returned by
+ *                inotifytools_exclude_compile().  Can be NULL if no
+ *                directories are to be excluded.
+ *
+ * @param num_threads number of threads scanning directories; see
+ *                    inotifytools_watch_recursively_parallel().
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().  Errors on subdirectories are
+ *         handled as in inotifytools_watch_recursively_with_exclude().
+ */
+int inotifytools_watch_recursively_excluding( char const * path, int events,
+                                    inotifytools_exclude const * exclude,
+                                    int num_threads ) {
+	return inotifytools_ctx_watch_recursively_excluding( &default_ctx, path,
+	                                                     events, exclude,
+	                                                     num_threads );
+}
+
+/**
+ * Like inotifytools_watch_recursively_excluding(), but operates on @a ctx.
+ */
+int inotifytools_ctx_watch_recursively_excluding( inotifytools_ctx *ctx,
+                                    char const * path, int events,
+                                    inotifytools_exclude const * exclude,
+                                    int num_threads ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+
+	ctx->error = 0;
+	int fd = -1;
+	if ( ctx->backend->add_tree ) {
+		// the backend would report opening it as an event
+		struct stat sb;
+		if ( stat( path, &sb ) ) {
+			ctx->error = errno;
+			return 0;
+		}
+		if ( !S_ISDIR( sb.st_mode ) ) {
+			return inotifytools_ctx_watch_file( ctx, path, events );
+		}
+	}
+	else if ( (fd = open( path, O_RDONLY | O_DIRECTORY | O_CLOEXEC )) < 0 ) {
+		// If not a directory, don't need to do anything special
+		if ( errno == ENOTDIR ) {
+			return inotifytools_ctx_watch_file( ctx, path, events );
+		}
+		else {
+			ctx->error = errno;
+			return 0;
+		}
+	}
+
+	struct path_buf buf = { 0, 0, 0 };
+	path_buf_append( &buf, path,
+	                 path[strlen(path)-1] == '/' ? "" : "/" );
+	int ret;
+	if ( ctx->backend->add_tree ) {
+		int wd = ctx->backend->add_tree( ctx->backend_data, ctx->inotify_fd,
+		                                 buf.str, events, exclude );
+		if ( wd < 0 ) ctx->error = errno;
+		else create_watch( ctx, wd, buf.str );
+		ret = wd >= 0;
+	}
+	else if ( num_threads > 1 ) {
+		close( fd );
+		ret = crawl_tree( ctx, path, events, exclude, num_threads );
+	}
+	else {
+		ret = watch_dir_recursively( ctx, fd, &buf, events, exclude );
+	}
+	if ( ret && ctx->rescan && !ctx->backend->add_tree ) {
+		rescan_root_add( ctx, buf.str, events, exclude );
+	}
+	free( buf.str );
+	return ret;
+}
+
+
+/**
+ * How long real IN_CREATE and IN_MOVED_TO events on a directory watched by
+ * inotifytools_watch_recursively_async() are checked against the events
+ * synthesized for it, counted from when they were handed out.  By then, all
+ * events queued while the directory was being read have been read too.
+ */
+#define ASYNC_DEDUP_MS 1000
+/** Initial number of buckets of the table of names checked for duplicates. */
+#define ASYNC_BUCKETS 64
+/**
+ * Events the worker thread's own reading of a directory would cause: one
+ * IN_OPEN, IN_ACCESS for each batch of entries and one IN_CLOSE_NOWRITE.
+ * They are only watched for on the directory once it has been read, and
+ * dropped from the watch on its parent, see async_is_self().
+ */
+#define ASYNC_SELF_EVENTS ( IN_OPEN | IN_ACCESS | IN_CLOSE_NOWRITE )
+
+/**
+ * @internal
+ * Kinds of struct async_found.
+ */
+enum {
+	ASYNC_WATCH,
+	ASYNC_READING,
+	ASYNC_ENTRIES,
+	ASYNC_ERROR,
+	ASYNC_DONE
+};
+
+/**
+ * @internal
+ * A directory tree queued by inotifytools_watch_recursively_async().
+ */
+struct async_job {
+	struct async_job *next;
+	char *path;
+	int events;
+	inotifytools_exclude const *exclude;
+	int prune;
+	int snapshot;
+};
+
+/**
+ * @internal
+ * A directory the worker thread has watched and still has to read.
+ */
+struct async_dir {
+	struct async_dir *next;
+	char *path;
+	int wd;
+};
+
+/**
+ * @internal
+ * Something the worker thread hands to the thread reading events: a watch
+ * @a wd it added on @a path (ASYNC_WATCH), that it is about to read that
+ * directory for @a events (ASYNC_READING), the entries of the directory watched by @a wd
+ * (ASYNC_ENTRIES), a directory it failed to watch with @a error
+ * (ASYNC_ERROR), or the end of a job (ASYNC_DONE).  @a names holds
+ * @a names_len bytes of entries, each a 'd' for directories or an 'f' for
+ * anything else followed by the NUL terminated name.
+ */
+struct async_found {
+	struct async_found *next;
+	int kind;
+	int wd;
+	int events;
+	int error;
+	char *path;
+	char *names;
+	size_t names_len;
+	int has_snap;
+	struct dir_snapshot snap;
+};
+
+/**
+ * @internal
+ * A name in a freshly watched directory @a wd, which is either the entry
+ * an event was synthesized for, or a real IN_CREATE or IN_MOVED_TO event was
+ * seen for.  The entry with an empty name marks @a wd as fresh until
+ * @a until; names in directories which are not fresh are stale.
+ */
+struct async_name {
+	struct async_name *chain;
+	unsigned hash;
+	int wd;
+	int synthesized;
+	long long until;
+	char name[];
+};
+
+/**
+ * @internal
+ * A directory @a name in directory @a wd which the worker thread reads.  Of
+ * the ASYNC_SELF_EVENTS on the watch on @a wd, as many as that read causes
+ * are dropped: the IN_OPEN and IN_CLOSE_NOWRITE events in @a expect, and the
+ * IN_ACCESS events between them.  @a until is the number of events checked
+ * by async_is_self() by which all of them have been seen, once the read is
+ * over, in case some were not watched for.  @a dir_wd is the watch on the
+ * directory itself.
+ */
+struct async_self {
+	struct async_self *next;
+	int wd;
+	int dir_wd;
+	uint32_t expect;
+	long long until;
+	char name[];
+};
+
+/**
+ * @internal
+ * The worker thread of inotifytools_watch_recursively_async() and what it
+ * found.  The worker only uses the backend, the inotify fd and the regex of
+ * the context, which don't change while it runs: inotifytools_set_backend()
+ * fails and inotifytools_ignore_events_by_regex() waits for it to be idle.
+ */
+struct async {
+	inotifytools_ctx *ctx;
+	int wake_fd;
+	pthread_t thread;
+
+	// everything below is protected by @a lock
+	pthread_mutex_t lock;
+	pthread_cond_t work_cond;
+	pthread_cond_t idle_cond;
+	struct async_job *jobs;
+	struct async_job *jobs_tail;
+	struct async_found *found;
+	struct async_found *found_tail;
+	int busy;
+	int stop;
+
+	// everything below is only used by the thread reading events
+	int num_jobs;
+	// set while the event buffer holds synthesized events
+	int synthetic;
+	char *synth;
+	size_t synth_bytes;
+	size_t synth_size;
+	struct async_name **buckets;
+	unsigned num_buckets;
+	unsigned num_names;
+	long long next_sweep;
+	struct async_self *self;
+	// number of real events checked by async_is_self()
+	long long checked;
+};
+
+/**
+ * @internal
+ * Hand @a f to the thread reading events.  Must be called with @a a->lock
+ * held.
+ */
+static void async_publish( struct async *a, struct async_found *f ) {
+	f->next = NULL;
+	if ( a->found_tail ) a->found_tail->next = f;
+	else a->found = f;
+	a->found_tail = f;
+}
+
+/**
+ * @internal
+ * Watch directory @a path, ending in '/', for the events of @a job except
+ * ASYNC_SELF_EVENTS.  The watch is handed to the thread reading events
+ * before anyone else can take @a a->lock, so once that thread holds it,
+ * every watch which can have events is known.
+ *
+ * @return the watch descriptor, or -1 on failure.
+ */
+static int async_add_watch( struct async *a, struct async_job const *job,
+                            char const *path ) {
+	inotifytools_ctx *ctx = a->ctx;
+	struct async_found *f =
+	    (struct async_found *)calloc( 1, sizeof(struct async_found) );
+	niceassert( f, "out of memory" );
+
+	pthread_mutex_lock( &a->lock );
+	int wd = ctx->backend->add_watch( ctx->backend_data, ctx->inotify_fd,
+	                                  path, job->events & ~ASYNC_SELF_EVENTS );
+	int error = errno;
+	if ( wd >= 0 ) {
+		f->kind = ASYNC_WATCH;
+		f->wd = wd;
+	}
+	else if ( EACCES == error || ENOENT == error || ELOOP == error ||
+	          ENOTDIR == error ) {
+		// vanished or can't be read, skipped as by the other recursive
+		// watches
+		free( f );
+		f = NULL;
+	}
+	else {
+		f->kind = ASYNC_ERROR;
+		f->error = error;
+	}
+	if ( f ) {
+		f->path = strdup( path );
+		niceassert( f->path, "out of memory" );
+		async_publish( a, f );
+	}
+	pthread_mutex_unlock( &a->lock );
+	if ( f ) eventfd_write( a->wake_fd, 1 );
+	return wd;
+}
+
+/**
+ * @internal
+ * Extend the watch on directory @a d to all events of @a job.
+ */
+static void async_watch_all( struct async *a, struct async_job const *job,
+                             struct async_dir const *d ) {
+	if ( !(job->events & ASYNC_SELF_EVENTS) ) return;
+	inotifytools_ctx *ctx = a->ctx;
+	int wd = ctx->backend->add_watch( ctx->backend_data, ctx->inotify_fd,
+	                                  d->path, job->events );
+	// Something else was put in the directory's place; its own IN_CREATE
+	// event takes care of it.  Failures are as good as the directory going
+	// away, which IN_IGNORED reports.
+	if ( wd >= 0 && wd != d->wd ) {
+		ctx->backend->rm_watch( ctx->backend_data, ctx->inotify_fd, wd );
+	}
+}
+
+/**
+ * @internal
+ * Read directory @a d of @a job, watch its subdirectories and queue them on
+ * @a stack, then hand the entries of @a d to the thread reading events.
+ * Subdirectories are handed over first, so they are watched by the time
+ * the events synthesized for them are.  Finally, the watch on @a d is
+ * extended to all events of @a job.
+ */
+static void async_scan( struct async *a, struct async_job const *job,
+                        struct async_dir *d, struct async_dir **stack ) {
+	struct async_found *f;
+	if ( job->events & ASYNC_SELF_EVENTS ) {
+		// Published before any of the events, so it is collected along
+		// with them at the latest.
+		f = (struct async_found *)calloc( 1, sizeof(struct async_found) );
+		niceassert( f, "out of memory" );
+		f->kind = ASYNC_READING;
+		f->wd = d->wd;
+		f->events = job->events;
+		f->path = strdup( d->path );
+		niceassert( f->path, "out of memory" );
+		pthread_mutex_lock( &a->lock );
+		async_publish( a, f );
+		pthread_mutex_unlock( &a->lock );
+	}
+
+	f = (struct async_found *)calloc( 1, sizeof(struct async_found) );
+	niceassert( f, "out of memory" );
+	f->kind = ASYNC_ENTRIES;
+	f->wd = d->wd;
+
+	DIR * dir = opendir( d->path );
+	if ( !dir ) {
+		// handed over empty, which ends what ASYNC_READING started
+		async_watch_all( a, job, d );
+		pthread_mutex_lock( &a->lock );
+		async_publish( a, f );
+		pthread_mutex_unlock( &a->lock );
+		eventfd_write( a->wake_fd, 1 );
+		return;
+	}
+
+	if ( job->snapshot ) f->has_snap = snapshot_take( dirfd( dir ), &f->snap );
+	size_t names_size = 0;
+	inotifytools_filter const *prune = job->prune ? a->ctx->filter : NULL;
+	struct dirent * ent;
+
+	while ( (ent = readdir( dir )) ) {
+		if ( !strcmp( ent->d_name, "." ) || !strcmp( ent->d_name, ".." ) ) {
+			continue;
+		}
+		int is_dir = dirent_is_dir( dirfd( dir ), ent );
+		if ( is_dir < 0 ) continue;
+
+		if ( job->events & IN_CREATE ) {
+			size_t len = strlen( ent->d_name ) + 2;
+			if ( f->names_len + len > names_size ) {
+				names_size = names_size ? 2 * names_size : 1024;
+				while ( names_size < f->names_len + len ) names_size *= 2;
+				f->names = (char *)realloc( f->names, names_size );
+				niceassert( f->names, "out of memory" );
+			}
+			f->names[f->names_len] = is_dir ? 'd' : 'f';
+			memcpy( &f->names[f->names_len + 1], ent->d_name, len - 1 );
+			f->names_len += len;
+		}
+		if ( !is_dir ) continue;
+
+		char *path;
+		nasprintf( &path, "%s%s/", d->path, ent->d_name );
+		int wd = -1;
+		if ( !inotifytools_exclude_matches( job->exclude, path ) &&
+		     !prune_dir( prune, path ) ) {
+			wd = async_add_watch( a, job, path );
+		}
+		if ( wd < 0 ) {
+			free( path );
+			continue;
+		}
+		struct async_dir *child =
+		    (struct async_dir *)malloc( sizeof(struct async_dir) );
+		niceassert( child, "out of memory" );
+		child->path = path;
+		child->wd = wd;
+		child->next = *stack;
+		*stack = child;
+	}
+	closedir( dir );
+	async_watch_all( a, job, d );
+
+	pthread_mutex_lock( &a->lock );
+	async_publish( a, f );
+	pthread_mutex_unlock( &a->lock );
+	eventfd_write( a->wake_fd, 1 );
+}
+
+/**
+ * @internal
+ * Watch the tree of @a job, depth first, unless the context is cleaned up
+ * before it is done.
+ */
+static void async_run( struct async *a, struct async_job const *job ) {
+	struct async_dir *stack = NULL;
+	int wd = async_add_watch( a, job, job->path );
+	if ( wd >= 0 ) {
+		stack = (struct async_dir *)malloc( sizeof(struct async_dir) );
+		niceassert( stack, "out of memory" );
+		stack->path = strdup( job->path );
+		niceassert( stack->path, "out of memory" );
+		stack->wd = wd;
+		stack->next = NULL;
+	}
+
+	while ( stack ) {
+		struct async_dir *d = stack;
+		stack = d->next;
+		pthread_mutex_lock( &a->lock );
+		int stop = a->stop;
+		pthread_mutex_unlock( &a->lock );
+		if ( !stop ) async_scan( a, job, d, &stack );
+		free( d->path );
+		free( d );
+	}
+
+	struct async_found *f =
+	    (struct async_found *)calloc( 1, sizeof(struct async_found) );
+	niceassert( f, "out of memory" );
+	f->kind = ASYNC_DONE;
+	pthread_mutex_lock( &a->lock );
+	async_publish( a, f );
+	pthread_mutex_unlock( &a->lock );
+	eventfd_write( a->wake_fd, 1 );
+}
+
+/**
+ * @internal
+ * Main loop of the worker thread: run jobs until told to stop.
+ */
+static void * async_worker( void *arg ) {
+	struct async *a = (struct async *)arg;
+
+	pthread_mutex_lock( &a->lock );
+	for (;;) {
+		while ( !a->jobs && !a->stop ) {
+			a->busy = 0;
+			pthread_cond_broadcast( &a->idle_cond );
+			pthread_cond_wait( &a->work_cond, &a->lock );
+		}
+		if ( a->stop ) break;
+		struct async_job *job = a->jobs;
+		a->jobs = job->next;
+		if ( !a->jobs ) a->jobs_tail = NULL;
+		a->busy = 1;
+		pthread_mutex_unlock( &a->lock );
+
+		async_run( a, job );
+		free( job->path );
+		free( job );
+
+		pthread_mutex_lock( &a->lock );
+	}
+	a->busy = 0;
+	pthread_cond_broadcast( &a->idle_cond );
+	pthread_mutex_unlock( &a->lock );
+	return NULL;
+}
+
+/**
+ * @internal
+ * Wait until the worker thread of @a ctx, if any, has run all queued jobs.
+ */
+static void async_wait_idle( inotifytools_ctx *ctx ) {
+	struct async *a = ctx->async;
+	if ( !a ) return;
+	pthread_mutex_lock( &a->lock );
+	while ( a->jobs || a->busy ) pthread_cond_wait( &a->idle_cond, &a->lock );
+	pthread_mutex_unlock( &a->lock );
+}
+
+/**
+ * @internal
+ * @return the entry for @a name in directory @a wd, or NULL.
+ */
+static struct async_name * async_name_find( struct async *a, int wd,
+                                            char const *name ) {
+	if ( !a->num_names ) return NULL;
+	unsigned hash = coalesce_hash( wd, name );
+	struct async_name *n = a->buckets[hash & (a->num_buckets - 1)];
+	for ( ; n; n = n->chain ) {
+		if ( n->hash == hash && n->wd == wd && !strcmp( n->name, name ) ) {
+			return n;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @internal
+ * Add an entry for @a name in directory @a wd, which must not have one yet.
+ *
+ * @return the new entry.
+ */
+static struct async_name * async_name_add( struct async *a, int wd,
+                                           char const *name,
+                                           int synthesized ) {
+	if ( a->num_names >= a->num_buckets ) {
+		unsigned num = a->num_buckets ? 2 * a->num_buckets : ASYNC_BUCKETS;
+		struct async_name **buckets = (struct async_name **)calloc(
+		    num, sizeof(struct async_name *) );
+		niceassert( buckets, "out of memory" );
+		unsigned i;
+		for ( i = 0; i < a->num_buckets; ++i ) {
+			struct async_name *n = a->buckets[i];
+			while ( n ) {
+				struct async_name *next = n->chain;
+				n->chain = buckets[n->hash & (num - 1)];
+				buckets[n->hash & (num - 1)] = n;
+				n = next;
+			}
+		}
+		free( a->buckets );
+		a->buckets = buckets;
+		a->num_buckets = num;
+	}
+
+	size_t len = strlen( name ) + 1;
+	struct async_name *n =
+	    (struct async_name *)malloc( sizeof(struct async_name) + len );
+	niceassert( n, "out of memory" );
+	n->hash = coalesce_hash( wd, name );
+	n->wd = wd;
+	n->synthesized = synthesized;
+	n->until = 0;
+	memcpy( n->name, name, len );
+	n->chain = a->buckets[n->hash & (a->num_buckets - 1)];
+	a->buckets[n->hash & (a->num_buckets - 1)] = n;
+	++a->num_names;
+	return n;
+}
+
+/**
+ * @internal
+ * Remove entry @a n.
+ */
+static void async_name_remove( struct async *a, struct async_name *n ) {
+	struct async_name **p = &a->buckets[n->hash & (a->num_buckets - 1)];
+	while ( *p != n ) p = &(*p)->chain;
+	*p = n->chain;
+	free( n );
+	--a->num_names;
+}
+
+/**
+ * @internal
+ * Remove all entries of directories which are no longer fresh at @a now.
+ */
+static void async_sweep( struct async *a, long long now ) {
+	unsigned i;
+	for ( i = 0; i < a->num_buckets && a->num_names; ++i ) {
+		struct async_name *n = a->buckets[i], *next;
+		for ( ; n; n = next ) {
+			next = n->chain;
+			struct async_name *fresh =
+			    n->name[0] ? async_name_find( a, n->wd, "" ) : n;
+			if ( !fresh || fresh->until < now ) async_name_remove( a, n );
+		}
+	}
+	a->next_sweep = now + ASYNC_DEDUP_MS;
+}
+
+/**
+ * @internal
+ * Queue an IN_CREATE event for each entry in @a f, the contents of
+ * directory @a f->wd, which no real event was seen for.
+ */
+static void async_synthesize( struct async *a, struct async_found const *f ) {
+	char const *p = f->names;
+	while ( p < f->names + f->names_len ) {
+		int isdir = ( *p == 'd' );
+		char const *name = p + 1;
+		size_t len = strlen( name );
+		p += len + 2;
+
+		struct async_name *n = async_name_find( a, f->wd, name );
+		if ( n ) {
+			// reported by a real event, or found by an earlier crawl
+			if ( !n->synthesized ) async_name_remove( a, n );
+			continue;
+		}
+		async_name_add( a, f->wd, name, 1 );
+
+		// pad the name as inotify does
+		size_t name_len = (len + sizeof(struct inotify_event)) &
+		                  ~(sizeof(struct inotify_event) - 1);
+		size_t size = sizeof(struct inotify_event) + name_len;
+		if ( a->synth_bytes + size > a->synth_size ) {
+			size_t want = a->synth_size ? 2 * a->synth_size : READ_BUFFER_MIN;
+			while ( want < a->synth_bytes + size ) want *= 2;
+			a->synth = (char *)realloc( a->synth, want );
+			niceassert( a->synth, "out of memory" );
+			a->synth_size = want;
+		}
+		struct inotify_event *event =
+		    (struct inotify_event *)(a->synth + a->synth_bytes);
+		memset( event, 0, size );
+		event->wd = f->wd;
+		event->mask = IN_CREATE | (isdir ? IN_ISDIR : 0);
+		event->len = name_len;
+		memcpy( event->name, name, len );
+		a->synth_bytes += size;
+	}
+}
+
+/**
+ * @internal
+ * Record that the worker thread reads directory @a f->path, so that the
+ * events this causes on the watch on its parent are dropped.
+ */
+static void async_self_add( inotifytools_ctx *ctx,
+                            struct async_found const *f ) {
+	size_t len = strlen( f->path );
+	if ( len && f->path[len - 1] == '/' ) --len;
+	size_t base = len;
+	while ( base && f->path[base - 1] != '/' ) --base;
+	// the parent isn't watched under this name, e.g. for a relative path
+	if ( !base ) return;
+
+	char *parent = strndup( f->path, base );
+	niceassert( parent, "out of memory" );
+	watch *w = watch_from_filename( ctx, parent );
+	free( parent );
+	if ( !w ) return;
+
+	struct async_self *s = (struct async_self *)malloc(
+	    sizeof(struct async_self) + len - base + 1 );
+	niceassert( s, "out of memory" );
+	s->wd = w->wd;
+	s->dir_wd = f->wd;
+	s->expect = f->events & (IN_OPEN | IN_CLOSE_NOWRITE | IN_ACCESS);
+	s->until = LLONG_MAX;
+	memcpy( s->name, f->path + base, len - base );
+	s->name[len - base] = 0;
+	s->next = ctx->async->self;
+	ctx->async->self = s;
+}
+
+/**
+ * @internal
+ * @return upper bound of the number of real events which have been queued
+ *         but not checked by async_is_self() yet.
+ */
+static long long async_unchecked( inotifytools_ctx *ctx ) {
+	long long bytes = 0;
+	if ( !ctx->async->synthetic ) bytes += ctx->bytes - ctx->first_byte;
+	if ( ctx->ring ) bytes += ring_used( ctx->ring );
+	int error = ctx->error;
+	int queued = queued_bytes( ctx );
+	ctx->error = error;
+	if ( queued < 0 ) return LLONG_MAX / 2;
+	bytes += queued;
+	return bytes / sizeof(struct inotify_event);
+}
+
+/**
+ * @internal
+ * The worker thread is done reading the directory watched by @a dir_wd, so
+ * all events of that read are queued: they have turned up once as many
+ * events as are queued now have been checked.
+ */
+static void async_self_done( inotifytools_ctx *ctx, int dir_wd ) {
+	struct async *a = ctx->async;
+	struct async_self *s;
+	for ( s = a->self; s; s = s->next ) {
+		if ( s->dir_wd == dir_wd && s->until == LLONG_MAX ) {
+			s->until = a->checked + async_unchecked( ctx );
+		}
+	}
+}
+
+/**
+ * @internal
+ * Take everything the worker thread of @a ctx has found so far: register
+ * its watches and queue the events synthesized for the directories it has
+ * read.
+ */
+static void async_collect( inotifytools_ctx *ctx ) {
+	struct async *a = ctx->async;
+	eventfd_t count;
+	eventfd_read( a->wake_fd, &count );
+
+	pthread_mutex_lock( &a->lock );
+	struct async_found *f = a->found;
+	a->found = a->found_tail = NULL;
+	pthread_mutex_unlock( &a->lock );
+
+	long long now = now_ms();
+	struct async_name *fresh;
+	while ( f ) {
+		struct async_found *next = f->next;
+		switch ( f->kind ) {
+		case ASYNC_WATCH:
+			create_watch( ctx, f->wd, f->path );
+			// real events are recorded until the entries are in
+			fresh = async_name_find( a, f->wd, "" );
+			if ( !fresh ) fresh = async_name_add( a, f->wd, "", 0 );
+			fresh->until = LLONG_MAX;
+			break;
+		case ASYNC_READING:
+			async_self_add( ctx, f );
+			break;
+		case ASYNC_ENTRIES:
+			if ( f->has_snap ) {
+				watch *w = watch_from_wd( ctx, f->wd );
+				if ( w ) snapshot_set( ctx, w, &f->snap );
+			}
+			async_synthesize( a, f );
+			fresh = async_name_find( a, f->wd, "" );
+			if ( fresh ) fresh->until = now + ASYNC_DEDUP_MS;
+			async_self_done( ctx, f->wd );
+			break;
+		case ASYNC_ERROR:
+			fprintf( stderr, "Couldn't watch new directory %s: %s\n",
+			         f->path, strerror( f->error ) );
+			break;
+		case ASYNC_DONE:
+			--a->num_jobs;
+			break;
+		}
+		free( f->path );
+		free( f->names );
+		free( f );
+		f = next;
+	}
+	if ( a->num_names && now >= a->next_sweep ) async_sweep( a, now );
+}
+
+/**
+ * @internal
+ * Collect what the worker thread of @a ctx has found and move as many
+ * synthesized events as fit into the (empty) event buffer.  Called first
+ * thing whenever the buffer is refilled.
+ *
+ * @return 1 if there were synthesized events, 0 otherwise.
+ */
+static int async_read( inotifytools_ctx *ctx ) {
+	struct async *a = ctx->async;
+	a->synthetic = 0;
+	async_collect( ctx );
+	if ( !a->synth_bytes ) return 0;
+
+	read_buf_fit( ctx, a->synth_bytes );
+	size_t bytes = 0;
+	while ( bytes < a->synth_bytes ) {
+		struct inotify_event *event =
+		    (struct inotify_event *)(a->synth + bytes);
+		size_t size = sizeof(struct inotify_event) + event->len;
+		if ( bytes + size > ctx->event_buf_size ) break;
+		bytes += size;
+	}
+	memcpy( ctx->event_buf, a->synth, bytes );
+	a->synth_bytes -= bytes;
+	memmove( a->synth, a->synth + bytes, a->synth_bytes );
+	ctx->bytes = bytes;
+	a->synthetic = 1;
+	return 1;
+}
+
+/**
+ * @internal
+ * @return the eventfd the worker thread of @a ctx wakes up readers with.
+ */
+static int async_wake_fd( inotifytools_ctx *ctx ) {
+	return ctx->async->wake_fd;
+}
+
+/**
+ * @internal
+ * Check a real event which is about to be handed out against the events
+ * synthesized for fresh directories, and remember the names it reports.
+ *
+ * @return 1 if @a event reports an entry an event was synthesized for
+ *         already, so it must be dropped, 0 otherwise.
+ */
+static int async_is_duplicate( inotifytools_ctx *ctx,
+                               struct inotify_event const * event ) {
+	struct async *a = ctx->async;
+	if ( a->synthetic || !a->num_names || !event->len ||
+	     !(event->mask & (IN_CREATE | IN_MOVED_TO | IN_DELETE |
+	                      IN_MOVED_FROM)) ) {
+		return 0;
+	}
+	struct async_name *fresh = async_name_find( a, event->wd, "" );
+	if ( !fresh || fresh->until < now_ms() ) return 0;
+
+	struct async_name *n = async_name_find( a, event->wd, event->name );
+	if ( event->mask & (IN_DELETE | IN_MOVED_FROM) ) {
+		// a later IN_CREATE is for a new file
+		if ( n ) async_name_remove( a, n );
+		return 0;
+	}
+	if ( n && n->synthesized ) {
+		async_name_remove( a, n );
+		return 1;
+	}
+	if ( !n ) async_name_add( a, event->wd, event->name, 0 );
+	return 0;
+}
+
+/**
+ * @internal
+ * Check a real event which is about to be handed out against the
+ * directories the worker thread reads, and forget those whose events have
+ * all been seen.  The events of a read can't be told apart from someone
+ * else's, but only as many are dropped as the read causes: an IN_OPEN, the
+ * IN_ACCESS events up to the next IN_CLOSE_NOWRITE, and that one.
+ *
+ * @return 1 if @a event was caused by the worker thread reading a
+ *         directory, so it must be dropped, 0 otherwise.
+ */
+static int async_is_self( inotifytools_ctx *ctx,
+                          struct inotify_event const * event ) {
+	struct async *a = ctx->async;
+	if ( !a->self || a->synthetic ) return 0;
+	++a->checked;
+	int self = 0;
+	struct async_self **p = &a->self;
+	while ( *p ) {
+		struct async_self *s = *p;
+		int done = a->checked > s->until ||
+		           (event->mask & IN_Q_OVERFLOW) ||
+		           ((event->mask & IN_IGNORED) && event->wd == s->wd);
+		if ( !done && !self && s->wd == event->wd && event->len &&
+		     (event->mask & IN_ISDIR) && !strcmp( s->name, event->name ) ) {
+			uint32_t mask = event->mask & ASYNC_SELF_EVENTS;
+			if ( mask == IN_OPEN ) {
+				self = (s->expect & IN_OPEN) != 0;
+				s->expect &= ~IN_OPEN;
+			}
+			else if ( mask == IN_ACCESS ) {
+				self = !(s->expect & IN_OPEN) && (s->expect & IN_ACCESS);
+			}
+			else if ( mask == IN_CLOSE_NOWRITE ) {
+				self = (s->expect & IN_CLOSE_NOWRITE) != 0;
+				done = self;
+			}
+		}
+		if ( done ) {
+			*p = s->next;
+			free( s );
+			continue;
+		}
+		p = &s->next;
+	}
+	return self;
+}
+
+/**
+ * @internal
+ * Stop the worker thread of @a ctx and free everything it has not handed
+ * out yet.
+ */
+static void async_free( inotifytools_ctx *ctx ) {
+	struct async *a = ctx->async;
+	if ( !a ) return;
+
+	pthread_mutex_lock( &a->lock );
+	a->stop = 1;
+	pthread_cond_signal( &a->work_cond );
+	pthread_mutex_unlock( &a->lock );
+	pthread_join( a->thread, NULL );
+
+	while ( a->jobs ) {
+		struct async_job *next = a->jobs->next;
+		free( a->jobs->path );
+		free( a->jobs );
+		a->jobs = next;
+	}
+	while ( a->found ) {
+		struct async_found *next = a->found->next;
+		free( a->found->path );
+		free( a->found->names );
+		free( a->found );
+		a->found = next;
+	}
+	unsigned i;
+	for ( i = 0; i < a->num_buckets; ++i ) {
+		while ( a->buckets[i] ) {
+			struct async_name *next = a->buckets[i]->chain;
+			free( a->buckets[i] );
+			a->buckets[i] = next;
+		}
+	}
+	free( a->buckets );
+	while ( a->self ) {
+		struct async_self *next = a->self->next;
+		free( a->self );
+		a->self = next;
+	}
+	free( a->synth );
+	epoll_ctl( ctx->epoll_fd, EPOLL_CTL_DEL, a->wake_fd, NULL );
+	close( a->wake_fd );
+	pthread_cond_destroy( &a->idle_cond );
+	pthread_cond_destroy( &a->work_cond );
+	pthread_mutex_destroy( &a->lock );
+	free( a );
+	ctx->async = NULL;
+}
+
+/**
+ * @internal
+ * Start the worker thread of @a ctx.
+ *
+ * @return 1 on success, 0 on failure with @a ctx->error set.
+ */
+static int async_start( inotifytools_ctx *ctx ) {
+	struct async *a = (struct async *)calloc( 1, sizeof(struct async) );
+	if ( !a ) {
+		ctx->error = ENOMEM;
+		return 0;
+	}
+	a->ctx = ctx;
+	a->wake_fd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+	int error = a->wake_fd < 0 ? errno : 0;
+	if ( !error ) {
+		// wakes up the functions waiting for events
+		struct epoll_event ev;
+		memset( &ev, 0, sizeof(ev) );
+		ev.events = EPOLLIN | EPOLLET;
+		ev.data.fd = a->wake_fd;
+		if ( -1 == epoll_ctl( ctx->epoll_fd, EPOLL_CTL_ADD, a->wake_fd,
+		                      &ev ) ) {
+			error = errno;
+		}
+	}
+	if ( !error ) {
+		pthread_mutex_init( &a->lock, NULL );
+		pthread_cond_init( &a->work_cond, NULL );
+		pthread_cond_init( &a->idle_cond, NULL );
+		sigset_t all, old;
+		sigfillset( &all );
+		pthread_sigmask( SIG_SETMASK, &all, &old );
+		error = pthread_create( &a->thread, NULL, async_worker, a );
+		pthread_sigmask( SIG_SETMASK, &old, NULL );
+		if ( error ) {
+			pthread_cond_destroy( &a->idle_cond );
+			pthread_cond_destroy( &a->work_cond );
+			pthread_mutex_destroy( &a->lock );
+			epoll_ctl( ctx->epoll_fd, EPOLL_CTL_DEL, a->wake_fd, NULL );
+		}
+	}
+	if ( error ) {
+		if ( a->wake_fd >= 0 ) close( a->wake_fd );
+		free( a );
+		ctx->error = error;
+		return 0;
+	}
+	ctx->async = a;
+	return 1;
+}
+
+/**
+ * Set up recursive watches on an entire directory tree in the background.
+ *
+ * This is meant for directories which appear in a recursive watch while
+ * events are being read, as inotifywait -m -r and inotifywatch -r watch
+ * them.  Watching those with inotifytools_watch_recursively_excluding()
+ * holds up all events until the whole new tree is watched; this returns at
+ * once instead, and a worker thread reads the tree and adds the watches.
+ * The functions returning events register them, before returning any event
+ * for them.
+ *
+ * Files and directories in the new tree may have been created before their
+ * directory was watched, so no events were queued for them.  If @a events
+ * contains IN_CREATE, an IN_CREATE event, with IN_ISDIR for directories, is
+ * therefore synthesized for everything found in the new directories and
+ * returned like any other event.  Entries which also get a real IN_CREATE or
+ * IN_MOVED_TO event, because they were created after the watch was added but
+ * before the directory was read, are only reported once.  The event for
+ * @a path itself is not synthesized: that is the one which made you call
+ * this function.
+ *
+ * The worker thread reading the new directories causes no IN_OPEN,
+ * IN_ACCESS or IN_CLOSE_NOWRITE events, neither on their own watches nor on
+ * those of their parents.  Only as many events are dropped from the watch
+ * on a parent as the worker thread causes there, assuming the parent of
+ * @a path is watched for @a events too, but as inotify doesn't say who
+ * caused an event, someone else's IN_ACCESS events on a new directory
+ * between the worker thread opening and closing it are dropped with its
+ * own, and someone else's IN_OPEN or IN_CLOSE_NOWRITE event may be dropped
+ * in place of the worker thread's, which is then reported.
+ *
+ * Directories which are watched already are skipped, as are excluded
+ * directories and those pruned by inotifytools_set_prune_by_regex().
+ * Directories which vanish or can't be read are skipped silently, while
+ * other errors, such as running out of watches, are printed on stderr.
+ *
+ * If the backend watches whole trees on its own, see
+ * inotifytools_set_backend(), this is just
+ * inotifytools_watch_recursively_excluding().
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param path path of directory to watch.
+ *
+ * @param events Inotify events to watch for.  See section \ref events.
+ *
+ * @param exclude compiled list of directories not to watch, or NULL.  It is
+ *                used by the worker thread, so it must not be freed before
+ *                inotifytools_get_async_pending() returns 0.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().
+ */
+int inotifytools_watch_recursively_async( char const * path, int events,
+                                          inotifytools_exclude const * exclude ) {
+	return inotifytools_ctx_watch_recursively_async( &default_ctx, path,
+	                                                 events, exclude );
+}
+
+/**
+ * Like inotifytools_watch_recursively_async(), but operates on @a ctx.
+ */
+int inotifytools_ctx_watch_recursively_async( inotifytools_ctx *ctx,
+                                    char const * path, int events,
+                                    inotifytools_exclude const * exclude ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+
+	ctx->error = 0;
+	if ( ctx->backend->add_tree ) {
+		return inotifytools_ctx_watch_recursively_excluding( ctx, path,
+		                                                     events, exclude,
+		                                                     1 );
+	}
+
+	struct async_job *job =
+	    (struct async_job *)calloc( 1, sizeof(struct async_job) );
+	if ( !job ) {
+		ctx->error = ENOMEM;
+		return 0;
+	}
+	if ( path[strlen(path)-1] != '/' ) {
+		nasprintf( &job->path, "%s/", path );
+	}
+	else {
+		job->path = strdup( path );
+		niceassert( job->path, "out of memory" );
+	}
+	if ( watch_from_filename( ctx, job->path ) ||
+	     (!ctx->async && !async_start( ctx )) ) {
+		free( job->path );
+		free( job );
+		return !ctx->error;
+	}
+	job->events = events;
+	job->exclude = exclude;
+	job->prune = ctx->prune;
+	job->snapshot = ctx->rescan;
+
+	struct async *a = ctx->async;
+	pthread_mutex_lock( &a->lock );
+	if ( a->jobs_tail ) a->jobs_tail->next = job;
+	else a->jobs = job;
+	a->jobs_tail = job;
+	pthread_cond_signal( &a->work_cond );
+	pthread_mutex_unlock( &a->lock );
+	++a->num_jobs;
+	return 1;
+}
+
+/**
+ * Get the amount of work inotifytools_watch_recursively_async() has left.
+ *
+ * The work is done by the worker thread and the functions returning events,
+ * so keep reading events until this returns 0.
+ *
+ * @return the number of trees queued which are not fully watched yet, plus
+ *         one if synthesized events are waiting to be returned; 0 once all
+ *         is done.
+ */
+int inotifytools_get_async_pending() {
+	return inotifytools_ctx_get_async_pending( &default_ctx );
+}
+
+/**
+ * Like inotifytools_get_async_pending(), but operates on @a ctx.
+ */
+int inotifytools_ctx_get_async_pending( inotifytools_ctx *ctx ) {
+	struct async *a = ctx->async;
+	if ( !a ) return 0;
+	return a->num_jobs + (a->synth_bytes ? 1 : 0);
+}
+
+/**
+ * Bring recursive watches up to date after events may have been lost.
+ *
+ * When the kernel's event queue overflows, an event with IN_Q_OVERFLOW and a
+ * @a wd of -1 is queued and all further events are dropped until there is
+ * room again.  Directories created during that time are not watched, and
+ * watches on directories which were removed or moved are not updated.
+ *
+ * This function checks the directories below every directory watched with
+ * one of the inotifytools_watch_recursively() functions since
+ * inotifytools_set_rescan_on_overflow() was turned on.  Each watched
+ * directory is stat()ed, and only directories whose inode or modification
+ * time differ from when they were last read are read again.  Watches are
+ * added for new subdirectories, using the events and exclude list of the
+ * recursive watch they are below, watches on directories which no longer
+ * exist are removed, and directories which were moved are renamed as with
+ * inotifytools_replace_filename().  On a tree where little has changed this
+ * costs one stat() per watch.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().  Errors on single directories
+ *         are handled as in inotifytools_watch_recursively().
+ *
+ * @note The events lost in the overflow are not recreated; in particular
+ *       no IN_CREATE events are reported for the new directories.
+ */
+int inotifytools_rescan() {
+	return inotifytools_ctx_rescan( &default_ctx );
+}
+
+/**
+ * Like inotifytools_rescan(), but operates on @a ctx.
+ */
+int inotifytools_ctx_rescan( inotifytools_ctx *ctx ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+
+	ctx->error = 0;
+	if ( !ctx->roots ) return 1;
+
+	// Find all changed directories first, since adding and removing watches
+	// moves watches around in the table.
+	int *changed = NULL;
+	unsigned num = 0, size = 0;
+	unsigned i;
+	for ( i = 0; i < ctx->table_wd.size; ++i ) {
+		watch *w = ctx->table_wd.slots[i];
+		if ( !w ) continue;
+		char const * path = path_str( ctx, w->node );
+		size_t len = strlen( path );
+		if ( !len || path[len-1] != '/' || !rescan_root_find( ctx, path ) ) {
+			continue;
+		}
+		struct stat64 st;
+		if ( 0 == stat64( path, &st ) && snapshot_matches( ctx, w, &st ) ) {
+			continue;
+		}
+		if ( num == size ) {
+			size = size ? 2 * size : 64;
+			changed = (int *)realloc( changed, size * sizeof(int) );
+			niceassert( changed, "out of memory" );
+		}
+		changed[num++] = w->wd;
+	}
+
+	int ret = 1;
+	for ( i = 0; i < num && ret; ++i ) {
+		// earlier directories may have taken this one with them
+		watch *w = watch_from_wd( ctx, changed[i] );
+		if ( w ) ret = rescan_dir( ctx, w );
+	}
+	free( changed );
+	return ret;
+}
+
+/** Magic string at the start of files written by inotifytools_save_snapshot(). */
+#define SNAPFILE_MAGIC "ITSNAP1"
+
+/**
+ * @internal
+ * Header of a file written by inotifytools_save_snapshot().  It is followed
+ * by @a count entries and then by the NUL terminated paths they refer to,
+ * @a strings bytes from the start of the file.  Everything is in native byte
+ * order, since the file is only meant to be read on the same machine.
+ */
+struct snapfile_header {
+	char magic[8];
+	uint64_t count;
+	uint64_t strings;
+	uint64_t strings_size;
+};
+
+/**
+ * @internal
+ * A watched directory in a snapshot file.  @a ino is 0 if the directory has
+ * to be read again when the file is loaded.  @a path is the offset of its
+ * name in the string section.
+ */
+struct snapfile_entry {
+	uint64_t ino;
+	int64_t sec;
+	int64_t nsec;
+	uint64_t path;
+};
+
+/**
+ * Save the directories watched to @a file, so that
+ * inotifytools_watch_recursively_from_snapshot() can watch them again
+ * later without reading every one of them.
+ *
+ * Along with its name, the inode number and modification time of each
+ * directory are saved, as recorded while it was read.  Those are only kept
+ * while inotifytools_set_rescan_on_overflow() is on; without them, every
+ * directory is read again when the file is loaded.
+ *
+ * The file is replaced atomically, so a crash while saving leaves the
+ * previous snapshot in place.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param file name of the file to write.
  *
  * @return 1 on success, 0 on failure.  On failure, the error can be
  *         obtained from inotifytools_error().
  */
-int inotifytools_watch_files( char const * filenames[], int events ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	error = 0;
+int inotifytools_save_snapshot( char const * file ) {
+	return inotifytools_ctx_save_snapshot( &default_ctx, file );
+}
 
-	static int i;
-	for ( i = 0; filenames[i]; ++i ) {
-		static int wd;
-		wd = inotify_add_watch( inotify_fd, filenames[i], events );
-		if ( wd < 0 ) {
-			if ( wd == -1 ) {
-				error = errno;
-				return 0;
-			} // if ( wd == -1 )
+/**
+ * Like inotifytools_save_snapshot(), but operates on @a ctx.
+ */
+int inotifytools_ctx_save_snapshot( inotifytools_ctx *ctx,
+                                    char const * file ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+
+	ctx->error = 0;
+	struct snapfile_header header;
+	memset( &header, 0, sizeof(header) );
+	memcpy( header.magic, SNAPFILE_MAGIC, sizeof(header.magic) );
+	unsigned i;
+	for ( i = 0; i < ctx->table_wd.size; ++i ) {
+		watch *w = ctx->table_wd.slots[i];
+		if ( !w ) continue;
+		char const * path = path_str( ctx, w->node );
+		size_t len = strlen( path );
+		if ( !len || path[len-1] != '/' ) continue;
+		++header.count;
+		header.strings_size += len + 1;
+	}
+	header.strings = sizeof(header) +
+	                 header.count * sizeof(struct snapfile_entry);
+
+	char * tmp;
+	nasprintf( &tmp, "%s.tmp", file );
+	FILE * out = fopen( tmp, "w" );
+	if ( !out ) {
+		ctx->error = errno;
+		free( tmp );
+		return 0;
+	}
+	fwrite( &header, sizeof(header), 1, out );
+
+	// Entries first, then the paths they point to.
+	int pass;
+	for ( pass = 0; pass < 2; ++pass ) {
+		uint64_t offset = 0;
+		for ( i = 0; i < ctx->table_wd.size; ++i ) {
+			watch *w = ctx->table_wd.slots[i];
+			if ( !w ) continue;
+			char const * path = path_str( ctx, w->node );
+			size_t len = strlen( path );
+			if ( !len || path[len-1] != '/' ) continue;
+			if ( pass ) {
+				fwrite( path, len + 1, 1, out );
+				continue;
+			}
+			struct snapfile_entry entry;
+			memset( &entry, 0, sizeof(entry) );
+			if ( w->slot < ctx->snapshots_size ) {
+				struct dir_snapshot const * snap = &ctx->snapshots[w->slot];
+				entry.ino = snap->ino;
+				entry.sec = snap->mtime.tv_sec;
+				entry.nsec = snap->mtime.tv_nsec;
+			}
+			entry.path = offset;
+			offset += len + 1;
+			fwrite( &entry, sizeof(entry), 1, out );
+		}
+	}
+
+	int error = ferror( out ) ? EIO : 0;
+	if ( fclose( out ) && !error ) error = errno;
+	if ( !error && rename( tmp, file ) ) error = errno;
+	if ( error ) {
+		unlink( tmp );
+		ctx->error = error;
+	}
+	free( tmp );
+	return !error;
+}
+
+/**
+ * @internal
+ * A directory of a snapshot file being watched again.  @a same is set by
+ * snapload_check() if @a check is set.
+ */
+struct snapload_dir {
+	char * path;
+	struct dir_snapshot snap;
+	int wd;
+	int skip;
+	int check;
+	int same;
+};
+
+/**
+ * @internal
+ * State shared by the threads of snapload_check().
+ */
+struct snapload {
+	struct snapload_dir *dirs;
+	unsigned num_dirs;
+	unsigned next;
+};
+
+/** Number of directories a snapload_thread() checks at a time. */
+#define SNAPLOAD_CHUNK 64
+
+/**
+ * @internal
+ * Check directories of a snapshot file against their saved snapshot until
+ * none are left.
+ */
+static void * snapload_thread( void * arg ) {
+	struct snapload * l = (struct snapload *)arg;
+	for (;;) {
+		unsigned first = __atomic_fetch_add( &l->next, SNAPLOAD_CHUNK,
+		                                     __ATOMIC_RELAXED );
+		if ( first >= l->num_dirs ) break;
+		unsigned end = first + SNAPLOAD_CHUNK;
+		if ( end > l->num_dirs ) end = l->num_dirs;
+		unsigned i;
+		for ( i = first; i < end; ++i ) {
+			struct snapload_dir * d = &l->dirs[i];
+			struct stat64 st;
+			if ( !d->check ) continue;
+			d->same = 0;
+			if ( !d->snap.ino ) continue;
+			d->same = 0 == lstat64( d->path, &st ) &&
+			          d->snap.ino == st.st_ino &&
+			          d->snap.mtime.tv_sec == st.st_mtim.tv_sec &&
+			          d->snap.mtime.tv_nsec == st.st_mtim.tv_nsec;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @internal
+ * Find out which of @a l's directories to check still match their saved
+ * snapshot, using up to @a num_threads threads.
+ */
+static void snapload_check( struct snapload * l, int num_threads ) {
+	if ( (unsigned)num_threads > l->num_dirs / SNAPLOAD_CHUNK ) {
+		num_threads = l->num_dirs / SNAPLOAD_CHUNK;
+	}
+	pthread_t * threads = NULL;
+	int started = 0;
+	if ( num_threads > 1 ) {
+		threads = (pthread_t *)calloc( num_threads - 1, sizeof(pthread_t) );
+		niceassert( threads, "out of memory" );
+	}
+	for ( ; started < num_threads - 1; ++started ) {
+		if ( pthread_create( &threads[started], NULL, snapload_thread, l ) ) {
+			break;
+		}
+	}
+	snapload_thread( l );
+	int i;
+	for ( i = 0; i < started; ++i ) {
+		pthread_join( threads[i], NULL );
+	}
+	free( threads );
+}
+
+/**
+ * @internal
+ * Sort snapload_dirs by path, which puts every directory right before the
+ * ones below it.
+ */
+static int snapload_dir_cmp( void const * a, void const * b ) {
+	return strcmp( ((struct snapload_dir const *)a)->path,
+	               ((struct snapload_dir const *)b)->path );
+}
+
+/**
+ * @internal
+ * Map the snapshot file @a file and check that it is well formed.  The
+ * mapping is private, so paths in it can be modified as prune_dir() does.
+ *
+ * @return the mapping, of @a size bytes, or NULL if @a file can't be used.
+ */
+static struct snapfile_header * snapfile_map( char const * file,
+                                                    size_t * size ) {
+	int fd = open( file, O_RDONLY | O_CLOEXEC );
+	if ( fd < 0 ) return NULL;
+	struct stat64 st;
+	void * map = MAP_FAILED;
+	if ( 0 == fstat64( fd, &st ) &&
+	     (uint64_t)st.st_size >= sizeof(struct snapfile_header) ) {
+		*size = st.st_size;
+		map = mmap( NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+	}
+	close( fd );
+	if ( map == MAP_FAILED ) return NULL;
+
+	struct snapfile_header * header = (struct snapfile_header *)map;
+	int valid =
+	    !memcmp( header->magic, SNAPFILE_MAGIC, sizeof(header->magic) ) &&
+	    header->count <= (*size - sizeof(*header)) /
+	                     sizeof(struct snapfile_entry) &&
+	    header->strings == sizeof(*header) +
+	                       header->count * sizeof(struct snapfile_entry) &&
+	    header->strings_size <= *size - header->strings &&
+	    (!header->count ||
+	     (header->strings_size &&
+	      !((char const *)map)[header->strings + header->strings_size - 1]));
+	struct snapfile_entry const * entries =
+	    (struct snapfile_entry const *)(header + 1);
+	uint64_t i;
+	for ( i = 0; valid && i < header->count; ++i ) {
+		valid = entries[i].path < header->strings_size;
+	}
+	if ( !valid ) {
+		munmap( map, *size );
+		return NULL;
+	}
+	return header;
+}
+
+/**
+ * @internal
+ * Read the directory @a buf->str of a snapshot file again since it changed,
+ * and watch it along with the subdirectories which are not watched yet and
+ * everything below them.  @a buf->str must end in '/', and only the root of
+ * the tree, @a is_root, may be a symbolic link.
+ *
+ * @return 1 on success, 0 on failure with @a ctx->error set.
+ */
+static int snapload_read( inotifytools_ctx *ctx, struct path_buf *buf,
+                          int events, inotifytools_exclude const * exclude,
+                          int is_root ) {
+	int fd = open( buf->str, O_RDONLY | O_DIRECTORY | O_CLOEXEC |
+	                         (is_root ? 0 : O_NOFOLLOW) );
+	if ( fd < 0 ) {
+		ctx->error = errno;
+		return 0;
+	}
+	// Taken before reading, as by watch_dir_recursively().
+	struct dir_snapshot snap;
+	int have_snap = snapshot_take( fd, &snap );
+	DIR * dir = fdopendir( fd );
+	if ( !dir ) {
+		ctx->error = errno;
+		close( fd );
+		return 0;
+	}
+	size_t len = buf->len;
+	struct dirent * ent;
+	int ret = 1;
+	while ( ret && (ent = readdir( dir )) ) {
+		if ( !strcmp( ent->d_name, "." ) || !strcmp( ent->d_name, ".." ) ) {
+			continue;
+		}
+		if ( 1 != dirent_is_dir( dirfd( dir ), ent ) ) continue;
+
+		path_buf_append( buf, ent->d_name, "/" );
+		if ( !watch_from_filename( ctx, buf->str ) &&
+		     !prune_dir( ctx->prune ? ctx->filter : NULL, buf->str ) &&
+		     !inotifytools_exclude_matches( exclude, buf->str ) ) {
+			int child_fd = openat( dirfd( dir ), ent->d_name,
+			                       O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+			                       O_CLOEXEC );
+			if ( child_fd < 0 ) {
+				ctx->error = errno;
+				ret = 0;
+			}
 			else {
-				fprintf( stderr, "Failed to watch %s: returned wd was %d "
-				         "(expected -1 or >0 )", filenames[i], wd );
-				// no appropriate value for error
-				return 0;
-			} // else
-		} // if ( wd < 0 )
+				ret = watch_dir_recursively( ctx, child_fd, buf, events,
+				                             exclude );
+			}
+			if ( !ret && (EACCES == ctx->error || ENOENT == ctx->error ||
+			              ELOOP == ctx->error) ) {
+				ret = 1;
+			}
+		}
+		path_buf_truncate( buf, len );
+	}
+	closedir( dir );
+	if ( !ret ) return 0;
+	ctx->error = 0;
+	return watch_dir( ctx, buf->str, events, have_snap ? &snap : NULL );
+}
+
+/**
+ * Set up recursive watches on an entire directory tree, starting from a
+ * snapshot saved by inotifytools_save_snapshot().
+ *
+ * This behaves like inotifytools_watch_recursively_excluding(), but rather
+ * than reading every directory of the tree, the directories listed for it
+ * in @a file are watched straight away.  Only those which were modified
+ * since the snapshot was taken, judging by their inode number and
+ * modification time, are read again to find new subdirectories.  When
+ * restarting on a large tree which changed little, this saves most of the
+ * time spent setting up watches.
+ *
+ * Directories are checked again once they are watched, so changes made
+ * while the watches are being set up are noticed too.  Changes which leave a
+ * directory's modification time alone, such as setting it back with
+ * touch(1), are not noticed.
+ *
+ * If @a file does not exist, can't be read, or has no snapshot of @a path,
+ * the tree is read in full as by inotifytools_watch_recursively_excluding().
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param file name of the snapshot file.
+ *
+ * @param path path of directory or file to watch.
+ *
+ * @param events Inotify events to watch for.  See section \ref events.
+ *
+ * @param exclude list of directories not to watch, as returned by
+ *                inotifytools_exclude_compile().  Can be NULL if no
+ *                directories are to be excluded.
+ *
+ * @param num_threads number of threads checking directories against the
+ *                    snapshot, or scanning the tree if it is read in full.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error().  Errors on subdirectories are
+ *         handled as in inotifytools_watch_recursively_excluding().
+ */
+int inotifytools_watch_recursively_from_snapshot( char const * file,
+                                    char const * path, int events,
+                                    inotifytools_exclude const * exclude,
+                                    int num_threads ) {
+	return inotifytools_ctx_watch_recursively_from_snapshot( &default_ctx,
+	                                                         file, path,
+	                                                         events, exclude,
+	                                                         num_threads );
+}
+
+/**
+ * Like inotifytools_watch_recursively_from_snapshot(), but operates on
+ * @a ctx.
+ */
+int inotifytools_ctx_watch_recursively_from_snapshot( inotifytools_ctx *ctx,
+                                    char const * file,
+                                    char const * path, int events,
+                                    inotifytools_exclude const * exclude,
+                                    int num_threads ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+
+	size_t size = 0;
+	struct snapfile_header * header =
+	    ctx->backend->add_tree ? NULL : snapfile_map( file, &size );
+	if ( !header ) {
+		return inotifytools_ctx_watch_recursively_excluding( ctx, path,
+		                                                     events, exclude,
+		                                                     num_threads );
+	}
+
+	ctx->error = 0;
+	struct path_buf buf = { 0, 0, 0 };
+	path_buf_append( &buf, path,
+	                 path[strlen(path)-1] == '/' ? "" : "/" );
+
+	// Pick the directories of the tree below @a path.
+	struct snapfile_entry const * entries =
+	    (struct snapfile_entry const *)(header + 1);
+	char * strings = (char *)header + header->strings;
+	struct snapload l;
+	memset( &l, 0, sizeof(l) );
+	int have_root = 0;
+	uint64_t i;
+	for ( i = 0; i < header->count; ++i ) {
+		char * name = &strings[entries[i].path];
+		size_t len = strlen( name );
+		if ( len < buf.len || name[len-1] != '/' ||
+		     strncmp( name, buf.str, buf.len ) ) {
+			continue;
+		}
+		if ( !l.dirs ) {
+			l.dirs = (struct snapload_dir *)calloc(
+			    header->count - i, sizeof(struct snapload_dir) );
+			niceassert( l.dirs, "out of memory" );
+		}
+		struct snapload_dir * d = &l.dirs[l.num_dirs++];
+		d->path = name;
+		d->snap.ino = entries[i].ino;
+		d->snap.mtime.tv_sec = entries[i].sec;
+		d->snap.mtime.tv_nsec = entries[i].nsec;
+		if ( !name[buf.len] ) have_root = 1;
+	}
+	if ( !have_root ) {
+		free( l.dirs );
+		free( buf.str );
+		munmap( header, size );
+		return inotifytools_ctx_watch_recursively_excluding( ctx, path,
+		                                                     events, exclude,
+		                                                     num_threads );
+	}
+	qsort( l.dirs, l.num_dirs, sizeof(struct snapload_dir),
+	       snapload_dir_cmp );
+
+	// Leave out directories already watched, and excluded ones along with
+	// everything below them.  The root sorts first.
+	unsigned j;
+	for ( j = 1; j < l.num_dirs; ++j ) {
+		struct snapload_dir * d = &l.dirs[j];
+		if ( watch_from_filename( ctx, d->path ) ) {
+			d->skip = 1;
+			continue;
+		}
+		if ( prune_dir( ctx->prune ? ctx->filter : NULL, d->path ) ||
+		     inotifytools_exclude_matches( exclude, d->path ) ) {
+			size_t len = strlen( d->path );
+			for ( ; j < l.num_dirs &&
+			        !strncmp( l.dirs[j].path, d->path, len ); ++j ) {
+				l.dirs[j].skip = 1;
+			}
+			--j;
+		}
+	}
+	for ( j = 0; j < l.num_dirs; ++j ) {
+		l.dirs[j].wd = -1;
+		l.dirs[j].check = !l.dirs[j].skip;
+	}
+	snapload_check( &l, num_threads );
+
+	// Directories below others come first, so that both reading changed
+	// directories and watching new ones below them are done before their
+	// parents are watched, and cause no events.
+	int ret = 1;
+	for ( j = l.num_dirs; j-- > 0 && ret; ) {
+		struct snapload_dir * d = &l.dirs[j];
+		if ( d->skip ) continue;
+		if ( d->same ) {
+			d->wd = ctx->backend->add_watch( ctx->backend_data,
+			                                 ctx->inotify_fd, d->path,
+			                                 events | IN_ONLYDIR |
+			                                 (j ? IN_DONT_FOLLOW : 0) );
+			watch *w = d->wd < 0 ? NULL : create_watch( ctx, d->wd, d->path );
+			if ( w ) snapshot_set( ctx, w, &d->snap );
+			if ( d->wd < 0 ) ctx->error = errno;
+		}
+		else {
+			struct path_buf dir = { 0, 0, 0 };
+			path_buf_append( &dir, d->path, "" );
+			snapload_read( ctx, &dir, events, exclude, !j );
+			free( dir.str );
+		}
+		int error = ctx->error;
+		ctx->error = 0;
+		if ( error && (!j || (error != EACCES && error != ENOENT &&
+		                      error != ELOOP && error != ENOTDIR)) ) {
+			ctx->error = error;
+			ret = 0;
+		}
+	}
+
+	// Directories changed before their watch was added would miss events,
+	// so those are checked once more, and read again if they changed.
+	if ( ret ) {
+		for ( j = 0; j < l.num_dirs; ++j ) {
+			l.dirs[j].check = l.dirs[j].wd >= 0;
+		}
+		snapload_check( &l, num_threads );
+		for ( j = 0; j < l.num_dirs && ret; ++j ) {
+			struct snapload_dir * d = &l.dirs[j];
+			if ( !d->check || d->same ) continue;
+			watch *w = watch_from_wd( ctx, d->wd );
+			if ( w ) ret = rescan_dir_for( ctx, w, events, exclude );
+		}
+	}
+	if ( ret && ctx->rescan ) {
+		rescan_root_add( ctx, buf.str, events, exclude );
+	}
+	free( l.dirs );
+	free( buf.str );
+	munmap( header, size );
+	return ret;
+}
+
+/**
+ * @internal
+ * Count an event with @a mask on @a slot in the current interval.
+ */
+static void record_interval( inotifytools_ctx *ctx, unsigned slot,
+                             uint32_t mask ) {
+	unsigned b = ctx->epoch & 1;
+	int i;
+	if ( ctx->interval_epoch[b][slot] != ctx->epoch ) {
+		for ( i = 0; i < NUM_STATS; ++i ) {
+			if ( ctx->interval[b][i] ) ctx->interval[b][i][slot] = 0;
+		}
+		ctx->interval_epoch[b][slot] = ctx->epoch;
+	}
+	for ( mask &= STAT_EVENTS; mask; mask &= mask - 1 ) {
+		i = __builtin_ctz( mask );
+		++ctx->interval[b][i][slot];
+		++ctx->interval_total[b][i];
+	}
+	++ctx->interval[b][STAT_TOTAL][slot];
+	++ctx->interval_total[b][STAT_TOTAL];
+}
+
+/**
+ * @internal
+ */
+void record_stats( inotifytools_ctx *ctx, struct inotify_event const * event ) {
+	if (!event) return;
+	watch *w = watch_from_wd(ctx, event->wd);
+	if (!w) return;
+	uint32_t mask = event->mask & STAT_EVENTS;
+	for ( ; mask; mask &= mask - 1 ) {
+		int i = __builtin_ctz( mask );
+		++ctx->stats[i][w->slot];
+		++ctx->stat_total[i];
+	}
+	++ctx->stats[STAT_TOTAL][w->slot];
+	++ctx->stat_total[STAT_TOTAL];
+	if ( ctx->epoch ) record_interval( ctx, w->slot, event->mask );
+}
+
+/**
+ * @internal
+ * @return the index of @a event in the statistics table, STAT_TOTAL for 0 or
+ *         -1 if @a event is not a single counted event.
+ */
+static int stat_index( int event ) {
+	if ( 0 == event ) return STAT_TOTAL;
+	if ( (event & ~STAT_EVENTS) || (event & (event - 1)) ) return -1;
+	return __builtin_ctz( event );
+}
+
+/**
+ * @internal
+ * Clamp a 64-bit counter to the range of the int returning accessors.
+ */
+static int stat_to_int( long long count ) {
+	return count > INT_MAX ? INT_MAX : (int)count;
+}
+
+/**
+ * Get statistics by a particular watch descriptor.
+ *
+ * inotifytools_initialize_stats() must be called before this function can
+ * be used.
+ *
+ * @param wd watch descriptor to get stats for.
+ *
+ * @param event a single inotify event to get statistics for, or 0 for event
+ *              total.  See section \ref events.
+ *
+ * @return the number of times the event specified by @a event has occurred on
+ *         the watch descriptor specified by @a wd since stats collection was
+ *         enabled, or -1 if @a event or @a wd are invalid.  Counts which do
+ *         not fit into an int are returned as INT_MAX; use
+ *         inotifytools_get_stat64_by_wd() to get the exact value.
+ */
+int inotifytools_get_stat_by_wd( int wd, int event ) {
+	return inotifytools_ctx_get_stat_by_wd( &default_ctx, wd, event );
+}
+
+/**
+ * Like inotifytools_get_stat_by_wd(), but operates on @a ctx.
+ */
+int inotifytools_ctx_get_stat_by_wd( inotifytools_ctx *ctx, int wd,
+                                     int event ) {
+	return stat_to_int( inotifytools_ctx_get_stat64_by_wd( ctx, wd, event ) );
+}
+
+/**
+ * Like inotifytools_get_stat_by_wd(), but returns the full 64-bit count.
+ */
+long long inotifytools_get_stat64_by_wd( int wd, int event ) {
+	return inotifytools_ctx_get_stat64_by_wd( &default_ctx, wd, event );
+}
+
+/**
+ * Like inotifytools_get_stat64_by_wd(), but operates on @a ctx.
+ */
+long long inotifytools_ctx_get_stat64_by_wd( inotifytools_ctx *ctx, int wd,
+                                             int event ) {
+	if (!ctx->collect_stats) return -1;
+
+	watch *w = watch_from_wd(ctx, wd);
+	if (!w) return -1;
+	int i = stat_index(event);
+	if (i < 0) return -1;
+	return ctx->stats[i][w->slot];
+}
+
+/**
+ * Get statistics aggregated across all watches.
+ *
+ * inotifytools_initialize_stats() must be called before this function can
+ * be used.
+ *
+ * @param event a single inotify event to get statistics for, or 0 for event
+ *              total.  See section \ref events.
+ *
+ * @return the number of times the event specified by @a event has occurred over
+ *         all watches since stats collection was enabled, or -1 if @a event
+ *         is not a valid event.  Counts which do not fit into an int are
+ *         returned as INT_MAX; use inotifytools_get_stat64_total() to get the
+ *         exact value.
+ */
+int inotifytools_get_stat_total( int event ) {
+	return inotifytools_ctx_get_stat_total( &default_ctx, event );
+}
+
+/**
+ * Like inotifytools_get_stat_total(), but operates on @a ctx.
+ */
+int inotifytools_ctx_get_stat_total( inotifytools_ctx *ctx, int event ) {
+	return stat_to_int( inotifytools_ctx_get_stat64_total( ctx, event ) );
+}
 
-		char *filename;
-		// Always end filename with / if it is a directory
-		if ( !isdir(filenames[i])
-		     || filenames[i][strlen(filenames[i])-1] == '/') {
-			filename = strdup(filenames[i]);
-		}
-		else {
-			nasprintf( &filename, "%s/", filenames[i] );
-		}
-		create_watch(wd, filename);
-		free(filename);
-	} // for
+/**
+ * Like inotifytools_get_stat_total(), but returns the full 64-bit count.
+ */
+long long inotifytools_get_stat64_total( int event ) {
+	return inotifytools_ctx_get_stat64_total( &default_ctx, event );
+}
 
-	return 1;
+/**
+ * Like inotifytools_get_stat64_total(), but operates on @a ctx.
+ */
+long long inotifytools_ctx_get_stat64_total( inotifytools_ctx *ctx,
+                                             int event ) {
+	if (!ctx->collect_stats) return -1;
+	int i = stat_index(event);
+	if (i < 0) return -1;
+	return ctx->stat_total[i];
 }
 
 /**
- * Get the next inotify event to occur.
+ * @internal
+ * @return the count at index @a i of the statistics table for @a slot, in
+ *         the last interval if @a interval is set and in total otherwise.
+ */
+static uint64_t stat_count( inotifytools_ctx const *ctx, int i,
+                            unsigned slot, int interval ) {
+	if ( !interval ) return ctx->stats[i][slot];
+	unsigned b = (ctx->epoch - 1) & 1;
+	if ( ctx->interval_epoch[b][slot] != ctx->epoch - 1 ) return 0;
+	return ctx->interval[b][i][slot];
+}
+
+/**
+ * Get statistics by a particular watch descriptor for the last interval.
  *
- * inotifytools_initialize() must be called before this function can
- * be used.
+ * @param wd watch descriptor to get stats for.
  *
- * @param timeout maximum amount of time, in seconds, to wait for an event.
- *                If @a timeout is 0, the function is non-blocking.  If
- *                @a timeout is negative, the function will block until an
- *                event occurs.
+ * @param event a single inotify event to get statistics for, or 0 for event
+ *              total.  See section \ref events.
  *
- * @return pointer to an inotify event, or NULL if function timed out before
- *         an event occurred.  The event is located in static storage and it
- *         may be overwritten in subsequent calls; do not call free() on it,
- *         and make a copy if you want to keep it.
+ * @return the number of times the event specified by @a event occurred on
+ *         the watch descriptor specified by @a wd during the interval ended
+ *         by the latest call to inotifytools_next_interval(), or -1 if there
+ *         was none yet or @a event or @a wd are invalid.
+ */
+long long inotifytools_get_interval_stat_by_wd( int wd, int event ) {
+	return inotifytools_ctx_get_interval_stat_by_wd( &default_ctx, wd,
+	                                                 event );
+}
+
+/**
+ * Like inotifytools_get_interval_stat_by_wd(), but operates on @a ctx.
+ */
+long long inotifytools_ctx_get_interval_stat_by_wd( inotifytools_ctx *ctx,
+                                                    int wd, int event ) {
+	if ( !ctx->collect_stats || !ctx->epoch ) return -1;
+
+	watch *w = watch_from_wd( ctx, wd );
+	if ( !w ) return -1;
+	int i = stat_index( event );
+	if ( i < 0 ) return -1;
+	return stat_count( ctx, i, w->slot, 1 );
+}
+
+/**
+ * Get statistics aggregated across all watches for the last interval.
  *
- * @note Your program should call this function or
- *       inotifytools_next_events() frequently; between calls to this function,
- *       inotify events will be queued in the kernel, and eventually the queue
- *       will overflow and you will miss some events.
+ * @param event a single inotify event to get statistics for, or 0 for event
+ *              total.  See section \ref events.
  *
- * @note If the function inotifytools_ignore_events_by_regex() has been called
- *       with a non-NULL parameter, this function will not return on events
- *       which match the regular expression passed to that function.  However,
- *       the @a timeout period begins again each time a matching event occurs.
+ * @return the number of times the event specified by @a event occurred over
+ *         all watches during the interval ended by the latest call to
+ *         inotifytools_next_interval(), or -1 if there was none yet or
+ *         @a event is not a valid event.
  */
-struct inotify_event * inotifytools_next_event( int timeout ) {
-	return inotifytools_next_events( timeout, 1 );
+long long inotifytools_get_interval_stat_total( int event ) {
+	return inotifytools_ctx_get_interval_stat_total( &default_ctx, event );
 }
 
+/**
+ * Like inotifytools_get_interval_stat_total(), but operates on @a ctx.
+ */
+long long inotifytools_ctx_get_interval_stat_total( inotifytools_ctx *ctx,
+                                                    int event ) {
+	if ( !ctx->collect_stats || !ctx->epoch ) return -1;
+	int i = stat_index( event );
+	if ( i < 0 ) return -1;
+	return ctx->interval_total[(ctx->epoch - 1) & 1][i];
+}
 
 /**
- * Get the next inotify events to occur.
+ * Get statistics by a particular filename.
  *
- * inotifytools_initialize() must be called before this function can
+ * inotifytools_initialize_stats() must be called before this function can
  * be used.
  *
- * @param timeout maximum amount of time, in seconds, to wait for an event.
- *                If @a timeout is 0, the function is non-blocking.  If
- *                @a timeout is negative, the function will block until an
- *                event occurs.
+ * @param filename name of file to get stats for.
  *
- * @param num_events approximate number of inotify events to wait for until
- *                   this function returns.  Use this for buffering reads to
- *                   inotify if you expect to receive large amounts of events.
- *                   You are NOT guaranteed that this number of events will
- *                   actually be read; instead, you are guaranteed that the
- *                   number of bytes read from inotify is
- *                   @a num_events * sizeof(struct inotify_event).  Obviously
- *                   the larger this number is, the greater the latency between
- *                   when an event occurs and when you'll know about it.
- *                   May not be larger than 4096.
+ * @param event a single inotify event to get statistics for, or 0 for event
+ *              total.  See section \ref events.
  *
- * @return pointer to an inotify event, or NULL if function timed out before
- *         an event occurred or @a num_events < 1.  The event is located in
- *         static storage and it may be overwritten in subsequent calls; do not
- *         call free() on it, and make a copy if you want to keep it.
- *         When @a num_events is greater than 1, this will return a pointer to
- *         the first event only, and you MUST call this function again to
- *         get pointers to subsequent events; don't try to add to the pointer
- *         to find the next events or you will run into trouble.
+ * @return the number of times the event specified by @a event has occurred on
+ *         the file specified by @a filename since stats collection was
+ *         enabled, or -1 if the file is not being watched or @a event is
+ *         invalid.
  *
- * @note You may actually get different events with different values of
- *       @a num_events.  This is because inotify does some in-kernel filtering
- *       of duplicate events, meaning some duplicate events will not be
- *       reported if @a num_events > 1.  For some purposes this is fine, but
- *       for others (such as gathering accurate statistics on numbers of event
- *       occurrences) you must call this function with @a num_events = 1, or
- *       simply use inotifytools_next_event().
+ * @note The filename specified must always be the original name used to
+ *       establish the watch.
+ */
+int inotifytools_get_stat_by_filename( char const * filename,
+                                                int event ) {
+	return inotifytools_ctx_get_stat_by_filename( &default_ctx, filename, event );
+}
+
+/**
+ * Like inotifytools_get_stat_by_filename(), but operates on @a ctx.
+ */
+int inotifytools_ctx_get_stat_by_filename( inotifytools_ctx *ctx,
+                                           char const * filename, int event ) {
+	return inotifytools_ctx_get_stat_by_wd( ctx,
+	       inotifytools_ctx_wd_from_filename( ctx, filename ), event );
+}
+
+/**
+ * Like inotifytools_get_stat_by_filename(), but returns the full 64-bit
+ * count.
+ */
+long long inotifytools_get_stat64_by_filename( char const * filename,
+                                               int event ) {
+	return inotifytools_ctx_get_stat64_by_filename( &default_ctx, filename,
+	                                                event );
+}
+
+/**
+ * Like inotifytools_get_stat64_by_filename(), but operates on @a ctx.
+ */
+long long inotifytools_ctx_get_stat64_by_filename( inotifytools_ctx *ctx,
+                                                   char const * filename,
+                                                   int event ) {
+	return inotifytools_ctx_get_stat64_by_wd( ctx,
+	       inotifytools_ctx_wd_from_filename( ctx, filename ), event );
+}
+
+/**
+ * Get the last error which occurred.
  *
- * @note Your program should call this function or
- *       inotifytools_next_events() frequently; between calls to this function,
- *       inotify events will be queued in the kernel, and eventually the queue
- *       will overflow and you will miss some events.
+ * When a function fails, call this to find out why.  The returned value is
+ * a typical @a errno value, the meaning of which depends on context.  For
+ * example, if inotifytools_watch_file() fails because you attempt to watch
+ * a file which doesn't exist, this function will return @a ENOENT.
  *
- * @note If the function inotifytools_ignore_events_by_regex() has been called
- *       with a non-NULL parameter, this function will not return on events
- *       which match the regular expression passed to that function.  However,
- *       the @a timeout period begins again each time a matching event occurs.
+ * @return an error code.
  */
-struct inotify_event * inotifytools_next_events( int timeout, int num_events ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
-	niceassert( num_events <= MAX_EVENTS, "too many events requested" );
+int inotifytools_error() {
+	return default_ctx.error;
+}
 
-	if ( num_events < 1 ) return NULL;
+/**
+ * Like inotifytools_error(), but returns the last error on @a ctx.
+ */
+int inotifytools_ctx_error( inotifytools_ctx *ctx ) {
+	return ctx->error;
+}
 
-	static struct inotify_event event[MAX_EVENTS];
-	static struct inotify_event * ret;
-	static int first_byte = 0;
-	static ssize_t bytes;
-	static jmp_buf jmp;
-	static char match_name[MAX_STRLEN];
-
-#define RETURN(A) {\
-	if (regex) {\
-		inotifytools_snprintf(match_name, MAX_STRLEN, A, "%w%f");\
-		if (0 == regexec(regex, match_name, 0, 0, 0)) {\
-			longjmp(jmp,0);\
-		}\
-	}\
-	if ( collect_stats ) {\
-		record_stats( A );\
-	}\
-	return A;\
-}
-
-	setjmp(jmp);
-
-	error = 0;
-
-	// first_byte is index into event buffer
-	if ( first_byte != 0
-	  && first_byte <= (int)(bytes - sizeof(struct inotify_event)) ) {
-
-		ret = (struct inotify_event *)((char *)&event[0] + first_byte);
-		first_byte += sizeof(struct inotify_event) + ret->len;
-
-		// if the pointer to the next event exactly hits end of bytes read,
-		// that's good.  next time we're called, we'll read.
-		if ( first_byte == bytes ) {
-			first_byte = 0;
-		}
-		else if ( first_byte > bytes ) {
-			// oh... no.  this can't be happening.  An incomplete event.
-			// Copy what we currently have into first element, call self to
-			// read remainder.
-			// oh, and they BETTER NOT overlap.
-			// Boy I hope this code works.
-			// But I think this can never happen due to how inotify is written.
-			niceassert( (long)((char *)&event[0] +
-			            sizeof(struct inotify_event) +
-			            event[0].len) <= (long)ret,
-			            "extremely unlucky user, death imminent" );
-			// how much of the event do we have?
-			bytes = (char *)&event[0] + bytes - (char *)ret;
-			memcpy( &event[0], ret, bytes );
-			return inotifytools_next_events( timeout, num_events );
-		}
-		RETURN(ret);
-
-	}
-
-	else if ( first_byte == 0 ) {
-		bytes = 0;
-	}
-
-
-	static ssize_t this_bytes;
-	static unsigned int bytes_to_read;
-	static int rc;
-	static fd_set read_fds;
-
-	static struct timeval read_timeout;
-	read_timeout.tv_sec = timeout;
-	read_timeout.tv_usec = 0;
-	static struct timeval * read_timeout_ptr;
-	read_timeout_ptr = ( timeout <= 0 ? NULL : &read_timeout );
-
-	FD_ZERO(&read_fds);
-	FD_SET(inotify_fd, &read_fds);
-	rc = select(inotify_fd + 1, &read_fds,
-	            NULL, NULL, read_timeout_ptr);
-	if ( rc < 0 ) {
-		// error
-		error = errno;
-		return NULL;
-	}
-	else if ( rc == 0 ) {
-		// timeout
-		return NULL;
+/**
+ * @internal
+ */
+int isdir( char const * path ) {
+	struct stat64 my_stat;
+
+	if ( -1 == lstat64( path, &my_stat ) ) {
+		if (errno == ENOENT) return 0;
+		fprintf(stderr, "Stat failed on %s: %s\n", path, strerror(errno));
+		return 0;
 	}
 
-	// wait until we have enough bytes to read
-	do {
-		rc = ioctl( inotify_fd, FIONREAD, &bytes_to_read );
-	} while ( !rc &&
-	          bytes_to_read < sizeof(struct inotify_event)*num_events );
+	return S_ISDIR( my_stat.st_mode ) && !S_ISLNK( my_stat.st_mode );
+}
 
-	if ( rc == -1 ) {
-		error = errno;
-		return NULL;
-	}
 
-	this_bytes = read(inotify_fd, &event[0] + bytes,
-	                  sizeof(struct inotify_event)*MAX_EVENTS - bytes);
-	if ( this_bytes < 0 ) {
-		error = errno;
-		return NULL;
-	}
-	if ( this_bytes == 0 ) {
-		fprintf(stderr, "Inotify reported end-of-file.  Possibly too many "
-		                "events occurred at once.\n");
-		return NULL;
-	}
-	bytes += this_bytes;
+/**
+ * Get the number of watches set up through libinotifytools.
+ *
+ * @return number of watches set up by inotifytools_watch_file(),
+ *         inotifytools_watch_files() and inotifytools_watch_recursively().
+ */
+int inotifytools_get_num_watches() {
+	return inotifytools_ctx_get_num_watches( &default_ctx );
+}
 
-	ret = &event[0];
-	first_byte = sizeof(struct inotify_event) + ret->len;
-	niceassert( first_byte <= bytes, "ridiculously long filename, things will "
-	                                 "almost certainly screw up." );
-	if ( first_byte == bytes ) {
-		first_byte = 0;
-	}
+/**
+ * Like inotifytools_get_num_watches(), but operates on @a ctx.
+ */
+int inotifytools_ctx_get_num_watches( inotifytools_ctx *ctx ) {
+	return ctx->table_wd.count;
+}
 
-	RETURN(ret);
+/**
+ * Make the functions waiting for events return while @a fd is readable.
+ *
+ * They then return no event, as on a timeout, and inotifytools_error() is
+ * 0.  Unlike a signal interrupting the wait, this can't be missed by a
+ * signal arriving just before the wait starts: e.g. a signal handler may
+ * write to a pipe whose read end is @a fd.  The functions keep returning at
+ * once until @a fd is read from.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.  inotifytools_cleanup() forgets @a fd, but doesn't close it.
+ *
+ * @param fd file descriptor to wait on along with the events, or -1 for
+ *           none.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be obtained
+ *         from inotifytools_error().
+ */
+int inotifytools_set_wake_fd( int fd ) {
+	return inotifytools_ctx_set_wake_fd( &default_ctx, fd );
+}
 
-#undef RETURN
+/**
+ * Like inotifytools_set_wake_fd(), but operates on @a ctx.
+ */
+int inotifytools_ctx_set_wake_fd( inotifytools_ctx *ctx, int fd ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	if ( fd >= 0 ) {
+		struct epoll_event ev;
+		memset( &ev, 0, sizeof(ev) );
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if ( -1 == epoll_ctl( ctx->epoll_fd, EPOLL_CTL_ADD, fd, &ev ) ) {
+			ctx->error = errno;
+			return 0;
+		}
+	}
+	if ( ctx->wake_fd >= 0 ) {
+		epoll_ctl( ctx->epoll_fd, EPOLL_CTL_DEL, ctx->wake_fd, NULL );
+	}
+	ctx->wake_fd = fd;
+	return 1;
 }
 
 /**
- * Set up recursive watches on an entire directory tree.
+ * Limit the size of the buffer events are read into.
+ *
+ * Events are read from the kernel into a buffer which starts out at 64KiB.
+ * Whenever more events are queued than fit into it, or a read fills it, the
+ * buffer is doubled for the next read, up to @a bytes.  Larger buffers let a
+ * single read drain more of the kernel queue during bursts, so fewer reads
+ * are needed and the queue is less likely to overflow.  If the buffer is
+ * larger than @a bytes, it is shrunk before the next read.
  *
  * inotifytools_initialize() must be called before this function can
  * be used.
  *
- * @param path path of directory or file to watch.  If the path is a directory,
- *             every subdirectory will also be watched for the same events up
- *             to the maximum readable depth.  If the path is a file, the file
- *             is watched exactly as if inotifytools_watch_file() were used.
- *
- * @param events Inotify events to watch for.  See section \ref events.
+ * @param bytes largest size of the read buffer.  The default is 1MiB.  Must
+ *              be large enough for an event with the longest possible file
+ *              name, sizeof(struct inotify_event) + NAME_MAX + 1 bytes.
  *
- * @return 1 on success, 0 on failure.  On failure, the error can be
- *         obtained from inotifytools_error().  Note that some errors on
- *         subdirectories will be ignored; for example, if you watch a directory
- *         tree which contains some directories which you do not have access to,
- *         those directories will not be watched, but this function will still
- *         return 1 if no other errors occur.
+ * @return 1 on success, 0 if @a bytes is too small.  On failure, the error
+ *         can be obtained from inotifytools_error().
+ */
+int inotifytools_set_read_buffer( size_t bytes ) {
+	return inotifytools_ctx_set_read_buffer( &default_ctx, bytes );
+}
+
+/**
+ * Like inotifytools_set_read_buffer(), but operates on @a ctx.
+ */
+int inotifytools_ctx_set_read_buffer( inotifytools_ctx *ctx, size_t bytes ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	if ( bytes < READ_BUFFER_MIN ) {
+		ctx->error = EINVAL;
+		return 0;
+	}
+	ctx->event_buf_limit = bytes;
+	return 1;
+}
+
+/**
+ * Get the current size of the buffer events are read into.
  *
- * @note This function does not attempt to work atomically.  If you use this
- *       function to watch a directory tree and files or directories are being
- *       created or removed within that directory tree, there are no guarantees
- *       as to whether or not those files will be watched.
+ * @return size of the read buffer in bytes; see
+ *         inotifytools_set_read_buffer().
  */
-int inotifytools_watch_recursively( char const * path, int events ) {
-	return inotifytools_watch_recursively_with_exclude( path, events, 0 );
+size_t inotifytools_get_read_buffer_size() {
+	return inotifytools_ctx_get_read_buffer_size( &default_ctx );
 }
 
 /**
- * Set up recursive watches on an entire directory tree, optionally excluding
- * some directories.
+ * Like inotifytools_get_read_buffer_size(), but operates on @a ctx.
+ */
+size_t inotifytools_ctx_get_read_buffer_size( inotifytools_ctx *ctx ) {
+	return ctx->event_buf_size;
+}
+
+/**
+ * Get the number of reads from the kernel since inotifytools_initialize().
  *
- * inotifytools_initialize() must be called before this function can
- * be used.
+ * Together with inotifytools_get_num_events_read() this gives the average
+ * number of events each read returned.
  *
- * @author UH
+ * @return number of reads which returned events.
+ */
+long long inotifytools_get_num_reads() {
+	return inotifytools_ctx_get_num_reads( &default_ctx );
+}
+
+/**
+ * Like inotifytools_get_num_reads(), but operates on @a ctx.
+ */
+long long inotifytools_ctx_get_num_reads( inotifytools_ctx *ctx ) {
+	return ctx->num_reads;
+}
+
+/**
+ * Get the number of events read from the kernel since
+ * inotifytools_initialize().
  *
- * @param path path of directory or file to watch.  If the path is a directory,
- *             every subdirectory will also be watched for the same events up
- *             to the maximum readable depth.  If the path is a file, the file
- *             is watched exactly as if inotifytools_watch_file() were used.
+ * @return number of events read, including those that were ignored or have
+ *         not been returned yet.
+ */
+long long inotifytools_get_num_events_read() {
+	return inotifytools_ctx_get_num_events_read( &default_ctx );
+}
+
+/**
+ * Like inotifytools_get_num_events_read(), but operates on @a ctx.
+ */
+long long inotifytools_ctx_get_num_events_read( inotifytools_ctx *ctx ) {
+	return ctx->num_events_read;
+}
+
+/**
+ * Turn collection of metrics of the library's own work on or off.
  *
- * @param exclude_list NULL terminated path list of directories not to watch.
- *                     Can be NULL if no paths are to be excluded.
- *                     Directories may or may not include a trailing '/'.
+ * While on, the library counts the events and bytes each read from the
+ * kernel returns, and times waiting for events, matching event names against
+ * the regular expression passed to inotifytools_ignore_events_by_regex(),
+ * formatting events with inotifytools_snprintf() and friends, and setting up
+ * each directory watched by the recursive functions.  While off, none of
+ * this costs more than a test of a pointer.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
  *
- * @param events Inotify events to watch for.  See section \ref events.
+ * @param enable whether to collect metrics.  Turning metrics on when they
+ *               are on already starts them from zero again.
  *
  * @return 1 on success, 0 on failure.  On failure, the error can be
- *         obtained from inotifytools_error().  Note that some errors on
- *         subdirectories will be ignored; for example, if you watch a directory
- *         tree which contains some directories which you do not have access to,
- *         those directories will not be watched, but this function will still
- *         return 1 if no other errors occur.
- *
- * @note This function does not attempt to work atomically.  If you use this
- *       function to watch a directory tree and files or directories are being
- *       created or removed within that directory tree, there are no guarantees
- *       as to whether or not those files will be watched.
+ *         obtained from inotifytools_error().
  */
-int inotifytools_watch_recursively_with_exclude( char const * path, int events,
-                                                 char const ** exclude_list ) {
-	niceassert( init, "inotifytools_initialize not called yet" );
+int inotifytools_enable_metrics( int enable ) {
+	return inotifytools_ctx_enable_metrics( &default_ctx, enable );
+}
 
-	DIR * dir;
-	char * my_path;
-	error = 0;
-	dir = opendir( path );
-	if ( !dir ) {
-		// If not a directory, don't need to do anything special
-		if ( errno == ENOTDIR ) {
-			return inotifytools_watch_file( path, events );
-		}
-		else {
-			error = errno;
+/**
+ * Like inotifytools_enable_metrics(), but operates on @a ctx.
+ */
+int inotifytools_ctx_enable_metrics( inotifytools_ctx *ctx, int enable ) {
+	if ( !enable ) {
+		free( ctx->metrics );
+		ctx->metrics = NULL;
+		return 1;
+	}
+	if ( !ctx->metrics ) {
+		ctx->metrics = (struct inotifytools_metrics *)malloc(
+		                               sizeof(struct inotifytools_metrics) );
+		if ( !ctx->metrics ) {
+			ctx->error = ENOMEM;
 			return 0;
 		}
 	}
+	memset( ctx->metrics, 0, sizeof(struct inotifytools_metrics) );
+	return 1;
+}
 
-	if ( path[strlen(path)-1] != '/' ) {
-		nasprintf( &my_path, "%s/", path );
-	}
-	else {
-		my_path = (char *)path;
-	}
+/**
+ * Get the metrics collected since inotifytools_enable_metrics().
+ *
+ * Besides the histograms, which are in bytes, events or nanoseconds as
+ * their names say, this gets the number of bytes currently waiting in the
+ * kernel's event queue and the size of that queue from
+ * inotifytools_get_max_queued_events().  Each event takes at least
+ * sizeof(struct inotify_event) bytes there, which bounds how full the
+ * queue is.
+ *
+ * @param metrics where to store the metrics.
+ *
+ * @return 1 on success, 0 if metrics are off.
+ */
+int inotifytools_get_metrics( struct inotifytools_metrics * metrics ) {
+	return inotifytools_ctx_get_metrics( &default_ctx, metrics );
+}
 
-	static struct dirent * ent;
-	char * next_file;
-	static struct stat64 my_stat;
-	ent = readdir( dir );
-	// Watch each directory within this directory
-	while ( ent ) {
-		if ( (0 != strcmp( ent->d_name, "." )) &&
-		     (0 != strcmp( ent->d_name, ".." )) ) {
-			nasprintf(&next_file,"%s%s", my_path, ent->d_name);
-			if ( -1 == lstat64( next_file, &my_stat ) ) {
-				error = errno;
-				free( next_file );
-				if ( errno != EACCES ) {
-					error = errno;
-					if ( my_path != path ) free( my_path );
-					closedir( dir );
-					return 0;
-				}
-			}
-			else if ( S_ISDIR( my_stat.st_mode ) &&
-			          !S_ISLNK( my_stat.st_mode )) {
-				free( next_file );
-				nasprintf(&next_file,"%s%s/", my_path, ent->d_name);
-				static unsigned int no_watch;
-				static char const ** exclude_entry;
-
-				no_watch = 0;
-				for (exclude_entry = exclude_list;
-					 exclude_entry && *exclude_entry && !no_watch;
-					 ++exclude_entry) {
-					static int exclude_length;
-
-					exclude_length = strlen(*exclude_entry);
-					if ((*exclude_entry)[exclude_length-1] == '/') {
-						--exclude_length;
-					}
-					if ( strlen(next_file) == (unsigned)(exclude_length + 1) &&
-					    !strncmp(*exclude_entry, next_file, exclude_length)) {
-						// directory found in exclude list
-						no_watch = 1;
-					}
-				}
-				if (!no_watch) {
-					static int status;
-					status = inotifytools_watch_recursively_with_exclude(
-					              next_file,
-					              events,
-					              exclude_list );
-					// For some errors, we will continue.
-					if ( !status && (EACCES != error) && (ENOENT != error) &&
-					     (ELOOP != error) ) {
-						free( next_file );
-						if ( my_path != path ) free( my_path );
-						closedir( dir );
-						return 0;
-					}
-				} // if !no_watch
-				//veraoks_debug
-				//printf("Watching %s dir_used=%c\n", next_file, 'n');
-				struct my_struct *s = NULL;
-				s = (struct my_struct*)malloc(sizeof(struct my_struct));
-				s->dir_name = strdup(next_file);
-				s->dir_used = 'n';
-			
-				HASH_ADD_KEYPTR( hh, hashtable, s->dir_name, strlen(s->dir_name), s );	
-				free( next_file );
-			} // if isdir and not islnk
-			else {
-				free( next_file );
-			}
-		}
-		ent = readdir( dir );
-		error = 0;
+/**
+ * Like inotifytools_get_metrics(), but operates on @a ctx.
+ */
+int inotifytools_ctx_get_metrics( inotifytools_ctx *ctx,
+                                  struct inotifytools_metrics * metrics ) {
+	if ( !ctx->metrics ) {
+		ctx->error = EINVAL;
+		return 0;
 	}
+	*metrics = *ctx->metrics;
+	unsigned int bytes;
+	metrics->queued_bytes = -1 == ioctl( ctx->inotify_fd, FIONREAD, &bytes ) ?
+	                        -1 : (long long)bytes;
+	metrics->max_queued_events = inotifytools_get_max_queued_events();
+	return 1;
+}
 
-	closedir( dir );
-
-	int ret = inotifytools_watch_file( my_path, events );
-	if ( my_path != path ) free( my_path );
-        return ret;
+/**
+ * Read events on a separate thread.
+ *
+ * Normally, events are only read from inotify when they are asked for, so
+ * while the program is busy with the events it got, new ones pile up in the
+ * kernel's queue, which overflows after
+ * inotifytools_get_max_queued_events() events.  This starts a thread which
+ * reads events as soon as they arrive, into a ring buffer of @a ring_bytes
+ * bytes, and the functions returning events take them from there.  The
+ * thread only moves events into the ring: filtering, statistics and all
+ * other processing still happen on the thread asking for events.
+ *
+ * If the ring fills up, the reader thread stops reading from inotify until
+ * events are taken from the ring, so new events wait in the kernel's queue
+ * as they would without the thread, and an IN_Q_OVERFLOW event is only
+ * reported if that queue overflows.  inotifytools_get_reader_depth() and
+ * inotifytools_get_reader_high_water() show how full the ring gets.
+ *
+ * inotifytools_initialize() must be called before this function can be
+ * used, and only the inotify backend can be read on a separate thread.
+ * Only one thread may ask for events from the context, as usual; it is
+ * safe to add and remove watches meanwhile.  The reader thread blocks all
+ * signals.
+ *
+ * @param ring_bytes size of the ring buffer in bytes, rounded up to a power
+ *                   of two.  Must be at least twice the smallest read
+ *                   buffer; see inotifytools_set_read_buffer().  Each event
+ *                   takes up sizeof(struct inotify_event) bytes plus its
+ *                   name rounded up to a multiple of that.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be obtained
+ *         from inotifytools_error(): EBUSY if the reader thread is already
+ *         running, EINVAL if @a ring_bytes is too small, EOPNOTSUPP with the
+ *         fanotify or sharded backend.
+ */
+int inotifytools_start_reader( size_t ring_bytes ) {
+	return inotifytools_ctx_start_reader( &default_ctx, ring_bytes );
 }
 
 /**
- * @internal
+ * Like inotifytools_start_reader(), but operates on @a ctx.
  */
-void record_stats( struct inotify_event const * event ) {
-	if (!event) return;
-	watch *w = watch_from_wd(event->wd);
-	if (!w) return;
-	if ( IN_ACCESS & event->mask ) {
-		++w->hit_access;
-		++num_access;
-	}
-	if ( IN_MODIFY & event->mask ) {
-		++w->hit_modify;
-		++num_modify;
-	}
-	if ( IN_ATTRIB & event->mask ) {
-		++w->hit_attrib;
-		++num_attrib;
-	}
-	if ( IN_CLOSE_WRITE & event->mask ) {
-		++w->hit_close_write;
-		++num_close_write;
-	}
-	if ( IN_CLOSE_NOWRITE & event->mask ) {
-		++w->hit_close_nowrite;
-		++num_close_nowrite;
-	}
-	if ( IN_OPEN & event->mask ) {
-		++w->hit_open;
-		++num_open;
-	}
-	if ( IN_MOVED_FROM & event->mask ) {
-		++w->hit_moved_from;
-		++num_moved_from;
+int inotifytools_ctx_start_reader( inotifytools_ctx *ctx, size_t ring_bytes ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	if ( ctx->ring ) {
+		ctx->error = EBUSY;
+		return 0;
 	}
-	if ( IN_MOVED_TO & event->mask ) {
-		++w->hit_moved_to;
-		++num_moved_to;
+	if ( ctx->backend != &inotify_backend ) {
+		ctx->error = EOPNOTSUPP;
+		return 0;
 	}
-	if ( IN_CREATE & event->mask ) {
-		++w->hit_create;
-		++num_create;
+	if ( ring_bytes < 2 * READ_BUFFER_MIN ) {
+		ctx->error = EINVAL;
+		return 0;
 	}
-	if ( IN_DELETE & event->mask ) {
-		++w->hit_delete;
-		++num_delete;
+
+	struct event_ring *r =
+		(struct event_ring *)calloc( 1, sizeof(struct event_ring) );
+	if ( !r ) {
+		ctx->error = ENOMEM;
+		return 0;
 	}
-	if ( IN_DELETE_SELF & event->mask ) {
-		++w->hit_delete_self;
-		++num_delete_self;
+	r->size = 1;
+	while ( r->size < ring_bytes ) r->size *= 2;
+	r->fd = ctx->inotify_fd;
+	r->buf = (char *)malloc( r->size );
+	r->data_fd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+	r->space_fd = eventfd( 0, EFD_CLOEXEC | EFD_NONBLOCK );
+	r->stop_fd = eventfd( 0, EFD_CLOEXEC );
+	int error = !r->buf ? ENOMEM : 0;
+	if ( !error && (r->data_fd < 0 || r->space_fd < 0 || r->stop_fd < 0) ) {
+		error = errno;
 	}
-	if ( IN_UNMOUNT & event->mask ) {
-		++w->hit_unmount;
-		++num_unmount;
+	if ( !error ) {
+		sigset_t all, old;
+		sigfillset( &all );
+		pthread_sigmask( SIG_SETMASK, &all, &old );
+		error = pthread_create( &r->thread, NULL, ring_reader, r );
+		pthread_sigmask( SIG_SETMASK, &old, NULL );
 	}
-	if ( IN_MOVE_SELF & event->mask ) {
-		++w->hit_move_self;
-		++num_move_self;
+	if ( error ) {
+		if ( r->data_fd >= 0 ) close( r->data_fd );
+		if ( r->space_fd >= 0 ) close( r->space_fd );
+		if ( r->stop_fd >= 0 ) close( r->stop_fd );
+		free( r->buf );
+		free( r );
+		ctx->error = error;
+		return 0;
 	}
-
-	++w->hit_total;
-	++num_total;
-
+	ctx->ring = r;
+	return 1;
 }
 
-int *stat_ptr(watch *w, int event)
-{
-	if ( IN_ACCESS == event )
-		return &w->hit_access;
-	if ( IN_MODIFY == event )
-		return &w->hit_modify;
-	if ( IN_ATTRIB == event )
-		return &w->hit_attrib;
-	if ( IN_CLOSE_WRITE == event )
-		return &w->hit_close_write;
-	if ( IN_CLOSE_NOWRITE == event )
-		return &w->hit_close_nowrite;
-	if ( IN_OPEN == event )
-		return &w->hit_open;
-	if ( IN_MOVED_FROM == event )
-		return &w->hit_moved_from;
-	if ( IN_MOVED_TO == event )
-		return &w->hit_moved_to;
-	if ( IN_CREATE == event )
-		return &w->hit_create;
-	if ( IN_DELETE == event )
-		return &w->hit_delete;
-	if ( IN_DELETE_SELF == event )
-		return &w->hit_delete_self;
-	if ( IN_UNMOUNT == event )
-		return &w->hit_unmount;
-	if ( IN_MOVE_SELF == event )
-		return &w->hit_move_self;
-	if ( 0 == event )
-		return &w->hit_total;
-	return 0;
+/**
+ * Stop the thread started by inotifytools_start_reader().  Events still in
+ * its ring buffer are lost; events which arrive from now on are read by the
+ * functions returning events again.  inotifytools_cleanup() stops the
+ * reader thread too.
+ */
+void inotifytools_stop_reader() {
+	inotifytools_ctx_stop_reader( &default_ctx );
 }
 
 /**
- * Get statistics by a particular watch descriptor.
- *
- * inotifytools_initialize_stats() must be called before this function can
- * be used.
- *
- * @param wd watch descriptor to get stats for.
- *
- * @param event a single inotify event to get statistics for, or 0 for event
- *              total.  See section \ref events.
- *
- * @return the number of times the event specified by @a event has occurred on
- *         the watch descriptor specified by @a wd since stats collection was
- *         enabled, or -1 if @a event or @a wd are invalid.
+ * Like inotifytools_stop_reader(), but operates on @a ctx.
  */
-int inotifytools_get_stat_by_wd( int wd, int event ) {
-	if (!collect_stats) return -1;
-
-	watch *w = watch_from_wd(wd);
-	if (!w) return -1;
-	int *i = stat_ptr(w, event);
-	if (!i) return -1;
-	return *i;
+void inotifytools_ctx_stop_reader( inotifytools_ctx *ctx ) {
+	ring_stop( ctx );
 }
 
 /**
- * Get statistics aggregated across all watches.
- *
- * inotifytools_initialize_stats() must be called before this function can
- * be used.
- *
- * @param event a single inotify event to get statistics for, or 0 for event
- *              total.  See section \ref events.
+ * Get the number of events in the ring buffer of the reader thread.
  *
- * @return the number of times the event specified by @a event has occurred over
- *         all watches since stats collection was enabled, or -1 if @a event
- *         is not a valid event.
+ * @return number of events the reader thread has read which have not been
+ *         taken from the ring yet, or 0 if it is not running.  See
+ *         inotifytools_start_reader().
  */
-int inotifytools_get_stat_total( int event ) {
-	if (!collect_stats) return -1;
-	if ( IN_ACCESS == event )
-		return num_access;
-	if ( IN_MODIFY == event )
-		return num_modify;
-	if ( IN_ATTRIB == event )
-		return num_attrib;
-	if ( IN_CLOSE_WRITE == event )
-		return num_close_write;
-	if ( IN_CLOSE_NOWRITE == event )
-		return num_close_nowrite;
-	if ( IN_OPEN == event )
-		return num_open;
-	if ( IN_MOVED_FROM == event )
-		return num_moved_from;
-	if ( IN_MOVED_TO == event )
-		return num_moved_to;
-	if ( IN_CREATE == event )
-		return num_create;
-	if ( IN_DELETE == event )
-		return num_delete;
-	if ( IN_DELETE_SELF == event )
-		return num_delete_self;
-	if ( IN_UNMOUNT == event )
-		return num_unmount;
-	if ( IN_MOVE_SELF == event )
-		return num_move_self;
-
-	if ( 0 == event )
-		return num_total;
-
-	return -1;
+long long inotifytools_get_reader_depth() {
+	return inotifytools_ctx_get_reader_depth( &default_ctx );
 }
 
 /**
- * Get statistics by a particular filename.
- *
- * inotifytools_initialize_stats() must be called before this function can
- * be used.
- *
- * @param filename name of file to get stats for.
- *
- * @param event a single inotify event to get statistics for, or 0 for event
- *              total.  See section \ref events.
- *
- * @return the number of times the event specified by @a event has occurred on
- *         the file specified by @a filename since stats collection was
- *         enabled, or -1 if the file is not being watched or @a event is
- *         invalid.
- *
- * @note The filename specified must always be the original name used to
- *       establish the watch.
+ * Like inotifytools_get_reader_depth(), but operates on @a ctx.
  */
-int inotifytools_get_stat_by_filename( char const * filename,
-                                                int event ) {
-	return inotifytools_get_stat_by_wd( inotifytools_wd_from_filename(
-	       filename ), event );
+long long inotifytools_ctx_get_reader_depth( inotifytools_ctx *ctx ) {
+	if ( !ctx->ring ) return 0;
+	return __atomic_load_n( &ctx->ring->pushed, __ATOMIC_RELAXED ) -
+	       __atomic_load_n( &ctx->ring->popped, __ATOMIC_RELAXED );
 }
 
 /**
- * Get the last error which occurred.
+ * Get the largest number of events there have been in the ring buffer of
+ * the reader thread.
  *
- * When a function fails, call this to find out why.  The returned value is
- * a typical @a errno value, the meaning of which depends on context.  For
- * example, if inotifytools_watch_file() fails because you attempt to watch
- * a file which doesn't exist, this function will return @a ENOENT.
- *
- * @return an error code.
+ * @return highest inotifytools_get_reader_depth() since the reader thread
+ *         was started, or 0 if it is not running.
  */
-int inotifytools_error() {
-	return error;
+long long inotifytools_get_reader_high_water() {
+	return inotifytools_ctx_get_reader_high_water( &default_ctx );
 }
 
 /**
- * @internal
+ * Like inotifytools_get_reader_high_water(), but operates on @a ctx.
  */
-int isdir( char const * path ) {
-	static struct stat64 my_stat;
-
-	if ( -1 == lstat64( path, &my_stat ) ) {
-		if (errno == ENOENT) return 0;
-		fprintf(stderr, "Stat failed on %s: %s\n", path, strerror(errno));
-		return 0;
-	}
-
-	return S_ISDIR( my_stat.st_mode ) && !S_ISLNK( my_stat.st_mode );
+long long inotifytools_ctx_get_reader_high_water( inotifytools_ctx *ctx ) {
+	if ( !ctx->ring ) return 0;
+	return __atomic_load_n( &ctx->ring->high_water, __ATOMIC_RELAXED );
 }
 
-
 /**
- * Get the number of watches set up through libinotifytools.
+ * Get the number of events the reader thread dropped because its ring
+ * buffer was full.
  *
- * @return number of watches set up by inotifytools_watch_file(),
- *         inotifytools_watch_files() and inotifytools_watch_recursively().
+ * @deprecated The reader thread no longer drops events: while its ring is
+ *             full, it leaves them in the kernel's queue.  See
+ *             inotifytools_start_reader().
+ *
+ * @return 0.
  */
-int inotifytools_get_num_watches() {
-	int ret = 0;
-	rbwalk(tree_filename, get_num, (void*)&ret);
-	return ret;
+long long inotifytools_get_reader_drops() {
+	return inotifytools_ctx_get_reader_drops( &default_ctx );
+}
+
+/**
+ * Like inotifytools_get_reader_drops(), but operates on @a ctx.
+ */
+long long inotifytools_ctx_get_reader_drops(
+		inotifytools_ctx *ctx __attribute__((unused)) ) {
+	return 0;
 }
 
 /**
@@ -1679,7 +7523,15 @@ int inotifytools_get_num_watches() {
  * @endcode
  */
 int inotifytools_printf( struct inotify_event* event, char* fmt ) {
-	return inotifytools_fprintf( stdout, event, fmt );
+	return inotifytools_ctx_printf( &default_ctx, event, fmt );
+}
+
+/**
+ * Like inotifytools_printf(), but operates on @a ctx.
+ */
+int inotifytools_ctx_printf( inotifytools_ctx *ctx,
+                             struct inotify_event* event, char* fmt ) {
+	return inotifytools_ctx_fprintf( ctx, stdout, event, fmt );
 }
 
 /**
@@ -1724,10 +7576,17 @@ int inotifytools_printf( struct inotify_event* event, char* fmt ) {
  * @endcode
  */
 int inotifytools_fprintf( FILE* file, struct inotify_event* event, char* fmt ) {
-	static char out[MAX_STRLEN+1];
-	static int ret;
-	ret = inotifytools_sprintf( out, event, fmt );
-	if ( -1 != ret ) fprintf( file, "%s", out );
+	return inotifytools_ctx_fprintf( &default_ctx, file, event, fmt );
+}
+
+/**
+ * Like inotifytools_fprintf(), but operates on @a ctx.
+ */
+int inotifytools_ctx_fprintf( inotifytools_ctx *ctx, FILE* file,
+                              struct inotify_event* event, char* fmt ) {
+	int ret;
+	ret = inotifytools_ctx_sprintf( ctx, ctx->out, event, fmt );
+	if ( -1 != ret ) fprintf( file, "%s", ctx->out );
 	return ret;
 }
 
@@ -1782,7 +7641,15 @@ int inotifytools_fprintf( FILE* file, struct inotify_event* event, char* fmt ) {
  * @endcode
  */
 int inotifytools_sprintf( char * out, struct inotify_event* event, char* fmt ) {
-	return inotifytools_snprintf( out, MAX_STRLEN, event, fmt );
+	return inotifytools_ctx_sprintf( &default_ctx, out, event, fmt );
+}
+
+/**
+ * Like inotifytools_sprintf(), but operates on @a ctx.
+ */
+int inotifytools_ctx_sprintf( inotifytools_ctx *ctx, char * out,
+                              struct inotify_event* event, char* fmt ) {
+	return inotifytools_ctx_snprintf( ctx, out, MAX_STRLEN, event, fmt );
 }
 
 
@@ -1792,7 +7659,8 @@ int inotifytools_sprintf( char * out, struct inotify_event* event, char* fmt ) {
  *
  * @param out location in which to store string.
  *
- * @param size maximum amount of characters to write.
+ * @param size size of @a out.  At most @a size - 1 characters followed by a
+ *             terminating null byte are written.
  *
  * @param event the event to use to construct a string.
  *
@@ -1834,131 +7702,428 @@ int inotifytools_sprintf( char * out, struct inotify_event* event, char* fmt ) {
  */
 int inotifytools_snprintf( char * out, int size,
                            struct inotify_event* event, char* fmt ) {
-	static char * filename, * eventname, * eventstr;
-	static unsigned int i, ind;
-	static char ch1;
-	static char timestr[MAX_STRLEN];
-	static time_t now;
+	return inotifytools_ctx_snprintf( &default_ctx, out, size, event, fmt );
+}
+
+/**
+ * @internal
+ * Kinds of operations a format string is compiled to.
+ */
+enum format_op_type {
+	FORMAT_LITERAL,
+	FORMAT_WATCH,
+	FORMAT_FILE,
+	FORMAT_EVENTS,
+	FORMAT_TIME,
+};
+
+/**
+ * @internal
+ * One operation of a compiled format string.  @a text and @a len describe the
+ * text of a FORMAT_LITERAL, @a sep is the separator of a FORMAT_EVENTS.
+ */
+struct format_op {
+	enum format_op_type type;
+	char sep;
+	char const * text;
+	size_t len;
+};
 
+/**
+ * @internal
+ * A compiled format string.  @a text holds the literal text of all
+ * FORMAT_LITERAL operations back to back, @a src the original string.
+ */
+struct inotifytools_format {
+	struct format_op * ops;
+	unsigned num_ops;
+	char * text;
+	char * src;
+};
 
-	if ( event->len > 0 ) {
-		eventname = event->name;
+/**
+ * @internal
+ * Append an operation to @a format.  Consecutive literals are merged.
+ */
+static void format_add( struct inotifytools_format * format,
+                        enum format_op_type type, char sep,
+                        char * text, char const * str, size_t len ) {
+	struct format_op * op;
+	if ( type == FORMAT_LITERAL ) {
+		memcpy( text, str, len );
+		op = format->num_ops ? &format->ops[format->num_ops - 1] : NULL;
+		if ( op && op->type == FORMAT_LITERAL ) {
+			op->len += len;
+			return;
+		}
 	}
-	else {
-		eventname = NULL;
+	op = &format->ops[format->num_ops++];
+	op->type = type;
+	op->sep = sep;
+	op->text = text;
+	op->len = type == FORMAT_LITERAL ? len : 0;
+}
+
+/**
+ * Compile a format string for use with inotifytools_format_event().
+ *
+ * The format string is parsed only once, so formatting many events with a
+ * compiled format is considerably faster than calling inotifytools_snprintf()
+ * for each of them.  See inotifytools_snprintf() for the format string syntax.
+ *
+ * @param fmt the format string to compile.
+ *
+ * @return a compiled format, which must be freed with
+ *         inotifytools_format_free(), or NULL on failure, in which case
+ *         @a errno is set.  @a errno is EINVAL if @a fmt is empty or ends in
+ *         a lone '%'.
+ */
+inotifytools_format * inotifytools_format_compile( char const * fmt ) {
+	if ( !fmt || 0 == fmt[0] ) {
+		errno = EINVAL;
+		return NULL;
 	}
 
+	size_t len = strlen( fmt );
+	inotifytools_format * format = (inotifytools_format *)calloc( 1,
+	                                                     sizeof(*format) );
+	if ( !format ) return NULL;
+	// Every operation consumes at least one character of fmt.
+	format->ops = (struct format_op *)malloc( len * sizeof(*format->ops) );
+	format->text = (char *)malloc( len );
+	format->src = strdup( fmt );
+	if ( !format->ops || !format->text || !format->src ) {
+		inotifytools_format_free( format );
+		errno = ENOMEM;
+		return NULL;
+	}
 
-	filename = inotifytools_filename_from_wd( event->wd );
+	char * text = format->text;
+	size_t i;
+	for ( i = 0; i < len; ++i ) {
+		char const * lit = &fmt[i];
+		size_t lit_len = 1;
+		enum format_op_type type = FORMAT_LITERAL;
+		char sep = ',';
+
+		if ( fmt[i] == '%' ) {
+			if ( i == len - 1 ) {
+				// last character is %, invalid
+				inotifytools_format_free( format );
+				errno = EINVAL;
+				return NULL;
+			}
 
-	struct my_struct *s = (struct my_struct*)malloc(sizeof(struct my_struct));
-	struct my_struct *replaced_item_ptr = (struct my_struct*)malloc(sizeof(struct my_struct));
-	HASH_FIND_STR( hashtable, filename, s);
-	    if (s) { 
-		//HASH_DEL( hashtable, s);
-		// If the key is found, then update the dir_used to 'y'
-		// Later, before inotifywait exits, we just iterate, and pirnt all the key, and values.
-		s->dir_used = 'y';
-	    }
+			switch ( fmt[i+1] ) {
+				case '%': lit = "%";                break;
+				case 'w': type = FORMAT_WATCH;      break;
+				case 'f': type = FORMAT_FILE;       break;
+				case 'e': type = FORMAT_EVENTS;     break;
+				case 'T': type = FORMAT_TIME;       break;
+				default:
+					if ( i + 2 < len && fmt[i+2] == 'e' ) {
+						type = FORMAT_EVENTS;
+						sep = fmt[i+1];
+						++i;
+					}
+					else {
+						// not a special format character, output as normal
+						lit_len = 2;
+					}
+			}
+			++i;
+		}
 
-	return 0;
-	if ( !fmt || 0 == strlen(fmt) ) {
-		error = EINVAL;
-		return -1;
+		format_add( format, type, sep, text, lit, lit_len );
+		if ( type == FORMAT_LITERAL ) text += lit_len;
 	}
-	if ( strlen(fmt) > MAX_STRLEN || size > MAX_STRLEN) {
-		error = EMSGSIZE;
-		return -1;
+
+	return format;
+}
+
+/**
+ * Free a format returned by inotifytools_format_compile().
+ *
+ * @param format the format to free.  May be NULL.
+ */
+void inotifytools_format_free( inotifytools_format * format ) {
+	if ( !format ) return;
+	free( format->ops );
+	free( format->text );
+	free( format->src );
+	free( format );
+}
+
+/**
+ * @internal
+ * Get the current time formatted with the format set by
+ * inotifytools_set_printf_timefmt().  strftime() is only called once per
+ * second; within the same second the previous result is reused.
+ *
+ * @return 1 on success, 0 if the time format could not be used.
+ */
+static int format_time( inotifytools_ctx *ctx ) {
+	time_t now = time(0);
+	if ( ctx->time_valid && now == ctx->time_cached ) return 1;
+
+	struct tm now_tm;
+	ctx->time_len = strftime( ctx->time_str, sizeof(ctx->time_str),
+	                          ctx->timefmt, localtime_r( &now, &now_tm ) );
+	if ( 0 == ctx->time_len ) {
+		// time format probably invalid
+		ctx->time_valid = 0;
+		return 0;
 	}
+	ctx->time_cached = now;
+	ctx->time_valid = 1;
+	return 1;
+}
 
-	ind = 0;
-	for ( i = 0; i < strlen(fmt) &&
-	             (int)ind < size - 1; ++i ) {
-		if ( fmt[i] != '%' ) {
-			out[ind++] = fmt[i];
-			continue;
-		}
+/**
+ * Construct a string from an inotify_event using a compiled format.
+ *
+ * This behaves like inotifytools_snprintf(), but the format string has been
+ * parsed in advance by inotifytools_format_compile().  No memory is allocated,
+ * the watched file is looked up only once, and \%T is only rendered again
+ * when the current second changes.
+ *
+ * @param format a format returned by inotifytools_format_compile().
+ *
+ * @param out location in which to store the string.
+ *
+ * @param size size of @a out.  At most @a size - 1 characters followed by a
+ *             terminating null byte are written; longer output is truncated.
+ *
+ * @param event the event to use to construct the string.
+ *
+ * @return number of characters written, not counting the terminating null
+ *         byte, or -1 if an error occurs.  The error can be obtained from
+ *         inotifytools_error().
+ *
+ * @section example Example
+ * @code
+ * inotifytools_format * format = inotifytools_format_compile( "%w%f %e\n" );
+ * char line[4096];
+ * struct inotify_event * event;
+ * while ( (event = inotifytools_next_event( -1 )) ) {
+ *         int len = inotifytools_format_event( format, line, sizeof(line),
+ *                                              event );
+ *         if ( len > 0 ) fwrite( line, 1, len, stdout );
+ * }
+ * inotifytools_format_free( format );
+ * @endcode
+ */
+int inotifytools_format_event( inotifytools_format const * format,
+                               char * out, int size,
+                               struct inotify_event * event ) {
+	return inotifytools_ctx_format_event( &default_ctx, format, out, size,
+	                                      event );
+}
 
-		if ( i == strlen(fmt) - 1 ) {
-			// last character is %, invalid
-			error = EINVAL;
-			return ind;
-		}
+/**
+ * Like inotifytools_format_event(), but operates on @a ctx.
+ */
+int inotifytools_ctx_format_event( inotifytools_ctx *ctx,
+                                   inotifytools_format const * format,
+                                   char * out, int size,
+                                   struct inotify_event * event ) {
+	if ( !ctx->metrics ) return format_event( ctx, format, out, size, event );
+	long long start = now_ns();
+	int ret = format_event( ctx, format, out, size, event );
+	histogram_add_since( &ctx->metrics->format_ns, start );
+	return ret;
+}
 
-		ch1 = fmt[i+1];
+/**
+ * @internal
+ * Implements inotifytools_ctx_format_event().
+ */
+static int format_event( inotifytools_ctx *ctx,
+                         inotifytools_format const * format,
+                         char * out, int size,
+                         struct inotify_event * event ) {
+	if ( !format || size <= 0 ) {
+		ctx->error = EINVAL;
+		return -1;
+	}
 
-		if ( ch1 == '%' ) {
-			out[ind++] = '%';
-			++i;
-			continue;
+	watch * w = watch_from_wd( ctx, event->wd );
+	char const * filename = w ? path_str( ctx, w->node ) : NULL;
+
+	char * p = out;
+	char * end = out + size - 1;
+	unsigned i;
+	for ( i = 0; i < format->num_ops && p < end; ++i ) {
+		struct format_op const * op = &format->ops[i];
+		switch ( op->type ) {
+			case FORMAT_LITERAL:
+				p = put_str( p, end, op->text, op->len );
+				break;
+			case FORMAT_WATCH:
+				if ( filename ) {
+					p = put_str( p, end, filename, strlen(filename) );
+				}
+				break;
+			case FORMAT_FILE:
+				if ( event->len > 0 ) {
+					p = put_str( p, end, event->name, strlen(event->name) );
+				}
+				break;
+			case FORMAT_EVENTS:
+				p = put_events( p, end, event->mask, op->sep );
+				break;
+			case FORMAT_TIME:
+				if ( !ctx->timefmt ) break;
+				if ( !format_time( ctx ) ) {
+					*p = 0;
+					ctx->error = EINVAL;
+					return -1;
+				}
+				p = put_str( p, end, ctx->time_str, ctx->time_len );
+				break;
 		}
+	}
+	*p = 0;
 
-		if ( ch1 == 'w' ) {
-			if ( filename ) {
-				strncpy( &out[ind], filename, size - ind );
-				ind += strlen(filename);
-			}
-			++i;
-			continue;
-		}
+	return p - out;
+}
 
-		if ( ch1 == 'f' ) {
-			if ( eventname ) {
-				strncpy( &out[ind], eventname, size - ind );
-				ind += strlen(eventname);
-			}
-			++i;
-			continue;
-		}
+/**
+ * Like inotifytools_snprintf(), but operates on @a ctx.
+ *
+ * The most recently used format string is kept compiled in @a ctx, so
+ * calling this function repeatedly with the same format only parses it once.
+ */
+int inotifytools_ctx_snprintf( inotifytools_ctx *ctx, char * out, int size,
+                               struct inotify_event* event, char* fmt ) {
+	if ( !fmt || 0 == fmt[0] ) {
+		ctx->error = EINVAL;
+		return -1;
+	}
+	if ( size > MAX_STRLEN ) {
+		ctx->error = EMSGSIZE;
+		return -1;
+	}
 
-		if ( ch1 == 'e' ) {
-			eventstr = inotifytools_event_to_str( event->mask );
-			strncpy( &out[ind], eventstr, size - ind );
-			ind += strlen(eventstr);
-			++i;
-			continue;
+	if ( !ctx->format || 0 != strcmp( ctx->format->src, fmt ) ) {
+		if ( strlen(fmt) > MAX_STRLEN ) {
+			ctx->error = EMSGSIZE;
+			return -1;
 		}
+		inotifytools_format_free( ctx->format );
+		ctx->format = inotifytools_format_compile( fmt );
+		if ( !ctx->format ) {
+			ctx->error = errno;
+			return -1;
+		}
+	}
 
-		if ( ch1 == 'T' ) {
-
-			if ( timefmt ) {
+	return inotifytools_ctx_format_event( ctx, ctx->format, out, size, event );
+}
 
-				now = time(0);
-				if ( 0 >= strftime( timestr, MAX_STRLEN-1, timefmt,
-				                    localtime( &now ) ) ) {
+/**
+ * Don't watch directories whose events would be ignored.
+ *
+ * Normally the regular expression given to
+ * inotifytools_ignore_events_by_regex() only filters events after the kernel
+ * has delivered them.  With pruning enabled, recursive watch functions also
+ * skip every subdirectory whose path (without trailing '/') matches the
+ * regular expression, or another exclude pattern of inotifytools_add_filter(),
+ * and so never descend into it.  The kernel then does not
+ * generate any events for those trees, which saves watches, queue space and
+ * the cost of matching each event.
+ *
+ * Note that this also drops events on files inside pruned directories which
+ * the regular expression alone would not have ignored.  Directories passed
+ * directly to the watch functions are always watched.  Directories created
+ * later are pruned too, as long as they are watched in response to an event,
+ * since the creation event is itself ignored.
+ *
+ * @param prune 1 to enable pruning, 0 to disable it (the default).
+ */
+void inotifytools_set_prune_by_regex( int prune ) {
+	inotifytools_ctx_set_prune_by_regex( &default_ctx, prune );
+}
 
-					// time format probably invalid
-					error = EINVAL;
-					return ind;
-				}
-			}
-			else {
-				timestr[0] = 0;
-			}
+/**
+ * Like inotifytools_set_prune_by_regex(), but operates on @a ctx.
+ */
+void inotifytools_ctx_set_prune_by_regex( inotifytools_ctx *ctx, int prune ) {
+	ctx->prune = prune;
+}
 
-			strncpy( &out[ind], timestr, size - ind );
-			ind += strlen(timestr);
-			++i;
-			continue;
-		}
+/**
+ * Bring recursive watches up to date whenever the event queue overflows.
+ *
+ * When enabled, the functions returning events call inotifytools_rescan()
+ * before they return an IN_Q_OVERFLOW event, so that by the time the caller
+ * sees the overflow, directories created while events were lost are
+ * watched.  The overflow event itself is always returned, even if it matches
+ * the regular expression given to inotifytools_ignore_events_by_regex().
+ *
+ * Only recursive watches added while this is enabled are rescanned.  For
+ * them, the inode and modification time of each directory are kept when it
+ * is read (24 bytes per watch), so a rescan only reads directories which
+ * changed.  This has no effect with the fanotify backend, which never misses
+ * directories.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param rescan 1 to enable rescanning, 0 to disable it (the default) and
+ *               forget the recursive watches and snapshots.
+ */
+void inotifytools_set_rescan_on_overflow( int rescan ) {
+	inotifytools_ctx_set_rescan_on_overflow( &default_ctx, rescan );
+}
 
-		// Check if next char in fmt is e
-		if ( i < strlen(fmt) - 2 && fmt[i+2] == 'e' ) {
-			eventstr = inotifytools_event_to_str_sep( event->mask, ch1 );
-			strncpy( &out[ind], eventstr, size - ind );
-			ind += strlen(eventstr);
-			i += 2;
-			continue;
-		}
+/**
+ * Like inotifytools_set_rescan_on_overflow(), but operates on @a ctx.
+ */
+void inotifytools_ctx_set_rescan_on_overflow( inotifytools_ctx *ctx,
+                                              int rescan ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	if ( !rescan ) rescan_free( ctx );
+	ctx->rescan = rescan;
+}
 
-		// OK, this wasn't a special format character, just output it as normal
-		if ( ind < MAX_STRLEN ) out[ind++] = '%';
-		if ( ind < MAX_STRLEN ) out[ind++] = ch1;
-		++i;
-	}
-	out[ind] = 0;
+/**
+ * Merge repeated events on the same file before handing them out.
+ *
+ * When enabled, each event is held back for @a ms milliseconds, and events
+ * on the same file occurring meanwhile are merged into it by OR-ing their
+ * masks together, so that e.g. a file being written to in many small pieces
+ * is reported once as IN_MODIFY|IN_CLOSE_WRITE rather than once per write.
+ * Only IN_ACCESS, IN_MODIFY, IN_ATTRIB, IN_OPEN and the IN_CLOSE events are
+ * merged, and only into an earlier event on the same file: an earlier one
+ * of those, an IN_CREATE or an IN_MOVED_TO.  Other events are never merged
+ * or reordered, so the events on a file are still handed out in the order
+ * they occurred, and every IN_MOVED_FROM event is immediately followed by
+ * the IN_MOVED_TO event with the same cookie, if there is one.
+ *
+ * Events are handed out in the order of the first event merged into them,
+ * no later than @a ms milliseconds after it occurred.  The events returned
+ * by inotifytools_next_events() and inotifytools_next_event_batch() are
+ * coalesced; they stay valid until the next call to either.  Statistics are
+ * tallied for each event before it is coalesced.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param ms time in milliseconds to hold events back for, or 0 to disable
+ *           coalescing (the default).  Events already held back are handed
+ *           out by the next calls without waiting.
+ */
+void inotifytools_set_coalesce_ms( long ms ) {
+	inotifytools_ctx_set_coalesce_ms( &default_ctx, ms );
+}
 
-	return ind - 1;
+/**
+ * Like inotifytools_set_coalesce_ms(), but operates on @a ctx.
+ */
+void inotifytools_ctx_set_coalesce_ms( inotifytools_ctx *ctx, long ms ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	ctx->coalesce_ms = ms > 0 ? ms : 0;
 }
 
 /**
@@ -1971,7 +8136,16 @@ int inotifytools_snprintf( char * out, int size,
  *            incorrect results.
  */
 void inotifytools_set_printf_timefmt( char * fmt ) {
-	timefmt = fmt;
+	inotifytools_ctx_set_printf_timefmt( &default_ctx, fmt );
+}
+
+/**
+ * Like inotifytools_set_printf_timefmt(), but operates on @a ctx.
+ */
+void inotifytools_ctx_set_printf_timefmt( inotifytools_ctx *ctx,
+                                          char * fmt ) {
+	ctx->timefmt = fmt;
+	ctx->time_valid = 0;
 }
 
 /**
@@ -1984,7 +8158,7 @@ void inotifytools_set_printf_timefmt( char * fmt ) {
  */
 int inotifytools_get_max_queued_events() {
 	int ret;
-	if ( !read_num_from_file( QUEUE_SIZE_PATH, &ret ) ) return -1;
+	if ( !read_num_from_file( &default_ctx, QUEUE_SIZE_PATH, &ret ) ) return -1;
 	return ret;
 }
 
@@ -1999,7 +8173,7 @@ int inotifytools_get_max_queued_events() {
  */
 int inotifytools_get_max_user_instances() {
 	int ret;
-	if ( !read_num_from_file( INSTANCES_PATH, &ret ) ) return -1;
+	if ( !read_num_from_file( &default_ctx, INSTANCES_PATH, &ret ) ) return -1;
 	return ret;
 }
 
@@ -2014,10 +8188,100 @@ int inotifytools_get_max_user_instances() {
  */
 int inotifytools_get_max_user_watches() {
 	int ret;
-	if ( !read_num_from_file( WATCHES_SIZE_PATH, &ret ) ) return -1;
+	if ( !read_num_from_file( &default_ctx, WATCHES_SIZE_PATH, &ret ) ) return -1;
 	return ret;
 }
 
+/**
+ * @internal
+ * Compile the patterns of @a ctx into its filter.
+ *
+ * @return 1 on success, 0 with the error in @a ctx if a pattern doesn't
+ *         compile, in which case the previous filter is kept.
+ */
+static int filters_compile( inotifytools_ctx *ctx ) {
+	int error;
+	inotifytools_filter *filter =
+	    inotifytools_filter_compile( ctx->filter_patterns,
+	                                 ctx->num_filter_patterns, &error );
+	if ( error ) {
+		ctx->error = error;
+		return 0;
+	}
+	inotifytools_filter_free( ctx->filter );
+	ctx->filter = filter;
+	return 1;
+}
+
+/**
+ * @internal
+ * Append a pattern to those of @a ctx, without compiling them.
+ */
+static void filters_push( inotifytools_ctx *ctx, char const *pattern,
+                          int flags, int cflags, int slot ) {
+	struct inotifytools_filter_pattern *patterns =
+	    (struct inotifytools_filter_pattern *)realloc( ctx->filter_patterns,
+	        (ctx->num_filter_patterns + 1) * sizeof(*patterns) );
+	niceassert( patterns, "out of memory" );
+	ctx->filter_patterns = patterns;
+	struct inotifytools_filter_pattern *p =
+	    &patterns[ctx->num_filter_patterns++];
+	p->pattern = strdup( pattern );
+	niceassert( p->pattern, "out of memory" );
+	p->flags = flags;
+	p->cflags = cflags;
+	p->slot = slot;
+}
+
+/**
+ * @internal
+ * Remove the pattern at @a i from those of @a ctx, without compiling them.
+ */
+static void filters_remove( inotifytools_ctx *ctx, int i ) {
+	free( ctx->filter_patterns[i].pattern );
+	memmove( &ctx->filter_patterns[i], &ctx->filter_patterns[i + 1],
+	         (ctx->num_filter_patterns - i - 1) *
+	         sizeof(struct inotifytools_filter_pattern) );
+	--ctx->num_filter_patterns;
+}
+
+/**
+ * @internal
+ * Replace the pattern set by the function of @a slot with @a pattern, or
+ * just remove it if @a pattern is NULL.  If @a pattern doesn't compile,
+ * neither is left.
+ */
+static int filters_set_slot( inotifytools_ctx *ctx, int slot,
+                             char const *pattern, int flags, int cflags ) {
+	// the worker thread of inotifytools_watch_recursively_async() prunes by it
+	async_wait_idle( ctx );
+
+	for ( int i = 0; i < ctx->num_filter_patterns; ++i ) {
+		if ( ctx->filter_patterns[i].slot == slot ) filters_remove( ctx, i-- );
+	}
+	if ( !pattern ) return filters_compile( ctx );
+	filters_push( ctx, pattern, flags, cflags, slot );
+	if ( filters_compile( ctx ) ) return 1;
+	filters_remove( ctx, ctx->num_filter_patterns - 1 );
+	filters_compile( ctx );
+	return 0;
+}
+
+/**
+ * @internal
+ * Remove every pattern of @a ctx.
+ */
+static void filters_clear( inotifytools_ctx *ctx ) {
+	for ( int i = 0; i < ctx->num_filter_patterns; ++i ) {
+		free( ctx->filter_patterns[i].pattern );
+	}
+	free( ctx->filter_patterns );
+	ctx->filter_patterns = NULL;
+	ctx->num_filter_patterns = 0;
+	inotifytools_filter_free( ctx->filter );
+	ctx->filter = NULL;
+}
+
 /**
  * Ignore inotify events matching a particular regular expression.
  *
@@ -2028,35 +8292,120 @@ int inotifytools_get_max_user_watches() {
  * the regular expression is executed on the filename of files on which
  * events occur.  If the regular expression matches, the matched event will be
  * ignored.
+ *
+ * Each call replaces the regular expression of the previous one, and a NULL
+ * @a pattern removes it.  Patterns added with inotifytools_add_filter() are
+ * kept.
  */
 int inotifytools_ignore_events_by_regex( char const *pattern, int flags ) {
-	if (!pattern) {
-		if (regex) {
-			regfree(regex);
-			free(regex);
-			regex = 0;
-		}
-		return 1;
-	}
+	return inotifytools_ctx_ignore_events_by_regex( &default_ctx, pattern, flags );
+}
+
+/**
+ * Like inotifytools_ignore_events_by_regex(), but operates on @a ctx.
+ */
+int inotifytools_ctx_ignore_events_by_regex( inotifytools_ctx *ctx,
+                                             char const *pattern, int flags ) {
+	return filters_set_slot( ctx, 1, pattern, 0, flags );
+}
+
+/**
+ * Ignore inotify events not matching a particular regular expression.
+ *
+ * Like inotifytools_ignore_events_by_regex(), but only events on files whose
+ * name the regular expression matches are reported.  Each call replaces the
+ * regular expression of the previous one.
+ */
+int inotifytools_ignore_events_by_inverted_regex( char const *pattern,
+                                                  int flags ) {
+	return inotifytools_ctx_ignore_events_by_inverted_regex( &default_ctx,
+	                                                         pattern, flags );
+}
 
-	if (regex) { regfree(regex); }
-	else       { regex = (regex_t *)malloc(sizeof(regex_t)); }
+/**
+ * Like inotifytools_ignore_events_by_inverted_regex(), but operates on
+ * @a ctx.
+ */
+int inotifytools_ctx_ignore_events_by_inverted_regex( inotifytools_ctx *ctx,
+                                                      char const *pattern,
+                                                      int flags ) {
+	return filters_set_slot( ctx, 2, pattern, INOTIFYTOOLS_FILTER_INCLUDE,
+	                         flags );
+}
 
-	int ret = regcomp(regex, pattern, flags | REG_NOSUB);
-	if (0 == ret) return 1;
+/**
+ * Add a pattern for the names of files whose events are ignored.
+ *
+ * Any number of patterns can be added.  An event is ignored if its file name
+ * matches an exclude pattern, or if there are include patterns and it
+ * matches none of them.  The file name is the watched path followed by the
+ * name of the event, as in "%w%f" with inotifytools_printf(), and the
+ * regular expression of inotifytools_ignore_events_by_regex() counts as one
+ * more exclude pattern.  inotifytools_set_prune_by_regex() only prunes by
+ * exclude patterns.
+ *
+ * By default @a pattern is a POSIX extended regular expression, which
+ * matches anywhere in the name.  With INOTIFYTOOLS_FILTER_GLOB it is a shell
+ * wildcard pattern, which must match the whole name, and whose '*' and '?'
+ * match '/' too.  Patterns which compare a literal with the whole name, its
+ * start or its end, such as the glob "*.swp" or the regex "\.swp$", are
+ * looked up in hash tables; all other patterns are combined into a single
+ * regular expression.  The cost of matching an event thus barely grows with
+ * the number of such patterns.
+ *
+ * @param pattern regular expression or glob.
+ * @param flags bitwise OR of INOTIFYTOOLS_FILTER_INCLUDE to only report
+ *              matching events, INOTIFYTOOLS_FILTER_GLOB, and
+ *              INOTIFYTOOLS_FILTER_ICASE to ignore case.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error(): EINVAL if @a pattern is not a
+ *         valid regular expression.
+ */
+int inotifytools_add_filter( char const *pattern, int flags ) {
+	return inotifytools_ctx_add_filter( &default_ctx, pattern, flags );
+}
 
-	regfree(regex);
-	free(regex);
-	regex = 0;
-	error = EINVAL;
+/**
+ * Like inotifytools_add_filter(), but operates on @a ctx.
+ */
+int inotifytools_ctx_add_filter( inotifytools_ctx *ctx, char const *pattern,
+                                 int flags ) {
+	async_wait_idle( ctx );
+	filters_push( ctx, pattern, flags & (INOTIFYTOOLS_FILTER_INCLUDE |
+	                                     INOTIFYTOOLS_FILTER_GLOB),
+	              REG_EXTENDED |
+	              (flags & INOTIFYTOOLS_FILTER_ICASE ? REG_ICASE : 0), 0 );
+	if ( filters_compile( ctx ) ) return 1;
+	filters_remove( ctx, ctx->num_filter_patterns - 1 );
 	return 0;
 }
 
+/**
+ * Remove every pattern added with inotifytools_add_filter() or set with
+ * inotifytools_ignore_events_by_regex() and
+ * inotifytools_ignore_events_by_inverted_regex().
+ */
+void inotifytools_clear_filters() {
+	inotifytools_ctx_clear_filters( &default_ctx );
+}
+
+/**
+ * Like inotifytools_clear_filters(), but operates on @a ctx.
+ */
+void inotifytools_ctx_clear_filters( inotifytools_ctx *ctx ) {
+	async_wait_idle( ctx );
+	filters_clear( ctx );
+}
+
 int event_compare(const void *p1, const void *p2, const void *config)
 {
 	if (!p1 || !p2) return p1 - p2;
+	inotifytools_ctx const *ctx = (inotifytools_ctx const *)config;
+	watch const *w1 = (watch const *)p1;
+	watch const *w2 = (watch const *)p2;
 	char asc = 1;
-	int sort_event = (int)config;
+	int sort_event = ctx->sort_event;
 	if (sort_event == -1) {
 		sort_event = 0;
 		asc = 0;
@@ -2064,45 +8413,395 @@ int event_compare(const void *p1, const void *p2, const void *config)
 		sort_event = -sort_event;
 		asc = 0;
 	}
-	int *i1 = stat_ptr((watch*)p1, sort_event);
-	int *i2 = stat_ptr((watch*)p2, sort_event);
-	if (0 == *i1 - *i2) {
-		return ((watch*)p1)->wd - ((watch*)p2)->wd;
+	int i = stat_index(sort_event);
+	if (i < 0 || !ctx->stats[i] || ctx->stats[i][w1->slot] ==
+	                               ctx->stats[i][w2->slot]) {
+		return w1->wd - w2->wd;
 	}
-	if (asc)
-		return *i1 - *i2;
-	else
-		return *i2 - *i1;
+	int cmp = ctx->stats[i][w1->slot] < ctx->stats[i][w2->slot] ? -1 : 1;
+	return asc ? cmp : -cmp;
+}
+
+struct rbtree *inotifytools_wd_sorted_by_event(int sort_event) {
+	return inotifytools_ctx_wd_sorted_by_event( &default_ctx, sort_event );
 }
 
-struct rbtree *inotifytools_wd_sorted_by_event(int sort_event)
+/**
+ * Like inotifytools_wd_sorted_by_event(), but operates on @a ctx.
+ *
+ * The tree refers to the sort order stored in @a ctx, so only the tree
+ * returned by the latest call may be used.
+ */
+struct rbtree *inotifytools_ctx_wd_sorted_by_event( inotifytools_ctx *ctx,
+                                                    int sort_event )
 {
-	struct rbtree *ret = rbinit(event_compare, (void*)sort_event);
-	RBLIST *all = rbopenlist(tree_wd);
-	void const *p = rbreadlist(all);
-	while (p) {
+	ctx->sort_event = sort_event;
+	struct rbtree *ret = rbinit(event_compare, ctx);
+	unsigned i;
+	for ( i = 0; i < ctx->table_wd.size; ++i ) {
+		void const *p = ctx->table_wd.slots[i];
+		if ( !p ) continue;
 		void const *r = rbsearch(p, ret);
 		niceassert((int)(r == p), "Couldn't insert watch into new tree");
-		p = rbreadlist(all);
 	}
-	rbcloselist(all);
 	return ret;
 }
 
+/**
+ * @internal
+ * A watch and the count it is sorted by in inotifytools_wds_sorted_by_event().
+ */
+struct stat_rank {
+	uint64_t count;
+	int wd;
+};
+
+/**
+ * @internal
+ * @return 1 if @a a sorts before @a b, by count in ascending order if
+ *         @a asc is set and descending otherwise, and then by watch
+ *         descriptor.
+ */
+static int stat_rank_before( struct stat_rank const *a,
+                             struct stat_rank const *b, int asc ) {
+	if ( a->count != b->count ) {
+		return asc ? a->count < b->count : a->count > b->count;
+	}
+	return a->wd < b->wd;
+}
+
+/**
+ * @internal
+ * Restore the heap property below @a i of the @a num entries of @a heap,
+ * whose top is the entry sorting last.
+ */
+static void stat_rank_sift( struct stat_rank *heap, unsigned num, unsigned i,
+                            int asc ) {
+	struct stat_rank r = heap[i];
+	for (;;) {
+		unsigned child = 2 * i + 1;
+		if ( child >= num ) break;
+		if ( child + 1 < num &&
+		     stat_rank_before( &heap[child], &heap[child+1], asc ) ) {
+			++child;
+		}
+		if ( !stat_rank_before( &r, &heap[child], asc ) ) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = r;
+}
+
+static int stats_sorted( inotifytools_ctx *ctx, int sort_event,
+                         int skip_idle, int * wds, int max, int interval );
+
+/**
+ * Get watch descriptors sorted by the number of times a particular event
+ * occurred on them.
+ *
+ * Only the first @a max watches in that order are kept while going through
+ * all watches once, so getting the few busiest of a large number of watches
+ * is cheap, and nothing is allocated apart from @a max records.
+ *
+ * inotifytools_initialize_stats() must be called before this function can
+ * be used.
+ *
+ * @param sort_event event to sort by, in ascending order, or the negated
+ *                   event for descending order.  0 sorts by the total in
+ *                   ascending order and -1 by the total in descending
+ *                   order.  Watches with equal counts are sorted by watch
+ *                   descriptor.
+ *
+ * @param skip_idle if nonzero, leave out watches which had no events.
+ *
+ * @param wds where to store the watch descriptors.
+ *
+ * @param max room in @a wds.
+ *
+ * @return the number of watch descriptors stored, or -1 if @a sort_event is
+ *         invalid or statistics are not collected.
+ */
+int inotifytools_wds_sorted_by_event( int sort_event, int skip_idle,
+                                      int * wds, int max ) {
+	return inotifytools_ctx_wds_sorted_by_event( &default_ctx, sort_event,
+	                                             skip_idle, wds, max );
+}
+
+/**
+ * Like inotifytools_wds_sorted_by_event(), but operates on @a ctx.
+ */
+int inotifytools_ctx_wds_sorted_by_event( inotifytools_ctx *ctx,
+                                          int sort_event, int skip_idle,
+                                          int * wds, int max ) {
+	return stats_sorted( ctx, sort_event, skip_idle, wds, max, 0 );
+}
+
+/**
+ * Like inotifytools_wds_sorted_by_event(), but sorts by the counts of the
+ * interval ended by the latest call to inotifytools_next_interval(), and
+ * with @a skip_idle set only leaves out watches which had no events then.
+ *
+ * @return the number of watch descriptors stored, or -1 if @a sort_event is
+ *         invalid or there was no interval yet.
+ */
+int inotifytools_interval_wds_sorted_by_event( int sort_event,
+                                               int skip_idle,
+                                               int * wds, int max ) {
+	return inotifytools_ctx_interval_wds_sorted_by_event( &default_ctx,
+	                                                      sort_event,
+	                                                      skip_idle, wds,
+	                                                      max );
+}
+
+/**
+ * Like inotifytools_interval_wds_sorted_by_event(), but operates on @a ctx.
+ */
+int inotifytools_ctx_interval_wds_sorted_by_event( inotifytools_ctx *ctx,
+                                                   int sort_event,
+                                                   int skip_idle,
+                                                   int * wds, int max ) {
+	if ( !ctx->epoch ) return -1;
+	return stats_sorted( ctx, sort_event, skip_idle, wds, max, 1 );
+}
+
+/**
+ * @internal
+ * Implements inotifytools_wds_sorted_by_event() and, with @a interval set,
+ * inotifytools_interval_wds_sorted_by_event().
+ */
+static int stats_sorted( inotifytools_ctx *ctx, int sort_event,
+                         int skip_idle, int * wds, int max, int interval ) {
+	int asc = 1;
+	if ( sort_event == -1 ) {
+		sort_event = 0;
+		asc = 0;
+	}
+	else if ( sort_event < 0 ) {
+		sort_event = -sort_event;
+		asc = 0;
+	}
+	int s = stat_index( sort_event );
+	if ( !ctx->collect_stats || s < 0 ) return -1;
+	if ( max <= 0 ) return 0;
+
+	// The heap keeps the entries sorting first, with the one sorting last
+	// of them on top to be replaced.
+	struct stat_rank *heap = (struct stat_rank *)malloc(
+	    max * sizeof(struct stat_rank) );
+	niceassert( heap, "out of memory" );
+	unsigned num = 0;
+	unsigned i;
+	for ( i = 0; i < ctx->table_wd.size; ++i ) {
+		watch const *w = ctx->table_wd.slots[i];
+		if ( !w ) continue;
+		if ( skip_idle && !stat_count( ctx, STAT_TOTAL, w->slot, interval ) ) {
+			continue;
+		}
+		struct stat_rank r = { stat_count( ctx, s, w->slot, interval ),
+		                       w->wd };
+		if ( num < (unsigned)max ) {
+			// sift up
+			unsigned j = num++;
+			while ( j && stat_rank_before( &heap[(j-1)/2], &r, asc ) ) {
+				heap[j] = heap[(j-1)/2];
+				j = (j - 1) / 2;
+			}
+			heap[j] = r;
+		}
+		else if ( stat_rank_before( &r, &heap[0], asc ) ) {
+			heap[0] = r;
+			stat_rank_sift( heap, num, 0, asc );
+		}
+	}
+
+	// Take the entry sorting last off the top until the heap is empty.
+	unsigned n;
+	for ( n = num; n; --n ) {
+		wds[n-1] = heap[0].wd;
+		heap[0] = heap[n-1];
+		stat_rank_sift( heap, n - 1, 0, asc );
+	}
+	free( heap );
+	return num;
+}
+
+
+/**
+ * @internal
+ * Make the reachability bitmaps of @a ctx hold bit @a wd.
+ *
+ * @return 1 on success, 0 if there is no memory for that.
+ */
+static int reach_grow( inotifytools_ctx *ctx, int wd ) {
+	unsigned words = ctx->reach_words ? ctx->reach_words : 64;
+	while ( words <= (unsigned)wd / 64 ) words *= 2;
+	uint64_t *reached = (uint64_t *)realloc( ctx->reached,
+	                                         words * sizeof(uint64_t) );
+	if ( !reached ) return 0;
+	ctx->reached = reached;
+	uint64_t *dirty = (uint64_t *)realloc( ctx->reach_dirty,
+	                                       words * sizeof(uint64_t) );
+	if ( !dirty ) return 0;
+	ctx->reach_dirty = dirty;
+	memset( &reached[ctx->reach_words], 0,
+	        (words - ctx->reach_words) * sizeof(uint64_t) );
+	memset( &dirty[ctx->reach_words], 0,
+	        (words - ctx->reach_words) * sizeof(uint64_t) );
+	ctx->reach_words = words;
+	return 1;
+}
+
+/**
+ * @internal
+ * Record that watch @a wd had an event.
+ */
+static void reach_mark( inotifytools_ctx *ctx, int wd ) {
+	if ( wd < 0 ) return;
+	unsigned word = (unsigned)wd / 64;
+	uint64_t bit = (uint64_t)1 << (wd % 64);
+	if ( word >= ctx->reach_words && !reach_grow( ctx, wd ) ) return;
+	if ( ctx->reached[word] & bit ) return;
+	ctx->reached[word] |= bit;
+	ctx->reach_dirty[word] |= bit;
+}
+
+/**
+ * @internal
+ * Record that watch @a wd was just created, and has not had any event yet.
+ */
+static void reach_new( inotifytools_ctx *ctx, int wd ) {
+	unsigned word = (unsigned)wd / 64;
+	uint64_t bit = (uint64_t)1 << (wd % 64);
+	if ( word >= ctx->reach_words && !reach_grow( ctx, wd ) ) return;
+	ctx->reached[word] &= ~bit;
+	ctx->reach_dirty[word] |= bit;
+}
+
+/**
+ * @internal
+ * Free the reachability bitmaps of @a ctx and stop tracking.
+ */
+static void reach_free( inotifytools_ctx *ctx ) {
+	free( ctx->reached );
+	free( ctx->reach_dirty );
+	free( ctx->reach_path );
+	ctx->reached = NULL;
+	ctx->reach_dirty = NULL;
+	ctx->reach_path = NULL;
+	ctx->reach_words = 0;
+	ctx->reach = 0;
+}
+
+/**
+ * Track which watched directories have had events.
+ *
+ * This is meant for finding cold directories in large trees: watch them,
+ * let events come in for a while and see which directories never had one.
+ * Tracking costs one bit per watch descriptor and a bit set for each event
+ * returned, so it can be left on for trees of millions of directories.  The
+ * result is written with inotifytools_write_reach_file().
+ *
+ * Events count when they are returned by the functions returning events.
+ * Watches which exist when tracking is turned on start out as not reached.
+ *
+ * inotifytools_initialize() must be called before this function can
+ * be used.
+ *
+ * @param track 1 to start tracking, 0 to stop and forget what was recorded
+ *              (the default).
+ */
+void inotifytools_set_reach_tracking( int track ) {
+	inotifytools_ctx_set_reach_tracking( &default_ctx, track );
+}
+
+/**
+ * Like inotifytools_set_reach_tracking(), but operates on @a ctx.
+ */
+void inotifytools_ctx_set_reach_tracking( inotifytools_ctx *ctx, int track ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	if ( !track ) {
+		reach_free( ctx );
+		return;
+	}
+	if ( ctx->reach ) return;
+	ctx->reach = 1;
+	unsigned i;
+	for ( i = 0; i < ctx->table_wd.size; ++i ) {
+		watch const *w = ctx->table_wd.slots[i];
+		if ( w ) reach_new( ctx, w->wd );
+	}
+}
+
+/**
+ * Write which watched directories have had events to a file.
+ *
+ * Each line of the file is the path of a watched directory, ending in '/',
+ * then a comma and 'y' if it had an event since it was watched or 'n' if it
+ * did not.  The first call for a file writes every watched directory.
+ * Later calls for the same file only append the directories watched or
+ * reached for the first time since the previous call, so this is cheap
+ * enough to call regularly.  A directory may therefore appear more than
+ * once; its last line counts.  Directories which are no longer watched are
+ * left as they were.  Asking for a different file starts over with that
+ * file.
+ *
+ * Watches on files are not tracked, and paths are written as they are, so a
+ * path containing a newline can't be told apart from two paths.
+ *
+ * @param path file to write.
+ *
+ * @return 1 on success, 0 on failure.  On failure, the error can be
+ *         obtained from inotifytools_error(), and the next call writes
+ *         everything again.  If tracking is off, the error is EINVAL.
+ */
+int inotifytools_write_reach_file( char const * path ) {
+	return inotifytools_ctx_write_reach_file( &default_ctx, path );
+}
+
+/**
+ * Like inotifytools_write_reach_file(), but operates on @a ctx.
+ */
+int inotifytools_ctx_write_reach_file( inotifytools_ctx *ctx,
+                                       char const * path ) {
+	niceassert( ctx->init, "inotifytools_initialize not called yet" );
+	if ( !ctx->reach ) {
+		ctx->error = EINVAL;
+		return 0;
+	}
 
-void inotifytools_print_unreached_dirs() {
-	printf("caught a ctrl+c. Writing results \n");
-	struct my_struct *s;
-	FILE *f = fopen("/users/veraoks/result.csv", "w");
+	int full = !ctx->reach_path || strcmp( ctx->reach_path, path );
+	FILE *f = fopen( path, full ? "w" : "a" );
 	if ( !f ) {
-		printf("failed to open /users/veraoks/result.csv\n");
-		exit(errno);
+		ctx->error = errno;
+		return 0;
+	}
+	unsigned i;
+	for ( i = 0; i < ctx->reach_words; ++i ) {
+		uint64_t bits = full ? ~(uint64_t)0 : ctx->reach_dirty[i];
+		for ( ; bits; bits &= bits - 1 ) {
+			int wd = i * 64 + __builtin_ctzll( bits );
+			watch * w = watch_from_wd( ctx, wd );
+			if ( !w ) continue;
+			char const * name = path_str( ctx, w->node );
+			size_t len = strlen( name );
+			if ( !len || name[len-1] != '/' ) continue;
+			fprintf( f, "%s,%c\n", name,
+			         (ctx->reached[i] >> (wd % 64)) & 1 ? 'y' : 'n' );
+		}
 	}
-	for (s=hashtable; s != NULL; s=s->hh.next) {
-		fprintf(f, "%s,%c\n", s->dir_name, s->dir_used);
+	int error = ferror( f ) ? EIO : 0;
+	if ( fclose( f ) && !error ) error = errno;
+
+	free( ctx->reach_path );
+	ctx->reach_path = NULL;
+	if ( error ) {
+		ctx->error = error;
+		return 0;
 	}
-	fclose(f);	
-	exit(0);
+	ctx->reach_path = strdup( path );
+	niceassert( ctx->reach_path, "out of memory" );
+	memset( ctx->reach_dirty, 0, ctx->reach_words * sizeof(uint64_t) );
+	return 1;
 }
 
 
@@ -8,10 +8,58 @@ extern "C"
 
 #include <stdio.h>
 
+typedef struct inotifytools_ctx inotifytools_ctx;
+typedef struct inotifytools_exclude inotifytools_exclude;
+typedef struct inotifytools_format inotifytools_format;
+
+/* A move reported by inotifytools_track_move() or inotifytools_expire_move(). */
+struct inotifytools_move {
+	char const * from;
+	char const * to;
+	unsigned int cookie;
+	int isdir;
+};
+
+/* Number of buckets of struct inotifytools_histogram. */
+#define INOTIFYTOOLS_HISTOGRAM_BUCKETS 40
+
+/* A distribution of samples.  Bucket 0 counts samples of 0, bucket i those
+ * of at least 2^(i-1) and less than 2^i, and the last bucket also those
+ * which are larger. */
+struct inotifytools_histogram {
+	unsigned long long count;
+	unsigned long long sum;
+	unsigned long long max;
+	unsigned long long buckets[INOTIFYTOOLS_HISTOGRAM_BUCKETS];
+};
+
+/* Counters kept once inotifytools_enable_metrics() has been called, see
+ * inotifytools_get_metrics(). */
+struct inotifytools_metrics {
+	struct inotifytools_histogram read_events;  /* events per read */
+	struct inotifytools_histogram read_bytes;   /* bytes per read */
+	struct inotifytools_histogram wait_ns;      /* blocked waiting for events */
+	struct inotifytools_histogram regex_ns;     /* matching an event name */
+	struct inotifytools_histogram format_ns;    /* formatting an event */
+	struct inotifytools_histogram dir_ns;       /* setting up a directory */
+	long long queued_bytes;      /* in the kernel's queue, or -1 */
+	int max_queued_events;       /* size of the kernel's queue, or -1 */
+};
+
+/* Size of a buffer for inotifytools_event_to_str_r() which fits any mask. */
+#define INOTIFYTOOLS_EVENT_STR_SIZE 160
+
+/* Flags of inotifytools_add_filter(). */
+#define INOTIFYTOOLS_FILTER_INCLUDE 0x1  /* report only matching events */
+#define INOTIFYTOOLS_FILTER_GLOB    0x2  /* a glob rather than a regex */
+#define INOTIFYTOOLS_FILTER_ICASE   0x4  /* ignore case */
+
 int inotifytools_str_to_event(char const * event);
 int inotifytools_str_to_event_sep(char const * event, char sep);
 char * inotifytools_event_to_str(int events);
 char * inotifytools_event_to_str_sep(int events, char sep);
+int inotifytools_event_to_str_r( int events, char sep, char * buf,
+                                 int size );
 void inotifytools_set_filename_by_wd( int wd, char const * filename );
 void inotifytools_set_filename_by_filename( char const * oldname,
                                             char const * newname );
@@ -28,18 +76,84 @@ int inotifytools_watch_recursively_with_exclude( char const * path,
                                                  int events,
                                                  char const ** exclude_list );
                                                  // [UH]
+int inotifytools_watch_recursively_parallel( char const * path, int events,
+                                             char const ** exclude_list,
+                                             int num_threads );
+inotifytools_exclude * inotifytools_exclude_compile(
+                                         char const ** exclude_list );
+void inotifytools_exclude_free( inotifytools_exclude * exclude );
+int inotifytools_exclude_matches( inotifytools_exclude const * exclude,
+                                  char const * path );
+int inotifytools_watch_recursively_excluding( char const * path, int events,
+                                    inotifytools_exclude const * exclude,
+                                    int num_threads );
+int inotifytools_watch_recursively_async( char const * path, int events,
+                                          inotifytools_exclude const * exclude );
+int inotifytools_get_async_pending();
 int inotifytools_ignore_events_by_regex( char const *pattern, int flags );
+int inotifytools_ignore_events_by_inverted_regex( char const *pattern,
+                                                  int flags );
+int inotifytools_add_filter( char const *pattern, int flags );
+void inotifytools_clear_filters();
+void inotifytools_set_prune_by_regex( int prune );
+void inotifytools_set_rescan_on_overflow( int rescan );
+int inotifytools_rescan();
+int inotifytools_save_snapshot( char const * file );
+int inotifytools_watch_recursively_from_snapshot( char const * file,
+                                    char const * path, int events,
+                                    inotifytools_exclude const * exclude,
+                                    int num_threads );
+void inotifytools_set_coalesce_ms( long ms );
 struct inotify_event * inotifytools_next_event( int timeout );
 struct inotify_event * inotifytools_next_events( int timeout, int num_events );
+struct inotify_event * inotifytools_next_events_ms( long timeout_ms,
+                                                    int num_events,
+                                                    long max_latency_ms );
+int inotifytools_next_event_batch( int timeout, struct inotify_event ** events,
+                                   int max );
+int inotifytools_next_event_batch_ms( long timeout_ms,
+                                      struct inotify_event ** events,
+                                      int max, long max_latency_ms );
+int inotifytools_track_move( struct inotify_event * event,
+                             struct inotifytools_move * move );
+int inotifytools_expire_move( long max_age_ms,
+                              struct inotifytools_move * move );
+int inotifytools_get_num_pending_moves();
 int inotifytools_error();
 int inotifytools_get_stat_by_wd( int wd, int event );
 int inotifytools_get_stat_total( int event );
 int inotifytools_get_stat_by_filename( char const * filename,
                                                 int event );
+long long inotifytools_get_stat64_by_wd( int wd, int event );
+long long inotifytools_get_stat64_total( int event );
+long long inotifytools_get_stat64_by_filename( char const * filename,
+                                               int event );
 void inotifytools_initialize_stats();
+int inotifytools_wds_sorted_by_event( int sort_event, int skip_idle,
+                                      int * wds, int max );
+int inotifytools_next_interval();
+long long inotifytools_get_interval_stat_by_wd( int wd, int event );
+long long inotifytools_get_interval_stat_total( int event );
+int inotifytools_interval_wds_sorted_by_event( int sort_event,
+                                               int skip_idle,
+                                               int * wds, int max );
 int inotifytools_initialize();
+int inotifytools_set_backend( char const * name );
+int inotifytools_set_shards( int num_shards, int by_subtree );
 void inotifytools_cleanup();
 int inotifytools_get_num_watches();
+int inotifytools_set_wake_fd( int fd );
+int inotifytools_set_read_buffer( size_t bytes );
+size_t inotifytools_get_read_buffer_size();
+long long inotifytools_get_num_reads();
+long long inotifytools_get_num_events_read();
+int inotifytools_enable_metrics( int enable );
+int inotifytools_get_metrics( struct inotifytools_metrics * metrics );
+int inotifytools_start_reader( size_t ring_bytes );
+void inotifytools_stop_reader();
+long long inotifytools_get_reader_depth();
+long long inotifytools_get_reader_high_water();
+long long inotifytools_get_reader_drops();
 
 int inotifytools_printf( struct inotify_event* event, char* fmt );
 int inotifytools_fprintf( FILE* file, struct inotify_event* event, char* fmt );
@@ -47,11 +161,160 @@ int inotifytools_sprintf( char * out, struct inotify_event* event, char* fmt );
 int inotifytools_snprintf( char * out, int size, struct inotify_event* event,
                            char* fmt );
 void inotifytools_set_printf_timefmt( char * fmt );
+inotifytools_format * inotifytools_format_compile( char const * fmt );
+void inotifytools_format_free( inotifytools_format * format );
+int inotifytools_format_event( inotifytools_format const * format,
+                               char * out, int size,
+                               struct inotify_event * event );
 
 int inotifytools_get_max_user_watches();
 int inotifytools_get_max_user_instances();
 int inotifytools_get_max_queued_events();
-void inotifytools_print_unreached_dirs();
+void inotifytools_set_reach_tracking( int track );
+int inotifytools_write_reach_file( char const * path );
+
+inotifytools_ctx * inotifytools_ctx_create();
+void inotifytools_ctx_destroy( inotifytools_ctx *ctx );
+int inotifytools_ctx_initialize( inotifytools_ctx *ctx );
+void inotifytools_ctx_cleanup( inotifytools_ctx *ctx );
+void inotifytools_ctx_set_filename_by_wd( inotifytools_ctx *ctx, int wd,
+                                          char const * filename );
+void inotifytools_ctx_set_filename_by_filename( inotifytools_ctx *ctx,
+                                                char const * oldname,
+                                                char const * newname );
+void inotifytools_ctx_replace_filename( inotifytools_ctx *ctx,
+                                        char const * oldname,
+                                        char const * newname );
+char * inotifytools_ctx_filename_from_wd( inotifytools_ctx *ctx, int wd );
+int inotifytools_ctx_wd_from_filename( inotifytools_ctx *ctx,
+                                       char const * filename );
+int inotifytools_ctx_remove_watch_by_filename( inotifytools_ctx *ctx,
+                                               char const * filename );
+int inotifytools_ctx_remove_watch_by_wd( inotifytools_ctx *ctx, int wd );
+int inotifytools_ctx_watch_file( inotifytools_ctx *ctx, char const * filename,
+                                 int events );
+int inotifytools_ctx_watch_files( inotifytools_ctx *ctx,
+                                  char const * filenames[], int events );
+int inotifytools_ctx_watch_recursively( inotifytools_ctx *ctx,
+                                        char const * path, int events );
+int inotifytools_ctx_watch_recursively_with_exclude( inotifytools_ctx *ctx,
+                                                     char const * path,
+                                                     int events,
+                                                     char const ** exclude_list );
+int inotifytools_ctx_watch_recursively_parallel( inotifytools_ctx *ctx,
+                                                 char const * path,
+                                                 int events,
+                                                 char const ** exclude_list,
+                                                 int num_threads );
+int inotifytools_ctx_watch_recursively_excluding( inotifytools_ctx *ctx,
+                                    char const * path, int events,
+                                    inotifytools_exclude const * exclude,
+                                    int num_threads );
+int inotifytools_ctx_watch_recursively_async( inotifytools_ctx *ctx,
+                                    char const * path, int events,
+                                    inotifytools_exclude const * exclude );
+int inotifytools_ctx_get_async_pending( inotifytools_ctx *ctx );
+int inotifytools_ctx_ignore_events_by_regex( inotifytools_ctx *ctx,
+                                             char const *pattern, int flags );
+int inotifytools_ctx_ignore_events_by_inverted_regex( inotifytools_ctx *ctx,
+                                                      char const *pattern,
+                                                      int flags );
+int inotifytools_ctx_add_filter( inotifytools_ctx *ctx, char const *pattern,
+                                 int flags );
+void inotifytools_ctx_clear_filters( inotifytools_ctx *ctx );
+void inotifytools_ctx_set_prune_by_regex( inotifytools_ctx *ctx, int prune );
+void inotifytools_ctx_set_rescan_on_overflow( inotifytools_ctx *ctx,
+                                              int rescan );
+int inotifytools_ctx_rescan( inotifytools_ctx *ctx );
+int inotifytools_ctx_save_snapshot( inotifytools_ctx *ctx,
+                                    char const * file );
+int inotifytools_ctx_watch_recursively_from_snapshot( inotifytools_ctx *ctx,
+                                    char const * file,
+                                    char const * path, int events,
+                                    inotifytools_exclude const * exclude,
+                                    int num_threads );
+void inotifytools_ctx_set_coalesce_ms( inotifytools_ctx *ctx, long ms );
+struct inotify_event * inotifytools_ctx_next_event( inotifytools_ctx *ctx,
+                                                    int timeout );
+struct inotify_event * inotifytools_ctx_next_events( inotifytools_ctx *ctx,
+                                                     int timeout,
+                                                     int num_events );
+struct inotify_event * inotifytools_ctx_next_events_ms( inotifytools_ctx *ctx,
+                                                        long timeout_ms,
+                                                        int num_events,
+                                                        long max_latency_ms );
+int inotifytools_ctx_next_event_batch( inotifytools_ctx *ctx, int timeout,
+                                       struct inotify_event ** events, int max );
+int inotifytools_ctx_next_event_batch_ms( inotifytools_ctx *ctx,
+                                          long timeout_ms,
+                                          struct inotify_event ** events,
+                                          int max, long max_latency_ms );
+int inotifytools_ctx_track_move( inotifytools_ctx *ctx,
+                                 struct inotify_event * event,
+                                 struct inotifytools_move * move );
+int inotifytools_ctx_expire_move( inotifytools_ctx *ctx, long max_age_ms,
+                                  struct inotifytools_move * move );
+int inotifytools_ctx_get_num_pending_moves( inotifytools_ctx *ctx );
+int inotifytools_ctx_error( inotifytools_ctx *ctx );
+int inotifytools_ctx_get_stat_by_wd( inotifytools_ctx *ctx, int wd,
+                                     int event );
+int inotifytools_ctx_get_stat_total( inotifytools_ctx *ctx, int event );
+int inotifytools_ctx_get_stat_by_filename( inotifytools_ctx *ctx,
+                                           char const * filename, int event );
+long long inotifytools_ctx_get_stat64_by_wd( inotifytools_ctx *ctx, int wd,
+                                             int event );
+long long inotifytools_ctx_get_stat64_total( inotifytools_ctx *ctx,
+                                             int event );
+long long inotifytools_ctx_get_stat64_by_filename( inotifytools_ctx *ctx,
+                                                   char const * filename,
+                                                   int event );
+void inotifytools_ctx_initialize_stats( inotifytools_ctx *ctx );
+int inotifytools_ctx_wds_sorted_by_event( inotifytools_ctx *ctx,
+                                          int sort_event, int skip_idle,
+                                          int * wds, int max );
+int inotifytools_ctx_next_interval( inotifytools_ctx *ctx );
+long long inotifytools_ctx_get_interval_stat_by_wd( inotifytools_ctx *ctx,
+                                                    int wd, int event );
+long long inotifytools_ctx_get_interval_stat_total( inotifytools_ctx *ctx,
+                                                    int event );
+int inotifytools_ctx_interval_wds_sorted_by_event( inotifytools_ctx *ctx,
+                                                   int sort_event,
+                                                   int skip_idle,
+                                                   int * wds, int max );
+int inotifytools_ctx_set_backend( inotifytools_ctx *ctx, char const * name );
+int inotifytools_ctx_set_shards( inotifytools_ctx *ctx, int num_shards,
+                                 int by_subtree );
+int inotifytools_ctx_get_num_watches( inotifytools_ctx *ctx );
+int inotifytools_ctx_set_wake_fd( inotifytools_ctx *ctx, int fd );
+int inotifytools_ctx_set_read_buffer( inotifytools_ctx *ctx, size_t bytes );
+size_t inotifytools_ctx_get_read_buffer_size( inotifytools_ctx *ctx );
+long long inotifytools_ctx_get_num_reads( inotifytools_ctx *ctx );
+long long inotifytools_ctx_get_num_events_read( inotifytools_ctx *ctx );
+int inotifytools_ctx_enable_metrics( inotifytools_ctx *ctx, int enable );
+int inotifytools_ctx_get_metrics( inotifytools_ctx *ctx,
+                                  struct inotifytools_metrics * metrics );
+int inotifytools_ctx_start_reader( inotifytools_ctx *ctx, size_t ring_bytes );
+void inotifytools_ctx_stop_reader( inotifytools_ctx *ctx );
+long long inotifytools_ctx_get_reader_depth( inotifytools_ctx *ctx );
+long long inotifytools_ctx_get_reader_high_water( inotifytools_ctx *ctx );
+long long inotifytools_ctx_get_reader_drops( inotifytools_ctx *ctx );
+
+int inotifytools_ctx_printf( inotifytools_ctx *ctx,
+                             struct inotify_event* event, char* fmt );
+int inotifytools_ctx_fprintf( inotifytools_ctx *ctx, FILE* file,
+                              struct inotify_event* event, char* fmt );
+int inotifytools_ctx_sprintf( inotifytools_ctx *ctx, char * out,
+                              struct inotify_event* event, char* fmt );
+int inotifytools_ctx_snprintf( inotifytools_ctx *ctx, char * out, int size,
+                               struct inotify_event* event, char* fmt );
+void inotifytools_ctx_set_printf_timefmt( inotifytools_ctx *ctx, char * fmt );
+int inotifytools_ctx_format_event( inotifytools_ctx *ctx,
+                                   inotifytools_format const * format,
+                                   char * out, int size,
+                                   struct inotify_event * event );
+void inotifytools_ctx_set_reach_tracking( inotifytools_ctx *ctx, int track );
+int inotifytools_ctx_write_reach_file( inotifytools_ctx *ctx,
+                                       char const * path );
 
 #ifdef __cplusplus
 }
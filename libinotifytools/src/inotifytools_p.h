@@ -1,27 +1,177 @@
 #ifndef INOTIFYTOOLS_P_H
 #define INOTIFYTOOLS_P_H
 
+#include <stdint.h>
+#include <sys/types.h>
+
 #include "redblack.h"
 
+#include "inotifytools/inotifytools.h"
+
+/**
+ * @internal
+ * Assert that a condition evaluates to true, and optionally output a message
+ * if the assertion fails.
+ *
+ * @param  cond  Integer; if 0, assertion fails, otherwise assertion succeeds.
+ *
+ * @param  mesg  A human-readable error message shown if assertion fails.
+ *
+ * @section example Example
+ * @code
+ * int upper = 100, lower = 50;
+ * int input = get_user_input();
+ * niceassert( input <= upper && input >= lower,
+ *             "input not in required range!");
+ * @endcode
+ */
+#define niceassert(cond,mesg) _niceassert((long)cond, __LINE__, __FILE__, \
+                                          #cond, mesg)
+
+void _niceassert( long cond, int line, char const * file, char const * condstr,
+                  char const * mesg );
+
 struct rbtree *inotifytools_wd_sorted_by_event(int sort_event);
+struct rbtree *inotifytools_ctx_wd_sorted_by_event( inotifytools_ctx *ctx,
+                                                    int sort_event );
 
+struct path_node;
+
+/**
+ * @internal
+ * A watch.  Watches live in fixed-size blocks of a per-context arena, so the
+ * records that are touched for every event are small and stay next to each
+ * other.  @a slot is the index of the record in the arena; it also indexes
+ * the statistics table, which is only allocated while statistics are being
+ * collected.
+ */
 typedef struct watch {
-	char *filename;
+	struct path_node *node;
 	int wd;
-	unsigned hit_access;
-	unsigned hit_modify;
-	unsigned hit_attrib;
-	unsigned hit_close_write;
-	unsigned hit_close_nowrite;
-	unsigned hit_open;
-	unsigned hit_moved_from;
-	unsigned hit_moved_to;
-	unsigned hit_create;
-	unsigned hit_delete;
-	unsigned hit_delete_self;
-	unsigned hit_unmount;
-	unsigned hit_move_self;
-	unsigned hit_total;
+	unsigned slot;
 } watch;
 
+/**
+ * @internal
+ * Open-addressed hash table of watches keyed by watch descriptor.
+ *
+ * Kernel watch descriptors are small, mostly dense integers, so the wd itself
+ * is used as the hash and collisions are resolved by linear probing.  @a size
+ * is always a power of two and at most half of the slots are used.
+ */
+struct watch_table {
+	watch **slots;
+	unsigned size;
+	unsigned count;
+};
+
+/**
+ * @internal
+ * Arena of watch records.  Blocks are never moved once allocated, so
+ * pointers to watches stay valid; released slots are reused before the arena
+ * grows.
+ */
+struct watch_arena {
+	watch **blocks;
+	unsigned num_blocks;
+	unsigned used;
+	unsigned *free_slots;
+	unsigned free_size;
+	unsigned num_free;
+};
+
+/**
+ * @internal
+ * Open-addressed hash set used by the path store, see inotifytools.c.
+ */
+struct path_set {
+	struct path_entry **slots;
+	unsigned size;
+	unsigned count;
+};
+
+/**
+ * @internal
+ * Source of events under a context.
+ *
+ * The inotify backend is a thin layer over the inotify syscalls.  Other
+ * backends translate their events into struct inotify_event records, with
+ * watch descriptors of their own; everything above this layer is shared.
+ * Functions return -1 and set @a errno on failure.
+ */
+struct inotifytools_backend {
+	/** Name passed to inotifytools_set_backend(). */
+	char const *name;
+	/** Return a pollable file descriptor, and the backend's state in @a data. */
+	int (*open)( void **data );
+	/** Close @a fd and free @a data. */
+	void (*close)( void *data, int fd );
+	/** Watch @a path for @a events; return the watch descriptor. */
+	int (*add_watch)( void *data, int fd, char const *path, uint32_t events );
+	/**
+	 * Watch the directory @a path and everything below it not matched by
+	 * @a exclude, which is only valid during the call; return the watch
+	 * descriptor of @a path.  NULL if the backend can only watch single
+	 * directories, which are then added one by one.
+	 */
+	int (*add_tree)( void *data, int fd, char const *path, uint32_t events,
+	                 inotifytools_exclude const *exclude );
+	/** Remove the watch @a wd. */
+	int (*rm_watch)( void *data, int fd, int wd );
+	/**
+	 * Read events into @a buf, which holds @a size bytes.  Return the number
+	 * of bytes of struct inotify_event records stored, or -1 with @a errno
+	 * set to EAGAIN if no event was left after filtering.  Backends which
+	 * create watch descriptors while reading name them with
+	 * inotifytools_backend_set_path().
+	 */
+	ssize_t (*read)( inotifytools_ctx *ctx, void *data, int fd, char *buf,
+	                 size_t size );
+	/**
+	 * Return the number of bytes waiting to be read from @a fd, or -1 with
+	 * @a errno set once no more events can come.  NULL to ask @a fd with
+	 * FIONREAD.
+	 */
+	int (*queued)( void *data, int fd );
+};
+
+extern struct inotifytools_backend const inotifytools_fanotify_backend;
+extern struct inotifytools_backend const inotifytools_shard_backend;
+
+int inotifytools_shard_open( void **data, int num_shards, int by_subtree );
+
+/**
+ * @internal
+ * A pattern given to inotifytools_add_filter() or one of the
+ * inotifytools_ignore_events_by_*regex() functions.
+ */
+struct inotifytools_filter_pattern {
+	char *pattern;
+	/** INOTIFYTOOLS_FILTER_* flags. */
+	int flags;
+	/** regcomp() flags, of which only REG_ICASE applies to globs. */
+	int cflags;
+	/** 0, or the function which set it: 1 for by_regex, 2 for inverted. */
+	int slot;
+};
+
+typedef struct inotifytools_filter inotifytools_filter;
+
+inotifytools_filter * inotifytools_filter_compile(
+                        struct inotifytools_filter_pattern const *patterns,
+                        int count, int *error );
+void inotifytools_filter_free( inotifytools_filter *filter );
+int inotifytools_filter_needs_dir( inotifytools_filter const *filter,
+                                   size_t name_len );
+int inotifytools_filter_ignores( inotifytools_filter const *filter,
+                                 char const *dir, char const *name,
+                                 char *buf, size_t size );
+int inotifytools_filter_prunes( inotifytools_filter const *filter,
+                                char const *path );
+
+void inotifytools_backend_set_path( inotifytools_ctx *ctx, int wd,
+                                    char const *path );
+inotifytools_exclude * inotifytools_exclude_copy(
+                                      inotifytools_exclude const * exclude );
+
 #endif
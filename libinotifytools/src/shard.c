@@ -0,0 +1,413 @@
+// kate: replace-tabs off; space-indent off;
+
+/**
+ * @file shard.c
+ * @internal
+ * Sharded inotify backend; see inotifytools_set_shards().
+ *
+ * Watches are spread over several inotify instances, so that each has a
+ * kernel event queue of its own.  Every instance is drained by a thread,
+ * which renumbers the watch descriptors of its events so that they are
+ * unique across instances and appends them to a stream socket shared by all
+ * threads.  The context reads the merged events from the other end, in the
+ * order the threads got them from the kernel.  Events of different
+ * instances are not ordered otherwise.
+ *
+ * Watch descriptor w of instance i becomes (w - 1) * num_shards + i + 1.
+ * Watches for which that would not fit into an int are not added.
+ */
+
+#include "../../config.h"
+#include "inotifytools_p.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "inotifytools/inotify.h"
+
+/** @internal Bytes each thread reads from its inotify instance at once. */
+#define SHARD_READ_SIZE (64 * 1024)
+/** @internal Send buffer asked for the merged stream. */
+#define SHARD_STREAM_SIZE (1024 * 1024)
+/** @internal Largest event, see READ_BUFFER_MIN in inotifytools.c. */
+#define SHARD_EVENT_MAX ( sizeof(struct inotify_event) + NAME_MAX + 1 )
+/** @internal Number of shards of the "sharded" backend. */
+#define SHARD_DEFAULT 4
+
+struct shard_backend;
+
+/**
+ * @internal
+ * One inotify instance and the thread draining it.
+ */
+struct shard {
+	struct shard_backend *b;
+	int index;
+	int fd;
+	int started;
+	pthread_t thread;
+	char *buf;
+};
+
+/**
+ * @internal
+ * State of the sharded backend.  @a stream[1] is written by the threads,
+ * while holding @a lock so that batches of events stay whole, and
+ * @a stream[0] is the file descriptor the context reads.  @a partial holds
+ * the start of an event cut short by the last read.  @a error is why the
+ * first thread to give up did.
+ */
+struct shard_backend {
+	int num_shards;
+	int by_subtree;
+	// components of the first path watched, see shard_of()
+	int root_depth;
+	struct shard *shards;
+	int stream[2];
+	int stop_fd;
+	pthread_mutex_t lock;
+	int error;
+	char partial[SHARD_EVENT_MAX];
+	size_t partial_len;
+};
+
+/**
+ * @internal
+ * @return the number of '/' separated components of @a path.
+ */
+static int path_depth( char const *path ) {
+	int depth = 0;
+	for ( char const *p = path; *p; ++p ) {
+		if ( *p != '/' && (p == path || p[-1] == '/') ) ++depth;
+	}
+	return depth;
+}
+
+/**
+ * @internal
+ * @return the shard @a path is watched by.  By default this is given by a
+ *         hash of the whole path.  With @a by_subtree, it is given by the
+ *         path up to the directory just below the first path watched, so
+ *         that every subtree of that directory is in a single shard and moves
+ *         within it are reported in order.  A directory moved to a path of
+ *         another shard stays with the shard it was watched by.
+ */
+static int shard_of( struct shard_backend *b, char const *path ) {
+	size_t len = strlen( path );
+	if ( b->by_subtree ) {
+		if ( !b->root_depth ) b->root_depth = path_depth( path );
+		int depth = 0;
+		for ( size_t i = 0; i < len; ++i ) {
+			if ( path[i] != '/' && (i == 0 || path[i - 1] == '/') &&
+			     ++depth > b->root_depth + 1 ) {
+				len = i;
+				break;
+			}
+		}
+	}
+
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for ( size_t i = 0; i < len; ++i ) {
+		// paths of directories may or may not end in '/'
+		if ( i == len - 1 && path[i] == '/' ) break;
+		hash = (hash ^ (unsigned char)path[i]) * 16777619u;
+	}
+	return hash % b->num_shards;
+}
+
+/**
+ * @internal
+ * @return the watch descriptor of @a wd of instance @a i across instances,
+ *         or -1 if it doesn't fit into an int.
+ */
+static int merged_wd( struct shard_backend *b, int i, int wd ) {
+	if ( wd - 1 > (INT_MAX - i - 1) / b->num_shards ) return -1;
+	return (wd - 1) * b->num_shards + i + 1;
+}
+
+/**
+ * @internal
+ * Write all @a size bytes of @a buf to the merged stream.
+ *
+ * @return 0 on success, or an error number.
+ */
+static int shard_send( struct shard_backend *b, char const *buf,
+                       size_t size ) {
+	int error = 0;
+	pthread_mutex_lock( &b->lock );
+	while ( size ) {
+		ssize_t sent = send( b->stream[1], buf, size, MSG_NOSIGNAL );
+		if ( sent < 0 ) {
+			if ( errno == EINTR ) continue;
+			error = errno;
+			break;
+		}
+		buf += sent;
+		size -= sent;
+	}
+	pthread_mutex_unlock( &b->lock );
+	return error;
+}
+
+/**
+ * @internal
+ * End a thread of @a b which gives up with @a error, or 0 if told to stop.
+ * The events of its instance would be lost from then on, so the first error
+ * ends the merged stream, and the other threads give up on their next send.
+ */
+static void * shard_exit( struct shard_backend *b, int error ) {
+	int none = 0;
+	if ( error &&
+	     __atomic_compare_exchange_n( &b->error, &none, error, 0,
+	                                  __ATOMIC_RELEASE, __ATOMIC_RELAXED ) ) {
+		shutdown( b->stream[1], SHUT_WR );
+	}
+	return NULL;
+}
+
+/**
+ * @internal
+ * Thread draining the inotify instance of @a arg, a struct shard, into the
+ * merged stream until the backend is closed.
+ */
+static void * shard_thread( void *arg ) {
+	struct shard *s = (struct shard *)arg;
+	struct shard_backend *b = s->b;
+	struct pollfd fds[2];
+	fds[0].fd = s->fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = b->stop_fd;
+	fds[1].events = POLLIN;
+
+	for (;;) {
+		if ( poll( fds, 2, -1 ) < 0 ) {
+			if ( errno == EINTR ) continue;
+			return shard_exit( b, errno );
+		}
+		if ( fds[1].revents ) return shard_exit( b, 0 );
+
+		ssize_t bytes = read( s->fd, s->buf, SHARD_READ_SIZE );
+		if ( bytes <= 0 ) {
+			if ( bytes < 0 && errno == EINTR ) continue;
+			return shard_exit( b, bytes < 0 ? errno : EIO );
+		}
+		ssize_t used = 0, size;
+		for ( ssize_t i = 0; i < bytes; i += size ) {
+			struct inotify_event *event =
+				(struct inotify_event *)(s->buf + i);
+			size = sizeof(struct inotify_event) + event->len;
+			// overflows have no watch, and the events of watches
+			// add_watch() refused to add are dropped
+			if ( event->wd > 0 ) {
+				event->wd = merged_wd( b, s->index, event->wd );
+				if ( event->wd < 0 ) continue;
+			}
+			memmove( s->buf + used, event, size );
+			used += size;
+		}
+		if ( !used ) continue;
+		int error = shard_send( b, s->buf, used );
+		if ( error ) return shard_exit( b, error );
+	}
+}
+
+/**
+ * @internal
+ */
+static void shard_backend_close( void *data,
+                                 int fd __attribute__((unused)) ) {
+	struct shard_backend *b = (struct shard_backend *)data;
+	eventfd_write( b->stop_fd, 1 );
+	// a thread waiting to send gives up once nobody can read
+	shutdown( b->stream[0], SHUT_RDWR );
+	for ( int i = 0; i < b->num_shards; ++i ) {
+		struct shard *s = &b->shards[i];
+		if ( s->started ) pthread_join( s->thread, NULL );
+		if ( s->fd >= 0 ) close( s->fd );
+		free( s->buf );
+	}
+	free( b->shards );
+	close( b->stream[0] );
+	close( b->stream[1] );
+	close( b->stop_fd );
+	pthread_mutex_destroy( &b->lock );
+	free( b );
+}
+
+/**
+ * @internal
+ * Open @a num_shards inotify instances and start their threads.
+ *
+ * @return the file descriptor of the merged stream, or -1 with @a errno set.
+ */
+int inotifytools_shard_open( void **data, int num_shards, int by_subtree ) {
+	struct shard_backend *b =
+		(struct shard_backend *)calloc( 1, sizeof(struct shard_backend) );
+	if ( !b ) {
+		errno = ENOMEM;
+		return -1;
+	}
+	b->num_shards = num_shards;
+	b->by_subtree = by_subtree;
+	b->stop_fd = -1;
+	pthread_mutex_init( &b->lock, NULL );
+	b->shards = (struct shard *)calloc( num_shards, sizeof(struct shard) );
+	if ( !b->shards ||
+	     0 != socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0,
+	                      b->stream ) ) {
+		int error = b->shards ? errno : ENOMEM;
+		free( b->shards );
+		pthread_mutex_destroy( &b->lock );
+		free( b );
+		errno = error;
+		return -1;
+	}
+	int size = SHARD_STREAM_SIZE;
+	setsockopt( b->stream[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size) );
+
+	int error = 0;
+	b->stop_fd = eventfd( 0, EFD_CLOEXEC );
+	if ( b->stop_fd < 0 ) error = errno;
+	for ( int i = 0; i < num_shards; ++i ) {
+		b->shards[i].fd = -1;
+	}
+	for ( int i = 0; !error && i < num_shards; ++i ) {
+		struct shard *s = &b->shards[i];
+		s->b = b;
+		s->index = i;
+		s->buf = (char *)malloc( SHARD_READ_SIZE );
+		// EMFILE here means fs.inotify.max_user_instances is reached
+		s->fd = inotify_init1( IN_CLOEXEC );
+		if ( !s->buf ) error = ENOMEM;
+		else if ( s->fd < 0 ) error = errno;
+	}
+	if ( !error ) {
+		sigset_t all, old;
+		sigfillset( &all );
+		pthread_sigmask( SIG_SETMASK, &all, &old );
+		for ( int i = 0; !error && i < num_shards; ++i ) {
+			struct shard *s = &b->shards[i];
+			error = pthread_create( &s->thread, NULL, shard_thread, s );
+			s->started = !error;
+		}
+		pthread_sigmask( SIG_SETMASK, &old, NULL );
+	}
+	if ( error ) {
+		if ( b->stop_fd < 0 ) b->stop_fd = eventfd( 0, EFD_CLOEXEC );
+		shard_backend_close( b, b->stream[0] );
+		errno = error;
+		return -1;
+	}
+	*data = b;
+	return b->stream[0];
+}
+
+/**
+ * @internal
+ */
+static int shard_backend_open( void **data ) {
+	return inotifytools_shard_open( data, SHARD_DEFAULT, 0 );
+}
+
+/**
+ * @internal
+ */
+static int shard_backend_add_watch( void *data, int fd __attribute__((unused)),
+                                    char const *path, uint32_t events ) {
+	struct shard_backend *b = (struct shard_backend *)data;
+	int i = shard_of( b, path );
+	int wd = inotify_add_watch( b->shards[i].fd, path, events );
+	if ( wd < 0 ) return -1;
+	int merged = merged_wd( b, i, wd );
+	if ( merged < 0 ) {
+		// only a new watch can be out of range
+		inotify_rm_watch( b->shards[i].fd, wd );
+		errno = EOVERFLOW;
+	}
+	return merged;
+}
+
+/**
+ * @internal
+ */
+static int shard_backend_rm_watch( void *data, int fd __attribute__((unused)),
+                                   int wd ) {
+	struct shard_backend *b = (struct shard_backend *)data;
+	if ( wd <= 0 ) {
+		errno = EINVAL;
+		return -1;
+	}
+	int i = (wd - 1) % b->num_shards;
+	return inotify_rm_watch( b->shards[i].fd, (wd - 1) / b->num_shards + 1 );
+}
+
+/**
+ * @internal
+ * Read whole events from the merged stream.  The threads send whole events,
+ * but a read may end in the middle of one; its start is kept for the next
+ * read.  Once the stream has ended, fail with the error a thread gave up
+ * with.
+ */
+static ssize_t shard_backend_read(
+		inotifytools_ctx *ctx __attribute__((unused)), void *data, int fd,
+		char *buf, size_t size ) {
+	struct shard_backend *b = (struct shard_backend *)data;
+	size_t used = b->partial_len;
+	memcpy( buf, b->partial, used );
+	ssize_t bytes = recv( fd, buf + used, size - used, MSG_DONTWAIT );
+	if ( bytes < 0 && errno != EAGAIN ) return -1;
+	if ( bytes > 0 ) used += bytes;
+
+	size_t whole = 0;
+	while ( whole + sizeof(struct inotify_event) <= used ) {
+		size_t len = sizeof(struct inotify_event) +
+		             ((struct inotify_event *)(buf + whole))->len;
+		if ( whole + len > used ) break;
+		whole += len;
+	}
+	b->partial_len = used - whole;
+	memcpy( b->partial, buf + whole, b->partial_len );
+	if ( !whole ) {
+		int error = __atomic_load_n( &b->error, __ATOMIC_ACQUIRE );
+		errno = bytes ? EAGAIN : error ? error : EIO;
+		return -1;
+	}
+	return whole;
+}
+
+/**
+ * @internal
+ * Like FIONREAD, but fails once a thread has given up and everything sent
+ * before has been read.
+ */
+static int shard_backend_queued( void *data, int fd ) {
+	struct shard_backend *b = (struct shard_backend *)data;
+	int bytes;
+	if ( -1 == ioctl( fd, FIONREAD, &bytes ) ) return -1;
+	if ( bytes ) return bytes;
+	int error = __atomic_load_n( &b->error, __ATOMIC_ACQUIRE );
+	if ( !error ) return 0;
+	errno = error;
+	return -1;
+}
+
+struct inotifytools_backend const inotifytools_shard_backend = {
+	"sharded",
+	shard_backend_open,
+	shard_backend_close,
+	shard_backend_add_watch,
+	NULL,
+	shard_backend_rm_watch,
+	shard_backend_read,
+	shard_backend_queued,
+};
@@ -1,11 +1,12 @@
 // kate: replace-tabs off; space-indent off;
 
+#include "../../config.h"
+
 #include "inotifytools/inotifytools.h"
 #include "inotifytools/inotify.h"
 
-#include "../../config.h"
-
-#define __USE_MISC
+#include <ctype.h>
+#include <dirent.h>
 #include <unistd.h>
 
 #include <stdio.h>
@@ -14,6 +15,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <regex.h>
 #include <stdlib.h>
 #include <time.h>
 
@@ -115,6 +117,60 @@ ENTER
 EXIT
 }
 
+void event_to_str_r() {
+ENTER
+	char buf[INOTIFYTOOLS_EVENT_STR_SIZE];
+	compare( inotifytools_event_to_str_r( IN_CLOSE_WRITE | IN_ISDIR, ',', buf,
+	                                      sizeof(buf) ), 23 );
+	verify2( !strcmp( buf, "CLOSE_WRITE,CLOSE,ISDIR" ), buf );
+	// names keep their order, whatever the order of their bits
+	inotifytools_event_to_str_r( IN_MOVE_SELF | IN_UNMOUNT | IN_ACCESS, '-',
+	                             buf, sizeof(buf) );
+	verify2( !strcmp( buf, "ACCESS-UNMOUNT-MOVE_SELF" ), buf );
+	inotifytools_event_to_str_r( 0, ',', buf, sizeof(buf) );
+	verify2( !strcmp( buf, "0x00000000" ), buf );
+	inotifytools_event_to_str_r( IN_ONLYDIR | IN_OPEN, ',', buf, sizeof(buf) );
+	verify2( !strcmp( buf, "OPEN" ), buf );
+
+	// every name fits, and is cut short in a smaller buffer
+	int all = inotifytools_event_to_str_r( -1, ',', buf, sizeof(buf) );
+	compare( all, strlen( buf ) );
+	verify( all < INOTIFYTOOLS_EVENT_STR_SIZE - 1 );
+	compare( inotifytools_str_to_event( buf ),
+	         IN_ALL_EVENTS | IN_UNMOUNT | IN_Q_OVERFLOW | IN_IGNORED |
+	         IN_ISDIR | IN_ONESHOT );
+	char small[6];
+	compare( inotifytools_event_to_str_r( IN_ACCESS | IN_MODIFY, ',', small,
+	                                      sizeof(small) ), 5 );
+	verify2( !strcmp( small, "ACCES" ), small );
+	compare( inotifytools_event_to_str_r( IN_ACCESS, ',', small, 0 ), -1 );
+
+	// every name is found, in any case, and nothing close to one
+	char const * names[] = { "ACCESS", "MODIFY", "ATTRIB", "CLOSE_WRITE",
+		"CLOSE_NOWRITE", "OPEN", "MOVED_FROM", "MOVED_TO", "CREATE", "DELETE",
+		"DELETE_SELF", "UNMOUNT", "Q_OVERFLOW", "IGNORED", "CLOSE",
+		"MOVE_SELF", "MOVE", "ISDIR", "ONESHOT", "ALL_EVENTS" };
+	int masks[] = { IN_ACCESS, IN_MODIFY, IN_ATTRIB, IN_CLOSE_WRITE,
+		IN_CLOSE_NOWRITE, IN_OPEN, IN_MOVED_FROM, IN_MOVED_TO, IN_CREATE,
+		IN_DELETE, IN_DELETE_SELF, IN_UNMOUNT, IN_Q_OVERFLOW, IN_IGNORED,
+		IN_CLOSE, IN_MOVE_SELF, IN_MOVE, IN_ISDIR, IN_ONESHOT,
+		IN_ALL_EVENTS };
+	for ( unsigned i = 0; i < sizeof(names) / sizeof(names[0]); ++i ) {
+		char name[32];
+		compare( inotifytools_str_to_event( names[i] ), masks[i] );
+		for ( int j = 0; names[i][j]; ++j ) {
+			name[j] = j % 2 ? tolower( names[i][j] ) : names[i][j];
+		}
+		name[strlen( names[i] )] = 0;
+		compare( inotifytools_str_to_event( name ), masks[i] );
+		snprintf( name, sizeof(name), "%sX", names[i] );
+		compare( inotifytools_str_to_event( name ), -1 );
+		snprintf( name, sizeof(name), "X%s", names[i] + 1 );
+		compare( inotifytools_str_to_event( name ), -1 );
+	}
+EXIT
+}
+
 void str_to_event() {
 ENTER
 	compare( inotifytools_str_to_event("open,modify,access"),
@@ -212,7 +268,15 @@ ENTER
 	RESET;
 	test_event->mask = IN_MODIFY;
 	inotifytools_snprintf(buf, 10, test_event, "Event %e %.e on %w %f %T");
-	verify2( !strcmp(buf, "Event MODI"), buf );
+	verify2( !strcmp(buf, "Event MOD"), buf );
+
+	// nothing is written past the end of a small buffer
+	RESET;
+	test_event->mask = IN_MODIFY;
+	memset( buf, 'x', BUFSZ );
+	compare( inotifytools_snprintf(buf, 8, test_event, "Event %e"), 7 );
+	verify2( !strcmp(buf, "Event M"), buf );
+	compare( buf[8], 'x' );
 
 	RESET;
 	test_event->mask = IN_ACCESS;
@@ -238,6 +302,371 @@ ENTER
 EXIT
 }
 
+void tst_next_event_batch() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+	verify( inotifytools_watch_file( TEST_DIR, IN_CREATE ) );
+
+	char fn[1024];
+	for (int i = 0; i < 3; ++i) {
+		snprintf(fn, 1023, "%s/batch%d", TEST_DIR, i);
+		int fd = creat(fn, 0700);
+		verify( -1 != fd );
+		verify( 0 == close(fd) );
+	}
+
+	struct inotify_event *events[8];
+	compare( inotifytools_next_event_batch( 1, events, 2 ), 2 );
+	verify( events[0]->mask & IN_CREATE );
+	verify2( !strcmp(events[0]->name, "batch0"), events[0]->name );
+	verify2( !strcmp(events[1]->name, "batch1"), events[1]->name );
+	// remainder of the read is handed out by the next call
+	compare( inotifytools_next_event_batch( 1, events, 8 ), 1 );
+	verify2( !strcmp(events[0]->name, "batch2"), events[0]->name );
+	compare( inotifytools_next_event_batch( 1, events, 8 ), 0 );
+	compare( inotifytools_error(), 0 );
+EXIT
+}
+
+static long elapsed_ms( struct timespec const * start ) {
+	struct timespec now;
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (now.tv_sec - start->tv_sec) * 1000 +
+	       (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+void tst_next_events_ms() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+	verify( inotifytools_watch_file( TEST_DIR, IN_CREATE ) );
+
+	struct timespec start;
+	clock_t cpu = clock();
+
+	// sub-second timeout with nothing happening
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	verify( !inotifytools_next_events_ms( 100, 1, -1 ) );
+	compare( inotifytools_error(), 0 );
+	verify( elapsed_ms( &start ) >= 90 );
+	verify( elapsed_ms( &start ) < 1000 );
+
+	// non-blocking
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	verify( !inotifytools_next_events_ms( 0, 1, -1 ) );
+	verify( elapsed_ms( &start ) < 50 );
+
+	// one event queued, asked for many: returns once the latency is used up
+	int fd = creat(TEST_DIR "/latency", 0700);
+	verify( -1 != fd );
+	verify( 0 == close(fd) );
+	struct inotify_event *events[64];
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	compare( inotifytools_next_event_batch_ms( -1, events, 64, 100 ), 1 );
+	verify( elapsed_ms( &start ) >= 90 );
+	verify( elapsed_ms( &start ) < 1000 );
+	verify2( !strcmp(events[0]->name, "latency"), events[0]->name );
+
+	// a readable wake fd ends waits at once, but queued events come first
+	int wake[2];
+	verify( 0 == pipe( wake ) );
+	verify( inotifytools_set_wake_fd( wake[0] ) );
+	verify( 1 == write( wake[1], "", 1 ) );
+	fd = creat(TEST_DIR "/wake", 0700);
+	verify( -1 != fd );
+	verify( 0 == close(fd) );
+	struct inotify_event *event = inotifytools_next_events_ms( -1, 1, -1 );
+	verify( event );
+	verify2( !strcmp(event->name, "wake"), event->name );
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	verify( !inotifytools_next_events_ms( -1, 1, -1 ) );
+	compare( inotifytools_error(), 0 );
+	verify( inotifytools_start_reader( 64 * 1024 ) );
+	verify( !inotifytools_next_events_ms( -1, 1, -1 ) );
+	compare( inotifytools_error(), 0 );
+	inotifytools_stop_reader();
+	inotifytools_set_coalesce_ms( 1000 );
+	verify( !inotifytools_next_events_ms( -1, 1, -1 ) );
+	compare( inotifytools_error(), 0 );
+	inotifytools_set_coalesce_ms( 0 );
+	verify( elapsed_ms( &start ) < 50 );
+	char byte;
+	verify( 1 == read( wake[0], &byte, 1 ) );
+	verify( inotifytools_set_wake_fd( -1 ) );
+	verify( 0 == close( wake[0] ) );
+	verify( 0 == close( wake[1] ) );
+
+	// none of the waiting above should have burnt CPU
+	verify( (clock() - cpu) * 1000 / CLOCKS_PER_SEC < 100 );
+EXIT
+}
+
+void tst_ctx() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( (0 == mkdir(TEST_DIR "/ctx1", 0700)) || (EEXIST == errno) );
+	verify( (0 == mkdir(TEST_DIR "/ctx2", 0700)) || (EEXIST == errno) );
+
+	inotifytools_ctx *ctx1 = inotifytools_ctx_create();
+	inotifytools_ctx *ctx2 = inotifytools_ctx_create();
+	verify( ctx1 );
+	verify( ctx2 );
+	verify( inotifytools_ctx_watch_file( ctx1, TEST_DIR "/ctx1", IN_CREATE ) );
+	verify( inotifytools_ctx_watch_file( ctx2, TEST_DIR "/ctx2", IN_CREATE ) );
+	verify( inotifytools_ctx_watch_file( ctx2, TEST_DIR, IN_CREATE ) );
+	compare( inotifytools_ctx_get_num_watches( ctx1 ), 1 );
+	compare( inotifytools_ctx_get_num_watches( ctx2 ), 2 );
+	// the default context is not touched
+	verify( inotifytools_initialize() );
+	compare( inotifytools_get_num_watches(), 0 );
+	verify( -1 == inotifytools_wd_from_filename( TEST_DIR "/ctx1" ) );
+
+	int fd = creat( TEST_DIR "/ctx1/file", 0700 );
+	verify( -1 != fd );
+	verify( 0 == close(fd) );
+
+	struct inotify_event *event = inotifytools_ctx_next_event( ctx1, 1 );
+	verify( event );
+	verify( event->mask & IN_CREATE );
+	verify2( !strcmp(event->name, "file"), event->name );
+	verify( !strcmp( inotifytools_ctx_filename_from_wd( ctx1, event->wd ),
+	                 TEST_DIR "/ctx1/" ) );
+	verify( !inotifytools_ctx_next_events_ms( ctx2, 0, 1, -1 ) );
+	compare( inotifytools_ctx_error( ctx2 ), 0 );
+
+	inotifytools_ctx_destroy( ctx1 );
+	inotifytools_ctx_destroy( ctx2 );
+	verify( 0 == unlink( TEST_DIR "/ctx1/file" ) );
+	verify( 0 == rmdir( TEST_DIR "/ctx1" ) );
+	verify( 0 == rmdir( TEST_DIR "/ctx2" ) );
+EXIT
+}
+
+void tst_watch_table() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+	inotifytools_initialize_stats();
+
+#define TABLE_WATCHES 1000
+	char fn[1024];
+	int wds[TABLE_WATCHES];
+	for (int i = 0; i < TABLE_WATCHES; ++i) {
+		snprintf(fn, 1023, "%s/table%d", TEST_DIR, i);
+		int fd = creat(fn, 0700);
+		verify( -1 != fd );
+		verify( 0 == close(fd) );
+		verify( inotifytools_watch_file(fn, IN_ALL_EVENTS) );
+		wds[i] = inotifytools_wd_from_filename(fn);
+		verify( wds[i] > 0 );
+	}
+	// watching the same file again must not create a second watch
+	snprintf(fn, 1023, "%s/table0", TEST_DIR);
+	verify( inotifytools_watch_file(fn, IN_ALL_EVENTS) );
+	compare( inotifytools_get_num_watches(), TABLE_WATCHES );
+
+	// punch holes into the table, then check every remaining watch
+	for (int i = 0; i < TABLE_WATCHES; i += 3) {
+		verify( inotifytools_remove_watch_by_wd(wds[i]) );
+	}
+	for (int i = 0; i < TABLE_WATCHES; ++i) {
+		snprintf(fn, 1023, "%s/table%d", TEST_DIR, i);
+		if (i % 3 == 0) {
+			compare( inotifytools_filename_from_wd(wds[i]), 0 );
+			compare( inotifytools_wd_from_filename(fn), -1 );
+		}
+		else {
+			verify2( inotifytools_filename_from_wd(wds[i]) &&
+			         !strcmp(fn, inotifytools_filename_from_wd(wds[i])), fn );
+		}
+	}
+
+	snprintf(fn, 1023, "%s/table1", TEST_DIR);
+	int fd = open(fn, O_WRONLY);
+	verify( -1 != fd );
+	verify( 1 == write(fd, "x", 1) );
+	verify( 0 == close(fd) );
+	struct inotify_event *event;
+	while ((event = inotifytools_next_events_ms(100, 1, -1)))
+		;
+	compare( inotifytools_get_stat_by_wd(wds[1], IN_MODIFY), 1 );
+	compare( inotifytools_get_stat_by_wd(wds[2], IN_MODIFY), 0 );
+	compare( inotifytools_get_stat_total(IN_MODIFY), 1 );
+EXIT
+}
+
+void tst_watch_recursively_parallel() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( (0 == mkdir(TEST_DIR "/tree", 0700)) || (EEXIST == errno) );
+
+	// 4 levels of 5 subdirectories each, plus a file in every directory
+#define TREE_FANOUT 5
+	char fn[1024];
+	int dirs = 1;
+	for (int a = 0; a < TREE_FANOUT; ++a)
+	for (int b = -1; b < TREE_FANOUT; ++b)
+	for (int c = -1; c < TREE_FANOUT; ++c) {
+		if (b < 0 && c >= 0) continue;
+		if (b < 0) snprintf(fn, 1023, TEST_DIR "/tree/%d", a);
+		else if (c < 0) snprintf(fn, 1023, TEST_DIR "/tree/%d/%d", a, b);
+		else snprintf(fn, 1023, TEST_DIR "/tree/%d/%d/%d", a, b, c);
+		verify( (0 == mkdir(fn, 0700)) || (EEXIST == errno) );
+		++dirs;
+		strcat(fn, "/file");
+		int fd = creat(fn, 0700);
+		verify( -1 != fd );
+		verify( 0 == close(fd) );
+	}
+
+	// symbolic links to directories are not followed
+	verify( 0 == symlink( TEST_DIR "/tree/0", TEST_DIR "/tree/link" ) );
+
+	verify( inotifytools_initialize() );
+	char const *exclude[] = { TEST_DIR "/tree/2/3", 0 };
+	verify( inotifytools_watch_recursively_parallel( TEST_DIR "/tree",
+	                                                 IN_ALL_EVENTS, exclude,
+	                                                 4 ) );
+	// the excluded directory and its TREE_FANOUT children are not watched
+	compare( inotifytools_get_num_watches(), dirs - 1 - TREE_FANOUT );
+	verify( inotifytools_wd_from_filename( TEST_DIR "/tree/" ) > 0 );
+	verify( inotifytools_wd_from_filename( TEST_DIR "/tree/4/4/4/" ) > 0 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/tree/2/3/" ), -1 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/tree/2/3/1/" ), -1 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/tree/0/file" ), -1 );
+	inotifytools_cleanup();
+
+	// same result as the serial walker
+	verify( inotifytools_initialize() );
+	verify( inotifytools_watch_recursively_with_exclude( TEST_DIR "/tree",
+	                                                     IN_ALL_EVENTS,
+	                                                     exclude ) );
+	compare( inotifytools_get_num_watches(), dirs - 1 - TREE_FANOUT );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/tree/link/" ), -1 );
+	inotifytools_cleanup();
+
+	verify( inotifytools_initialize() );
+	verify( !inotifytools_watch_recursively_parallel( TEST_DIR "/nonexistent",
+	                                                  IN_ALL_EVENTS, 0, 4 ) );
+	compare( inotifytools_error(), ENOENT );
+	verify( 0 == system( "rm -rf " TEST_DIR "/tree" ) );
+EXIT
+}
+
+void tst_exclude() {
+ENTER
+	char const *list[] = { "/srv/exact", "/srv/slash/", "/var/cache*",
+	                       "/home/?/tmp", "/data/[ab]*", 0 };
+	inotifytools_exclude *ex = inotifytools_exclude_compile( list );
+	verify( ex );
+	verify( inotifytools_exclude_matches( ex, "/srv/exact" ) );
+	verify( inotifytools_exclude_matches( ex, "/srv/exact/" ) );
+	verify( inotifytools_exclude_matches( ex, "/srv/slash/" ) );
+	verify( inotifytools_exclude_matches( ex, "/srv/slash" ) );
+	verify( !inotifytools_exclude_matches( ex, "/srv/exac/" ) );
+	verify( !inotifytools_exclude_matches( ex, "/srv/exactly/" ) );
+	verify( !inotifytools_exclude_matches( ex, "/srv/" ) );
+	// prefix
+	verify( inotifytools_exclude_matches( ex, "/var/cache/" ) );
+	verify( inotifytools_exclude_matches( ex, "/var/cache-old/" ) );
+	verify( inotifytools_exclude_matches( ex, "/var/cache/a/b/" ) );
+	verify( !inotifytools_exclude_matches( ex, "/var/cach/" ) );
+	verify( !inotifytools_exclude_matches( ex, "/var/" ) );
+	// globs don't match across '/'
+	verify( inotifytools_exclude_matches( ex, "/home/a/tmp/" ) );
+	verify( !inotifytools_exclude_matches( ex, "/home/ab/tmp/" ) );
+	verify( !inotifytools_exclude_matches( ex, "/home/a/b/tmp/" ) );
+	verify( inotifytools_exclude_matches( ex, "/data/alpha/" ) );
+	verify( !inotifytools_exclude_matches( ex, "/data/alpha/beta/" ) );
+	verify( !inotifytools_exclude_matches( ex, "/data/gamma/" ) );
+	inotifytools_exclude_free( ex );
+
+	char const *empty[] = { 0 };
+	verify( !inotifytools_exclude_compile( empty ) );
+	verify( !inotifytools_exclude_compile( 0 ) );
+	verify( !inotifytools_exclude_matches( 0, "/" ) );
+
+	// many exact excludes
+	char *many[2001];
+	for (int i = 0; i < 2000; ++i) {
+		verify( -1 != asprintf( &many[i], "/many/%d/", i ) );
+	}
+	many[2000] = 0;
+	ex = inotifytools_exclude_compile( (char const **)many );
+	verify( ex );
+	for (int i = 0; i < 2000; ++i) {
+		verify( inotifytools_exclude_matches( ex, many[i] ) );
+		free( many[i] );
+	}
+	verify( !inotifytools_exclude_matches( ex, "/many/2000/" ) );
+	inotifytools_exclude_free( ex );
+
+	// the same compiled list used for several recursive watches
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( 0 == system( "mkdir -p " TEST_DIR "/ex/keep/skip.tmp "
+	                     TEST_DIR "/ex/skip.tmp/sub "
+	                     TEST_DIR "/ex2/a.tmp " TEST_DIR "/ex2/b" ) );
+	char const *globs[] = { TEST_DIR "/*/*.tmp", TEST_DIR "/ex/keep/*.tmp",
+	                        0 };
+	ex = inotifytools_exclude_compile( globs );
+	verify( inotifytools_initialize() );
+	verify( inotifytools_watch_recursively_excluding( TEST_DIR "/ex",
+	                                                  IN_ALL_EVENTS, ex, 1 ) );
+	verify( inotifytools_watch_recursively_excluding( TEST_DIR "/ex2",
+	                                                  IN_ALL_EVENTS, ex, 2 ) );
+	compare( inotifytools_get_num_watches(), 4 );
+	verify( inotifytools_wd_from_filename( TEST_DIR "/ex/keep/" ) > 0 );
+	verify( inotifytools_wd_from_filename( TEST_DIR "/ex2/b/" ) > 0 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/ex/skip.tmp/" ), -1 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/ex2/a.tmp/" ), -1 );
+	inotifytools_exclude_free( ex );
+	verify( 0 == system( "rm -rf " TEST_DIR "/ex " TEST_DIR "/ex2" ) );
+EXIT
+}
+
+void tst_prune_by_regex() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( 0 == system( "mkdir -p " TEST_DIR "/prune/.git/objects "
+	                     TEST_DIR "/prune/src/.git " TEST_DIR "/prune/git" ) );
+
+	for (int threads = 1; threads <= 2; ++threads) {
+		verify( inotifytools_initialize() );
+		verify( inotifytools_ignore_events_by_regex( "/\\.git$",
+		                                             REG_EXTENDED ) );
+		verify( inotifytools_watch_recursively_parallel( TEST_DIR "/prune",
+		                                                 IN_ALL_EVENTS, 0,
+		                                                 threads ) );
+		compare( inotifytools_get_num_watches(), 6 );
+		inotifytools_cleanup();
+
+		verify( inotifytools_initialize() );
+		verify( inotifytools_ignore_events_by_regex( "/\\.git$",
+		                                             REG_EXTENDED ) );
+		inotifytools_set_prune_by_regex( 1 );
+		verify( inotifytools_watch_recursively_parallel( TEST_DIR "/prune",
+		                                                 IN_ALL_EVENTS, 0,
+		                                                 threads ) );
+		compare( inotifytools_get_num_watches(), 3 );
+		verify( inotifytools_wd_from_filename( TEST_DIR "/prune/git/" ) > 0 );
+		compare( inotifytools_wd_from_filename( TEST_DIR "/prune/.git/" ), -1 );
+		compare( inotifytools_wd_from_filename( TEST_DIR "/prune/src/.git/" ),
+		         -1 );
+		inotifytools_cleanup();
+	}
+
+	// the directory passed in is always watched
+	verify( inotifytools_initialize() );
+	verify( inotifytools_ignore_events_by_regex( "\\.git", REG_EXTENDED ) );
+	inotifytools_set_prune_by_regex( 1 );
+	verify( inotifytools_watch_recursively( TEST_DIR "/prune/.git",
+	                                        IN_ALL_EVENTS ) );
+	compare( inotifytools_get_num_watches(), 1 );
+	verify( 0 == system( "rm -rf " TEST_DIR "/prune" ) );
+EXIT
+}
+
 void watch_limit() {
 ENTER
 	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
@@ -282,6 +711,1357 @@ void cleanup() {
 	inotifytools_cleanup();
 }
 
+void tst_format() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+	verify( inotifytools_watch_file( TEST_DIR, IN_CLOSE ) );
+
+	char buf[64];
+	char event_buf[4096];
+	struct inotify_event *test_event = (struct inotify_event*)event_buf;
+	memset(test_event, 0, sizeof(struct inotify_event));
+	test_event->wd = inotifytools_wd_from_filename( TEST_DIR "/" );
+	verify( test_event->wd >= 0 );
+	test_event->mask = IN_MODIFY | IN_ISDIR;
+	strcpy( test_event->name, "file" );
+	test_event->len = strlen( test_event->name )+1;
+
+	inotifytools_format *format =
+	    inotifytools_format_compile( "%w%f %e %-e 100%% %q %T." );
+	verify( format );
+	compare( inotifytools_format_event( format, buf, sizeof(buf), test_event ),
+	         (int)strlen( TEST_DIR "/file MODIFY,ISDIR MODIFY-ISDIR 100% %q ." ) );
+	verify2( !strcmp(buf, TEST_DIR "/file MODIFY,ISDIR MODIFY-ISDIR 100% %q ."),
+	         buf );
+
+	// output is truncated to the buffer size and always terminated
+	compare( inotifytools_format_event( format, buf, 4, test_event ), 3 );
+	verify2( !strcmp(buf, "/tm"), buf );
+
+	// unknown watch and no events
+	test_event->wd = -1;
+	test_event->mask = 0;
+	test_event->len = 0;
+	inotifytools_format_event( format, buf, sizeof(buf), test_event );
+	verify2( !strcmp(buf, " 0x00000000 0x00000000 100% %q ."), buf );
+	inotifytools_format_free( format );
+
+	errno = 0;
+	verify( !inotifytools_format_compile( "" ) );
+	compare( errno, EINVAL );
+	errno = 0;
+	verify( !inotifytools_format_compile( "%e %" ) );
+	compare( errno, EINVAL );
+	inotifytools_format_free( 0 );
+EXIT
+}
+
+void tst_replace_filename() {
+ENTER
+	char const *dirs[] = { "/ren", "/ren/a", "/ren/a/b", "/ren/a/b/c", "/ren/d",
+	                       "/ren-x", "/ren2", "/ren2/a", 0 };
+	char fn[1024];
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	for (int i = 0; dirs[i]; ++i) {
+		snprintf(fn, 1023, TEST_DIR "%s", dirs[i]);
+		verify( (0 == mkdir(fn, 0700)) || (EEXIST == errno) );
+	}
+	verify( inotifytools_initialize() );
+	verify( inotifytools_watch_recursively( TEST_DIR, IN_ALL_EVENTS ) );
+	compare( inotifytools_get_num_watches(), 9 );
+
+	int wd_c = inotifytools_wd_from_filename( TEST_DIR "/ren/a/b/c/" );
+	verify( wd_c > 0 );
+	inotifytools_replace_filename( TEST_DIR "/ren/", TEST_DIR "/moved/" );
+	compare( inotifytools_get_num_watches(), 9 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/ren/a/b/c/" ), -1 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/ren/" ), -1 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/moved/a/b/c/" ), wd_c );
+	verify2( !strcmp( inotifytools_filename_from_wd( wd_c ),
+	                  TEST_DIR "/moved/a/b/c/" ),
+	         inotifytools_filename_from_wd( wd_c ) );
+	verify( inotifytools_wd_from_filename( TEST_DIR "/moved/" ) > 0 );
+	verify( inotifytools_wd_from_filename( TEST_DIR "/moved/a/" ) > 0 );
+	verify( inotifytools_wd_from_filename( TEST_DIR "/moved/a/b/" ) > 0 );
+	verify( inotifytools_wd_from_filename( TEST_DIR "/moved/d/" ) > 0 );
+	// names which only share a string prefix are left alone
+	verify( inotifytools_wd_from_filename( TEST_DIR "/ren-x/" ) > 0 );
+	verify( inotifytools_wd_from_filename( TEST_DIR "/ren2/" ) > 0 );
+	verify( inotifytools_wd_from_filename( TEST_DIR "/ren2/a/" ) > 0 );
+	verify( inotifytools_wd_from_filename( TEST_DIR "/" ) > 0 );
+
+	// moving a subtree to a longer name below itself
+	inotifytools_replace_filename( TEST_DIR "/moved/a/", TEST_DIR "/moved/a/a/" );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/moved/a/a/b/c/" ), wd_c );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/moved/a/b/" ), -1 );
+	compare( inotifytools_get_num_watches(), 9 );
+EXIT
+}
+
+void tst_path_store() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( (0 == mkdir(TEST_DIR "/d", 0700)) || (EEXIST == errno) );
+	int fd = creat(TEST_DIR "/d/file", 0700);
+	verify( -1 != fd );
+	verify( 0 == close(fd) );
+	verify( 0 == chdir(TEST_DIR) );
+	verify( inotifytools_initialize() );
+
+	// names are given back exactly as they were watched
+	verify( inotifytools_watch_file( "d/file", IN_ALL_EVENTS ) );
+	int wd_file = inotifytools_wd_from_filename( "d/file" );
+	verify( wd_file > 0 );
+	verify( inotifytools_watch_file( TEST_DIR "//d", IN_ALL_EVENTS ) );
+	int wd_dir = inotifytools_wd_from_filename( TEST_DIR "//d/" );
+	verify( wd_dir > 0 );
+	verify2( !strcmp( inotifytools_filename_from_wd( wd_file ), "d/file" ),
+	         inotifytools_filename_from_wd( wd_file ) );
+	verify2( !strcmp( inotifytools_filename_from_wd( wd_dir ), TEST_DIR "//d/" ),
+	         inotifytools_filename_from_wd( wd_dir ) );
+	compare( inotifytools_wd_from_filename( "d/" ), -1 );
+	compare( inotifytools_wd_from_filename( "d/fil" ), -1 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/d/" ), -1 );
+
+	// moving to a different, previously unknown parent
+	inotifytools_replace_filename( TEST_DIR "//", "/elsewhere/deep/" );
+	verify2( !strcmp( inotifytools_filename_from_wd( wd_dir ),
+	                  "/elsewhere/deep/d/" ),
+	         inotifytools_filename_from_wd( wd_dir ) );
+	compare( inotifytools_wd_from_filename( "/elsewhere/deep/d/" ), wd_dir );
+	compare( inotifytools_wd_from_filename( TEST_DIR "//d/" ), -1 );
+
+	// string prefixes which aren't directories
+	inotifytools_replace_filename( "d/f", "d/g" );
+	compare( inotifytools_wd_from_filename( "d/gile" ), wd_file );
+
+	inotifytools_set_filename_by_wd( wd_file, "other" );
+	compare( inotifytools_wd_from_filename( "other" ), wd_file );
+	compare( inotifytools_wd_from_filename( "d/gile" ), -1 );
+	inotifytools_set_filename_by_filename( "other", "/elsewhere/deep/d/x" );
+	compare( inotifytools_wd_from_filename( "/elsewhere/deep/d/x" ), wd_file );
+
+	// removing the parent watch keeps the child's name
+	verify( inotifytools_remove_watch_by_wd( wd_dir ) );
+	compare( inotifytools_wd_from_filename( "/elsewhere/deep/d/" ), -1 );
+	verify2( !strcmp( inotifytools_filename_from_wd( wd_file ),
+	                  "/elsewhere/deep/d/x" ),
+	         inotifytools_filename_from_wd( wd_file ) );
+	compare( inotifytools_get_num_watches(), 1 );
+	verify( inotifytools_remove_watch_by_filename( "/elsewhere/deep/d/x" ) );
+	compare( inotifytools_get_num_watches(), 0 );
+
+	// nodes are created again after all of them went away
+	verify( inotifytools_watch_file( "d/file", IN_ALL_EVENTS ) );
+	verify( inotifytools_wd_from_filename( "d/file" ) > 0 );
+	verify( 0 == chdir("/") );
+EXIT
+}
+
+void tst_stats() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+
+	// enough watches to need more than one block of watch records, most of
+	// them added before statistics are enabled
+#define STATS_WATCHES 1100
+	char fn[1024];
+	int wds[STATS_WATCHES];
+	for (int i = 0; i < STATS_WATCHES; ++i) {
+		if (i == STATS_WATCHES - 10) inotifytools_initialize_stats();
+		snprintf(fn, 1023, "%s/stats%d", TEST_DIR, i);
+		int fd = creat(fn, 0700);
+		verify( -1 != fd );
+		verify( 0 == close(fd) );
+		verify( inotifytools_watch_file(fn, IN_ALL_EVENTS) );
+		wds[i] = inotifytools_wd_from_filename(fn);
+		verify( wds[i] > 0 );
+	}
+
+	int touched[] = { 0, STATS_WATCHES - 50, STATS_WATCHES - 1 };
+	for (int t = 0; t < 3; ++t) {
+		snprintf(fn, 1023, "%s/stats%d", TEST_DIR, touched[t]);
+		int fd = open(fn, O_WRONLY);
+		verify( -1 != fd );
+		verify( 1 == write(fd, "x", 1) );
+		verify( 0 == close(fd) );
+	}
+	struct inotify_event *event;
+	while ((event = inotifytools_next_events_ms(100, 1, -1)))
+		;
+	for (int t = 0; t < 3; ++t) {
+		int wd = wds[touched[t]];
+		compare( inotifytools_get_stat_by_wd(wd, IN_OPEN), 1 );
+		compare( inotifytools_get_stat_by_wd(wd, IN_MODIFY), 1 );
+		compare( inotifytools_get_stat_by_wd(wd, IN_CLOSE_WRITE), 1 );
+		compare( inotifytools_get_stat_by_wd(wd, IN_ACCESS), 0 );
+		compare( inotifytools_get_stat_by_wd(wd, 0), 3 );
+		compare( inotifytools_get_stat64_by_wd(wd, 0), 3 );
+	}
+	compare( inotifytools_get_stat_by_wd(wds[1], 0), 0 );
+	compare( inotifytools_get_stat_total(IN_MODIFY), 3 );
+	compare( inotifytools_get_stat64_total(0), 9 );
+	snprintf(fn, 1023, "%s/stats0", TEST_DIR);
+	compare( inotifytools_get_stat64_by_filename(fn, IN_OPEN), 1 );
+
+	// only single counted events can be queried
+	compare( inotifytools_get_stat_by_wd(wds[0], IN_OPEN | IN_MODIFY), -1 );
+	compare( inotifytools_get_stat_by_wd(wds[0], IN_Q_OVERFLOW), -1 );
+	compare( inotifytools_get_stat_total(IN_IGNORED), -1 );
+	compare( inotifytools_get_stat64_by_wd(-1, 0), -1 );
+
+	// busiest watches first, then by watch descriptor
+	int top[STATS_WATCHES];
+	compare( inotifytools_wds_sorted_by_event(-1, 1, top, STATS_WATCHES), 3 );
+	compare( top[0], wds[touched[0]] );
+	compare( top[1], wds[touched[1]] );
+	compare( top[2], wds[touched[2]] );
+	compare( inotifytools_wds_sorted_by_event(-1, 0, top, 4), 4 );
+	compare( top[2], wds[touched[2]] );
+	compare( top[3], wds[1] );
+	compare( inotifytools_wds_sorted_by_event(IN_MODIFY, 0, top,
+	                                          STATS_WATCHES), STATS_WATCHES );
+	compare( top[0], wds[1] );
+	compare( top[STATS_WATCHES - 1], wds[touched[2]] );
+	compare( inotifytools_wds_sorted_by_event(IN_Q_OVERFLOW, 0, top, 1), -1 );
+	char busy[1024];
+	snprintf(busy, 1023, "%s/stats%d", TEST_DIR, touched[1]);
+	int fd = open(busy, O_RDONLY);
+	verify( -1 != fd );
+	verify( 0 == close(fd) );
+	while ((event = inotifytools_next_events_ms(100, 1, -1)))
+		;
+	compare( inotifytools_wds_sorted_by_event(-1, 1, top, 2), 2 );
+	compare( top[0], wds[touched[1]] );
+	compare( top[1], wds[touched[0]] );
+
+	// a watch which reuses the record of a removed one starts from zero
+	verify( inotifytools_remove_watch_by_wd(wds[0]) );
+	verify( inotifytools_watch_file(fn, IN_ALL_EVENTS) );
+	wds[0] = inotifytools_wd_from_filename(fn);
+	compare( inotifytools_get_stat_by_wd(wds[0], 0), 0 );
+
+	inotifytools_initialize_stats();
+	compare( inotifytools_get_stat_by_wd(wds[STATS_WATCHES - 1], 0), 0 );
+	compare( inotifytools_get_stat_total(0), 0 );
+EXIT
+}
+
+void tst_interval() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+	verify( !inotifytools_next_interval() );
+	compare( inotifytools_error(), EINVAL );
+	inotifytools_initialize_stats();
+	compare( inotifytools_get_interval_stat_total(0), -1 );
+
+	char fn[2][1024];
+	int wds[2];
+	for (int i = 0; i < 2; ++i) {
+		snprintf(fn[i], 1023, "%s/interval%d", TEST_DIR, i);
+		int fd = creat(fn[i], 0700);
+		verify( -1 != fd );
+		verify( 0 == close(fd) );
+		verify( inotifytools_watch_file(fn[i], IN_OPEN | IN_CLOSE) );
+		wds[i] = inotifytools_wd_from_filename(fn[i]);
+	}
+
+	struct inotify_event *event;
+	int top[2];
+	for (int round = 0; round < 3; ++round) {
+		verify( inotifytools_next_interval() );
+		// the first file is opened in every interval, the second in every
+		// other interval, once more than the first
+		for (int i = 0; i < 2; ++i) {
+			int opens = i == 0 ? 1 : (round % 2 ? 0 : 2);
+			for (int n = 0; n < opens; ++n) {
+				int fd = open(fn[i], O_RDONLY);
+				verify( -1 != fd );
+				verify( 0 == close(fd) );
+			}
+		}
+		while ((event = inotifytools_next_events_ms(100, 1, -1)))
+			;
+		if (round == 0) {
+			compare( inotifytools_get_interval_stat_total(0), 0 );
+			compare( inotifytools_interval_wds_sorted_by_event(-1, 1, top,
+			                                                   2), 0 );
+		}
+		else if (round == 1) {
+			compare( inotifytools_get_interval_stat_by_wd(wds[0], IN_OPEN),
+			         1 );
+			compare( inotifytools_get_interval_stat_by_wd(wds[1], IN_OPEN),
+			         2 );
+			compare( inotifytools_get_interval_stat_total(0), 6 );
+			compare( inotifytools_interval_wds_sorted_by_event(-1, 1, top,
+			                                                   2), 2 );
+			compare( top[0], wds[1] );
+		}
+		else {
+			// the second file was idle in the last interval
+			compare( inotifytools_get_interval_stat_by_wd(wds[1], 0), 0 );
+			compare( inotifytools_get_interval_stat_by_wd(wds[0],
+			                                            IN_CLOSE_NOWRITE),
+			         1 );
+			compare( inotifytools_get_interval_stat_total(IN_OPEN), 1 );
+			compare( inotifytools_interval_wds_sorted_by_event(-1, 1, top,
+			                                                   2), 1 );
+			compare( top[0], wds[0] );
+		}
+	}
+	// the totals keep counting across intervals
+	compare( inotifytools_get_stat_by_wd(wds[0], IN_OPEN), 3 );
+	compare( inotifytools_get_stat_by_wd(wds[1], IN_OPEN), 4 );
+	compare( inotifytools_get_interval_stat_by_wd(wds[0], IN_Q_OVERFLOW), -1 );
+
+	// resetting the statistics also empties the last interval
+	inotifytools_initialize_stats();
+	compare( inotifytools_get_interval_stat_by_wd(wds[0], 0), 0 );
+	compare( inotifytools_get_interval_stat_total(0), 0 );
+EXIT
+}
+
+void tst_metrics() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( (0 == mkdir(TEST_DIR "/metrics", 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+	struct inotifytools_metrics m;
+	verify( !inotifytools_get_metrics( &m ) );
+	compare( inotifytools_error(), EINVAL );
+	verify( inotifytools_enable_metrics( 1 ) );
+	verify( inotifytools_ignore_events_by_regex( "ignored", REG_EXTENDED ) );
+	verify( inotifytools_watch_recursively( TEST_DIR, IN_CREATE ) );
+
+	verify( inotifytools_get_metrics( &m ) );
+	verify( m.dir_ns.count >= 2 );
+	compare( m.read_events.count, 0 );
+	compare( m.queued_bytes, 0 );
+	verify( m.max_queued_events > 0 );
+
+	int fd = creat( TEST_DIR "/ignored", 0700 );
+	verify( -1 != fd );
+	verify( 0 == close( fd ) );
+	fd = creat( TEST_DIR "/metrics_file", 0700 );
+	verify( -1 != fd );
+	verify( 0 == close( fd ) );
+	verify( inotifytools_get_metrics( &m ) );
+	verify( m.queued_bytes >= 2 * (long long)sizeof(struct inotify_event) );
+
+	struct inotify_event *event = inotifytools_next_events_ms( 1000, 2, 100 );
+	verify( event );
+	char out[1024];
+	verify( inotifytools_snprintf( out, 1023, event, "%w%f" ) > 0 );
+	verify( inotifytools_get_metrics( &m ) );
+	verify( m.read_events.count >= 1 );
+	compare( m.read_events.sum, 2 );
+	// names are padded by the kernel
+	verify( m.read_bytes.sum >= 2 * sizeof(struct inotify_event) +
+	                            event->len + strlen("ignored") + 1 );
+	verify( m.read_bytes.max <= m.read_bytes.sum );
+	compare( m.regex_ns.count, 2 );
+	// matching doesn't format events, so only ours is counted
+	compare( m.format_ns.count, 1 );
+	unsigned long long sum = 0;
+	for ( int i = 0; i < INOTIFYTOOLS_HISTOGRAM_BUCKETS; ++i ) {
+		sum += m.format_ns.buckets[i];
+	}
+	compare( sum, 1 );
+	compare( m.read_events.buckets[2], m.read_events.count == 1 );
+	compare( m.queued_bytes, 0 );
+
+	// starting again from zero
+	verify( inotifytools_enable_metrics( 1 ) );
+	verify( inotifytools_get_metrics( &m ) );
+	compare( m.format_ns.count, 0 );
+	verify( inotifytools_enable_metrics( 0 ) );
+	verify( !inotifytools_get_metrics( &m ) );
+EXIT
+}
+
+void tst_read_buffer() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+	compare( inotifytools_get_read_buffer_size(), 64 * 1024 );
+	verify( !inotifytools_set_read_buffer( 64 ) );
+	compare( inotifytools_error(), EINVAL );
+	verify( inotifytools_watch_file( TEST_DIR, IN_CREATE ) );
+
+	// a burst larger than the initial buffer is read at once
+	char fn[1024];
+	char name[201];
+	memset( name, 'n', 200 );
+	name[200] = 0;
+	for ( int i = 0; i < 2000; ++i ) {
+		snprintf( fn, sizeof(fn), "%s/%s%d", TEST_DIR, name, i );
+		int fd = creat( fn, 0700 );
+		verify( -1 != fd );
+		verify( 0 == close( fd ) );
+	}
+	struct inotify_event *events[8192];
+	int num = 0, got;
+	while ( (got = inotifytools_next_event_batch_ms( 0, events, 8192, 0 )) ) {
+		num += got;
+	}
+	compare( num, 2000 );
+	compare( inotifytools_get_num_events_read(), 2000 );
+	compare( inotifytools_get_num_reads(), 1 );
+	verify( inotifytools_get_read_buffer_size() >= 2000 * 220 );
+
+	// a smaller limit shrinks the buffer, and takes more reads
+	verify( inotifytools_set_read_buffer( 8192 ) );
+	for ( int i = 0; i < 100; ++i ) {
+		snprintf( fn, sizeof(fn), "%s/%s%d", TEST_DIR, name, i );
+		verify( 0 == unlink( fn ) );
+		int fd = creat( fn, 0700 );
+		verify( -1 != fd );
+		verify( 0 == close( fd ) );
+	}
+	num = 0;
+	while ( (got = inotifytools_next_event_batch_ms( 0, events, 8192, 0 )) ) {
+		num += got;
+	}
+	compare( num, 100 );
+	compare( inotifytools_get_read_buffer_size(), 8192 );
+	verify( inotifytools_get_num_reads() >= 1 + 100 * 220 / 8192 );
+
+	// more events than used to fit into the buffer can be asked for
+	verify( !inotifytools_next_events_ms( 0, 10000, 0 ) );
+	compare( inotifytools_error(), 0 );
+EXIT
+}
+
+void append( char const * fn, int times ) {
+	for ( int i = 0; i < times; ++i ) {
+		int fd = open( fn, O_WRONLY | O_APPEND | O_CREAT, 0600 );
+		verify( -1 != fd );
+		verify( 1 == write( fd, "x", 1 ) );
+		verify( 0 == close( fd ) );
+	}
+}
+
+struct collected {
+	char name[16];
+	unsigned mask;
+	unsigned cookie;
+};
+
+/**
+ * Copy out the events returned until @a timeout_ms passes without one, since
+ * they are only valid until the next call.
+ */
+int collect( struct collected * got, int max, long timeout_ms ) {
+	struct inotify_event * events[16];
+	int num = 0, n;
+	while ( (n = inotifytools_next_event_batch_ms( timeout_ms, events, 16, 0 )) ) {
+		for ( int i = 0; i < n && num < max; ++i, ++num ) {
+			snprintf( got[num].name, sizeof(got[num].name), "%s",
+			          events[i]->len ? events[i]->name : "" );
+			got[num].mask = events[i]->mask;
+			got[num].cookie = events[i]->cookie;
+		}
+	}
+	return num;
+}
+
+void tst_coalesce() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+	verify( inotifytools_watch_file( TEST_DIR, IN_MODIFY | IN_ATTRIB |
+	        IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVE ) );
+	inotifytools_set_coalesce_ms( 100 );
+
+	// repeated writes and attribute changes are handed out once, after
+	// the window has passed
+	struct timespec start, end;
+	clock_gettime( CLOCK_MONOTONIC, &start );
+	append( TEST_DIR "/co", 10 );
+	verify( 0 == chmod( TEST_DIR "/co", 0700 ) );
+	verify( !inotifytools_next_events_ms( 0, 1, 0 ) );
+	struct inotify_event * event = inotifytools_next_events_ms( 1000, 1, 0 );
+	clock_gettime( CLOCK_MONOTONIC, &end );
+	verify( event );
+	verify2( !strcmp( event->name, "co" ), event->name );
+	compare( event->mask, (unsigned)(IN_CREATE | IN_MODIFY | IN_ATTRIB |
+	                                 IN_CLOSE_WRITE) );
+	long ms = (end.tv_sec - start.tv_sec) * 1000 +
+	          (end.tv_nsec - start.tv_nsec) / 1000000;
+	verify( ms >= 100 && ms < 1000 );
+	verify( !inotifytools_next_events_ms( 200, 1, 0 ) );
+	compare( inotifytools_error(), 0 );
+
+	// nothing is merged across a move, which stays paired
+	append( TEST_DIR "/co", 2 );
+	verify( 0 == rename( TEST_DIR "/co", TEST_DIR "/co2" ) );
+	append( TEST_DIR "/co2", 2 );
+	append( TEST_DIR "/co", 2 );
+	struct collected got[64];
+	int num = collect( got, 64, 500 );
+	compare( num, 4 );
+	verify2( !strcmp( got[0].name, "co" ), got[0].name );
+	compare( got[0].mask, (unsigned)(IN_MODIFY | IN_CLOSE_WRITE) );
+	verify2( !strcmp( got[1].name, "co" ), got[1].name );
+	compare( got[1].mask, (unsigned)IN_MOVED_FROM );
+	verify2( !strcmp( got[2].name, "co2" ), got[2].name );
+	compare( got[2].mask, (unsigned)(IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE) );
+	compare( got[1].cookie, got[2].cookie );
+	verify( got[1].cookie );
+	verify2( !strcmp( got[3].name, "co" ), got[3].name );
+	compare( got[3].mask, (unsigned)(IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE) );
+
+	// distinct files are handed out in the order they were first changed,
+	// and a delete ends merging
+	char fn[1024];
+	for ( int round = 0; round < 3; ++round ) {
+		for ( int i = 0; i < 50; ++i ) {
+			snprintf( fn, sizeof(fn), "%s/cf%d", TEST_DIR, 49 - i );
+			append( fn, 1 );
+		}
+	}
+	verify( 0 == unlink( TEST_DIR "/co" ) );
+	append( TEST_DIR "/co2", 1 );
+	num = collect( got, 64, 500 );
+	compare( num, 52 );
+	for ( int i = 0; i < 50; ++i ) {
+		snprintf( fn, sizeof(fn), "cf%d", 49 - i );
+		verify2( !strcmp( got[i].name, fn ), got[i].name );
+		compare( got[i].mask, (unsigned)(IN_CREATE | IN_MODIFY | IN_CLOSE_WRITE) );
+	}
+	compare( got[50].mask, (unsigned)IN_DELETE );
+	verify2( !strcmp( got[51].name, "co2" ), got[51].name );
+	compare( got[51].mask, (unsigned)(IN_MODIFY | IN_CLOSE_WRITE) );
+
+	// once disabled, events are handed out one by one again
+	inotifytools_set_coalesce_ms( 0 );
+	append( TEST_DIR "/co2", 2 );
+	compare( collect( got, 64, 0 ), 4 );
+EXIT
+}
+
+/**
+ * Fill in @a buf as an event of @a mask on @a name in the directory @a wd.
+ */
+struct inotify_event * move_event( char * buf, int wd, int mask,
+                                   unsigned cookie, char const * name ) {
+	struct inotify_event *event = (struct inotify_event *)buf;
+	memset( event, 0, sizeof(struct inotify_event) );
+	event->wd = wd;
+	event->mask = mask;
+	event->cookie = cookie;
+	strcpy( event->name, name );
+	event->len = strlen( name ) + 1;
+	return event;
+}
+
+void tst_moves() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( 0 == mkdir(TEST_DIR "/mv", 0700) );
+	verify( inotifytools_initialize() );
+	verify( inotifytools_watch_file( TEST_DIR, IN_MOVE ) );
+	verify( inotifytools_watch_file( TEST_DIR "/mv", IN_MOVE ) );
+	int top = inotifytools_wd_from_filename( TEST_DIR "/" );
+	int mv = inotifytools_wd_from_filename( TEST_DIR "/mv/" );
+	verify( top >= 0 && mv >= 0 );
+
+	// interleaved moves are paired by cookie
+	char buf[256];
+	struct inotifytools_move move;
+	verify( !inotifytools_track_move( move_event( buf, top,
+	        IN_MOVED_FROM | IN_ISDIR, 7, "a" ), &move ) );
+	verify( !inotifytools_track_move( move_event( buf, mv,
+	        IN_MOVED_FROM, 8, "b" ), &move ) );
+	verify( !inotifytools_track_move( move_event( buf, mv,
+	        IN_MODIFY, 0, "c" ), &move ) );
+	compare( inotifytools_get_num_pending_moves(), 2 );
+	verify( inotifytools_track_move( move_event( buf, top,
+	        IN_MOVED_TO, 8, "b2" ), &move ) );
+	verify2( !strcmp( move.from, TEST_DIR "/mv/b" ), move.from );
+	verify2( !strcmp( move.to, TEST_DIR "/b2" ), move.to );
+	compare( move.cookie, 8 );
+	verify( !move.isdir );
+	verify( inotifytools_track_move( move_event( buf, mv,
+	        IN_MOVED_TO | IN_ISDIR, 7, "a2" ), &move ) );
+	verify2( !strcmp( move.from, TEST_DIR "/a" ), move.from );
+	verify2( !strcmp( move.to, TEST_DIR "/mv/a2" ), move.to );
+	verify( move.isdir );
+	compare( inotifytools_get_num_pending_moves(), 0 );
+
+	// moves in from outside have no source, moves out expire
+	verify( inotifytools_track_move( move_event( buf, top,
+	        IN_MOVED_TO, 9, "in" ), &move ) );
+	verify( !move.from );
+	verify2( !strcmp( move.to, TEST_DIR "/in" ), move.to );
+	verify( !inotifytools_track_move( move_event( buf, top,
+	        IN_MOVED_FROM, 10, "out" ), &move ) );
+	verify( !inotifytools_track_move( move_event( buf, top,
+	        IN_MOVED_FROM, 11, "out2" ), &move ) );
+	verify( !inotifytools_expire_move( 10000, &move ) );
+	verify( inotifytools_expire_move( 0, &move ) );
+	verify2( !strcmp( move.from, TEST_DIR "/out" ), move.from );
+	verify( !move.to );
+	compare( inotifytools_get_num_pending_moves(), 1 );
+	verify( inotifytools_expire_move( 0, &move ) );
+	verify2( !strcmp( move.from, TEST_DIR "/out2" ), move.from );
+	verify( !inotifytools_expire_move( 0, &move ) );
+
+	// many pending moves
+	char name[32];
+	for ( int i = 0; i < 1000; ++i ) {
+		snprintf( name, sizeof(name), "f%d", i );
+		verify( !inotifytools_track_move( move_event( buf, top,
+		        IN_MOVED_FROM, 100 + i, name ), &move ) );
+	}
+	compare( inotifytools_get_num_pending_moves(), 1000 );
+	for ( int i = 999; i >= 0; --i ) {
+		snprintf( name, sizeof(name), "g%d", i );
+		verify( inotifytools_track_move( move_event( buf, mv,
+		        IN_MOVED_TO, 100 + i, name ), &move ) );
+		snprintf( name, sizeof(name), TEST_DIR "/f%d", i );
+		verify2( move.from && !strcmp( move.from, name ), move.from );
+	}
+	compare( inotifytools_get_num_pending_moves(), 0 );
+
+	// a real rename
+	verify( 0 == mkdir(TEST_DIR "/mv/d", 0700) );
+	verify( 0 == rename(TEST_DIR "/mv/d", TEST_DIR "/d2") );
+	struct inotify_event * event;
+	int moves = 0;
+	while ( (event = inotifytools_next_event( 1 )) ) {
+		if ( inotifytools_track_move( event, &move ) ) {
+			++moves;
+			verify2( move.from && !strcmp( move.from, TEST_DIR "/mv/d" ),
+			         move.from );
+			verify2( !strcmp( move.to, TEST_DIR "/d2" ), move.to );
+			verify( move.isdir );
+			break;
+		}
+	}
+	compare( moves, 1 );
+	verify( 0 == rmdir(TEST_DIR "/d2") );
+EXIT
+}
+
+void tst_reader() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+	verify( !inotifytools_start_reader( 64 ) );
+	compare( inotifytools_error(), EINVAL );
+	verify( inotifytools_watch_file( TEST_DIR, IN_CREATE ) );
+	verify( inotifytools_start_reader( 64 * 1024 ) );
+	verify( !inotifytools_start_reader( 64 * 1024 ) );
+	compare( inotifytools_error(), EBUSY );
+	verify( !inotifytools_set_backend( "fanotify" ) );
+	compare( inotifytools_error(), EBUSY );
+
+	// events are taken from the ring in order
+	char fn[1024];
+	for ( int i = 0; i < 100; ++i ) {
+		snprintf( fn, sizeof(fn), "%s/r%d", TEST_DIR, i );
+		int fd = creat( fn, 0700 );
+		verify( -1 != fd );
+		verify( 0 == close( fd ) );
+	}
+	struct inotify_event *events[64];
+	int num = 0, got;
+	while ( (got = inotifytools_next_event_batch_ms( 500, events, 64, 0 )) ) {
+		for ( int i = 0; i < got; ++i, ++num ) {
+			snprintf( fn, sizeof(fn), "r%d", num );
+			verify2( !strcmp( events[i]->name, fn ), events[i]->name );
+		}
+		if ( num == 100 ) break;
+	}
+	compare( num, 100 );
+	compare( inotifytools_get_reader_depth(), 0 );
+	verify( inotifytools_get_reader_high_water() >= 1 );
+	compare( inotifytools_get_reader_drops(), 0 );
+
+	// a full ring leaves events in the kernel's queue instead of dropping them
+	inotifytools_stop_reader();
+	verify( inotifytools_start_reader( 4096 ) );
+	for ( int i = 0; i < 1000; ++i ) {
+		snprintf( fn, sizeof(fn), "%s/r%d", TEST_DIR, i );
+		unlink( fn );
+		int fd = creat( fn, 0700 );
+		verify( -1 != fd );
+		verify( 0 == close( fd ) );
+	}
+	usleep( 100000 );
+	verify( inotifytools_get_reader_high_water() <= 4096 / 32 );
+	int overflows = 0;
+	num = 0;
+	while ( (got = inotifytools_next_event_batch_ms( 200, events, 64, 0 )) ) {
+		for ( int i = 0; i < got; ++i, ++num ) {
+			if ( events[i]->mask & IN_Q_OVERFLOW ) ++overflows;
+			snprintf( fn, sizeof(fn), "r%d", num );
+			verify2( !strcmp( events[i]->name, fn ), events[i]->name );
+		}
+	}
+	compare( overflows, 0 );
+	compare( num, 1000 );
+	compare( inotifytools_get_reader_drops(), 0 );
+
+	// once stopped, events are read directly again
+	inotifytools_stop_reader();
+	compare( inotifytools_get_reader_depth(), 0 );
+	verify( 0 == unlink( TEST_DIR "/r0" ) );
+	int fd = creat( TEST_DIR "/r0", 0700 );
+	verify( -1 != fd );
+	verify( 0 == close( fd ) );
+	struct inotify_event * event = inotifytools_next_events_ms( 500, 1, 0 );
+	verify( event );
+	verify2( !strcmp( event->name, "r0" ), event->name );
+EXIT
+}
+
+/**
+ * Copy out the events returned until @a timeout_ms passes without one and
+ * nothing is left for inotifytools_watch_recursively_async() to do, as
+ * "<masks> <path>" strings.
+ */
+int collect_async( char got[][64], int max, long timeout_ms ) {
+	struct inotify_event * events[16];
+	int num = 0, n;
+	while ( (n = inotifytools_next_event_batch_ms( timeout_ms, events, 16, 0 )) ||
+	        inotifytools_get_async_pending() ) {
+		for ( int i = 0; i < n && num < max; ++i, ++num ) {
+			inotifytools_snprintf( got[num], 64, events[i], "%e %w%f" );
+		}
+	}
+	return num;
+}
+
+/**
+ * @return how often @a want is in the @a num strings of @a got.
+ */
+int count_async( char got[][64], int num, char const * want ) {
+	int count = 0;
+	for ( int i = 0; i < num; ++i ) count += !strcmp( got[i], want );
+	return count;
+}
+
+void tst_async() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( 0 == mkdir(TEST_DIR "/as", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/stage", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/stage/d1", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/stage/d1/d2", 0700) );
+	int fd = creat( TEST_DIR "/stage/f1", 0700 );
+	verify( -1 != fd );
+	verify( 0 == close( fd ) );
+	fd = creat( TEST_DIR "/stage/d1/f2", 0700 );
+	verify( -1 != fd );
+	verify( 0 == close( fd ) );
+	verify( inotifytools_initialize() );
+	int events = IN_CREATE | IN_DELETE | IN_MOVE;
+	verify( inotifytools_watch_recursively( TEST_DIR "/as", events ) );
+	static char got[256][64];
+	// skip events from earlier tests
+	collect_async( got, 256, 100 );
+
+	// a tree moved in is watched in the background, and everything in it
+	// is reported as created
+	verify( 0 == rename( TEST_DIR "/stage", TEST_DIR "/as/new" ) );
+	struct inotify_event * event = inotifytools_next_events_ms( 500, 1, 0 );
+	verify( event );
+	verify2( !strcmp( event->name, "new" ), event->name );
+	verify( inotifytools_watch_recursively_async( TEST_DIR "/as/new", events,
+	                                              NULL ) );
+	verify( inotifytools_get_async_pending() );
+	int num = collect_async( got, 256, 100 );
+	compare( num, 4 );
+	compare( count_async( got, num, "CREATE " TEST_DIR "/as/new/f1" ), 1 );
+	compare( count_async( got, num,
+	                      "CREATE,ISDIR " TEST_DIR "/as/new/d1" ), 1 );
+	compare( count_async( got, num, "CREATE " TEST_DIR "/as/new/d1/f2" ), 1 );
+	compare( count_async( got, num,
+	                      "CREATE,ISDIR " TEST_DIR "/as/new/d1/d2" ), 1 );
+	compare( inotifytools_get_async_pending(), 0 );
+	verify( -1 != inotifytools_wd_from_filename( TEST_DIR "/as/new/d1/d2/" ) );
+	fd = creat( TEST_DIR "/as/new/d1/d2/f3", 0700 );
+	verify( -1 != fd );
+	verify( 0 == close( fd ) );
+	num = collect_async( got, 256, 100 );
+	compare( num, 1 );
+	compare( count_async( got, num, "CREATE " TEST_DIR "/as/new/d1/d2/f3" ), 1 );
+
+	// files created while the new directory is being set up are reported
+	// exactly once, whether or not the worker found them
+	verify( 0 == mkdir(TEST_DIR "/as/fast", 0700) );
+	event = inotifytools_next_events_ms( 500, 1, 0 );
+	verify( event );
+	verify2( !strcmp( event->name, "fast" ), event->name );
+	verify( inotifytools_watch_recursively_async( TEST_DIR "/as/fast", events,
+	                                              NULL ) );
+	char fn[1024];
+	for ( int i = 0; i < 100; ++i ) {
+		snprintf( fn, sizeof(fn), "%s/as/fast/f%d", TEST_DIR, i );
+		fd = creat( fn, 0700 );
+		verify( -1 != fd );
+		verify( 0 == close( fd ) );
+	}
+	num = collect_async( got, 256, 100 );
+	compare( num, 100 );
+	for ( int i = 0; i < 100; ++i ) {
+		snprintf( fn, sizeof(fn), "CREATE %s/as/fast/f%d", TEST_DIR, i );
+		compare( count_async( got, num, fn ), 1 );
+	}
+
+	// directories watched already are skipped
+	verify( inotifytools_watch_recursively_async( TEST_DIR "/as/new", events,
+	                                              NULL ) );
+	compare( inotifytools_get_async_pending(), 0 );
+
+	// the worker reading the new tree is not reported, neither on the new
+	// watches nor on the watch of the parent
+	verify( 0 == mkdir(TEST_DIR "/aq", 0700) );
+	verify( inotifytools_watch_recursively( TEST_DIR "/aq", IN_ALL_EVENTS ) );
+	collect_async( got, 256, 100 );
+	verify( 0 == mkdir(TEST_DIR "/aq/new", 0700) );
+	event = inotifytools_next_events_ms( 500, 1, 0 );
+	verify( event );
+	verify2( !strcmp( event->name, "new" ), event->name );
+	verify( 0 == mkdir(TEST_DIR "/aq/new/sub", 0700) );
+	verify( inotifytools_watch_recursively_async( TEST_DIR "/aq/new",
+	                                              IN_ALL_EVENTS, NULL ) );
+	num = collect_async( got, 256, 100 );
+	compare( num, 1 );
+	compare( count_async( got, num,
+	                      "CREATE,ISDIR " TEST_DIR "/aq/new/sub" ), 1 );
+	// while others reading it still are
+	DIR * dir = opendir( TEST_DIR "/aq/new" );
+	verify( dir );
+	verify( 0 == closedir( dir ) );
+	num = collect_async( got, 256, 100 );
+	compare( count_async( got, num, "OPEN,ISDIR " TEST_DIR "/aq/new" ), 1 );
+	compare( count_async( got, num, "OPEN,ISDIR " TEST_DIR "/aq/new/" ), 1 );
+
+	// also once the worker is done, if its read doesn't end with an event
+	verify( 0 == mkdir(TEST_DIR "/aq/open", 0700) );
+	verify( inotifytools_watch_recursively( TEST_DIR "/aq/open",
+	                                        IN_CREATE | IN_OPEN ) );
+	collect_async( got, 256, 100 );
+	verify( 0 == mkdir(TEST_DIR "/aq/open/new", 0700) );
+	event = inotifytools_next_events_ms( 500, 1, 0 );
+	verify( event );
+	verify2( !strcmp( event->name, "new" ), event->name );
+	verify( inotifytools_watch_recursively_async( TEST_DIR "/aq/open/new",
+	                                              IN_CREATE | IN_OPEN, NULL ) );
+	num = collect_async( got, 256, 100 );
+	compare( num, 0 );
+	dir = opendir( TEST_DIR "/aq/open/new" );
+	verify( dir );
+	verify( 0 == closedir( dir ) );
+	num = collect_async( got, 256, 100 );
+	compare( count_async( got, num,
+	                      "OPEN,ISDIR " TEST_DIR "/aq/open/new" ), 1 );
+	compare( count_async( got, num,
+	                      "OPEN,ISDIR " TEST_DIR "/aq/open/new/" ), 1 );
+EXIT
+}
+
+#define REACH_FILE TEST_DIR "_reach.csv"
+
+/**
+ * Read @a path into @a buf, which holds @a size bytes.
+ *
+ * @return the number of bytes read, or -1 on error.
+ */
+int slurp( char const * path, char * buf, int size ) {
+	FILE * f = fopen( path, "r" );
+	if ( !f ) return -1;
+	int len = fread( buf, 1, size - 1, f );
+	buf[len] = 0;
+	fclose( f );
+	return len;
+}
+
+void tst_reach() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( 0 == mkdir(TEST_DIR "/rt", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/rt/a", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/rt/b", 0700) );
+	verify( inotifytools_initialize() );
+	verify( !inotifytools_write_reach_file( REACH_FILE ) );
+	compare( inotifytools_error(), EINVAL );
+	verify( inotifytools_watch_recursively( TEST_DIR "/rt", IN_CREATE ) );
+	inotifytools_set_reach_tracking( 1 );
+	static char got[256][64];
+	// skip events from earlier tests
+	collect_async( got, 256, 100 );
+
+	// the first write lists every watched directory
+	static char buf[65536];
+	verify( inotifytools_write_reach_file( REACH_FILE ) );
+	int len = slurp( REACH_FILE, buf, sizeof(buf) );
+	verify( len > 0 );
+	verify2( strstr( buf, TEST_DIR "/rt/,n\n" ), buf );
+	verify2( strstr( buf, TEST_DIR "/rt/a/,n\n" ), buf );
+	verify2( strstr( buf, TEST_DIR "/rt/b/,n\n" ), buf );
+
+	// later writes only append what changed
+	int fd = creat( TEST_DIR "/rt/a/f", 0700 );
+	verify( -1 != fd );
+	verify( 0 == close( fd ) );
+	compare( collect_async( got, 256, 100 ), 1 );
+	verify( inotifytools_write_reach_file( REACH_FILE ) );
+	compare( slurp( REACH_FILE, buf, sizeof(buf) ),
+	         len + (int)strlen( TEST_DIR "/rt/a/,y\n" ) );
+	verify2( !strcmp( &buf[len], TEST_DIR "/rt/a/,y\n" ), &buf[len] );
+	len = strlen( buf );
+	verify( 0 == mkdir(TEST_DIR "/rt/c", 0700) );
+	compare( collect_async( got, 256, 100 ), 1 );
+	verify( inotifytools_watch_recursively( TEST_DIR "/rt/c", IN_CREATE ) );
+	verify( inotifytools_write_reach_file( REACH_FILE ) );
+	verify( slurp( REACH_FILE, buf, sizeof(buf) ) > len );
+	verify2( strstr( &buf[len], TEST_DIR "/rt/,y\n" ), &buf[len] );
+	verify2( strstr( &buf[len], TEST_DIR "/rt/c/,n\n" ), &buf[len] );
+	verify2( !strstr( &buf[len], TEST_DIR "/rt/a/" ), &buf[len] );
+	len = strlen( buf );
+	verify( inotifytools_write_reach_file( REACH_FILE ) );
+	compare( slurp( REACH_FILE, buf, sizeof(buf) ), len );
+
+	inotifytools_set_reach_tracking( 0 );
+	verify( !inotifytools_write_reach_file( REACH_FILE ) );
+	compare( inotifytools_error(), EINVAL );
+	verify( 0 == unlink( REACH_FILE ) );
+EXIT
+}
+
+void tst_rescan() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( 0 == mkdir(TEST_DIR "/rs", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/rs/a", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/rs/b", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/rs/b/c", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/rs/gone", 0700) );
+	verify( inotifytools_initialize() );
+	inotifytools_set_rescan_on_overflow( 1 );
+	verify( inotifytools_watch_recursively( TEST_DIR "/rs", IN_CREATE ) );
+	compare( inotifytools_get_num_watches(), 5 );
+
+	// changes whose events are never read
+	verify( 0 == mkdir(TEST_DIR "/rs/a/new", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/rs/a/new/deep", 0700) );
+	verify( 0 == rmdir(TEST_DIR "/rs/gone") );
+	verify( 0 == rename(TEST_DIR "/rs/b", TEST_DIR "/rs/moved") );
+	verify( inotifytools_rescan() );
+	verify( -1 != inotifytools_wd_from_filename( TEST_DIR "/rs/a/new/" ) );
+	verify( -1 != inotifytools_wd_from_filename( TEST_DIR "/rs/a/new/deep/" ) );
+	verify( -1 != inotifytools_wd_from_filename( TEST_DIR "/rs/moved/" ) );
+	verify( -1 != inotifytools_wd_from_filename( TEST_DIR "/rs/moved/c/" ) );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/rs/gone/" ), -1 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/rs/b/" ), -1 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/rs/b/c/" ), -1 );
+	compare( inotifytools_get_num_watches(), 6 );
+	// nothing changed since
+	verify( inotifytools_rescan() );
+	compare( inotifytools_get_num_watches(), 6 );
+
+	// a real overflow: the directories created at the end of the burst are
+	// watched by the time the overflow event is returned
+	int max = inotifytools_get_max_queued_events();
+	if ( max < 0 || max > 100000 ) {
+		INFO( "max_queued_events is %d, skipping overflow\n", max );
+		EXIT
+		return;
+	}
+	char fn[1024];
+	for ( int i = 0; i <= max; ++i ) {
+		snprintf( fn, sizeof(fn), TEST_DIR "/rs/a/f%d", i );
+		int fd = creat( fn, 0700 );
+		verify( -1 != fd );
+		verify( 0 == close( fd ) );
+	}
+	verify( 0 == mkdir(TEST_DIR "/rs/burst", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/rs/burst/inner", 0700) );
+	// even when every other event is ignored
+	verify( inotifytools_ignore_events_by_regex( "", 0 ) );
+	struct inotify_event *event = inotifytools_next_events_ms( 1000, 1, -1 );
+	verify( event );
+	verify( event->mask & IN_Q_OVERFLOW );
+	compare( event->wd, -1 );
+	verify( -1 != inotifytools_wd_from_filename( TEST_DIR "/rs/burst/" ) );
+	verify( -1 != inotifytools_wd_from_filename( TEST_DIR "/rs/burst/inner/" ) );
+EXIT
+}
+
+#define SNAPSHOT_FILE TEST_DIR "_snapshot"
+
+/**
+ * Set the modification time of @a path far into the past, so that snapshots
+ * of it are not considered racy.
+ */
+int age_dir( char const * path ) {
+	struct timespec times[2] = { { 1000000000, 0 }, { 1000000000, 0 } };
+	return utimensat( AT_FDCWD, path, times, 0 );
+}
+
+void tst_snapshot() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( 0 == mkdir(TEST_DIR "/sn", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/sn/a", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/sn/b", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/sn/b/c", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/sn/gone", 0700) );
+	char const * dirs[] = { "/sn", "/sn/a", "/sn/b", "/sn/b/c", "/sn/gone" };
+	char fn[1024];
+	for ( int i = 0; i < 5; ++i ) {
+		snprintf( fn, sizeof(fn), TEST_DIR "%s", dirs[i] );
+		verify( 0 == age_dir( fn ) );
+	}
+	verify( inotifytools_initialize() );
+	inotifytools_set_rescan_on_overflow( 1 );
+	verify( inotifytools_watch_recursively( TEST_DIR "/sn", IN_CREATE ) );
+	compare( inotifytools_get_num_watches(), 5 );
+	verify( inotifytools_save_snapshot( SNAPSHOT_FILE ) );
+	inotifytools_cleanup();
+
+	// changes while nothing was watched
+	verify( 0 == mkdir(TEST_DIR "/sn/a/new", 0700) );
+	verify( 0 == rmdir(TEST_DIR "/sn/gone") );
+	// a change the snapshot can't see
+	verify( 0 == mkdir(TEST_DIR "/sn/b/hidden", 0700) );
+	verify( 0 == age_dir( TEST_DIR "/sn/b" ) );
+
+	verify( inotifytools_initialize() );
+	inotifytools_set_rescan_on_overflow( 1 );
+	verify( inotifytools_watch_recursively_from_snapshot( SNAPSHOT_FILE,
+	        TEST_DIR "/sn", IN_CREATE | IN_OPEN, NULL, 4 ) );
+	// reading the changed directories is not reported
+	static char got[16][64];
+	compare( collect_async( got, 16, 100 ), 0 );
+	verify( -1 != inotifytools_wd_from_filename( TEST_DIR "/sn/" ) );
+	verify( -1 != inotifytools_wd_from_filename( TEST_DIR "/sn/a/new/" ) );
+	verify( -1 != inotifytools_wd_from_filename( TEST_DIR "/sn/b/c/" ) );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/sn/gone/" ), -1 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/sn/b/hidden/" ), -1 );
+	compare( inotifytools_get_num_watches(), 5 );
+	// the directories read again are saved with their new snapshot
+	verify( inotifytools_save_snapshot( SNAPSHOT_FILE ) );
+	inotifytools_cleanup();
+
+	// excluded directories are left out along with everything below them
+	char const * list[] = { TEST_DIR "/sn/b", NULL };
+	inotifytools_exclude * ex = inotifytools_exclude_compile( list );
+	verify( ex );
+	verify( inotifytools_initialize() );
+	verify( inotifytools_watch_recursively_from_snapshot( SNAPSHOT_FILE,
+	        TEST_DIR "/sn", IN_CREATE, ex, 1 ) );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/sn/b/" ), -1 );
+	compare( inotifytools_wd_from_filename( TEST_DIR "/sn/b/c/" ), -1 );
+	compare( inotifytools_get_num_watches(), 3 );
+	inotifytools_exclude_free( ex );
+	inotifytools_cleanup();
+
+	// without a usable snapshot, the whole tree is read
+	FILE * f = fopen( SNAPSHOT_FILE, "w" );
+	verify( f );
+	fputs( "not a snapshot", f );
+	verify( 0 == fclose( f ) );
+	verify( inotifytools_initialize() );
+	verify( inotifytools_watch_recursively_from_snapshot( SNAPSHOT_FILE,
+	        TEST_DIR "/sn", IN_CREATE, NULL, 1 ) );
+	verify( -1 != inotifytools_wd_from_filename( TEST_DIR "/sn/b/hidden/" ) );
+	compare( inotifytools_get_num_watches(), 6 );
+	verify( 0 == unlink( SNAPSHOT_FILE ) );
+	verify( inotifytools_watch_recursively_from_snapshot( SNAPSHOT_FILE,
+	        TEST_DIR "/sn/a", IN_CREATE, NULL, 1 ) );
+	compare( inotifytools_get_num_watches(), 6 );
+EXIT
+}
+
+void drain_events( char * log, int size ) {
+	struct inotify_event *event;
+	char line[1024];
+	int len = 0;
+	log[0] = 0;
+	while ( (event = inotifytools_next_events_ms( 200, 1, -1 )) ) {
+		int n = inotifytools_snprintf( line, sizeof(line) - 1, event,
+		                               "%w%f %e\n" );
+		if ( n <= 0 || len + n >= size ) continue;
+		memcpy( &log[len], line, n + 1 );
+		len += n;
+	}
+}
+
+void tst_backend() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+	verify( !inotifytools_set_backend( "nonexistent" ) );
+	compare( inotifytools_error(), EINVAL );
+	verify( inotifytools_watch_file( TEST_DIR, IN_CREATE ) );
+	verify( inotifytools_set_backend( "inotify" ) );
+	verify( !inotifytools_set_backend( "fanotify" ) );
+	compare( inotifytools_error(), EBUSY );
+	inotifytools_cleanup();
+
+	verify( inotifytools_initialize() );
+	if ( !inotifytools_set_backend( "fanotify" ) ) {
+		INFO( "fanotify unavailable (%s), skipping\n",
+		      strerror( inotifytools_error() ) );
+		EXIT
+		return;
+	}
+	verify( (0 == mkdir(TEST_DIR "/fan", 0700)) || (EEXIST == errno) );
+	verify( 0 == mkdir(TEST_DIR "/fan/a", 0700) );
+	verify( 0 == mkdir(TEST_DIR "/fan/skip", 0700) );
+	verify( (0 == mkdir(TEST_DIR "/outside", 0700)) || (EEXIST == errno) );
+	char const *exclude[] = { TEST_DIR "/fan/skip", 0 };
+	verify( inotifytools_watch_recursively_with_exclude( TEST_DIR "/fan",
+	                                                     IN_ALL_EVENTS,
+	                                                     exclude ) );
+
+	char log[16384];
+	int fd[3];
+	verify( -1 != (fd[0] = creat( TEST_DIR "/fan/a/file", 0700 )) );
+	verify( -1 != (fd[1] = creat( TEST_DIR "/fan/skip/file", 0700 )) );
+	verify( -1 != (fd[2] = creat( TEST_DIR "/outside/file", 0700 )) );
+	for ( int i = 0; i < 3; ++i ) verify( 0 == close( fd[i] ) );
+	drain_events( log, sizeof(log) );
+	// fanotify may merge the CREATE with the events that follow it
+	verify2( strstr( log, TEST_DIR "/fan/a/file " ), log );
+	verify2( strstr( log, "CREATE" ), log );
+	verify2( !strstr( log, "/skip/" ), log );
+	verify2( !strstr( log, "/outside/" ), log );
+
+	// a rename is a MOVED_FROM and MOVED_TO pair sharing a cookie
+	verify( 0 == rename( TEST_DIR "/fan/a", TEST_DIR "/fan/b" ) );
+	struct inotify_event *event;
+	uint32_t from = 0, to = 0;
+	while ( (event = inotifytools_next_events_ms( 200, 1, -1 )) ) {
+		if ( (event->mask & IN_MOVED_FROM) && !strcmp( event->name, "a" ) )
+			from = event->cookie;
+		if ( (event->mask & IN_MOVED_TO) && !strcmp( event->name, "b" ) )
+			to = event->cookie;
+	}
+	verify( from );
+	compare( from, to );
+
+	// paths below a renamed directory follow it
+	verify( -1 != (fd[0] = creat( TEST_DIR "/fan/b/other", 0700 )) );
+	verify( 0 == close( fd[0] ) );
+	drain_events( log, sizeof(log) );
+	verify2( strstr( log, TEST_DIR "/fan/b/other " ), log );
+
+	// a directory below the recursive watch isn't opened to be watched
+	verify( 0 == mkdir(TEST_DIR "/fan/new", 0700) );
+	drain_events( log, sizeof(log) );
+	verify( inotifytools_watch_recursively( TEST_DIR "/fan/new",
+	                                        IN_ALL_EVENTS ) );
+	drain_events( log, sizeof(log) );
+	verify2( !strstr( log, "OPEN" ), log );
+
+	// files watched under several names turn each record into several
+	// events, none of which is lost when they fill the read buffer
+	verify( inotifytools_set_read_buffer( 4096 ) );
+	char path[1024];
+	for ( int i = 0; i < 64; ++i ) {
+		snprintf( path, sizeof(path), TEST_DIR "/fan/new/f%d", i );
+		verify( -1 != (fd[0] = creat( path, 0700 )) );
+		verify( 0 == close( fd[0] ) );
+		verify( inotifytools_watch_file( path, IN_ATTRIB ) );
+		snprintf( path, sizeof(path), TEST_DIR "/fan/new/./f%d", i );
+		verify( inotifytools_watch_file( path, IN_ATTRIB ) );
+		snprintf( path, sizeof(path), TEST_DIR "/fan//new/f%d", i );
+		verify( inotifytools_watch_file( path, IN_ATTRIB ) );
+	}
+	drain_events( log, sizeof(log) );
+	for ( int i = 0; i < 64; ++i ) {
+		snprintf( path, sizeof(path), TEST_DIR "/fan/new/f%d", i );
+		verify( 0 == chmod( path, 0600 ) );
+	}
+	int attribs = 0;
+	while ( (event = inotifytools_next_events_ms( 200, 1, -1 )) ) {
+		attribs += (event->mask & IN_ATTRIB) != 0;
+		verify( !(event->mask & IN_Q_OVERFLOW) );
+	}
+	compare( attribs, 4 * 64 );
+
+	// records in other directories still fill the read buffer
+	for ( int i = 0; i < 16; ++i ) {
+		snprintf( path, sizeof(path), TEST_DIR "/fan/b/g%d", i );
+		verify( -1 != (fd[0] = creat( path, 0700 )) );
+		verify( 0 == close( fd[0] ) );
+	}
+	drain_events( log, sizeof(log) );
+	long long reads = inotifytools_get_num_reads();
+	for ( int i = 0; i < 16; ++i ) {
+		snprintf( path, sizeof(path), TEST_DIR "/fan/b/g%d", i );
+		verify( 0 == chmod( path, 0600 ) );
+	}
+	attribs = 0;
+	while ( (event = inotifytools_next_events_ms( 200, 1, -1 )) ) {
+		attribs += (event->mask & IN_ATTRIB) != 0;
+	}
+	compare( attribs, 16 );
+	verify( inotifytools_get_num_reads() - reads <= 4 );
+EXIT
+}
+
+void tst_shards() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( inotifytools_initialize() );
+	verify( !inotifytools_set_shards( 0, 0 ) );
+	compare( inotifytools_error(), EINVAL );
+	verify( inotifytools_set_shards( 1, 0 ) );
+	if ( !inotifytools_set_shards( 3, 1 ) ) {
+		INFO( "sharding unavailable (%s), skipping\n",
+		      strerror( inotifytools_error() ) );
+		EXIT
+		return;
+	}
+	verify( !inotifytools_start_reader( 1 << 20 ) );
+	compare( inotifytools_error(), EOPNOTSUPP );
+
+	char const *dirs[] = { "a", "a/sub", "b", "b/sub", "c", "c/sub",
+	                       "d", "d/sub" };
+	char path[1024];
+	verify( (0 == mkdir(TEST_DIR "/shard", 0700)) || (EEXIST == errno) );
+	for ( int i = 0; i < 8; ++i ) {
+		snprintf( path, sizeof(path), TEST_DIR "/shard/%s", dirs[i] );
+		verify( 0 == mkdir( path, 0700 ) );
+	}
+	verify( inotifytools_watch_recursively( TEST_DIR "/shard",
+	                                        IN_ALL_EVENTS ) );
+	compare( inotifytools_get_num_watches(), 9 );
+	verify( !inotifytools_set_shards( 2, 0 ) );
+	compare( inotifytools_error(), EBUSY );
+
+	// watch descriptors of different instances don't collide
+	for ( int i = 0; i < 8; ++i ) {
+		snprintf( path, sizeof(path), TEST_DIR "/shard/%s/", dirs[i] );
+		int wd = inotifytools_wd_from_filename( path );
+		verify2( wd > 0, path );
+		verify2( !strcmp( inotifytools_filename_from_wd( wd ), path ), path );
+	}
+
+	// events of every instance are merged
+	char log[16384];
+	for ( int i = 0; i < 8; ++i ) {
+		snprintf( path, sizeof(path), TEST_DIR "/shard/%s/file", dirs[i] );
+		int fd = creat( path, 0700 );
+		verify( fd != -1 );
+		verify( 0 == close( fd ) );
+	}
+	drain_events( log, sizeof(log) );
+	for ( int i = 0; i < 8; ++i ) {
+		snprintf( path, sizeof(path), TEST_DIR "/shard/%s/file CREATE",
+		          dirs[i] );
+		verify2( strstr( log, path ), log );
+	}
+
+	// a move within a subtree stays in order
+	verify( 0 == rename( TEST_DIR "/shard/b/sub", TEST_DIR "/shard/b/moved" ) );
+	drain_events( log, sizeof(log) );
+	char *from = strstr( log, TEST_DIR "/shard/b/sub MOVED_FROM" );
+	char *to = strstr( log, TEST_DIR "/shard/b/moved MOVED_TO" );
+	verify2( from && to && from < to, log );
+
+	// removed watches are removed from their own instance
+	verify( inotifytools_remove_watch_by_filename( TEST_DIR "/shard/c/" ) );
+	verify( 0 == unlink( TEST_DIR "/shard/c/sub/file" ) );
+	verify( 0 == rmdir( TEST_DIR "/shard/c/sub" ) );
+	drain_events( log, sizeof(log) );
+	verify2( !strstr( log, "/shard/c/sub DELETE" ), log );
+	verify2( strstr( log, "/shard/c/sub/ DELETE_SELF" ), log );
+	inotifytools_cleanup();
+
+	verify( inotifytools_initialize() );
+	verify( inotifytools_set_backend( "sharded" ) );
+	verify( inotifytools_watch_recursively( TEST_DIR "/shard",
+	                                        IN_ALL_EVENTS ) );
+	verify( 0 == mkdir( TEST_DIR "/shard/e", 0700 ) );
+	drain_events( log, sizeof(log) );
+	verify2( strstr( log, TEST_DIR "/shard/e CREATE,ISDIR" ), log );
+EXIT
+}
+
+void tst_filter() {
+ENTER
+	verify( (0 == mkdir(TEST_DIR, 0700)) || (EEXIST == errno) );
+	verify( 0 == system( "mkdir -p " TEST_DIR "/filter/skip1 "
+	                     TEST_DIR "/filter/node_modules/x" ) );
+	verify( inotifytools_initialize() );
+	inotifytools_set_prune_by_regex( 1 );
+	verify( inotifytools_add_filter( "*.swp", INOTIFYTOOLS_FILTER_GLOB ) );
+	verify( inotifytools_add_filter( "\\.tmp$", 0 ) );
+	verify( inotifytools_add_filter( "*.LOG", INOTIFYTOOLS_FILTER_GLOB |
+	                                          INOTIFYTOOLS_FILTER_ICASE ) );
+	verify( inotifytools_add_filter( "cache[0-9]", 0 ) );
+	verify( inotifytools_add_filter( "*/skip?/*", INOTIFYTOOLS_FILTER_GLOB ) );
+	verify( inotifytools_add_filter( "*/node_modules",
+	                                 INOTIFYTOOLS_FILTER_GLOB ) );
+	verify( !inotifytools_add_filter( "(", 0 ) );
+	compare( inotifytools_error(), EINVAL );
+	verify( inotifytools_watch_recursively( TEST_DIR "/filter", IN_CREATE ) );
+	// node_modules is pruned by its glob
+	compare( inotifytools_get_num_watches(), 2 );
+
+	char const *files[] = { "a.swp", "b.tmp", "c.log", "cache1", "skip1/f",
+	                        "keep.txt", "cache", "swp", 0 };
+	char path[1024], log[16384];
+	for ( int i = 0; files[i]; ++i ) {
+		snprintf( path, sizeof(path), TEST_DIR "/filter/%s", files[i] );
+		int fd = creat( path, 0700 );
+		verify( fd != -1 );
+		verify( 0 == close( fd ) );
+	}
+	drain_events( log, sizeof(log) );
+	verify2( strstr( log, "/filter/keep.txt CREATE" ), log );
+	verify2( strstr( log, "/filter/cache CREATE" ), log );
+	verify2( strstr( log, "/filter/swp CREATE" ), log );
+	verify2( !strstr( log, "a.swp" ), log );
+	verify2( !strstr( log, "b.tmp" ), log );
+	verify2( !strstr( log, "c.log" ), log );
+	verify2( !strstr( log, "cache1" ), log );
+	verify2( !strstr( log, "skip1/f" ), log );
+
+	// include patterns, which exclude patterns override
+	inotifytools_clear_filters();
+	verify( inotifytools_add_filter( "*.c", INOTIFYTOOLS_FILTER_GLOB |
+	                                        INOTIFYTOOLS_FILTER_INCLUDE ) );
+	verify( inotifytools_ignore_events_by_inverted_regex( "/Makefile$",
+	                                                      REG_EXTENDED ) );
+	verify( inotifytools_ignore_events_by_regex( "bad", REG_EXTENDED ) );
+	char const *more[] = { "x.c", "Makefile", "y.h", "bad.c", 0 };
+	for ( int i = 0; more[i]; ++i ) {
+		snprintf( path, sizeof(path), TEST_DIR "/filter/%s", more[i] );
+		int fd = creat( path, 0700 );
+		verify( fd != -1 );
+		verify( 0 == close( fd ) );
+	}
+	drain_events( log, sizeof(log) );
+	verify2( strstr( log, "/filter/x.c CREATE" ), log );
+	verify2( strstr( log, "/filter/Makefile CREATE" ), log );
+	verify2( !strstr( log, "y.h" ), log );
+	verify2( !strstr( log, "bad.c" ), log );
+
+	// each call replaces the regex of the previous one
+	verify( inotifytools_ignore_events_by_regex( "x\\.c", REG_EXTENDED ) );
+	verify( inotifytools_ignore_events_by_inverted_regex( NULL, 0 ) );
+	verify( inotifytools_watch_file( TEST_DIR "/filter", IN_DELETE ) );
+	verify( 0 == unlink( TEST_DIR "/filter/x.c" ) );
+	verify( 0 == unlink( TEST_DIR "/filter/bad.c" ) );
+	drain_events( log, sizeof(log) );
+	verify2( strstr( log, "/filter/bad.c DELETE" ), log );
+	verify2( !strstr( log, "x.c" ), log );
+	verify( 0 == system( "rm -rf " TEST_DIR "/filter" ) );
+EXIT
+}
+
 int main() {
 	tests_failed = 0;
 	tests_succeeded = 0;
@@ -304,6 +2084,9 @@ int main() {
 	event_to_str_sep();
 	cleanup();
 
+	event_to_str_r();
+	cleanup();
+
 	str_to_event();
 	cleanup();
 	str_to_event_sep();
@@ -312,6 +2095,66 @@ int main() {
 	basic_watch_info();
 	cleanup();
 
+	tst_next_event_batch();
+	cleanup();
+
+	tst_next_events_ms();
+	cleanup();
+
+	tst_ctx();
+	cleanup();
+
+	tst_watch_table();
+	cleanup();
+
+	tst_watch_recursively_parallel();
+	cleanup();
+
+	tst_exclude();
+	cleanup();
+
+	tst_prune_by_regex();
+	cleanup();
+
+	tst_format();
+	cleanup();
+
+	tst_replace_filename();
+	cleanup();
+
+	tst_path_store();
+	cleanup();
+
+	tst_stats();
+	cleanup();
+	tst_interval();
+	cleanup();
+	tst_metrics();
+	cleanup();
+
+	tst_read_buffer();
+	tst_coalesce();
+	tst_moves();
+	tst_reader();
+	tst_async();
+	tst_reach();
+	cleanup();
+
+	tst_rescan();
+	cleanup();
+
+	tst_snapshot();
+	cleanup();
+
+	tst_backend();
+	cleanup();
+
+	tst_shards();
+	cleanup();
+
+	tst_filter();
+	cleanup();
+
 	watch_limit();
 	cleanup();
 
@@ -9,9 +9,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <syslog.h>
 #include <unistd.h>
 
 #include <inotifytools/inotifytools.h>
+#include <inotifytools/inotify.h>
 
 #define MAXLEN 4096
 #define LIST_CHUNK 1024
@@ -123,6 +125,30 @@ void _niceassert( long cond, int line, char const * file, char const * condstr,
 	}
 }
 
+void add_filter_option( FilterList * list, char const * pattern, int flags ) {
+	list->patterns = (char const **)realloc( list->patterns,
+	                     sizeof(char *) * (list->count + 1) );
+	list->flags = (int *)realloc( list->flags,
+	                              sizeof(int) * (list->count + 1) );
+	niceassert( list->patterns && list->flags, "out of memory" );
+	list->patterns[list->count] = pattern;
+	list->flags[list->count] = flags;
+	++list->count;
+}
+
+// Add the patterns to the library, or complain about the first invalid one.
+bool apply_filters( FilterList const * list ) {
+	for ( int i = 0; i < list->count; ++i ) {
+		if ( !inotifytools_add_filter( list->patterns[i], list->flags[i] ) ) {
+			fprintf(stderr, "Error in `%s' regular expression `%s'.\n",
+			        list->flags[i] & INOTIFYTOOLS_FILTER_INCLUDE ?
+			        "include" : "exclude", list->patterns[i]);
+			return false;
+		}
+	}
+	return true;
+}
+
 void warn_inotify_init_error()
 {
 	int error = inotifytools_error();
@@ -174,3 +200,58 @@ bool is_timeout_option_valid(long int *timeout, char *optarg)
 
 	return true;
 }
+
+/**
+ * @return an upper bound of the smallest value which at least @a fraction
+ *         of the samples in @a h do not exceed.
+ */
+static unsigned long long percentile( struct inotifytools_histogram const * h,
+                                      double fraction ) {
+	unsigned long long want = h->count * fraction, seen = 0;
+	for ( int i = 0; i < INOTIFYTOOLS_HISTOGRAM_BUCKETS; ++i ) {
+		seen += h->buckets[i];
+		if ( seen > want || seen == h->count ) {
+			unsigned long long bound = i ? 1ULL << i : 0;
+			return bound < h->max ? bound : h->max;
+		}
+	}
+	return h->max;
+}
+
+void print_metrics( bool to_syslog ) {
+	struct inotifytools_metrics m;
+	if ( !inotifytools_get_metrics( &m ) ) return;
+
+	struct {
+		char const * name;
+		struct inotifytools_histogram const * h;
+	} const histograms[] = {
+		{ "read_events", &m.read_events },
+		{ "read_bytes", &m.read_bytes },
+		{ "wait_ns", &m.wait_ns },
+		{ "regex_ns", &m.regex_ns },
+		{ "format_ns", &m.format_ns },
+		{ "dir_ns", &m.dir_ns },
+	};
+	char line[256];
+	for ( unsigned i = 0; i < sizeof(histograms) / sizeof(histograms[0]);
+	      ++i ) {
+		struct inotifytools_histogram const * h = histograms[i].h;
+		snprintf( line, sizeof(line), "metrics: %s count=%llu avg=%.1f "
+		          "p50=%llu p99=%llu max=%llu\n", histograms[i].name,
+		          h->count, h->count ? (double)h->sum / h->count : 0.0,
+		          percentile( h, 0.5 ), percentile( h, 0.99 ), h->max );
+		if ( to_syslog ) syslog( LOG_INFO, "%s", line );
+		else fputs( line, stderr );
+	}
+
+	// every event takes at least an inotify_event in the queue
+	double fill = m.queued_bytes < 0 || m.max_queued_events <= 0 ? 0 :
+	              100.0 * m.queued_bytes / sizeof(struct inotify_event) /
+	              m.max_queued_events;
+	snprintf( line, sizeof(line), "metrics: queue bytes=%lld "
+	          "max_queued_events=%d full<=%.1f%%\n", m.queued_bytes,
+	          m.max_queued_events, fill );
+	if ( to_syslog ) syslog( LOG_INFO, "%s", line );
+	else fputs( line, stderr );
+}
@@ -20,6 +20,16 @@ typedef struct {
 } FileList;
 FileList construct_path_list( int argc, char ** argv, char const * filename );
 
+// Patterns of --exclude, --include and their variants, in the order given,
+// with their flags for inotifytools_add_filter().
+typedef struct {
+	char const ** patterns;
+	int * flags;
+	int count;
+} FilterList;
+void add_filter_option( FilterList * list, char const * pattern, int flags );
+bool apply_filters( FilterList const * list );
+
 #define niceassert(cond,mesg) _niceassert((long)cond, __LINE__, __FILE__, \
                                           #cond, mesg)
 
@@ -30,4 +40,8 @@ void warn_inotify_init_error();
 
 bool is_timeout_option_valid(long int *timeout, char *optarg);
 
+// Output the metrics of inotifytools_get_metrics(), as percentiles bounded
+// by their histogram bucket, to syslog or stderr.
+void print_metrics( bool to_syslog );
+
 #endif
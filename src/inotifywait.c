@@ -10,14 +10,15 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <regex.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 #include <inotifytools/inotifytools.h>
 #include <inotifytools/inotify.h>
@@ -27,6 +28,15 @@ extern int optind, opterr, optopt;
 
 #define MAX_STRLEN 4096
 #define EXCLUDE_CHUNK 1024
+#define EVENT_BATCH 4096
+// Time to wait for the moved_to event of a move before taking it as a move
+// out of the watched tree.
+#define MOVE_TIMEOUT_MS 1000
+// How often the --reach-file is brought up to date while events come in.
+#define REACH_INTERVAL_MS 10000
+// How often the --snapshot is saved while events come in.
+#define SNAPSHOT_INTERVAL_MS 60000
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
 
 #define nasprintf(...) niceassert( -1 != asprintf(__VA_ARGS__), "out of memory")
 
@@ -40,14 +50,27 @@ bool parse_opts(
   unsigned long int * timeout,
   int * recursive,
   bool * csv,
+  bool * json,
+  bool * binary,
   bool * daemon,
   bool * syslog,
   char ** format,
   char ** timefmt,
   char ** fromfile,
   char ** outfile,
-  char ** regex,
-  char ** iregex
+  FilterList * filters,
+  int * setup_threads,
+  bool * prune,
+  bool * buffered,
+  int * flush_events,
+  long * flush_ms,
+  char ** backend,
+  long * coalesce_ms,
+  long * reader_kb,
+  char ** reach_file,
+  char ** snapshot_file,
+  long * metrics_s,
+  int * shards
 );
 
 void print_help();
@@ -88,8 +111,15 @@ char * csv_escape( char * string ) {
 }
 
 
-void validate_format( char * fmt ) {
-	// Make a fake event
+inotifytools_format * compile_format( char * fmt ) {
+	inotifytools_format * format = inotifytools_format_compile( fmt );
+	if ( !format ) {
+		fprintf( stderr, "Something is wrong with your format string.\n" );
+		exit(EXIT_FAILURE);
+	}
+
+	// Make a fake event to check that the format (and a possible time
+	// format) can actually be used
 	struct inotify_event * event =
 	   (struct inotify_event *)malloc(sizeof(struct inotify_event) + 4);
 	if ( !event ) {
@@ -100,30 +130,389 @@ void validate_format( char * fmt ) {
 	event->mask = IN_ALL_EVENTS;
 	event->len = 3;
 	strcpy( event->name, "foo" );
-	FILE * devnull = fopen( "/dev/null", "a" );
-	if ( !devnull ) {
-		fprintf( stderr, "Couldn't open /dev/null: %s\n", strerror(errno) );
-		free( event );
-		return;
-	}
-	if ( -1 == inotifytools_fprintf( devnull, event, fmt ) ) {
+	char line[MAX_STRLEN];
+	if ( -1 == inotifytools_format_event( format, line, MAX_STRLEN, event ) ) {
 		fprintf( stderr, "Something is wrong with your format string.\n" );
 		exit(EXIT_FAILURE);
 	}
 	free( event );
-	fclose(devnull);
+	return format;
 }
 
+/**
+ * Events waiting to be written to stdout.  Formatted events are collected
+ * here and written with a single write(), instead of going through stdio and
+ * being flushed one at a time.
+ */
+static struct {
+	char buf[OUTPUT_BUFFER_SIZE];
+	size_t len;
+	int events;
+	long long first_ms;
+} output;
+
+long long now_ms() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-void output_event_csv( struct inotify_event * event ) {
-    char *filename = csv_escape(inotifytools_filename_from_wd(event->wd));
-    if (filename != NULL)
-        printf("%s,", csv_escape(filename));
+// File given with --reach-file, or NULL.
+char * reach_file = NULL;
+// now_ms() when reach_file was last written.
+long long reach_written_ms;
+
+/**
+ * Write the directories which were reached or watched since the last write
+ * to the --reach-file.
+ */
+void write_reach() {
+	if ( !inotifytools_write_reach_file( reach_file ) ) {
+		fprintf( stderr, "Couldn't write %s: %s\n", reach_file,
+		         strerror( inotifytools_error() ) );
+	}
+	reach_written_ms = now_ms();
+}
+
+// File given with --snapshot, or NULL.
+char * snapshot_file = NULL;
+// now_ms() when snapshot_file was last saved.
+long long snapshot_written_ms;
+
+/**
+ * Save the directories watched to the --snapshot file.
+ */
+void write_snapshot() {
+	if ( !inotifytools_save_snapshot( snapshot_file ) ) {
+		fprintf( stderr, "Couldn't write %s: %s\n", snapshot_file,
+		         strerror( inotifytools_error() ) );
+	}
+	snapshot_written_ms = now_ms();
+}
+
+void output_flush() {
+	size_t done = 0;
+	while ( done < output.len ) {
+		ssize_t ret = write( STDOUT_FILENO, &output.buf[done],
+		                     output.len - done );
+		if ( ret < 0 ) {
+			if ( errno == EINTR ) continue;
+			break;
+		}
+		done += ret;
+	}
+	output.len = 0;
+	output.events = 0;
+}
+
+/**
+ * Make sure there is room for one more formatted event of up to @a size
+ * bytes, and return where it should be written.
+ */
+char * output_reserve( size_t size ) {
+	if ( OUTPUT_BUFFER_SIZE - output.len < size ) output_flush();
+	if ( !output.events ) output.first_ms = now_ms();
+	return &output.buf[output.len];
+}
+
+void output_commit( int len ) {
+	if ( len <= 0 ) return;
+	output.len += len;
+	output.events++;
+}
 
-	printf("%s,", csv_escape( inotifytools_event_to_str( event->mask ) ) );
+void output_event_format( inotifytools_format const * format,
+                          struct inotify_event * event ) {
+	output_commit( inotifytools_format_event( format,
+	                                          output_reserve( MAX_STRLEN ),
+	                                          MAX_STRLEN, event ) );
+}
+
+int csv_append( char * out, int len, char const * str, char const * end ) {
+	int ret = snprintf( &out[len], MAX_STRLEN - len, "%s%s", str, end );
+	if ( ret < 0 ) return len;
+	len += ret;
+	return len < MAX_STRLEN ? len : MAX_STRLEN - 1;
+}
+
+void output_event_csv( struct inotify_event * event ) {
+	char * out = output_reserve( MAX_STRLEN );
+	int len = 0;
+	char *filename = csv_escape(inotifytools_filename_from_wd(event->wd));
+	if (filename != NULL)
+		len = csv_append( out, len, csv_escape(filename), "," );
+
+	char events[INOTIFYTOOLS_EVENT_STR_SIZE];
+	inotifytools_event_to_str_r( event->mask, ',', events, sizeof(events) );
+	len = csv_append( out, len, csv_escape( events ), "," );
 	if ( event->len > 0 )
-		printf("%s", csv_escape( event->name ) );
-	printf("\n");
+		len = csv_append( out, len, csv_escape( event->name ), "" );
+	len = csv_append( out, len, "", "\n" );
+	output_commit( len );
+}
+
+/**
+ * Start of the --binary output.  It is followed by records in host byte
+ * order, each starting with a struct binary_header and padded with zeros
+ * to a multiple of 8 bytes, with at least one zero after the name.
+ */
+#define BINARY_MAGIC "IWBIN1\n"
+// Longest directory name written in --binary output.
+#define BINARY_PATH_MAX (OUTPUT_BUFFER_SIZE / 2)
+
+enum {
+	// Names the directory with watch descriptor @a id.  Sent before the
+	// first event on it, and again whenever its name changes.
+	BINARY_DIR = 1,
+	// An event on the directory or file @a dir.
+	BINARY_EVENT = 2
+};
+
+struct binary_header {
+	uint32_t size;
+	uint16_t type;
+	uint16_t name_len;
+};
+
+// Followed by the name of the directory.
+struct binary_dir {
+	struct binary_header header;
+	int32_t id;
+	uint32_t reserved;
+};
+
+// Followed by the name of the file within the directory, if any.
+struct binary_event {
+	struct binary_header header;
+	int32_t dir;
+	uint32_t mask;
+	uint32_t cookie;
+	uint32_t reserved;
+	uint64_t time_ns;
+};
+
+// Directory names last sent in --binary output, indexed by watch descriptor.
+char ** binary_dirs = NULL;
+int num_binary_dirs = 0;
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime( CLOCK_REALTIME, &ts );
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * @return the size of a --binary record with a fixed part of @a size bytes
+ *         and a name of @a name_len bytes.
+ */
+size_t binary_size( size_t size, size_t name_len ) {
+	return (size + name_len + 8) & ~(size_t)7;
+}
+
+/**
+ * Write the header and name of a --binary record of @a size bytes, which
+ * has already been zeroed, to @a out.
+ */
+void binary_record( char * out, size_t size, size_t fixed, int type,
+                    char const * name, size_t name_len ) {
+	struct binary_header * header = (struct binary_header *)out;
+	header->size = size;
+	header->type = type;
+	header->name_len = name_len;
+	memcpy( &out[fixed], name, name_len );
+}
+
+/**
+ * @return true if the name of directory @a wd, @a dir, was not sent in
+ *         --binary output yet, and remember it as sent.
+ */
+bool binary_dir_changed( int wd, char const * dir ) {
+	if ( wd >= num_binary_dirs ) {
+		int num = num_binary_dirs ? num_binary_dirs : 64;
+		while ( num <= wd ) num *= 2;
+		binary_dirs = (char **)realloc( binary_dirs, num * sizeof(char *) );
+		niceassert( binary_dirs, "out of memory" );
+		memset( &binary_dirs[num_binary_dirs], 0,
+		        (num - num_binary_dirs) * sizeof(char *) );
+		num_binary_dirs = num;
+	}
+	if ( binary_dirs[wd] && !strcmp( binary_dirs[wd], dir ) ) return false;
+	free( binary_dirs[wd] );
+	binary_dirs[wd] = strdup( dir );
+	niceassert( binary_dirs[wd], "out of memory" );
+	return true;
+}
+
+void output_event_binary( struct inotify_event * event ) {
+	static bool started = false;
+	char const * dir = event->wd < 0 ? NULL :
+	                   inotifytools_filename_from_wd( event->wd );
+	size_t dir_len = dir ? strnlen( dir, BINARY_PATH_MAX ) : 0;
+	size_t name_len = event->len ? strnlen( event->name, event->len ) : 0;
+	bool send_dir = dir && binary_dir_changed( event->wd, dir );
+
+	size_t dir_size = send_dir ?
+	                  binary_size( sizeof(struct binary_dir), dir_len ) : 0;
+	size_t event_size = binary_size( sizeof(struct binary_event), name_len );
+	size_t magic_size = started ? 0 : sizeof(BINARY_MAGIC);
+	char * out = output_reserve( magic_size + dir_size + event_size );
+	memset( out, 0, magic_size + dir_size + event_size );
+	if ( !started ) {
+		memcpy( out, BINARY_MAGIC, sizeof(BINARY_MAGIC) );
+		out += magic_size;
+		started = true;
+	}
+	if ( send_dir ) {
+		((struct binary_dir *)out)->id = event->wd;
+		binary_record( out, dir_size, sizeof(struct binary_dir), BINARY_DIR,
+		               dir, dir_len );
+		out += dir_size;
+	}
+	struct binary_event * record = (struct binary_event *)out;
+	record->dir = event->wd;
+	record->mask = event->mask;
+	record->cookie = event->cookie;
+	record->time_ns = now_ns();
+	binary_record( out, event_size, sizeof(struct binary_event), BINARY_EVENT,
+	               event->name, name_len );
+	output_commit( magic_size + dir_size + event_size );
+}
+
+/**
+ * @return the length of the UTF-8 sequence at the start of the @a len bytes
+ *         at @a s, or 0 if they don't start with a valid one.
+ */
+int utf8_len( unsigned char const * s, size_t len ) {
+	unsigned char lo = 0x80, hi = 0xbf;
+	int n;
+	if ( s[0] >= 0xc2 && s[0] <= 0xdf ) n = 2;
+	else if ( s[0] >= 0xe0 && s[0] <= 0xef ) n = 3;
+	else if ( s[0] >= 0xf0 && s[0] <= 0xf4 ) n = 4;
+	else return 0;
+	// no overlong forms, surrogates or code points past U+10FFFF
+	if ( s[0] == 0xe0 ) lo = 0xa0;
+	if ( s[0] == 0xed ) hi = 0x9f;
+	if ( s[0] == 0xf0 ) lo = 0x90;
+	if ( s[0] == 0xf4 ) hi = 0x8f;
+	if ( (size_t)n > len || s[1] < lo || s[1] > hi ) return 0;
+	for ( int i = 2; i < n; ++i ) {
+		if ( (s[i] & 0xc0) != 0x80 ) return 0;
+	}
+	return n;
+}
+
+/**
+ * Write the @a len bytes at @a str to @a out as a JSON string, stopping
+ * before @a end.  Bytes which are not part of valid UTF-8 are written as the
+ * lone surrogates \udc80 to \udcff, as Python's surrogateescape does, so the
+ * original file name can still be recovered.
+ *
+ * @return the end of the string written.
+ */
+char * json_string( char * out, char const * end, char const * str,
+                    size_t len ) {
+	static char const hex[] = "0123456789abcdef";
+	unsigned char const * s = (unsigned char const *)str;
+	*out++ = '"';
+	// room for the longest escape and the closing quote
+	end -= 7;
+	for ( size_t i = 0; i < len && out < end; ++i ) {
+		unsigned char c = s[i];
+		if ( c >= 0x80 ) {
+			int n = utf8_len( &s[i], len - i );
+			if ( n ) {
+				memcpy( out, &s[i], n );
+				out += n;
+				i += n - 1;
+				continue;
+			}
+			memcpy( out, "\\udc", 4 );
+			out[4] = hex[c >> 4];
+			out[5] = hex[c & 15];
+			out += 6;
+		}
+		else if ( c == '"' || c == '\\' ) {
+			*out++ = '\\';
+			*out++ = c;
+		}
+		else if ( c == '\n' ) {
+			memcpy( out, "\\n", 2 );
+			out += 2;
+		}
+		else if ( c < 0x20 ) {
+			memcpy( out, "\\u00", 4 );
+			out[4] = hex[c >> 4];
+			out[5] = hex[c & 15];
+			out += 6;
+		}
+		else {
+			*out++ = c;
+		}
+	}
+	*out++ = '"';
+	return out;
+}
+
+void output_event_json( struct inotify_event * event ) {
+	char const * dir = event->wd < 0 ? NULL :
+	                   inotifytools_filename_from_wd( event->wd );
+	size_t dir_len = dir ? strlen( dir ) : 0;
+	size_t name_len = event->len ? strnlen( event->name, event->len ) : 0;
+	size_t size = 512 + 6 * (dir_len + name_len);
+	if ( size > OUTPUT_BUFFER_SIZE ) size = OUTPUT_BUFFER_SIZE;
+	char * start = output_reserve( size );
+	char const * end = start + size;
+
+	char * out = start + snprintf( start, size,
+	                               "{\"wd\":%d,\"mask\":%u,\"cookie\":%u,"
+	                               "\"time_ns\":%llu,\"events\":[\"",
+	                               event->wd, event->mask, event->cookie,
+	                               (unsigned long long)now_ns() );
+	char events[INOTIFYTOOLS_EVENT_STR_SIZE];
+	inotifytools_event_to_str_r( event->mask, ',', events, sizeof(events) );
+	for ( char const * e = events; *e; ++e ) {
+		if ( *e == ',' ) {
+			memcpy( out, "\",\"", 3 );
+			out += 3;
+		}
+		else {
+			*out++ = *e;
+		}
+	}
+	memcpy( out, "\"],\"dir\":", 9 );
+	out += 9;
+	if ( dir ) {
+		out = json_string( out, end - 16 - 6 * name_len, dir, dir_len );
+	}
+	else {
+		memcpy( out, "null", 4 );
+		out += 4;
+	}
+	memcpy( out, ",\"name\":", 8 );
+	out += 8;
+	out = json_string( out, end - 2, event->name, name_len );
+	memcpy( out, "}\n", 2 );
+	out += 2;
+	output_commit( out - start );
+}
+
+// Whether the event loop runs, so that interrupted() must let it finish.
+volatile sig_atomic_t in_event_loop = 0;
+// Set by interrupted() to leave the event loop.
+volatile sig_atomic_t stop_requested = 0;
+// Written to by interrupted() to wake up the wait for events, which waits on
+// the read end too, so a signal just before the wait isn't missed.
+int interrupt_pipe[2] = { -1, -1 };
+
+void interrupted( int sig __attribute__((unused)) ) {
+	// Nothing needs finishing while the watches are being set up.
+	if ( !in_event_loop ) _exit( EXIT_SUCCESS );
+	// The event loop writes the --reach-file and --snapshot and exits.
+	stop_requested = 1;
+	int error = errno;
+	ssize_t ret = write( interrupt_pipe[1], "", 1 );
+	(void)ret;
+	errno = error;
 }
 
 
@@ -138,6 +527,46 @@ void output_error( bool syslog, char* fmt, ... ) {
 	va_end(va);
 }
 
+/**
+ * Update the watches of a recursive watch after a move: rename the watches
+ * below a directory moved within the tree, watch a directory moved into it
+ * and unwatch one moved out of it.
+ */
+void watch_moved( struct inotifytools_move const * move, int events,
+                  inotifytools_exclude const * exclude, bool syslog ) {
+	if ( !move->isdir ) return;
+
+	char * from = 0;
+	if ( move->from ) {
+		nasprintf( &from, "%s/", move->from );
+		// if not watched...
+		if ( inotifytools_wd_from_filename( from ) == -1 ) {
+			free( from );
+			from = 0;
+		}
+	}
+
+	if ( from && move->to ) {
+		char * to;
+		nasprintf( &to, "%s/", move->to );
+		inotifytools_replace_filename( from, to );
+		free( to );
+	}
+	else if ( from ) {
+		if ( !inotifytools_remove_watch_by_filename( from ) ) {
+			output_error( syslog, "Error removing watch on %s: %s\n",
+			              from, strerror(inotifytools_error()) );
+		}
+	}
+	else if ( !inotifytools_exclude_matches( exclude, move->to ) &&
+	          !inotifytools_watch_recursively_async( move->to, events,
+	                                                 exclude ) ) {
+		output_error( syslog, "Couldn't watch new directory %s: %s\n",
+		              move->to, strerror( inotifytools_error() ) );
+	}
+	free( from );
+}
+
 int main(int argc, char ** argv)
 {
 	int events = 0;
@@ -147,22 +576,41 @@ int main(int argc, char ** argv)
 	unsigned long int timeout = 0;
 	int recursive = 0;
 	bool csv = false;
+	bool json = false;
+	bool binary = false;
 	bool daemon = false;
 	bool syslog = false;
 	char * format = NULL;
 	char * timefmt = NULL;
 	char * fromfile = NULL;
 	char * outfile = NULL;
-	char * regex = NULL;
-	char * iregex = NULL;
+	FilterList filters = { NULL, NULL, 0 };
+	int setup_threads = 1;
+	bool prune = false;
+	bool buffered = false;
+	int flush_events = 0;
+	long flush_ms = 0;
+	char * backend = NULL;
+	long coalesce_ms = 0;
+	long reader_kb = 0;
+	long metrics_s = 0;
+	int shards = 0;
 	pid_t pid;
     int fd;
 
-	signal(SIGINT, inotifytools_print_unreached_dirs);
+	// Without SA_RESTART, so that waiting for events stops at once.
+	struct sigaction sa;
+	memset( &sa, 0, sizeof(sa) );
+	sa.sa_handler = interrupted;
+	sigemptyset( &sa.sa_mask );
+	sigaction( SIGINT, &sa, NULL );
 	// Parse commandline options, aborting if something goes wrong
 	if ( !parse_opts(&argc, &argv, &events, &monitor, &quiet, &timeout,
-	                 &recursive, &csv, &daemon, &syslog, &format, &timefmt, 
-                         &fromfile, &outfile, &regex, &iregex) ) {
+	                 &recursive, &csv, &json, &binary, &daemon, &syslog, &format, &timefmt, 
+                         &fromfile, &outfile, &filters,
+	                 &setup_threads, &prune, &buffered, &flush_events,
+	                 &flush_ms, &backend, &coalesce_ms, &reader_kb,
+	                 &reach_file, &snapshot_file, &metrics_s, &shards) ) {
 		return EXIT_FAILURE;
 	}
 
@@ -177,18 +625,28 @@ int main(int argc, char ** argv)
 		return EXIT_FAILURE;
 	}
 
-	if ( timefmt ) inotifytools_set_printf_timefmt( timefmt );
-	if (
-		(regex && !inotifytools_ignore_events_by_regex(regex, REG_EXTENDED) ) ||
-		(iregex && !inotifytools_ignore_events_by_regex(iregex, REG_EXTENDED|
-		                                                        REG_ICASE))
-	) {
-		fprintf(stderr, "Error in `exclude' regular expression.\n");
+	if ( pipe2( interrupt_pipe, O_CLOEXEC | O_NONBLOCK ) ||
+	     !inotifytools_set_wake_fd( interrupt_pipe[0] ) ) {
+		fprintf( stderr, "Couldn't set up interrupt handling: %s\n",
+		         strerror( errno ) );
 		return EXIT_FAILURE;
 	}
 
+	if ( backend && !inotifytools_set_backend( backend ) ) {
+		fprintf(stderr, "Couldn't use the '%s' backend: %s\n", backend,
+		        strerror( inotifytools_error() ) );
+		return EXIT_FAILURE;
+	}
 
-	if ( format ) validate_format(format);
+	if ( coalesce_ms ) inotifytools_set_coalesce_ms( coalesce_ms );
+	if ( timefmt ) inotifytools_set_printf_timefmt( timefmt );
+	if ( !apply_filters( &filters ) ) return EXIT_FAILURE;
+	inotifytools_set_prune_by_regex( prune );
+
+
+	// The format is compiled once instead of being parsed for every event
+	inotifytools_format * compiled_format =
+	    compile_format( format ? format : "%w %,e %f\n" );
 
 	// Attempt to watch file
 	// If events is still 0, make it all events.
@@ -206,6 +664,10 @@ int main(int argc, char ** argv)
 		return EXIT_FAILURE;
 	}
 
+	// Compiled once, and also used for directories created later on
+	inotifytools_exclude * exclude =
+	    inotifytools_exclude_compile( list.exclude_files );
+
 
     // Daemonize - BSD double-fork approach
 	if ( daemon ) {
@@ -277,6 +739,25 @@ int main(int argc, char ** argv)
 		openlog ("inotifywait", LOG_CONS | LOG_PID | LOG_NDELAY, LOG_DAEMON);
         }
 
+	// The reader thread has to be started after daemonizing, since threads
+	// don't survive fork().  So do the threads draining each shard.
+	if ( shards && !inotifytools_set_shards( shards, 1 ) ) {
+		output_error( syslog, "Couldn't shard the watches: %s\n",
+		              strerror( inotifytools_error() ) );
+		return EXIT_FAILURE;
+	}
+	if ( reader_kb && !inotifytools_start_reader( reader_kb * 1024 ) ) {
+		output_error( syslog, "Couldn't start the reader thread: %s\n",
+		              strerror( inotifytools_error() ) );
+		return EXIT_FAILURE;
+	}
+	if ( metrics_s && !inotifytools_enable_metrics( 1 ) ) {
+		output_error( syslog, "Couldn't collect metrics: %s\n",
+		              strerror( inotifytools_error() ) );
+		return EXIT_FAILURE;
+	}
+	long long metrics_written_ms = now_ms();
+
 	if ( !quiet ) {
 		if ( recursive ) {
 			output_error( syslog, "Setting up watches.  Beware: since -r "
@@ -286,13 +767,28 @@ int main(int argc, char ** argv)
 		}
 	}
 
+	// Watch directories created while events were lost to a queue overflow.
+	// Snapshots of the directories read are kept for --snapshot, too.
+	if ( (monitor && recursive) || snapshot_file ) {
+		inotifytools_set_rescan_on_overflow( 1 );
+	}
+
 	// now watch files
 	for ( int i = 0; list.watch_files[i]; ++i ) {
 		char const *this_file = list.watch_files[i];
-		if ( (recursive && !inotifytools_watch_recursively_with_exclude(
+		if ( (recursive && snapshot_file &&
+		      !inotifytools_watch_recursively_from_snapshot(
+		                        snapshot_file,
 		                        this_file,
 		                        events,
-		                        list.exclude_files ))
+		                        exclude,
+		                        setup_threads ))
+		     || (recursive && !snapshot_file &&
+		         !inotifytools_watch_recursively_excluding(
+		                        this_file,
+		                        events,
+		                        exclude,
+		                        setup_threads ))
 		     || (!recursive && !inotifytools_watch_file( this_file, events )) ){
 			if ( inotifytools_error() == ENOSPC ) {
 				output_error( syslog, "Failed to watch %s; upper limit on inotify "
@@ -313,96 +809,167 @@ int main(int argc, char ** argv)
 		output_error( syslog, "Watches established.\n" );
 	}
 
+	// Record which directories have events from now on.
+	if ( reach_file ) {
+		inotifytools_set_reach_tracking( 1 );
+		write_reach();
+	}
+
+	// Restart from the directories watched now next time.
+	if ( snapshot_file ) {
+		write_snapshot();
+	}
+
 	// Now wait till we get event
-	struct inotify_event * event;
-	char * moved_from = 0;
+	struct inotify_event * event = 0;
+	struct inotify_event * batch[EVENT_BATCH];
+	int num_events;
+	struct inotifytools_move move;
+
+	// Without --buffered, every event is written as soon as it is printed.
+	if ( !buffered ) flush_events = 1;
 
+	int status = EXIT_SUCCESS;
+	in_event_loop = 1;
 	do {
-		event = inotifytools_next_event( timeout );
-		if ( !event ) {
-			if ( !inotifytools_error() ) {
-				return EXIT_TIMEOUT;
-			}
-			else {
-				output_error( syslog, "%s\n", strerror( inotifytools_error() ) );
-				return EXIT_FAILURE;
+		if ( stop_requested ) break;
+		if ( metrics_s &&
+		     now_ms() - metrics_written_ms >= metrics_s * 1000 ) {
+			print_metrics( syslog );
+			metrics_written_ms = now_ms();
+		}
+		if ( reach_file && now_ms() - reach_written_ms >= REACH_INTERVAL_MS ) {
+			write_reach();
+		}
+		if ( snapshot_file &&
+		     now_ms() - snapshot_written_ms >= SNAPSHOT_INTERVAL_MS ) {
+			write_snapshot();
+		}
+
+		// While buffered events are waiting for --flush-ms to pass, only
+		// wait for new events until it does.
+		long wait_ms = timeout ? (long)timeout * 1000 : -1;
+		if ( output.events ) {
+			wait_ms = output.first_ms + flush_ms - now_ms();
+			if ( wait_ms < 0 ) wait_ms = 0;
+		}
+		// Nor past the time moves waiting for their moved_to event expire.
+		int pending = inotifytools_get_num_pending_moves();
+		if ( pending && (wait_ms < 0 || wait_ms > MOVE_TIMEOUT_MS) ) {
+			wait_ms = MOVE_TIMEOUT_MS;
+		}
+		// Nor past the time the metrics, --reach-file or --snapshot are
+		// due.
+		bool timer_wait = false;
+		long long due_ms[3] = {
+			metrics_s ? metrics_written_ms + metrics_s * 1000 : -1,
+			reach_file ? reach_written_ms + REACH_INTERVAL_MS : -1,
+			snapshot_file ? snapshot_written_ms + SNAPSHOT_INTERVAL_MS : -1,
+		};
+		for ( int i = 0; monitor && i < 3; ++i ) {
+			if ( due_ms[i] < 0 ) continue;
+			long long left_ms = due_ms[i] - now_ms();
+			if ( wait_ms < 0 || wait_ms > left_ms ) {
+				wait_ms = left_ms > 0 ? left_ms : 0;
+				timer_wait = true;
 			}
 		}
 
-		if ( quiet < 2 && (event->mask & orig_events) ) {
-			if ( csv ) {
-				output_event_csv( event );
+		// In monitor mode take everything one read from inotify gives us;
+		// otherwise we only want a single event.
+		num_events = inotifytools_next_event_batch_ms( wait_ms, batch,
+		                                   monitor ? EVENT_BATCH : 1, 0 );
+		if ( !num_events && stop_requested ) break;
+		if ( !num_events && (output.events || pending || timer_wait) &&
+		     !inotifytools_error() ) {
+			output_flush();
+			while ( inotifytools_expire_move( MOVE_TIMEOUT_MS, &move ) ) {
+				watch_moved( &move, events, exclude, syslog );
 			}
-			else if ( format ) {
-				inotifytools_printf( event, format );
+			continue;
+		}
+		if ( !num_events ) {
+			if ( !inotifytools_error() ) {
+				status = EXIT_TIMEOUT;
 			}
 			else {
-				inotifytools_printf( event, "%w %,e %f\n" );
-			}
-		}
-
-		// if we last had MOVED_FROM and don't currently have MOVED_TO,
-		// moved_from file must have been moved outside of tree - so unwatch it.
-		if ( moved_from && !(event->mask & IN_MOVED_TO) ) {
-			if ( !inotifytools_remove_watch_by_filename( moved_from ) ) {
-				output_error( syslog, "Error removing watch on %s: %s\n",
-				         moved_from, strerror(inotifytools_error()) );
+				output_error( syslog, "%s\n", strerror( inotifytools_error() ) );
+				status = EXIT_FAILURE;
 			}
-			free( moved_from );
-			moved_from = 0;
+			event = 0;
+			break;
 		}
 
-		if ( monitor && recursive ) {
-			if ((event->mask & IN_CREATE) ||
-			    (!moved_from && (event->mask & IN_MOVED_TO))) {
-				// New file - if it is a directory, watch it
-				static char * new_file;
-
-				nasprintf( &new_file, "%s%s",
-				           inotifytools_filename_from_wd( event->wd ),
-				           event->name );
+		for ( int i = 0; i < num_events; ++i ) {
+			event = batch[i];
 
-				if ( isdir(new_file) &&
-				    !inotifytools_watch_recursively( new_file, events ) ) {
-					output_error( syslog, "Couldn't watch new directory %s: %s\n",
-					         new_file, strerror( inotifytools_error() ) );
+			// Overflows are always reported, since events were lost.
+			if ( quiet < 2 && (event->mask & (orig_events | IN_Q_OVERFLOW)) ) {
+				if ( csv ) {
+					output_event_csv( event );
 				}
-				free( new_file );
-			} // IN_CREATE
-			else if (event->mask & IN_MOVED_FROM) {
-				nasprintf( &moved_from, "%s%s/",
-				           inotifytools_filename_from_wd( event->wd ),
-				           event->name );
-				// if not watched...
-				if ( inotifytools_wd_from_filename(moved_from) == -1 ) {
-					free( moved_from );
-					moved_from = 0;
+				else if ( json ) {
+					output_event_json( event );
 				}
-			} // IN_MOVED_FROM
-			else if (event->mask & IN_MOVED_TO) {
-				if ( moved_from ) {
-					static char * new_name;
-					nasprintf( &new_name, "%s%s/",
+				else if ( binary ) {
+					output_event_binary( event );
+				}
+				else {
+					output_event_format( compiled_format, event );
+				}
+			}
+
+			if ( monitor && recursive ) {
+				if ( event->mask & IN_CREATE ) {
+					// New directory - watch it in the background, so events keep
+					// coming while its tree is read
+					static char * new_file;
+
+					nasprintf( &new_file, "%s%s",
 					           inotifytools_filename_from_wd( event->wd ),
 					           event->name );
-					inotifytools_replace_filename( moved_from, new_name );
-					free( moved_from );
-					moved_from = 0;
-				} // moved_from
+
+					if ( (event->mask & IN_ISDIR) &&
+					    !inotifytools_exclude_matches( exclude, new_file ) &&
+					    !inotifytools_watch_recursively_async( new_file, events,
+					                                           exclude ) ) {
+						output_error( syslog, "Couldn't watch new directory %s: %s\n",
+						         new_file, strerror( inotifytools_error() ) );
+					}
+					free( new_file );
+				} // IN_CREATE
+				else if ( inotifytools_track_move( event, &move ) ) {
+					watch_moved( &move, events, exclude, syslog );
+				}
+			}
+
+			if ( flush_events && output.events >= flush_events ) {
+				output_flush();
 			}
 		}
 
-		fflush( NULL );
+		// Moves whose moved_to event hasn't turned up left the tree.
+		while ( inotifytools_expire_move( MOVE_TIMEOUT_MS, &move ) ) {
+			watch_moved( &move, events, exclude, syslog );
+		}
+
+		// Unless asked to keep collecting events for a while, write all
+		// events of this read at once.
+		if ( !flush_ms ) output_flush();
 
 	} while ( monitor );
 
+	output_flush();
+
 	// If we weren't trying to listen for this event...
-	if ( (events & event->mask) == 0 ) {
+	if ( event && !stop_requested && (events & event->mask) == 0 ) {
 		// ...then most likely something bad happened, like IGNORE etc.
-		return EXIT_FAILURE;
+		status = EXIT_FAILURE;
 	}
 
-	return EXIT_SUCCESS;
+	if ( reach_file ) write_reach();
+	if ( snapshot_file ) write_snapshot();
+	return status;
 }
 
 
@@ -415,25 +982,44 @@ bool parse_opts(
   unsigned long int * timeout,
   int * recursive,
   bool * csv,
+  bool * json,
+  bool * binary,
   bool * daemon,
   bool * syslog,
   char ** format,
   char ** timefmt,
   char ** fromfile,
   char ** outfile,
-  char ** regex,
-  char ** iregex
+  FilterList * filters,
+  int * setup_threads,
+  bool * prune,
+  bool * buffered,
+  int * flush_events,
+  long * flush_ms,
+  char ** backend,
+  long * coalesce_ms,
+  long * reader_kb,
+  char ** reach_file,
+  char ** snapshot_file,
+  long * metrics_s,
+  int * shards
 ) {
 	assert( argc ); assert( argv ); assert( events ); assert( monitor );
 	assert( quiet ); assert( timeout ); assert( csv ); assert( daemon );
+	assert( json ); assert( binary );
 	assert( syslog ); assert( format ); assert( timefmt ); assert( fromfile ); 
-	assert( outfile ); assert( regex ); assert( iregex );
+	assert( outfile ); assert( filters );
+	assert( setup_threads ); assert( prune ); assert( buffered );
+	assert( flush_events ); assert( flush_ms );
+	assert( backend ); assert( coalesce_ms ); assert( reader_kb );
+	assert( reach_file ); assert( snapshot_file ); assert( metrics_s );
+	assert( shards );
 
 	// Short options
-	char * opt_string = "mrhcdsqt:fo:e:";
+	char * opt_string = "mrhcdsqt:fo:e:B";
 
 	// Construct array
-	struct option long_opts[17];
+	struct option long_opts[35];
 
 	// --help
 	long_opts[0].name = "help";
@@ -519,11 +1105,108 @@ bool parse_opts(
 	long_opts[15].has_arg = 1;
 	long_opts[15].flag = NULL;
 	long_opts[15].val = (int)'b';
+	// --setup-threads
+	long_opts[16].name = "setup-threads";
+	long_opts[16].has_arg = 1;
+	long_opts[16].flag = NULL;
+	long_opts[16].val = (int)'j';
+	char * setup_threads_end = NULL;
+	// --prune
+	long_opts[17].name = "prune";
+	long_opts[17].has_arg = 0;
+	long_opts[17].flag = NULL;
+	long_opts[17].val = (int)'P';
+	// --buffered
+	long_opts[18].name = "buffered";
+	long_opts[18].has_arg = 0;
+	long_opts[18].flag = NULL;
+	long_opts[18].val = (int)'B';
+	// --flush-events
+	long_opts[19].name = "flush-events";
+	long_opts[19].has_arg = 1;
+	long_opts[19].flag = NULL;
+	long_opts[19].val = (int)'F';
+	char * flush_events_end = NULL;
+	// --flush-ms
+	long_opts[20].name = "flush-ms";
+	long_opts[20].has_arg = 1;
+	long_opts[20].flag = NULL;
+	long_opts[20].val = (int)'L';
+	char * flush_ms_end = NULL;
+	// --backend
+	long_opts[21].name = "backend";
+	long_opts[21].has_arg = 1;
+	long_opts[21].flag = NULL;
+	long_opts[21].val = (int)'K';
+	// --coalesce
+	long_opts[22].name = "coalesce";
+	long_opts[22].has_arg = 1;
+	long_opts[22].flag = NULL;
+	long_opts[22].val = (int)'W';
+	char * coalesce_end = NULL;
+	// --reader
+	long_opts[23].name = "reader";
+	long_opts[23].has_arg = 1;
+	long_opts[23].flag = NULL;
+	long_opts[23].val = (int)'R';
+	char * reader_end = NULL;
+	// --reach-file
+	long_opts[24].name = "reach-file";
+	long_opts[24].has_arg = 1;
+	long_opts[24].flag = NULL;
+	long_opts[24].val = (int)'Y';
+	// --snapshot
+	long_opts[25].name = "snapshot";
+	long_opts[25].has_arg = 1;
+	long_opts[25].flag = NULL;
+	long_opts[25].val = (int)'S';
+	// --json
+	long_opts[26].name = "json";
+	long_opts[26].has_arg = 0;
+	long_opts[26].flag = NULL;
+	long_opts[26].val = (int)'J';
+	// --binary
+	long_opts[27].name = "binary";
+	long_opts[27].has_arg = 0;
+	long_opts[27].flag = NULL;
+	long_opts[27].val = (int)'G';
+	// --metrics
+	long_opts[28].name = "metrics";
+	long_opts[28].has_arg = 1;
+	long_opts[28].flag = NULL;
+	long_opts[28].val = (int)'M';
+	char * metrics_end = NULL;
+	// --shards
+	long_opts[29].name = "shards";
+	long_opts[29].has_arg = 1;
+	long_opts[29].flag = NULL;
+	long_opts[29].val = (int)'H';
+	char * shards_end = NULL;
+	// --include
+	long_opts[30].name = "include";
+	long_opts[30].has_arg = 1;
+	long_opts[30].flag = NULL;
+	long_opts[30].val = (int)'I';
+	// --includei
+	long_opts[31].name = "includei";
+	long_opts[31].has_arg = 1;
+	long_opts[31].flag = NULL;
+	long_opts[31].val = (int)'U';
+	// --exclude-glob
+	long_opts[32].name = "exclude-glob";
+	long_opts[32].has_arg = 1;
+	long_opts[32].flag = NULL;
+	long_opts[32].val = (int)'X';
+	// --include-glob
+	long_opts[33].name = "include-glob";
+	long_opts[33].has_arg = 1;
+	long_opts[33].flag = NULL;
+	long_opts[33].val = (int)'Q';
 	// Empty last element
-	long_opts[16].name = 0;
-	long_opts[16].has_arg = 0;
-	long_opts[16].flag = 0;
-	long_opts[16].val = 0;
+	long_opts[34].name = 0;
+	long_opts[34].has_arg = 0;
+	long_opts[34].flag = 0;
+	long_opts[34].val = 0;
 
 	// Get first option
 	char curr_opt = getopt_long(*argc, *argv, opt_string, long_opts, NULL);
@@ -560,6 +1243,16 @@ bool parse_opts(
 				(*csv) = true;
 				break;
 
+			// --json
+			case 'J':
+				(*json) = true;
+				break;
+
+			// --binary
+			case 'G':
+				(*binary) = true;
+				break;
+
 			// --daemon or -d
 			case 'd':
 				(*daemon) = true;
@@ -595,12 +1288,37 @@ bool parse_opts(
 
 			// --exclude
 			case 'a':
-				(*regex) = optarg;
+				add_filter_option( filters, optarg, 0 );
 				break;
 
 			// --excludei
 			case 'b':
-				(*iregex) = optarg;
+				add_filter_option( filters, optarg, INOTIFYTOOLS_FILTER_ICASE );
+				break;
+
+			// --include
+			case 'I':
+				add_filter_option( filters, optarg,
+				                   INOTIFYTOOLS_FILTER_INCLUDE );
+				break;
+
+			// --includei
+			case 'U':
+				add_filter_option( filters, optarg,
+				                   INOTIFYTOOLS_FILTER_INCLUDE |
+				                   INOTIFYTOOLS_FILTER_ICASE );
+				break;
+
+			// --exclude-glob
+			case 'X':
+				add_filter_option( filters, optarg, INOTIFYTOOLS_FILTER_GLOB );
+				break;
+
+			// --include-glob
+			case 'Q':
+				add_filter_option( filters, optarg,
+				                   INOTIFYTOOLS_FILTER_INCLUDE |
+				                   INOTIFYTOOLS_FILTER_GLOB );
 				break;
 
 			// --fromfile
@@ -634,6 +1352,126 @@ bool parse_opts(
 				}
 				break;
 
+			// --prune
+			case 'P':
+				(*prune) = true;
+				break;
+
+			// --setup-threads
+			case 'j':
+				*setup_threads = strtol(optarg, &setup_threads_end, 10);
+				if ( *setup_threads_end != '\0' || *setup_threads < 1 )
+				{
+					fprintf(stderr, "'%s' is not a valid number of threads.\n"
+					        "Please specify an integer of value 1 or "
+					        "greater.\n",
+					        optarg);
+					return false;
+				}
+				break;
+
+			// --buffered or -B
+			case 'B':
+				(*buffered) = true;
+				break;
+
+			// --flush-events
+			case 'F':
+				*flush_events = strtol(optarg, &flush_events_end, 10);
+				if ( *flush_events_end != '\0' || *flush_events < 1 )
+				{
+					fprintf(stderr, "'%s' is not a valid number of events.\n"
+					        "Please specify an integer of value 1 or "
+					        "greater.\n",
+					        optarg);
+					return false;
+				}
+				(*buffered) = true;
+				break;
+
+			// --flush-ms
+			case 'L':
+				*flush_ms = strtol(optarg, &flush_ms_end, 10);
+				if ( *flush_ms_end != '\0' || *flush_ms < 0 )
+				{
+					fprintf(stderr, "'%s' is not a valid number of "
+					        "milliseconds.\n"
+					        "Please specify an integer of value 0 or "
+					        "greater.\n",
+					        optarg);
+					return false;
+				}
+				(*buffered) = true;
+				break;
+
+			// --backend
+			case 'K':
+				(*backend) = optarg;
+				break;
+
+			// --coalesce
+			case 'W':
+				*coalesce_ms = strtol(optarg, &coalesce_end, 10);
+				if ( *coalesce_end != '\0' || *coalesce_ms < 0 )
+				{
+					fprintf(stderr, "'%s' is not a valid number of "
+					        "milliseconds.\n"
+					        "Please specify an integer of value 0 or "
+					        "greater.\n",
+					        optarg);
+					return false;
+				}
+				break;
+
+			// --reader
+			case 'R':
+				*reader_kb = strtol(optarg, &reader_end, 10);
+				if ( *reader_end != '\0' || *reader_kb < 1 )
+				{
+					fprintf(stderr, "'%s' is not a valid ring buffer size.\n"
+					        "Please specify an integer of value 1 or "
+					        "greater.\n",
+					        optarg);
+					return false;
+				}
+				break;
+
+			// --metrics
+			case 'M':
+				*metrics_s = strtol(optarg, &metrics_end, 10);
+				if ( *metrics_end != '\0' || *metrics_s < 1 )
+				{
+					fprintf(stderr, "'%s' is not a valid interval.\n"
+					        "Please specify an integer of value 1 or "
+					        "greater.\n",
+					        optarg);
+					return false;
+				}
+				break;
+
+			// --shards
+			case 'H':
+				*shards = strtol(optarg, &shards_end, 10);
+				if ( *shards_end != '\0' || *shards < 1 )
+				{
+					fprintf(stderr, "'%s' is not a valid number of shards.\n"
+					        "Please specify an integer of value 1 or "
+					        "greater.\n",
+					        optarg);
+					return false;
+				}
+				break;
+
+			// --reach-file
+			case 'Y':
+				*reach_file = optarg;
+				break;
+
+			// --snapshot
+			case 'S':
+				*snapshot_file = optarg;
+				break;
+
 			// --event or -e
 			case 'e':
 				// Get event mask from event string
@@ -665,8 +1503,15 @@ bool parse_opts(
 		return false;
 	}
 
-	if ( *regex && *iregex ) {
-		fprintf(stderr, "--exclude and --excludei cannot both be specified.\n");
+	bool excludes = false;
+	for ( int i = 0; i < filters->count; ++i ) {
+		if ( !(filters->flags[i] & INOTIFYTOOLS_FILTER_INCLUDE) ) {
+			excludes = true;
+		}
+	}
+	if ( *prune && !excludes ) {
+		fprintf(stderr, "--prune cannot be specified without --exclude, "
+		                "--excludei or --exclude-glob.\n");
 		return false;
 	}
 
@@ -675,6 +1520,17 @@ bool parse_opts(
 		return false;
 	}
 
+	if ( (*json || *binary) && (*csv || *format) ) {
+		fprintf(stderr, "--json and --binary cannot be specified with -c or "
+		                "--format.\n");
+		return false;
+	}
+
+	if ( *json && *binary ) {
+		fprintf(stderr, "--json and --binary cannot both be specified.\n");
+		return false;
+	}
+
 	if ( !*format && *timefmt ) {
 		fprintf(stderr, "--timefmt cannot be specified without --format.\n");
 		return false;
@@ -686,6 +1542,11 @@ bool parse_opts(
 		return false;
 	}
 
+	if ( *snapshot_file && !*recursive ) {
+		fprintf(stderr, "--snapshot cannot be specified without -r.\n");
+		return false;
+	}
+
 	if ( *daemon && *outfile == NULL ) {
 		fprintf(stderr, "-o must be specified with -d.\n");
 		return false;
@@ -711,9 +1572,25 @@ void print_help()
 	       "watched.\n");
 	printf("\t--exclude <pattern>\n"
 	       "\t              \tExclude all events on files matching the\n"
-	       "\t              \textended regular expression <pattern>.\n");
+	       "\t              \textended regular expression <pattern>.  May\n"
+	       "\t              \tbe given several times, as may the options\n"
+	       "\t              \tbelow.\n");
 	printf("\t--excludei <pattern>\n"
 	       "\t              \tLike --exclude but case insensitive.\n");
+	printf("\t--exclude-glob <glob>\n"
+	       "\t              \tExclude all events on files whose whole path\n"
+	       "\t              \tmatches the wildcard pattern <glob>.\n");
+	printf("\t--include <pattern>\n"
+	       "\t              \tOnly report events on files matching the\n"
+	       "\t              \textended regular expression <pattern>.\n");
+	printf("\t--includei <pattern>\n"
+	       "\t              \tLike --include but case insensitive.\n");
+	printf("\t--include-glob <glob>\n"
+	       "\t              \tOnly report events on files whose whole path\n"
+	       "\t              \tmatches the wildcard pattern <glob>.\n");
+	printf("\t--prune       \tDon't watch directories matching an exclude\n"
+	       "\t              \tpattern at all, so nothing below them is\n"
+	       "\t              \treported.\n");
 	printf("\t-m|--monitor  \tKeep listening for events forever.  Without\n"
 	       "\t              \tthis option, inotifywait will exit after one\n"
 	       "\t              \tevent is received.\n");
@@ -721,11 +1598,46 @@ void print_help()
                "\t              \tlogging events to a file specified by --outfile.\n"
                "\t              \tImplies --syslog.\n");
 	printf("\t-r|--recursive\tWatch directories recursively.\n");
+	printf("\t--setup-threads <n>\n"
+	       "\t              \tScan directories with <n> threads while setting\n"
+	       "\t              \tup recursive watches.\n");
+	printf("\t--snapshot <file>\n"
+	       "\t              \tSave the directories watched to <file>, and on\n"
+	       "\t              \tthe next start only read those which changed.\n");
+	printf("\t--backend <name>\n"
+	       "\t              \tWatch with the named backend, `inotify' (the\n"
+	       "\t              \tdefault) or `fanotify'.\n");
 	printf("\t--fromfile <file>\n"
 	       "\t              \tRead files to watch from <file> or `-' for "
 	       "stdin.\n");
 	printf("\t-o|--outfile <file>\n"
 	       "\t              \tPrint events to <file> rather than stdout.\n");
+	printf("\t-B|--buffered \tCollect the events of each read from inotify and\n"
+	       "\t              \twrite them at once, rather than one at a time.\n");
+	printf("\t--flush-events <n>\n"
+	       "\t              \tWrite buffered events as soon as <n> are\n"
+	       "\t              \twaiting.  Implies --buffered.\n");
+	printf("\t--flush-ms <ms>\n"
+	       "\t              \tKeep buffering events across reads, writing\n"
+	       "\t              \tthem at most <ms> milliseconds after the first\n"
+	       "\t              \tone.  Implies --buffered.\n");
+	printf("\t--coalesce <ms>\n"
+	       "\t              \tHold each event back for <ms> milliseconds and\n"
+	       "\t              \tmerge repeated events on the same file into it.\n");
+	printf("\t--reader <KiB>\tRead events on a separate thread into a ring\n"
+	       "\t              \tbuffer of <KiB> kilobytes, so that slow output\n"
+	       "\t              \tdoesn't overflow the kernel's event queue.\n");
+	printf("\t--shards <n>  \tSpread the watches over <n> inotify instances,\n"
+	       "\t              \tone per top level subtree, each read by a\n"
+	       "\t              \tthread of its own.\n");
+	printf("\t--reach-file <file>\n"
+	       "\t              \tWrite which watched directories had events to\n"
+	       "\t              \t<file>, and keep it up to date.\n");
+	printf("\t--metrics <seconds>\n"
+	       "\t              \tWith -m, every <seconds> seconds, write the\n"
+	       "\t              \tlibrary's read, wait, matching, formatting and\n"
+	       "\t              \tsetup metrics and the kernel queue size to\n"
+	       "\t              \tstderr, or to syslog with --syslog.\n");
 	printf("\t-s|--syslog   \tSend errors to syslog rather than stderr.\n");
 	printf("\t-q|--quiet    \tPrint less (only print events).\n");
 	printf("\t-qq           \tPrint nothing (not even events).\n");
@@ -734,6 +1646,9 @@ void print_help()
 	printf("\t--timefmt <fmt>\tstrftime-compatible format string for use with\n"
 	       "\t              \t%%T in --format string.\n");
 	printf("\t-c|--csv      \tPrint events in CSV format.\n");
+	printf("\t--json        \tPrint events as JSON objects, one per line.\n");
+	printf("\t--binary      \tWrite events as binary records; read the man\n"
+	       "\t              \tpage for their layout.\n");
 	printf("\t-t|--timeout <seconds>\n"
 	       "\t              \tWhen listening for a single event, time out "
 	       "after\n"
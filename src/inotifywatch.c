@@ -1,5 +1,3 @@
-// FIXME this is cheating!  Make this use only the public API.
-#include "../libinotifytools/src/inotifytools_p.h"
 #include "../config.h"
 #include "common.h"
 
@@ -12,12 +10,12 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
-#include <regex.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <inotifytools/inotifytools.h>
@@ -29,6 +27,10 @@ extern int optind, opterr, optopt;
 
 #define nasprintf(...) niceassert( -1 != asprintf(__VA_ARGS__), "out of memory")
 
+// Time to wait for the moved_to event of a move before taking it as a move
+// out of the watched tree.
+#define MOVE_TIMEOUT_MS 1000
+
 // METHODS
 bool parse_opts(
   int * argc,
@@ -40,10 +42,12 @@ bool parse_opts(
   int * sort,
   int * recursive,
   char ** fromfile,
-  char ** exc_regex,
-  char ** exc_iregex,
-  char ** inc_regex,
-  char ** inc_iregex
+  FilterList * filters,
+  char ** backend,
+  int * top,
+  long int * interval,
+  long int * metrics,
+  int * shards
 );
 
 void print_help();
@@ -69,6 +73,8 @@ void handle_signal( int signal __attribute__((unused)) ) {
 }
 
 int print_info();
+void print_interval( double seconds );
+double now_ms();
 
 void print_info_now( int signal __attribute__((unused)) ) {
     print_info();
@@ -78,6 +84,48 @@ void print_info_now( int signal __attribute__((unused)) ) {
 int events;
 int sort;
 int zero;
+// Rows printed by print_info(), 0 for all.
+int top;
+
+/**
+ * Update the watches of a recursive watch after a move: rename the watches
+ * below a directory moved within the tree, watch a directory moved into it
+ * and unwatch one moved out of it.
+ */
+void watch_moved( struct inotifytools_move const * move, int events,
+                  inotifytools_exclude const * exclude ) {
+	if ( !move->isdir ) return;
+
+	char * from = 0;
+	if ( move->from ) {
+		nasprintf( &from, "%s/", move->from );
+		// if not watched...
+		if ( inotifytools_wd_from_filename( from ) == -1 ) {
+			free( from );
+			from = 0;
+		}
+	}
+
+	if ( from && move->to ) {
+		char * to;
+		nasprintf( &to, "%s/", move->to );
+		inotifytools_replace_filename( from, to );
+		free( to );
+	}
+	else if ( from ) {
+		if ( !inotifytools_remove_watch_by_filename( from ) ) {
+			fprintf( stderr, "Error removing watch on %s: %s\n",
+			         from, strerror(inotifytools_error()) );
+		}
+	}
+	else if ( !inotifytools_exclude_matches( exclude, move->to ) &&
+	          !inotifytools_watch_recursively_async( move->to, events,
+	                                                 exclude ) ) {
+		fprintf( stderr, "Couldn't watch new directory %s: %s\n",
+		         move->to, strerror( inotifytools_error() ) );
+	}
+	free( from );
+}
 
 int main(int argc, char ** argv)
 {
@@ -89,40 +137,42 @@ int main(int argc, char ** argv)
 	char * fromfile = 0;
 	sort = -1;
 	done = false;
-	char * exc_regex = NULL;
-	char * exc_iregex = NULL;
-	char * inc_regex = NULL;
-	char * inc_iregex = NULL;
+	FilterList filters = { NULL, NULL, 0 };
+	char * backend = NULL;
+	long int interval = 0;
+	long int metrics = 0;
+	int shards = 0;
 
 	signal( SIGINT, handle_impatient_user );
 
 	// Parse commandline options, aborting if something goes wrong
 	if ( !parse_opts( &argc, &argv, &events, &timeout, &verbose, &zero, &sort,
-	                 &recursive, &fromfile, &exc_regex, &exc_iregex,
-	                 &inc_regex, &inc_iregex ) ) {
+	                 &recursive, &fromfile, &filters, &backend, &top,
+	                 &interval,
+	                 &metrics, &shards ) ) {
 		return EXIT_FAILURE;
 	}
 
-	if (
-		(exc_regex && !inotifytools_ignore_events_by_regex(exc_regex, REG_EXTENDED) ) ||
-		(exc_iregex && !inotifytools_ignore_events_by_regex(exc_iregex, REG_EXTENDED|
-		                                                        REG_ICASE))
-	) {
-		fprintf(stderr, "Error in `exclude' regular expression.\n");
+	if ( !apply_filters( &filters ) ) return EXIT_FAILURE;
+
+	if ( !inotifytools_initialize() ) {
+		warn_inotify_init_error();
 		return EXIT_FAILURE;
 	}
 
-	if (
-		(inc_regex && !inotifytools_ignore_events_by_inverted_regex(inc_regex, REG_EXTENDED) ) ||
-		(inc_iregex && !inotifytools_ignore_events_by_inverted_regex(inc_iregex, REG_EXTENDED|
-		                                                        REG_ICASE))
-	) {
-		fprintf(stderr, "Error in `include' regular expression.\n");
+	if ( backend && !inotifytools_set_backend( backend ) ) {
+		fprintf(stderr, "Couldn't use the '%s' backend: %s\n", backend,
+		        strerror( inotifytools_error() ) );
 		return EXIT_FAILURE;
 	}
-
-	if ( !inotifytools_initialize() ) {
-		warn_inotify_init_error();
+	if ( shards && !inotifytools_set_shards( shards, 1 ) ) {
+		fprintf(stderr, "Couldn't shard the watches: %s\n",
+		        strerror( inotifytools_error() ) );
+		return EXIT_FAILURE;
+	}
+	if ( metrics && !inotifytools_enable_metrics( 1 ) ) {
+		fprintf(stderr, "Couldn't collect metrics: %s\n",
+		        strerror( inotifytools_error() ) );
 		return EXIT_FAILURE;
 	}
 
@@ -138,8 +188,14 @@ int main(int argc, char ** argv)
 		return EXIT_FAILURE;
 	}
 
+	// Compiled once, and also used for directories created later on
+	inotifytools_exclude * exclude =
+	    inotifytools_exclude_compile( list.exclude_files );
+
 	unsigned int num_watches = 0;
 	unsigned int status;
+	// Watch directories created while events were lost to a queue overflow.
+	if ( recursive ) inotifytools_set_rescan_on_overflow( 1 );
 	fprintf( stderr, "Establishing watches...\n" );
 	for ( int i = 0; list.watch_files[i]; ++i ) {
 		char const *this_file = list.watch_files[i];
@@ -148,10 +204,10 @@ int main(int argc, char ** argv)
 		}
 
 		if ( recursive ) {
-			status = inotifytools_watch_recursively_with_exclude(
+			status = inotifytools_watch_recursively_excluding(
 			                               this_file,
 			                               events,
-			                               list.exclude_files );
+			                               exclude, 1 );
 		}
 		else {
 			status = inotifytools_watch_file( this_file, events );
@@ -196,14 +252,43 @@ int main(int argc, char ** argv)
         signal( SIGUSR1, print_info_now );
 
 	inotifytools_initialize_stats();
+	double interval_start = now_ms(), metrics_start = interval_start;
+	if ( interval && !inotifytools_next_interval() ) {
+		fprintf( stderr, "%s\n", strerror( inotifytools_error() ) );
+		return EXIT_FAILURE;
+	}
 	// Now wait till we get event
 	struct inotify_event * event;
-	char * moved_from = 0;
+	struct inotifytools_move move;
 
 	do {
-		event = inotifytools_next_event(BLOCKING_TIMEOUT);
+		long wait = BLOCKING_TIMEOUT;
+		if ( interval ) {
+			double now = now_ms();
+			if ( now >= interval_start + interval * 1000 ) {
+				// counting goes on in the next interval while the last one
+				// is printed
+				inotifytools_next_interval();
+				print_interval( (now - interval_start) / 1000 );
+				interval_start = now;
+			}
+			wait = interval_start + interval * 1000 - now + 1;
+		}
+		if ( metrics ) {
+			double now = now_ms();
+			if ( now >= metrics_start + metrics * 1000 ) {
+				print_metrics( false );
+				metrics_start = now;
+			}
+			long left = metrics_start + metrics * 1000 - now + 1;
+			if ( wait < 0 || left < wait ) wait = left;
+		}
+		event = inotifytools_next_events_ms( wait, 1, -1 );
 		if ( !event ) {
-			if ( !inotifytools_error() ) {
+			if ( (interval || metrics) && !inotifytools_error() ) {
+				continue;
+			}
+			else if ( !inotifytools_error() ) {
 				return EXIT_TIMEOUT;
 			}
 			else if ( inotifytools_error() != EINTR ) {
@@ -215,61 +300,140 @@ int main(int argc, char ** argv)
 			}
 		}
 
-		// if we last had MOVED_FROM and don't currently have MOVED_TO,
-		// moved_from file must have been moved outside of tree - so unwatch it.
-		if ( moved_from && !(event->mask & IN_MOVED_TO) ) {
-			if ( !inotifytools_remove_watch_by_filename( moved_from ) ) {
-				fprintf( stderr, "Error removing watch on %s: %s\n",
-				         moved_from, strerror(inotifytools_error()) );
-			}
-			free( moved_from );
-			moved_from = 0;
+		if ( event->mask & IN_Q_OVERFLOW ) {
+			fprintf( stderr, "Event queue overflowed; some events were not "
+			         "counted.\n" );
 		}
 
 		if ( recursive ) {
-			if ((event->mask & IN_CREATE) ||
-			    (!moved_from && (event->mask & IN_MOVED_TO))) {
-				// New file - if it is a directory, watch it
+			if ( event->mask & IN_CREATE ) {
+				// New directory - watch it in the background, so events keep
+				// coming while its tree is read
 				static char * new_file;
 
 				nasprintf( &new_file, "%s%s",
 				           inotifytools_filename_from_wd( event->wd ),
 				           event->name );
 
-				if ( isdir(new_file) &&
-				    !inotifytools_watch_recursively( new_file, events ) ) {
+				if ( (event->mask & IN_ISDIR) &&
+				    !inotifytools_exclude_matches( exclude, new_file ) &&
+				    !inotifytools_watch_recursively_async( new_file, events,
+				                                           exclude ) ) {
 					fprintf( stderr, "Couldn't watch new directory %s: %s\n",
 					         new_file, strerror( inotifytools_error() ) );
 				}
 				free( new_file );
 			} // IN_CREATE
-			else if (event->mask & IN_MOVED_FROM) {
-				nasprintf( &moved_from, "%s%s/",
-				           inotifytools_filename_from_wd( event->wd ),
-				           event->name );
-				// if not watched...
-				if ( inotifytools_wd_from_filename(moved_from) == -1 ) {
-					free( moved_from );
-					moved_from = 0;
-				}
-			} // IN_MOVED_FROM
-			else if (event->mask & IN_MOVED_TO) {
-				if ( moved_from ) {
-					static char * new_name;
-					nasprintf( &new_name, "%s%s/",
-					           inotifytools_filename_from_wd( event->wd ),
-					           event->name );
-					inotifytools_replace_filename( moved_from, new_name );
-					free( moved_from );
-					moved_from = 0;
-				} // moved_from
+			else if ( inotifytools_track_move( event, &move ) ) {
+				watch_moved( &move, events, exclude );
 			}
 		}
 
+		// Moves whose moved_to event hasn't turned up left the tree.
+		while ( inotifytools_expire_move( MOVE_TIMEOUT_MS, &move ) ) {
+			watch_moved( &move, events, exclude );
+		}
+
 	} while ( !done );
         return print_info();
 }
 
+/**
+ * Columns of the table printed by print_info(), after the total.  Counts
+ * are left aligned below the name of their event.
+ */
+static struct {
+	int event;
+	char const * name;
+} const columns[] = {
+	{ IN_ACCESS, "access" },
+	{ IN_MODIFY, "modify" },
+	{ IN_ATTRIB, "attrib" },
+	{ IN_CLOSE_WRITE, "close_write" },
+	{ IN_CLOSE_NOWRITE, "close_nowrite" },
+	{ IN_OPEN, "open" },
+	{ IN_MOVED_FROM, "moved_from" },
+	{ IN_MOVED_TO, "moved_to" },
+	{ IN_MOVE_SELF, "move_self" },
+	{ IN_CREATE, "create" },
+	{ IN_DELETE, "delete" },
+	{ IN_DELETE_SELF, "delete_self" },
+	{ IN_UNMOUNT, "unmount" },
+};
+#define NUM_COLUMNS (int)(sizeof(columns) / sizeof(columns[0]))
+
+/**
+ * @return the time in milliseconds on a clock which isn't set back.
+ */
+double now_ms() {
+	struct timespec ts;
+	clock_gettime( CLOCK_MONOTONIC, &ts );
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * Print the table of the interval just ended by inotifytools_next_interval(),
+ * which lasted @a seconds: a row of counts and the rate in events per second
+ * for each watch with events, then the counts and rates of all watches.
+ */
+void print_interval( double seconds ) {
+	long long total = inotifytools_get_interval_stat_total( 0 );
+	printf("%.3f seconds, %lld events, %.1f events/sec\n", seconds, total,
+	       total / seconds);
+	if ( !total && !zero ) {
+		printf("\n");
+		fflush( stdout );
+		return;
+	}
+
+	bool shown[NUM_COLUMNS];
+	printf("total  rate    ");
+	for ( int c = 0; c < NUM_COLUMNS; ++c ) {
+		shown[c] = (columns[c].event & events) &&
+		           ( zero ||
+		             inotifytools_get_interval_stat_total( columns[c].event ) );
+		if ( shown[c] ) printf("%s  ", columns[c].name);
+	}
+	printf("filename\n");
+
+	int max = top ? top : inotifytools_get_num_watches();
+	int * wds = (int *)malloc( (max > 0 ? max : 1) * sizeof(int) );
+	niceassert( wds, "out of memory" );
+	int num = inotifytools_interval_wds_sorted_by_event( sort, !zero, wds,
+	                                                     max );
+	for ( int i = 0; i < num; ++i ) {
+		int wd = wds[i];
+		long long count = inotifytools_get_interval_stat_by_wd( wd, 0 );
+		printf("%-5lld  %-6.1f  ", count, count / seconds );
+		for ( int c = 0; c < NUM_COLUMNS; ++c ) {
+			if ( !shown[c] ) continue;
+			printf("%-*lld  ", (int)strlen( columns[c].name ),
+			       inotifytools_get_interval_stat_by_wd( wd,
+			                                             columns[c].event ) );
+		}
+		printf("%s\n", inotifytools_filename_from_wd( wd ) );
+	}
+	free( wds );
+
+	// per event type over all watches
+	printf("%-5lld  %-6.1f  ", total, total / seconds );
+	for ( int c = 0; c < NUM_COLUMNS; ++c ) {
+		if ( !shown[c] ) continue;
+		printf("%-*lld  ", (int)strlen( columns[c].name ),
+		       inotifytools_get_interval_stat_total( columns[c].event ) );
+	}
+	printf("(all)\n");
+	printf("-      -       ");
+	for ( int c = 0; c < NUM_COLUMNS; ++c ) {
+		if ( !shown[c] ) continue;
+		printf("%-*.1f  ", (int)strlen( columns[c].name ),
+		       inotifytools_get_interval_stat_total( columns[c].event ) /
+		       seconds );
+	}
+	printf("(events/sec)\n\n");
+	fflush( stdout );
+}
+
 int print_info() {
 	if ( !inotifytools_get_stat_total( 0 ) ) {
 		fprintf( stderr, "No events occurred.\n" );
@@ -277,104 +441,33 @@ int print_info() {
 	}
 
 	// OK, go through the watches and print stats.
+	bool shown[NUM_COLUMNS];
 	printf("total  ");
-	if ( (IN_ACCESS & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_ACCESS ) ) )
-		printf("access  ");
-	if ( ( IN_MODIFY & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_MODIFY ) ) )
-		printf("modify  ");
-	if ( ( IN_ATTRIB & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_ATTRIB ) ) )
-		printf("attrib  ");
-	if ( ( IN_CLOSE_WRITE & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_CLOSE_WRITE ) ) )
-		printf("close_write  ");
-	if ( ( IN_CLOSE_NOWRITE & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_CLOSE_NOWRITE ) ) )
-		printf("close_nowrite  ");
-	if ( ( IN_OPEN & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_OPEN ) ) )
-		printf("open  ");
-	if ( ( IN_MOVED_FROM & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_MOVED_FROM ) ) )
-		printf("moved_from  ");
-	if ( ( IN_MOVED_TO & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_MOVED_TO ) ) )
-		printf("moved_to  ");
-	if ( ( IN_MOVE_SELF & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_MOVE_SELF ) ) )
-		printf("move_self  ");
-	if ( ( IN_CREATE & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_CREATE ) ) )
-		printf("create  ");
-	if ( ( IN_DELETE & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_DELETE ) ) )
-		printf("delete  ");
-	if ( ( IN_DELETE_SELF & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_DELETE_SELF ) ) )
-		printf("delete_self  ");
-	if ( ( IN_UNMOUNT & events) &&
-	     ( zero || inotifytools_get_stat_total( IN_UNMOUNT ) ) )
-		printf("unmount  ");
-
+	for ( int c = 0; c < NUM_COLUMNS; ++c ) {
+		shown[c] = (columns[c].event & events) &&
+		           ( zero || inotifytools_get_stat_total( columns[c].event ) );
+		if ( shown[c] ) printf("%s  ", columns[c].name);
+	}
 	printf("filename\n");
 
-	struct rbtree *tree = inotifytools_wd_sorted_by_event(sort);
-	RBLIST *rblist = rbopenlist(tree);
-	watch *w = (watch*)rbreadlist(rblist);
-
-	while (w) {
-		if ( !zero && !w->hit_total ) {
-			w = (watch*)rbreadlist(rblist);
-			continue;
+	// Only the rows printed are sorted, straight from the statistics.
+	int max = top ? top : inotifytools_get_num_watches();
+	if ( max <= 0 ) return EXIT_SUCCESS;
+	int * wds = (int *)malloc( max * sizeof(int) );
+	niceassert( wds, "out of memory" );
+	int num = inotifytools_wds_sorted_by_event( sort, !zero, wds, max );
+
+	for ( int i = 0; i < num; ++i ) {
+		int wd = wds[i];
+		printf("%-5lld  ", inotifytools_get_stat64_by_wd( wd, 0 ) );
+		for ( int c = 0; c < NUM_COLUMNS; ++c ) {
+			if ( !shown[c] ) continue;
+			printf("%-*lld  ", (int)strlen( columns[c].name ),
+			       inotifytools_get_stat64_by_wd( wd, columns[c].event ) );
 		}
-		printf("%-5u  ", w->hit_total );
-		if ( ( IN_ACCESS & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_ACCESS ) ) )
-			printf("%-6u  ", w->hit_access );
-		if ( ( IN_MODIFY & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_MODIFY ) ) )
-			printf("%-6u  ", w->hit_modify );
-		if ( ( IN_ATTRIB & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_ATTRIB ) ) )
-			printf("%-6u  ", w->hit_attrib );
-		if ( ( IN_CLOSE_WRITE & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_CLOSE_WRITE ) ) )
-			printf("%-11u  ",w->hit_close_write );
-		if ( ( IN_CLOSE_NOWRITE & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_CLOSE_NOWRITE ) ) )
-			printf("%-13u  ",w->hit_close_nowrite );
-		if ( ( IN_OPEN & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_OPEN ) ) )
-			printf("%-4u  ", w->hit_open );
-		if ( ( IN_MOVED_FROM & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_MOVED_FROM ) ) )
-			printf("%-10u  ", w->hit_moved_from );
-		if ( ( IN_MOVED_TO & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_MOVED_TO ) ) )
-			printf("%-8u  ", w->hit_moved_to );
-		if ( ( IN_MOVE_SELF & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_MOVE_SELF ) ) )
-			printf("%-9u  ", w->hit_move_self );
-		if ( ( IN_CREATE & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_CREATE ) ) )
-			printf("%-6u  ", w->hit_create );
-		if ( ( IN_DELETE & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_DELETE ) ) )
-			printf("%-6u  ", w->hit_delete );
-		if ( ( IN_DELETE_SELF & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_DELETE_SELF ) ) )
-			printf("%-11u  ",w->hit_delete_self );
-		if ( ( IN_UNMOUNT & events) &&
-		     ( zero || inotifytools_get_stat_total( IN_UNMOUNT ) ) )
-			printf("%-7u  ", w->hit_unmount );
-
-		printf("%s\n", w->filename );
-		w = (watch*)rbreadlist(rblist);
+		printf("%s\n", inotifytools_filename_from_wd( wd ) );
 	}
-	rbcloselist(rblist);
-	rbdestroy(tree);
+	free( wds );
 
 	return EXIT_SUCCESS;
 }
@@ -392,21 +485,23 @@ bool parse_opts(
   int * sort,
   int * recursive,
   char ** fromfile,
-  char ** exc_regex,
-  char ** exc_iregex,
-  char ** inc_regex,
-  char ** inc_iregex
+  FilterList * filters,
+  char ** backend,
+  int * top,
+  long int * interval,
+  long int * metrics,
+  int * shards
 ) {
 	assert( argc ); assert( argv ); assert( events ); assert( timeout );
 	assert( verbose ); assert( zero ); assert( sort ); assert( recursive );
-	assert( fromfile ); assert( exc_regex ); assert( exc_iregex );
-	assert( inc_regex ); assert( inc_iregex );
+	assert( fromfile ); assert( filters ); assert( backend );
+	assert( top ); assert( interval ); assert( metrics ); assert( shards );
 
 	// Short options
 	char * opt_string = "hra:d:zve:t:";
 
 	// Construct array
-	struct option long_opts[14];
+	struct option long_opts[21];
 
 	// --help
 	long_opts[0].name = "help";
@@ -475,11 +570,50 @@ bool parse_opts(
 	long_opts[12].has_arg = 1;
 	long_opts[12].flag = NULL;
 	long_opts[12].val = (int)'k';
+	// --backend
+	long_opts[13].name = "backend";
+	long_opts[13].has_arg = 1;
+	long_opts[13].flag = NULL;
+	long_opts[13].val = (int)'K';
+	// --top
+	long_opts[14].name = "top";
+	long_opts[14].has_arg = 1;
+	long_opts[14].flag = NULL;
+	long_opts[14].val = (int)'T';
+	char * top_end = NULL;
+	// --interval
+	long_opts[15].name = "interval";
+	long_opts[15].has_arg = 1;
+	long_opts[15].flag = NULL;
+	long_opts[15].val = (int)'I';
+	char * interval_end = NULL;
+	// --metrics
+	long_opts[16].name = "metrics";
+	long_opts[16].has_arg = 1;
+	long_opts[16].flag = NULL;
+	long_opts[16].val = (int)'M';
+	char * metrics_end = NULL;
+	// --shards
+	long_opts[17].name = "shards";
+	long_opts[17].has_arg = 1;
+	long_opts[17].flag = NULL;
+	long_opts[17].val = (int)'H';
+	char * shards_end = NULL;
+	// --exclude-glob
+	long_opts[18].name = "exclude-glob";
+	long_opts[18].has_arg = 1;
+	long_opts[18].flag = NULL;
+	long_opts[18].val = (int)'X';
+	// --include-glob
+	long_opts[19].name = "include-glob";
+	long_opts[19].has_arg = 1;
+	long_opts[19].flag = NULL;
+	long_opts[19].val = (int)'Q';
 	// Empty last element
-	long_opts[13].name = 0;
-	long_opts[13].has_arg = 0;
-	long_opts[13].flag = 0;
-	long_opts[13].val = 0;
+	long_opts[20].name = 0;
+	long_opts[20].has_arg = 0;
+	long_opts[20].flag = 0;
+	long_opts[20].val = 0;
 
 	// Get first option
 	char curr_opt = getopt_long(*argc, *argv, opt_string, long_opts, NULL);
@@ -513,22 +647,94 @@ bool parse_opts(
 
 			// --exclude
 			case 'c':
-				(*exc_regex) = optarg;
+				add_filter_option( filters, optarg, 0 );
 				break;
 
 			// --excludei
 			case 'b':
-				(*exc_iregex) = optarg;
+				add_filter_option( filters, optarg, INOTIFYTOOLS_FILTER_ICASE );
 				break;
 
 			// --include
 			case 'j':
-				(*inc_regex) = optarg;
+				add_filter_option( filters, optarg,
+				                   INOTIFYTOOLS_FILTER_INCLUDE );
 				break;
 
 			// --includei
 			case 'k':
-				(*inc_iregex) = optarg;
+				add_filter_option( filters, optarg,
+				                   INOTIFYTOOLS_FILTER_INCLUDE |
+				                   INOTIFYTOOLS_FILTER_ICASE );
+				break;
+
+			// --exclude-glob
+			case 'X':
+				add_filter_option( filters, optarg, INOTIFYTOOLS_FILTER_GLOB );
+				break;
+
+			// --include-glob
+			case 'Q':
+				add_filter_option( filters, optarg,
+				                   INOTIFYTOOLS_FILTER_INCLUDE |
+				                   INOTIFYTOOLS_FILTER_GLOB );
+				break;
+
+			// --backend
+			case 'K':
+				(*backend) = optarg;
+				break;
+
+			// --top
+			case 'T':
+				*top = strtol(optarg, &top_end, 10);
+				if ( *top_end != '\0' || *top < 1 )
+				{
+					fprintf(stderr, "'%s' is not a valid number of rows.\n"
+					        "Please specify an integer of value 1 or "
+					        "greater.\n",
+					        optarg);
+					return false;
+				}
+				break;
+
+			// --interval
+			case 'I':
+				*interval = strtol(optarg, &interval_end, 10);
+				if ( *interval_end != '\0' || *interval < 1 )
+				{
+					fprintf(stderr, "'%s' is not a valid interval.\n"
+					        "Please specify an integer of value 1 or "
+					        "greater.\n",
+					        optarg);
+					return false;
+				}
+				break;
+
+			// --metrics
+			case 'M':
+				*metrics = strtol(optarg, &metrics_end, 10);
+				if ( *metrics_end != '\0' || *metrics < 1 )
+				{
+					fprintf(stderr, "'%s' is not a valid interval.\n"
+					        "Please specify an integer of value 1 or "
+					        "greater.\n",
+					        optarg);
+					return false;
+				}
+				break;
+
+			// --shards
+			case 'H':
+				*shards = strtol(optarg, &shards_end, 10);
+				if ( *shards_end != '\0' || *shards < 1 )
+				{
+					fprintf(stderr, "'%s' is not a valid number of shards.\n"
+					        "Please specify an integer of value 1 or "
+					        "greater.\n",
+					        optarg);
+					return false;
+				}
 				break;
 
 			// --fromfile
@@ -639,20 +845,6 @@ bool parse_opts(
 		return false;
 	}
 
-	if ( *exc_regex && *exc_iregex ) {
-		fprintf(stderr, "--exclude and --excludei cannot both be specified.\n");
-		return false;
-	}
-	if ( *inc_regex && *inc_iregex ) {
-		fprintf(stderr, "--include and --includei cannot both be specified.\n");
-		return false;
-	}
-	if ( (*inc_regex && *exc_regex) || (*inc_regex && *exc_iregex) ||
-		 (*inc_iregex && *exc_regex) || (*inc_iregex && *exc_iregex) ) {
-		fprintf(stderr, "include and exclude regexp cannot both be specified.\n");
-		return false;
-	}
-
 	// If ? returned, invalid option
 	return (curr_opt != '?');
 }
@@ -672,20 +864,30 @@ void print_help()
 	       "\t\tRead files to watch from <file> or `-' for stdin.\n");
 	printf("\t--exclude <pattern>\n"
 	       "\t\tExclude all events on files matching the extended regular\n"
-	       "\t\texpression <pattern>.\n");
+	       "\t\texpression <pattern>.  May be given several times, as may\n"
+	       "\t\tthe options below.\n");
 	printf("\t--excludei <pattern>\n"
 	       "\t\tLike --exclude but case insensitive.\n");
+	printf("\t--exclude-glob <glob>\n"
+	       "\t\tExclude all events on files whose whole path matches the\n"
+	       "\t\twildcard pattern <glob>.\n");
 	printf("\t--include <pattern>\n"
 	       "\t\tExclude all events on files except the ones\n"
 	       "\t\tmatching the extended regular expression\n"
 	       "\t\t<pattern>.\n");
 	printf("\t--includei <pattern>\n"
 	       "\t\tLike --include but case insensitive.\n");
+	printf("\t--include-glob <glob>\n"
+	       "\t\tExclude all events on files except the ones whose whole\n"
+	       "\t\tpath matches the wildcard pattern <glob>.\n");
 	printf("\t-z|--zero\n"
 	       "\t\tIn the final table of results, output rows and columns even\n"
 	       "\t\tif they consist only of zeros (the default is to not output\n"
 	       "\t\tthese rows and columns).\n");
 	printf("\t-r|--recursive\tWatch directories recursively.\n");
+	printf("\t--backend <name>\n"
+	       "\t              \tWatch with the named backend, `inotify' (the\n"
+	       "\t              \tdefault) or `fanotify'.\n");
 	printf("\t-t|--timeout <seconds>\n"
 	       "\t\tListen only for specified amount of time in seconds; if\n"
 	       "\t\tomitted or negative, inotifywatch will execute until receiving an\n"
@@ -696,7 +898,21 @@ void print_help()
 	printf("\t-a|--ascending <event>\n"
 	       "\t\tSort ascending by a particular event, or `total'.\n");
 	printf("\t-d|--descending <event>\n"
-	       "\t\tSort descending by a particular event, or `total'.\n\n");
+	       "\t\tSort descending by a particular event, or `total'.\n");
+	printf("\t--top <n>\n"
+	       "\t\tOnly output the first <n> rows of the table, which is much\n"
+	       "\t\tfaster for a large number of watches.\n");
+	printf("\t--interval <seconds>\n"
+	       "\t\tEvery <seconds> seconds, also output a table of the events\n"
+	       "\t\tof the last interval and their rates in events per second.\n"
+	       "\t\tCollection of the totals is not interrupted.\n");
+	printf("\t--metrics <seconds>\n"
+	       "\t\tEvery <seconds> seconds, write the library's read, wait,\n"
+	       "\t\tmatching, formatting and setup metrics and the kernel queue\n"
+	       "\t\tsize to stderr.\n");
+	printf("\t--shards <n>\n"
+	       "\t\tSpread the watches over <n> inotify instances, one per top\n"
+	       "\t\tlevel subtree, each read by a thread of its own.\n\n");
 	printf("Exit status:\n");
 	printf("\t%d  -  Exited normally.\n", EXIT_SUCCESS);
 	printf("\t%d  -  Some error occurred.\n\n", EXIT_FAILURE);